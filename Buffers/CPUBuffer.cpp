@@ -75,6 +75,11 @@ void CPUBuffer::setFrom(const GPUBuffer& src, size_t srcBegin,
   if (srcEnd - srcBegin > size_ - destBegin) {
     throw std::runtime_error("Buffer overflow.");
   }
+  if (src.isOnHost()) {
+    memcpy(ptr_ + destBegin, (char*)src.getPtr() + srcBegin,
+        srcEnd - srcBegin);
+    return;
+  }
   cudaError_t err = cudaMemcpy(ptr_ + destBegin,
       (char*)src.getPtr() + srcBegin, srcEnd - srcBegin,
       cudaMemcpyDeviceToHost);
@@ -3,38 +3,45 @@
 #include "CPUBuffer.h"
 #include "PinnedCPUBuffer.h"
 
+#include <cstdlib>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+bool GPUBuffer::hostMemoryMode_ = false;
+
+void GPUBuffer::useHostMemory(bool onHost)
+{
+  hostMemoryMode_ = onHost;
+}
+
 GPUBuffer::GPUBuffer() :
-  device_(0), size_(0), ptr_(0)
+  device_(0), size_(0), ptr_(0), onHost_(hostMemoryMode_)
 {
 }
 
 GPUBuffer::GPUBuffer(int device) :
-  device_(device), size_(0), ptr_(0)
+  device_(device), size_(0), ptr_(0), onHost_(hostMemoryMode_)
 {
 }
 
 GPUBuffer::GPUBuffer(size_t size, int device) :
-  device_(device), size_(size), ptr_(0)
+  device_(device), size_(size), ptr_(0), onHost_(hostMemoryMode_)
 {
-  cudaError_t err = cudaSetDevice(device_);
-  if (err != cudaSuccess) {
-    throw std::runtime_error("cudaSetDevice failed.");
-  }
-  err = cudaMalloc((void**)&ptr_, size_);
-  if (err != cudaSuccess) {
-    throw std::runtime_error("cudaMalloc failed.");
-  }
+  allocate();
 }
 
 GPUBuffer::GPUBuffer(const GPUBuffer& toCopy) :
-  device_(toCopy.device_), size_(toCopy.size_), ptr_(0)
+  device_(toCopy.device_), size_(toCopy.size_), ptr_(0),
+  onHost_(hostMemoryMode_)
 {
   this->resize(size_);
   toCopy.set(this, 0, size_, 0);
 }
 
 GPUBuffer::GPUBuffer(const Buffer& toCopy, int device) :
-  device_(device), size_(toCopy.getSize()), ptr_(0)
+  device_(device), size_(toCopy.getSize()), ptr_(0),
+  onHost_(hostMemoryMode_)
 {
   this->resize(size_);
   toCopy.set(this, 0, size_, 0);
@@ -61,31 +68,37 @@ GPUBuffer& GPUBuffer::operator=(const CPUBuffer& rhs) {
 }
 
 GPUBuffer::~GPUBuffer() {
-  if (ptr_) {
-    cudaError_t err = cudaFree(ptr_);
-    if (err != cudaSuccess) {
-      std::cout << "Error code: " << err << std::endl;
-      std::cout << "ptr_: " << (long long int)ptr_ << std::endl;
-      throw std::runtime_error("cudaFree failed.");
-    }
-    ptr_ = 0;
-  }
+  release();
 }
 
-void GPUBuffer::resize(size_t newsize) {
-  if (ptr_) {
-    cudaError_t err = cudaFree(ptr_);
-    if (err != cudaSuccess) {
-      throw std::runtime_error("cudaFree failed.");
+void GPUBuffer::allocate()
+{
+  if (onHost_) {
+    if (size_ == 0) {
+      return;
     }
-    ptr_ = 0;
+    // Round up to a multiple of the alignment; required by aligned_alloc
+    // on some platforms and harmless elsewhere.
+    size_t padded = (size_ + hostAlignment - 1) / hostAlignment * hostAlignment;
+#ifdef _WIN32
+    ptr_ = (char*)_aligned_malloc(padded, hostAlignment);
+    if (!ptr_) {
+      throw std::runtime_error("_aligned_malloc failed.");
+    }
+#else
+    void* p = 0;
+    if (posix_memalign(&p, hostAlignment, padded) != 0) {
+      throw std::runtime_error("posix_memalign failed.");
+    }
+    ptr_ = (char*)p;
+#endif
+    return;
   }
   cudaError_t err = cudaSetDevice(device_);
   if (err != cudaSuccess) {
     throw std::runtime_error("cudaSetDevice failed.");
   }
-  size_ = newsize;
-  if (newsize > 0) {
+  if (size_ > 0) {
     err = cudaMalloc((void**)&ptr_, size_);
     if (err != cudaSuccess) {
       throw std::runtime_error("cudaMalloc failed.");
@@ -93,11 +106,38 @@ void GPUBuffer::resize(size_t newsize) {
   }
 }
 
-void GPUBuffer::setPtr(char* ptr, size_t size, int device)
+void GPUBuffer::release()
 {
   if (ptr_) {
-    cutilSafeCall(cudaFree(ptr_));
+    if (onHost_) {
+#ifdef _WIN32
+      _aligned_free(ptr_);
+#else
+      free(ptr_);
+#endif
+    }
+    else {
+      cudaError_t err = cudaFree(ptr_);
+      if (err != cudaSuccess) {
+        std::cout << "Error code: " << err << std::endl;
+        std::cout << "ptr_: " << (long long int)ptr_ << std::endl;
+        throw std::runtime_error("cudaFree failed.");
+      }
+    }
+    ptr_ = 0;
   }
+}
+
+void GPUBuffer::resize(size_t newsize) {
+  release();
+  onHost_ = hostMemoryMode_;
+  size_ = newsize;
+  allocate();
+}
+
+void GPUBuffer::setPtr(char* ptr, size_t size, int device)
+{
+  release();
   ptr_ = ptr;
   size_ = size;
   device_ = device;
@@ -118,6 +158,11 @@ void GPUBuffer::setFrom(const CPUBuffer& src, size_t srcBegin,
     std::cout << std::endl;
     throw std::runtime_error("Buffer overflow.");
   }
+  if (onHost_) {
+    memcpy(ptr_ + destBegin, (char*)src.getPtr() + srcBegin,
+        srcEnd - srcBegin);
+    return;
+  }
   cudaError_t err = cudaMemcpy(ptr_ + destBegin,
       (char*)src.getPtr() + srcBegin, srcEnd - srcBegin,
       cudaMemcpyHostToDevice);
@@ -136,6 +181,11 @@ void GPUBuffer::setFrom(const PinnedCPUBuffer& src, size_t srcBegin,
     std::cout << std::endl;
     throw std::runtime_error("Buffer overflow.");
   }
+  if (onHost_) {
+    memcpy(ptr_ + destBegin, (char*)src.getPtr() + srcBegin,
+        srcEnd - srcBegin);
+    return;
+  }
   cudaError_t err = cudaMemcpyAsync(ptr_ + destBegin,
       (char*)src.getPtr() + srcBegin, srcEnd - srcBegin,
       cudaMemcpyHostToDevice, 0);
@@ -144,9 +194,27 @@ void GPUBuffer::setFrom(const PinnedCPUBuffer& src, size_t srcBegin,
   }
 }
 
+void GPUBuffer::setFrom(const void* src, size_t srcBegin,
+    size_t srcEnd, size_t destBegin)  {
+  if (srcEnd - srcBegin > size_ - destBegin) {
+    throw std::runtime_error("Buffer overflow.");
+  }
+  if (onHost_) {
+    memcpy(ptr_ + destBegin, (const char*)src + srcBegin,
+        srcEnd - srcBegin);
+    return;
+  }
+  cudaError_t err = cudaMemcpy(ptr_ + destBegin,
+      (const char*)src + srcBegin, srcEnd - srcBegin,
+      cudaMemcpyHostToDevice);
+  if (err != cudaSuccess) {
+    throw std::runtime_error("cudaMemcpy failed.");
+  }
+}
+
 void GPUBuffer::setFrom(const GPUBuffer& src, size_t srcBegin,
     size_t srcEnd, size_t destBegin)  {
-  if (this->device_ != src.device_) {
+  if (this->device_ != src.device_ || onHost_ != src.onHost_) {
     throw std::runtime_error(
         "Currently setFrom only supports transferring data within the "
         "same device or between host and device.");
@@ -154,6 +222,11 @@ void GPUBuffer::setFrom(const GPUBuffer& src, size_t srcBegin,
   if (srcEnd - srcBegin > size_ - destBegin) {
     throw std::runtime_error("Buffer overflow.");
   }
+  if (onHost_) {
+    memmove(ptr_ + destBegin, (char*)src.getPtr() + srcBegin,
+        srcEnd - srcBegin);
+    return;
+  }
   cudaError_t err = cudaMemcpy(ptr_ + destBegin,
       (char*)src.getPtr() + srcBegin, srcEnd - srcBegin,
       cudaMemcpyDeviceToDevice);
@@ -169,6 +242,10 @@ void GPUBuffer::dump(std::ostream& stream, int numCols)
 
 void GPUBuffer::setToZero()
 {
+  if (onHost_) {
+    memset(ptr_, 0, size_);
+    return;
+  }
   cudaMemset(ptr_, 0, size_);
 }
 
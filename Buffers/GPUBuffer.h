@@ -16,6 +16,11 @@ class PinnedCPUBuffer;
 /** A class for managing flat GPU memory.  The GPU memory managed by a
  * GPUBuffer is freed when the buffer is destroyed (e.g. when it goes
  * out of scope). 
+ *
+ * When host memory mode is switched on with useHostMemory() (the CPU
+ * backend does this), GPUBuffers allocate aligned host memory instead
+ * and all transfers become plain memcpy's, so code written against
+ * GPUBuffer runs unchanged on machines without a CUDA device.
  * @brief Class for managing GPU memory.
  * */
 class GPUBuffer : public Buffer {
@@ -102,6 +107,16 @@ class GPUBuffer : public Buffer {
      * */
     virtual void setFrom(const GPUBuffer& src, size_t srcBegin,
         size_t srcEnd, size_t destBegin);
+    /** Set this buffer from a plain host array, e.g. memory shared with
+     * another process.  The transfer is synchronous, so src may be
+     * reused as soon as the call returns.
+     * @param src         Source array.
+     * @param srcBegin    Beginning of slice that is copied into this.
+     * @param srcEnd      End of slice that is copied into this.
+     * @param destBegin   Offset in dest.
+     * */
+    virtual void setFrom(const void* src, size_t srcBegin,
+        size_t srcEnd, size_t destBegin);
 
     virtual void setToZero();
 
@@ -111,10 +126,30 @@ class GPUBuffer : public Buffer {
 
     virtual bool hasNaNs(bool verbose = false) const;
 
+    /** Whether the memory managed by this buffer lives on the host
+     * (i.e. it was allocated while host memory mode was on).*/
+    bool isOnHost() const { return onHost_; } ;
+
+    /** Switch host memory mode on or off for all GPUBuffers allocated
+     * from now on.  Must be called before any GPUBuffer is allocated.
+     * @param onHost If true, allocate host memory instead of device memory.*/
+    static void useHostMemory(bool onHost);
+    /** Whether host memory mode is on.*/
+    static bool hostMemoryMode() { return hostMemoryMode_; } ;
+
+    /** Alignment in bytes of host allocations; suitable for SIMD and FFTW.*/
+    static const size_t hostAlignment = 64;
+
   private:
     int device_;
     size_t size_;
     char* ptr_;
+    bool onHost_;
+
+    static bool hostMemoryMode_;
+
+    void allocate();
+    void release();
 };
 
 #endif
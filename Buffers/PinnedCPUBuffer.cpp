@@ -3,73 +3,71 @@
 #include "GPUBuffer.h"
 
 PinnedCPUBuffer::PinnedCPUBuffer() :
-  size_(0), ptr_(0)
+  size_(0), ptr_(0), pinned_(false)
 {
 }
 
 PinnedCPUBuffer::PinnedCPUBuffer(size_t size) :
-  size_(size), ptr_(0)
+  size_(size), ptr_(0), pinned_(false)
 {
-  cudaError_t err = cudaHostAlloc((void**)&ptr_, size_, cudaHostAllocDefault);
-  if (err != cudaSuccess) {
-    throw std::runtime_error("cudaHostAlloc() failed.");
-  }
+  allocate();
 }
 
 PinnedCPUBuffer::PinnedCPUBuffer(const Buffer& toCopy) :
-  size_(toCopy.getSize()), ptr_(0)
+  size_(toCopy.getSize()), ptr_(0), pinned_(false)
 {
-  cudaError_t err = cudaHostAlloc((void**)&ptr_, size_, cudaHostAllocDefault);
-  if (err != cudaSuccess) {
-    throw std::runtime_error("cudaHostAlloc() failed.");
-  }
+  allocate();
   toCopy.set(this, 0, size_, 0);
 }
 
 PinnedCPUBuffer& PinnedCPUBuffer::operator=(const Buffer& rhs) {
-  cudaError_t err;
   if (this != &rhs) {
+    release();
     size_ = rhs. getSize();
-    if (ptr_ != 0) {
-      err = cudaFreeHost(ptr_);
-      if (err != cudaSuccess) {
-        throw std::runtime_error("cudaFreeHost() failed."); 
-      }
-    }
-    err = cudaHostAlloc((void**)&ptr_, size_, cudaHostAllocDefault);
-    if (err != cudaSuccess) {
-      throw std::runtime_error("cudaHostAlloc failed.");
-    }
+    allocate();
     rhs.set(this, 0, size_, 0);
   }
   return *this;
 }
 
 PinnedCPUBuffer::~PinnedCPUBuffer() {
-  if (ptr_) {
-    cudaError_t err = cudaFreeHost(ptr_);
-    if (err != cudaSuccess) {
-      throw std::runtime_error("cudaFreeHost() failed.");
-    }
+  release();
+}
+
+void PinnedCPUBuffer::allocate() {
+  if (size_ == 0) {
+    return;
+  }
+  pinned_ = !GPUBuffer::hostMemoryMode();
+  if (!pinned_) {
+    ptr_ = new char[size_];
+    return;
+  }
+  cudaError_t err = cudaHostAlloc((void**)&ptr_, size_, cudaHostAllocDefault);
+  if (err != cudaSuccess) {
+    throw std::runtime_error("cudaHostAlloc() failed.");
   }
 }
 
-void PinnedCPUBuffer::resize(size_t newsize) {
-  cudaError_t err;
+void PinnedCPUBuffer::release() {
   if (ptr_) {
-    err = cudaFreeHost(ptr_);
-    if (err != cudaSuccess) {
-      throw std::runtime_error("cudaFreeHost() failed.");
+    if (pinned_) {
+      cudaError_t err = cudaFreeHost(ptr_);
+      if (err != cudaSuccess) {
+        throw std::runtime_error("cudaFreeHost() failed.");
+      }
+    }
+    else {
+      delete [] ptr_;
     }
     ptr_ = 0;
   }
+}
+
+void PinnedCPUBuffer::resize(size_t newsize) {
+  release();
   size_ = newsize;
-  if (newsize > 0) {
-    err = cudaHostAlloc((void**)&ptr_, size_, cudaHostAllocDefault);
-    if (err != cudaSuccess) {
-      throw std::runtime_error("cudaHostAlloc() failed.");
-    }
-  }
+  allocate();
 }
 
 void PinnedCPUBuffer::set(Buffer* dest, size_t srcBegin, size_t srcEnd,
@@ -97,6 +95,11 @@ void PinnedCPUBuffer::setFrom(const GPUBuffer& src, size_t srcBegin,
   if (srcEnd - srcBegin > size_ - destBegin) {
     throw std::runtime_error("Buffer overflow.");
   }
+  if (src.isOnHost()) {
+    memcpy(ptr_ + destBegin, (char*)src.getPtr() + srcBegin,
+        srcEnd - srcBegin);
+    return;
+  }
   cudaError_t err = cudaMemcpyAsync(ptr_ + destBegin,
       (char*)src.getPtr() + srcBegin, srcEnd - srcBegin,
       cudaMemcpyDeviceToHost, 0);
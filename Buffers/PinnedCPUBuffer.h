@@ -10,6 +10,9 @@ class GPUBuffer;
 
 /**
  * @brief Buffer class for managing pinned host memory.
+ *
+ * In GPUBuffer host memory mode there is no device to pin memory for,
+ * so plain host memory is allocated instead.
  */
 class PinnedCPUBuffer : public CPUBuffer {
 
@@ -55,6 +58,10 @@ class PinnedCPUBuffer : public CPUBuffer {
   private:
     size_t size_;
     char* ptr_;
+    bool pinned_;
+
+    void allocate();
+    void release();
 };
 
 #endif
@@ -90,6 +90,45 @@ TEST(GPUBuffer, DumpTest) {
   b.set(&c, 0, 4 * sizeof(float), 0);
   c.dump(std::cout, 2);
 }
+TEST(GPUBuffer, HostMemoryTest) {
+  GPUBuffer::useHostMemory(true);
+  float src[4] = {11.0, 22.0, 33.0, 44.0};
+  float out[4];
+  CPUBuffer a(sizeof(src));
+  a.setFrom(src, 0, sizeof(src), 0);
+
+  GPUBuffer b(a.getSize(), 0);
+  EXPECT_TRUE(b.isOnHost());
+  EXPECT_EQ(0, (size_t)b.getPtr() % GPUBuffer::hostAlignment);
+  a.set(&b, 0, a.getSize(), 0);
+  ASSERT_EQ(0,
+      compareArrays((char*)b.getPtr(), (char*)src, sizeof(src)));
+
+  GPUBuffer c(b);
+  EXPECT_TRUE(c.isOnHost());
+  CPUBuffer d(c);
+  d.setPlainArray(out, 0, d.getSize(), 0);
+  ASSERT_EQ(0,
+      compareArrays((char*)out, (char*)src, sizeof(src)));
+
+  c.setToZero();
+  EXPECT_EQ(0.0f, ((float*)c.getPtr())[3]);
+  GPUBuffer::useHostMemory(false);
+}
+TEST(GPUBuffer, PlainArraySetTest) {
+  float src[4] = {11.0, 22.0, 33.0, 44.0};
+  float out[4];
+  GPUBuffer a(sizeof(src), 0);
+  a.setFrom(src, 0, sizeof(src), 0);
+  a.setFrom(src, 0, 2 * sizeof(float), 2 * sizeof(float));
+  CPUBuffer b(a);
+  b.setPlainArray(out, 0, b.getSize(), 0);
+  float result[] = {11.0, 22.0, 11.0, 22.0};
+  ASSERT_EQ(0,
+      compareArrays((char*)out, (char*)result, sizeof(result)));
+  EXPECT_THROW(a.setFrom(src, 0, sizeof(src), sizeof(float)),
+      std::runtime_error);
+}
 
 int compareArrays(char* arr1, char* arr2, int size) {
   int difference = 0;
@@ -4,6 +4,10 @@
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
 #include <boost/tokenizer.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+#include "asyncWriter.h"
 
 
 //! All calculation starts with a SIM_Reconstructor object
@@ -33,8 +37,8 @@ public:
   //! Load raw data from a file and do bleach correction (what "rescale" refers to)
   /*!
    * Calls private method loadImageData()
-   * As is in other occasions, 'waveIdx' is to indicate color channel but mostly unused.
-   * In the future, may add multi-color capability
+   * 'waveIdx' is the color channel; it also switches the config, OTF and
+   * k0 fits that processOneVolume() uses to those of that channel
    */
   void loadAndRescaleImage(int timeIdx, int waveIdx);
 
@@ -46,21 +50,55 @@ public:
    */
   void processOneVolume();
 
-  //! Off-load processed result to host and save it to disk
+  //! Off-load processed result to host and queue it for saving to disk
+  /*!
+    The volume is written by a background thread (see AsyncWriter and the
+    --writequeue option), so this only blocks while the queue is full.
+   */
   void writeResult(int timeIdx, int waveIdx);
 
   int getNTimes() { return m_imgParams.ntimes; };
+  //! First time point to reconstruct: 0, or where a --resume journal left off
+  int getFirstTime() const { return m_firstTime; };
+  //! Number of channels to reconstruct per time point (TIFF mode only does the first)
+  int getNWaves() const;
   void setCurTimeIdx(int it) { m_imgParams.curTimeIdx = it; };
   
   ReconParams & getReconParams() {return m_myParams;};
   ImageParams & getImageParams() {return m_imgParams;};
 
-  void closeFiles(); //! only needed for closing MRC output file
+  void closeFiles(); //! wait for pending writes; finalise the header and close the MRC files
+
+#ifndef __SIRECON_USE_TIFF__
+  //! Start reading and flat-fielding time point 'timeIdx' in the background
+  /*!
+    Only does something if the --prefetch option is on.  The raw data go
+    into a host staging set (one more raw time point worth of memory) and
+    are picked up by the next loadAndRescaleImage(timeIdx, waveIdx), which
+    then only has to upload them.
+   */
+  void prefetch(int timeIdx, int waveIdx);
+#endif
+
+  //! Wait for one more time point of a series that is still being acquired
+  /*!
+    With --watch (TIFF mode) that is the next matching file to be
+    finished; with --stream it is the next ndirs*nphases*nz frames of the
+    input stream, which are read into the staging buffer right away
+    (unless --prefetch already has them); with --shm it is the next
+    filled slot of the input ring.  Returns true, and getNTimes()
+    goes up by one, if there is one; returns false if the input is a
+    finished file, the stream has ended or no file came within
+    --watchidle seconds.
+   */
+  bool waitForNextTimePoint();
 
 #ifdef __SIRECON_USE_TIFF__
   //! Names of input TIFF files (usually a time series whose file names all match a pattern)
+  /*! Only grows with --watch; m_filesMutex guards it against the writer thread */
   std::vector< std::string > m_all_matching_files;
   // CImg<> m_otf_tiff;
+  TIFFReader m_tiffReader;  //! the input file of the time point being loaded
 #endif
 
 
@@ -74,14 +112,70 @@ private:
   po::options_description m_progopts;
   po::variables_map m_varsmap;
   IW_MRC_HEADER m_in_out_header;
+#ifndef __SIRECON_USE_TIFF__
+  MRCReader m_reader;  //! memory-mapped view of the raw data file (istream_no is kept for the header)
+  FrameStream m_stream;  //! raw frame input if --stream
+  bool m_streamEnded;  //! the last read of m_stream found its end
+  ShmRing* m_shmIn;  //! raw time point input ring if --shm, else 0
+  const void* m_shmSlot;  //! the slot of m_shmIn holding the next time point to load, or 0
+  ShmRing* m_shmOut;  //! output volume ring if --shmout, else 0
+  BatchReader m_batch;  //! raw data file opened for batched section reads if --iouring
+  Journal m_journal;  //! record of finished time points if --resume
+  //! Raw data of one time point on the host: flat-fielded (ndirs, nphases, nz) float sections or, for uint16 data, the unconverted sections in task order
+  PinnedCPUBuffer m_staging;
+  std::vector<float> m_stagingBgExtra;  //! per-section backgroundExtra of uint16 sections in m_staging
+  boost::thread* m_prefetchThread;
+  int m_prefetchTime, m_prefetchWave;  //! time point and channel in m_staging; m_prefetchTime is -1 if none
+  std::string m_prefetchError;
+  std::vector<unsigned short> m_outSection;  //! one converted output section (half or uint16 output)
+  std::vector<float> m_roiVolume;  //! the part of an output volume that --roi asks for
+  std::vector<float> m_u16Offset, m_u16Scale;  //! per channel uint16 scaling of time point 0 (--u16scale global)
+  ChunkStore* m_chunkStore;  //! output store if --outputformat zarr, else 0
+  std::vector<float> m_volumeOffset, m_volumeScale;  //! uint16 scaling of every (time point, channel) in m_chunkStore
+#endif
+
+  AsyncWriter* m_writer;  //! created by the first writeResult()
+#ifdef __SIRECON_USE_TIFF__
+  FileWatcher* m_watcher;  //! input folder watcher if --watch, else 0
+  boost::mutex m_filesMutex;
+#endif
+
+#ifndef __SIRECON_USE_TIFF__
+  //! Config, OTF and fits of every channel of a multi-wavelength file; empty for one channel
+  /*! The channel being reconstructed (m_curWave) has its buffers in
+      m_reconData instead (see swapWaveData()); m_myParams always holds
+      channel 0's config, which is what the output and the writer thread use */
+  std::vector<WaveData> m_waves;
+#endif
+  int m_curWave;  //! channel being reconstructed
+  int m_firstTime;  //! see getFirstTime()
 
   int m_argc;
   char ** m_argv;
 
   int setupProgramOptions(); //! setup command line options using Boost library
+  void parseCommandLine();  //! store the command line in m_varsmap
+  //! Store the config file (named for channel 'iw', see waveFileName()) in m_varsmap
+  void readConfigFile(int iw);
   int setParams();  //! assign parameters after parsing command line
+  void initBackend();  //! set up the CPU backend if it is used; once, after setParams()
+  //! 'name' with every "{wave}" replaced by the emission wavelength of channel 'iw'
+  std::string waveFileName(const std::string& name, int iw) const;
+  ReconParams* waveParams();  //! the config of the channel being reconstructed
+#ifndef __SIRECON_USE_TIFF__
+  void peekWavelengths();  //! fill m_imgParams.wave from the input header before the config is read
+  void setupWaves();  //! load the config and OTF of every further channel into m_waves
+  void selectWave(int iw);  //! make channel 'iw' the one in m_reconData
+  std::string journalName() const;  //! the --resume journal: output file name + ".journal"
+  //! Open the journal and restore the fits, intensities and ranges of the run it records
+  void openJournal();
+  //! Journal the k0 and modamp fits of (it, iw); on the main thread, before the volume is queued
+  void journalFit(int it, int iw);
+  //! Journal time point 'it' as written; on the writer thread, after its last channel
+  void journalDone(int it);
+#endif
 #ifdef __SIRECON_USE_TIFF__
-  void setup(CImg<> &inTIFF);
+  void setup(const TIFFReader& inTIFF);
 #else
   //! Read header, set up OTF and separation matrix, allocate device buffers, initialize parameters like k0guess etc.
   /*!
@@ -99,6 +193,11 @@ private:
      f. amp
    */
   void setup();
+  //! Set up m_imgParams and m_in_out_header for live input (m_stream or m_shmIn), which has no MRC header
+  void liveHeader(int nx, int ny, int nz, float dxy, float dz, int wavelength);
+  //! True if time points are counted as they arrive (--stream or --shm)
+  bool liveInput() const;
+  void createShmOutput();  //! create m_shmOut once the output size is known
 #endif
   void openFiles();
 
@@ -109,6 +208,54 @@ private:
     'iw' is color channel indicator; rarely used
    */
   void loadImageData(int it, int iw, int zoffset);
+  //! Save one output volume to disk; runs on the writer thread
+  void writeVolume(const CPUBuffer& outbufferHost, int it, int iw);
+  //! Write the --mip projections and preview of an nx*ny*nz volume of channel 'iw' as prefix + "_mipxy" + suffix + ".mrc" (".tif" in TIFF mode) etc.
+  void writeProjections(const float* volume, int nx, int ny, int nz, int iw,
+      const std::string& prefix, const std::string& suffix);
+  //! Write one float image, an XY or ('xz') an XZ view of channel 'iw', as a single-section file
+  void writeImage(const std::string& fname, int nx, int ny, const float* image,
+      int iw, bool xz);
+#ifndef __SIRECON_USE_TIFF__
+  void createChunkStore();
+  void writeChunkAttributes();
+#endif
+#ifndef __SIRECON_USE_TIFF__
+  //! True for native-endian uint16 data, which are flat-fielded after upload (see uploadRawU16())
+  bool rawIsU16() const;
+  float sectionBackgroundExtra(int zsec, int iw, int it) const;
+  //! Read and flat-field one raw section into 'dest'; safe to call from several threads
+  void loadSection(int it, int iw, int direction, int z, int phase, float* dest);
+  void reserveStaging();  //! size m_staging for one time point
+  //! Wait for the uploads from m_staging, so the next prefetch can overwrite it
+  void releaseStaging();
+  //! Fill m_staging with time point 'it'; throws std::runtime_error on failure
+  void loadIntoStaging(int it, int iw);
+  //! Time point of m_reader that time point 'it' is read from (see applyTimeRange())
+  int rawTime(int it) const;
+  //! First pixel of the grid (see applyRoi()) in raw section 'section' of m_reader
+  const char* roiOrigin(const void* section) const;
+  //! Copy the grid's rows of the uint16 section whose grid starts at 'origin' to 'dest' (nx*ny values)
+  void copyRawU16(const char* origin, unsigned short* dest) const;
+  //! True if m_batch reads uint16 sections straight into m_staging (whole rows are reconstructed)
+  bool batchReadsInPlace() const;
+  //! loadIntoStaging() with all sections read by m_batch in one batch
+  void batchLoadIntoStaging(int it, int iw);
+  //! Put the 'task'th section of a batch in place in m_staging; called as its read completes
+  void stageBatchedSection(int it, int iw, const char* raw, int task);
+  //! Read the next time point of m_stream into m_staging; false at the end of the stream
+  bool readStreamedTimePoint();
+  void runPrefetch(int it, int iw);  //! body of the prefetch thread
+  //! Transfer the uint16 sections in m_staging and flat-field them into savedBands
+  void uploadRawU16(int zoffset);
+  //! Transfer the time point in m_shmSlot straight from the ring, flat-field it and hand the slot back
+  void uploadShmSlot(int zoffset);
+  //! Flat-field the sections in rawU16 into savedBands; 'fileOrder' if they are in file rather than task order
+  void flatfieldRawU16(int zoffset, bool fileOrder);
+  void joinPrefetch();
+  //! Wait for a pending prefetch; true if it holds (it, iw)
+  bool takePrefetched(int it, int iw);
+#endif
 };
 
 #endif
@@ -0,0 +1,139 @@
+#include "asyncWriter.h"
+
+#include <stdexcept>
+
+AsyncWriter::AsyncWriter(size_t volumeBytes, int depth,
+    const WriteFunction& write) : m_write(write), m_stopping(false),
+  m_thread(0)
+{
+  int nbuffers = depth > 0 ? depth : 1;
+  for (int i = 0; i < nbuffers; ++i) {
+    m_buffers.push_back(new PinnedCPUBuffer(volumeBytes));
+  }
+  m_free = m_buffers;
+  if (depth > 0) {
+    m_thread = new boost::thread(&AsyncWriter::run, this);
+  }
+}
+
+AsyncWriter::~AsyncWriter()
+{
+  try {
+    finish();
+  }
+  catch (...) {
+  }
+  for (size_t i = 0; i < m_buffers.size(); ++i) {
+    delete m_buffers[i];
+  }
+}
+
+CPUBuffer* AsyncWriter::acquire()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  while (m_free.empty() && m_error.empty()) {
+    m_changed.wait(lock);
+  }
+  if (!m_error.empty()) {
+    throw std::runtime_error(m_error);
+  }
+  PinnedCPUBuffer* volume = m_free.back();
+  m_free.pop_back();
+  return volume;
+}
+
+void AsyncWriter::submit(CPUBuffer* volume, int it, int iw)
+{
+  Job job;
+  job.volume = static_cast<PinnedCPUBuffer*>(volume);
+  job.it = it;
+  job.iw = iw;
+
+  if (!m_thread) {
+    write(job);
+    m_free.push_back(job.volume);
+    throwIfFailed();
+    return;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_queue.push_back(job);
+  }
+  m_changed.notify_all();
+}
+
+void AsyncWriter::finish()
+{
+  if (m_thread) {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_stopping = true;
+    }
+    m_changed.notify_all();
+    m_thread->join();
+    delete m_thread;
+    m_thread = 0;
+  }
+  throwIfFailed();
+}
+
+void AsyncWriter::run()
+{
+  for (;;) {
+    Job job;
+    bool failed;
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while (m_queue.empty() && !m_stopping) {
+        m_changed.wait(lock);
+      }
+      if (m_queue.empty()) {
+        return;
+      }
+      job = m_queue.front();
+      m_queue.pop_front();
+      failed = !m_error.empty();
+    }
+
+    // after a failed write the rest of the queue is only drained, so
+    // that nobody waits on a buffer forever
+    if (!failed) {
+      write(job);
+    }
+
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_free.push_back(job.volume);
+    }
+    m_changed.notify_all();
+  }
+}
+
+void AsyncWriter::write(const Job& job)
+{
+  std::string error;
+  try {
+    m_write(*job.volume, job.it, job.iw);
+  }
+  catch (std::exception &e) {
+    error = e.what();
+  }
+  catch (...) {
+    error = "unknown error while writing output";
+  }
+  if (!error.empty()) {
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_error.empty()) {
+      m_error = error;
+    }
+  }
+}
+
+void AsyncWriter::throwIfFailed()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  if (!m_error.empty()) {
+    throw std::runtime_error(m_error);
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "PinnedCPUBuffer.h"
+
+//! Writes finished output volumes to disk on a background thread
+/*!
+  The writer owns a fixed pool of host buffers, each big enough for one
+  output volume.  The reconstruction thread takes a free one with
+  acquire(), downloads the result into it and hands it back with
+  submit(); the writer thread calls the write function on the submitted
+  volumes in submission order and then puts the buffers back in the pool.
+  acquire() blocks while every buffer is queued or being written, so at
+  most 'depth' volumes are ever pending.
+
+  With depth 0 there is no thread: one buffer is used and submit() writes
+  it right away.
+
+  An exception thrown by the write function is rethrown (as
+  std::runtime_error) from the next acquire(), submit() or finish().
+ */
+class AsyncWriter {
+public:
+  //! Called on the writer thread with the volume and its (time, wave) indices
+  typedef boost::function<void (const CPUBuffer&, int, int)> WriteFunction;
+
+  AsyncWriter(size_t volumeBytes, int depth, const WriteFunction& write);
+  //! Calls finish(), but never throws
+  ~AsyncWriter();
+
+  //! Returns a free buffer, waiting for the writer if there is none
+  CPUBuffer* acquire();
+  //! Queues a buffer returned by acquire() for writing
+  void submit(CPUBuffer* volume, int it, int iw);
+  //! Waits until every submitted volume is written and stops the thread
+  void finish();
+
+private:
+  struct Job {
+    PinnedCPUBuffer* volume;
+    int it, iw;
+  };
+
+  WriteFunction m_write;
+  std::vector<PinnedCPUBuffer*> m_buffers;
+  std::vector<PinnedCPUBuffer*> m_free;
+  std::deque<Job> m_queue;
+  bool m_stopping;
+  std::string m_error;
+
+  boost::mutex m_mutex;
+  boost::condition_variable m_changed;
+  boost::thread* m_thread;
+
+  void run();
+  void write(const Job& job);
+  void throwIfFailed();
+
+  // not copyable
+  AsyncWriter(const AsyncWriter&);
+  AsyncWriter& operator=(const AsyncWriter&);
+};
+
+#endif
@@ -0,0 +1,520 @@
+#include "batchReader.h"
+
+#include <stdexcept>
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __SIRECON_USE_IO_URING__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// older C libraries do not know the numbers yet; they are the same on all
+// architectures but alpha
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+#endif
+
+namespace {
+
+const size_t PAGE_BYTES = 4096;
+
+std::string errorText(const std::string& what, int err)
+{
+  return what + ": " + strerror(err);
+}
+
+}
+
+#ifdef __SIRECON_USE_IO_URING__
+
+namespace {
+
+const unsigned QUEUE_DEPTH = 128;
+const size_t MAX_FIXED_BYTES = 1 << 30;  // the kernel's limit per registered buffer
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete)
+{
+  int ret = syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+      minComplete ? IORING_ENTER_GETEVENTS : 0, (void*) 0, 0);
+  return ret < 0 ? -errno : ret;
+}
+
+}
+
+//! The mapped submission and completion rings of one io_uring instance
+struct BatchReaderRing {
+  int fd;
+  unsigned entries;
+  void* sqMap;
+  size_t sqMapBytes;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  io_uring_sqe* sqes;
+  size_t sqesBytes;
+  void* cqMap;
+  size_t cqMapBytes;
+  unsigned *cqHead, *cqTail, *cqMask;
+  io_uring_cqe* cqes;
+  int nfixed;  // registered buffers, MAX_FIXED_BYTES each but the last
+
+  BatchReaderRing() : fd(-1), entries(0), sqMap(MAP_FAILED), sqMapBytes(0),
+    sqes((io_uring_sqe*) MAP_FAILED), sqesBytes(0), cqMap(MAP_FAILED),
+    cqMapBytes(0), nfixed(0) {}
+
+  ~BatchReaderRing() {
+    if (sqMap != MAP_FAILED) {
+      munmap(sqMap, sqMapBytes);
+    }
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqesBytes);
+    }
+    if (cqMap != MAP_FAILED) {
+      munmap(cqMap, cqMapBytes);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  //! False if the kernel has no io_uring or does not let us use it
+  bool setup() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &p);
+    if (fd < 0) {
+      return false;
+    }
+    entries = p.sq_entries;
+
+    sqMapBytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    sqMap = mmap(0, sqMapBytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    sqesBytes = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*) mmap(0, sqesBytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    cqMapBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    cqMap = mmap(0, cqMapBytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (sqMap == MAP_FAILED || sqes == MAP_FAILED || cqMap == MAP_FAILED) {
+      return false;
+    }
+
+    char* sq = (char*) sqMap;
+    sqHead = (unsigned*) (sq + p.sq_off.head);
+    sqTail = (unsigned*) (sq + p.sq_off.tail);
+    sqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned*) (sq + p.sq_off.array);
+    char* cq = (char*) cqMap;
+    cqHead = (unsigned*) (cq + p.cq_off.head);
+    cqTail = (unsigned*) (cq + p.cq_off.tail);
+    cqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+    return true;
+  }
+};
+
+namespace {
+
+//! State of one read() through the ring; not thread-safe, callers take turns
+class RingBatch {
+public:
+  RingBatch(BatchReaderRing& ring, int fd, const std::string& fname,
+      const std::vector<BatchReader::Request>& requests,
+      const char* registered, size_t registeredBytes) :
+    m_ring(ring), m_fd(fd), m_fname(fname), m_requests(requests),
+    m_registered(registered), m_registeredBytes(registeredBytes),
+    m_doneBytes(requests.size(), 0), m_iov(requests.size()),
+    m_next(0), m_completed(0), m_inflight(0), m_unsubmitted(0) {}
+
+  //! Index of the next request that has completed, waiting for one; -1 when all have
+  int next() {
+    const int n = (int) m_requests.size();
+    for (;;) {
+      if (m_completed == n) {
+        return -1;
+      }
+      while (m_next < n && m_inflight < m_ring.entries) {
+        queue(m_next++);
+      }
+
+      unsigned head = *m_ring.cqHead;
+      if (head == __atomic_load_n(m_ring.cqTail, __ATOMIC_ACQUIRE)) {
+        int ret = ioUringEnter(m_ring.fd, m_unsubmitted, 1);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+          throw std::runtime_error(errorText("io_uring_enter failed", -ret));
+        }
+        if (ret > 0) {
+          m_unsubmitted -= ret;
+        }
+        continue;
+      }
+
+      const io_uring_cqe& cqe = m_ring.cqes[head & *m_ring.cqMask];
+      int i = (int) cqe.user_data;
+      int res = cqe.res;
+      __atomic_store_n(m_ring.cqHead, head + 1, __ATOMIC_RELEASE);
+      --m_inflight;
+      if (res == -EAGAIN || res == -EINTR) {
+        queue(i);
+        continue;
+      }
+      if (res < 0) {
+        throw std::runtime_error(errorText("Cannot read " + m_fname, -res));
+      }
+      if (res == 0) {
+        throw std::runtime_error(m_fname + " ended in the middle of a section");
+      }
+      m_doneBytes[i] += res;
+      if (m_doneBytes[i] < m_requests[i].nbytes) {
+        queue(i);  // short read; ask for the rest
+        continue;
+      }
+      ++m_completed;
+      return i;
+    }
+  }
+
+  //! Wait for the reads still in flight after an error, so their buffers can be reused
+  void drain() {
+    while (m_inflight > 0) {
+      unsigned head = *m_ring.cqHead;
+      unsigned tail = __atomic_load_n(m_ring.cqTail, __ATOMIC_ACQUIRE);
+      if (head != tail) {
+        m_inflight -= tail - head;
+        __atomic_store_n(m_ring.cqHead, tail, __ATOMIC_RELEASE);
+        continue;
+      }
+      int ret = ioUringEnter(m_ring.fd, m_unsubmitted, 1);
+      if (ret > 0) {
+        m_unsubmitted -= ret;
+      }
+      else if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+        return;  // nothing more can be done
+      }
+    }
+  }
+
+private:
+  BatchReaderRing& m_ring;
+  int m_fd;
+  const std::string& m_fname;
+  const std::vector<BatchReader::Request>& m_requests;
+  const char* m_registered;
+  size_t m_registeredBytes;
+  std::vector<size_t> m_doneBytes;
+  std::vector<iovec> m_iov;  // must outlive the READV they are given to
+  int m_next;  // first request not yet queued
+  int m_completed;
+  unsigned m_inflight;  // queued and not yet reaped
+  unsigned m_unsubmitted;  // queued and not yet passed to the kernel
+
+  //! Registered buffer holding all of [dest, dest+nbytes), or -1
+  int fixedIndex(const char* dest, size_t nbytes) const {
+    if (!m_ring.nfixed || dest < m_registered ||
+        dest + nbytes > m_registered + m_registeredBytes) {
+      return -1;
+    }
+    size_t first = dest - m_registered;
+    size_t index = first / MAX_FIXED_BYTES;
+    return (first + nbytes - 1) / MAX_FIXED_BYTES == index ? (int) index : -1;
+  }
+
+  //! Put (the rest of) request i on the submission ring
+  void queue(int i) {
+    const BatchReader::Request& request = m_requests[i];
+    char* dest = (char*) request.dest + m_doneBytes[i];
+    size_t nbytes = request.nbytes - m_doneBytes[i];
+    if (nbytes > MAX_FIXED_BYTES) {
+      nbytes = MAX_FIXED_BYTES;  // the rest comes as a short read
+    }
+
+    unsigned tail = *m_ring.sqTail;
+    unsigned slot = tail & *m_ring.sqMask;
+    io_uring_sqe* sqe = &m_ring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    int fixed = fixedIndex(dest, nbytes);
+    if (fixed >= 0) {
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->addr = (unsigned long) dest;
+      sqe->len = nbytes;
+      sqe->buf_index = fixed;
+    }
+    else {
+      m_iov[i].iov_base = dest;
+      m_iov[i].iov_len = nbytes;
+      sqe->opcode = IORING_OP_READV;
+      sqe->addr = (unsigned long) &m_iov[i];
+      sqe->len = 1;
+    }
+    sqe->fd = m_fd;
+    sqe->off = request.offset + m_doneBytes[i];
+    sqe->user_data = i;
+    m_ring.sqArray[slot] = slot;
+    __atomic_store_n(m_ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++m_inflight;
+    ++m_unsubmitted;
+  }
+};
+
+}
+
+#else
+
+struct BatchReaderRing {};
+
+#endif
+
+BatchReader::BatchReader() : m_fd(-1), m_ring(0), m_registered(0),
+  m_registeredBytes(0), m_buffer(0), m_bufferBytes(0)
+{
+}
+
+BatchReader::~BatchReader()
+{
+  close();
+}
+
+void BatchReader::open(const std::string& fname)
+{
+  close();
+  m_fname = fname;
+  m_fd = ::open(fname.c_str(), O_RDONLY);
+  if (m_fd < 0) {
+    throw std::runtime_error(errorText("Cannot open " + fname, errno));
+  }
+#ifdef __SIRECON_USE_IO_URING__
+  m_ring = new BatchReaderRing;
+  if (!m_ring->setup()) {
+    delete m_ring;
+    m_ring = 0;
+  }
+#endif
+}
+
+void BatchReader::close()
+{
+  unregisterBuffer();
+  delete m_ring;
+  m_ring = 0;
+  free(m_buffer);
+  m_buffer = 0;
+  m_bufferBytes = 0;
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+  m_fd = -1;
+}
+
+const char* BatchReader::method() const
+{
+  return m_ring ? "io_uring" : "pread";
+}
+
+#ifdef __SIRECON_USE_IO_URING__
+bool BatchReader::registerBuffer(void* base, size_t nbytes)
+{
+  unregisterBuffer();
+  if (!m_ring || !base || !nbytes) {
+    return false;
+  }
+  std::vector<iovec> iov;
+  for (size_t offset = 0; offset < nbytes; offset += MAX_FIXED_BYTES) {
+    iovec v;
+    v.iov_base = (char*) base + offset;
+    v.iov_len = nbytes - offset < MAX_FIXED_BYTES ? nbytes - offset : MAX_FIXED_BYTES;
+    iov.push_back(v);
+  }
+  // fails if the pages cannot be pinned, e.g. over RLIMIT_MEMLOCK
+  if (syscall(__NR_io_uring_register, m_ring->fd, IORING_REGISTER_BUFFERS,
+        &iov[0], (unsigned) iov.size()) < 0) {
+    return false;
+  }
+  m_ring->nfixed = iov.size();
+  m_registered = base;
+  m_registeredBytes = nbytes;
+  return true;
+}
+#else
+bool BatchReader::registerBuffer(void*, size_t)
+{
+  unregisterBuffer();
+  return false;  // reads go through pread()
+}
+#endif
+
+void BatchReader::unregisterBuffer()
+{
+#ifdef __SIRECON_USE_IO_URING__
+  if (m_ring && m_ring->nfixed) {
+    syscall(__NR_io_uring_register, m_ring->fd, IORING_UNREGISTER_BUFFERS,
+        (void*) 0, 0);
+    m_ring->nfixed = 0;
+  }
+#endif
+  m_registered = 0;
+  m_registeredBytes = 0;
+}
+
+void* BatchReader::buffer(size_t nbytes)
+{
+  if (nbytes > m_bufferBytes) {
+    if (m_registered == m_buffer) {
+      unregisterBuffer();
+    }
+    free(m_buffer);
+    m_buffer = 0;
+    m_bufferBytes = 0;
+    nbytes = (nbytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+    if (posix_memalign(&m_buffer, PAGE_BYTES, nbytes)) {
+      m_buffer = 0;
+      throw std::runtime_error("Cannot allocate the read buffer for " + m_fname);
+    }
+    m_bufferBytes = nbytes;
+  }
+  if (m_registered != m_buffer) {
+    registerBuffer(m_buffer, m_bufferBytes);
+  }
+  return m_buffer;
+}
+
+void BatchReader::preadAll(const Request& request)
+{
+  char* dest = (char*) request.dest;
+  size_t left = request.nbytes;
+  off_t offset = request.offset;
+  while (left) {
+    ssize_t got = pread(m_fd, dest, left, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      throw std::runtime_error(errorText("Cannot read " + m_fname, errno));
+    }
+    if (got == 0) {
+      throw std::runtime_error(m_fname + " ended in the middle of a section");
+    }
+    dest += got;
+    left -= got;
+    offset += got;
+  }
+}
+
+void BatchReader::read(const std::vector<Request>& requests,
+    const boost::function<void (int)>& done)
+{
+#ifdef __SIRECON_USE_IO_URING__
+  if (m_ring) {
+    readWithRing(requests, done);
+    return;
+  }
+#endif
+  const int n = (int) requests.size();
+  std::string errorMsg;
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < n; ++i) {
+    try {
+      preadAll(requests[i]);
+      done(i);
+    }
+    catch (std::exception &e) {
+#pragma omp critical
+      errorMsg = e.what();
+    }
+  }
+
+  if (!errorMsg.empty()) {
+    throw std::runtime_error(errorMsg);
+  }
+}
+
+#ifdef __SIRECON_USE_IO_URING__
+void BatchReader::readWithRing(const std::vector<Request>& requests,
+    const boost::function<void (int)>& done)
+{
+  // All the reads are queued up front (as many as the ring holds) and the
+  // threads take turns reaping one completion each, which they then
+  // process while the others wait for the next
+  RingBatch batch(*m_ring, m_fd, m_fname, requests,
+      (const char*) m_registered, m_registeredBytes);
+  std::string errorMsg;
+
+#pragma omp parallel
+  {
+    for (;;) {
+      int i = -1;
+#pragma omp critical(batchReaderRing)
+      {
+        if (errorMsg.empty()) {
+          try {
+            i = batch.next();
+          }
+          catch (std::exception &e) {
+            errorMsg = e.what();
+          }
+        }
+      }
+      if (i < 0) {
+        break;
+      }
+      try {
+        done(i);
+      }
+      catch (std::exception &e) {
+#pragma omp critical(batchReaderRing)
+        errorMsg = e.what();
+      }
+    }
+  }
+
+  batch.drain();
+  if (!errorMsg.empty()) {
+    throw std::runtime_error(errorMsg);
+  }
+}
+#endif
+
+#else
+
+namespace {
+
+void unsupported()
+{
+  throw std::runtime_error("Batched reads are not supported on Windows");
+}
+
+}
+
+struct BatchReaderRing {};
+
+BatchReader::BatchReader() : m_fd(-1), m_ring(0), m_registered(0),
+  m_registeredBytes(0), m_buffer(0), m_bufferBytes(0) {}
+BatchReader::~BatchReader() {}
+void BatchReader::open(const std::string&) { unsupported(); }
+void BatchReader::close() {}
+const char* BatchReader::method() const { return "none"; }
+bool BatchReader::registerBuffer(void*, size_t) { return false; }
+void* BatchReader::buffer(size_t) { unsupported(); return 0; }
+void BatchReader::read(const std::vector<Request>&,
+    const boost::function<void (int)>&) { unsupported(); }
+void BatchReader::preadAll(const Request&) {}
+void BatchReader::readWithRing(const std::vector<Request>&,
+    const boost::function<void (int)>&) {}
+void BatchReader::unregisterBuffer() {}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef BATCH_READER_H
+#define BATCH_READER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+
+struct BatchReaderRing;
+
+//! Reads many sections of one file at once, with io_uring where there is one
+/*!
+  read() takes all the positioned reads of a time point as one batch.
+  On Linux they are queued on an io_uring submission ring, so the device
+  sees the whole batch at once instead of one read per thread; elsewhere,
+  or if the kernel refuses io_uring (e.g. in a container that filters
+  the syscalls), they are done with pread() from OpenMP threads.
+
+  Reads that land in the buffer given to registerBuffer() use the
+  ring's registered (pinned-once) buffers; anything else still works,
+  only through a plain vectored read.  Either way the caller's 'done'
+  callback is called, from the OpenMP threads, for each read as soon as
+  it has completed, so its data can be processed while the rest of the
+  batch is still in flight.
+
+  cudasirecon reads MRC time points with it if --iouring is on.  Not
+  available on Windows.
+ */
+class BatchReader {
+public:
+  //! One read of a batch: 'nbytes' at file offset 'offset' into 'dest'
+  struct Request {
+    boost::uint64_t offset;
+    size_t nbytes;
+    void* dest;
+  };
+
+  BatchReader();
+  ~BatchReader();
+
+  //! Opens 'fname' for reading; throws std::runtime_error on failure
+  void open(const std::string& fname);
+  void close();
+  bool isOpen() const { return m_fd >= 0; };
+  //! "io_uring" or "pread"
+  const char* method() const;
+
+  //! Makes [base, base+nbytes) the registered buffer; false if the kernel would not register it
+  bool registerBuffer(void* base, size_t nbytes);
+  //! A page-aligned, registered buffer of at least 'nbytes', owned by the reader; valid till the next call
+  void* buffer(size_t nbytes);
+
+  //! Does all 'requests' and calls done(i) for each as it completes; throws std::runtime_error on failure
+  /*! Every read has finished, or failed, by the time it returns or throws. */
+  void read(const std::vector<Request>& requests,
+      const boost::function<void (int)>& done);
+
+private:
+  std::string m_fname;
+  int m_fd;
+  BatchReaderRing* m_ring;  // 0 if pread() is used
+  void* m_registered;
+  size_t m_registeredBytes;
+  void* m_buffer;
+  size_t m_bufferBytes;
+
+  void preadAll(const Request& request);
+  void readWithRing(const std::vector<Request>& requests,
+      const boost::function<void (int)>& done);
+  void unregisterBuffer();
+
+  // not copyable
+  BatchReader(const BatchReader&);
+  BatchReader& operator=(const BatchReader&);
+};
+
+#endif
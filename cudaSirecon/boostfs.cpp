@@ -6,12 +6,22 @@
 
 static boost::filesystem::path outputDir;
 
-std::vector<std::string> gatherMatchingFiles(std::string target_path, std::string pattern)
+static boost::regex fileFilter(std::string pattern)
 {
   pattern.insert(0, ".*");  // '.' is the wildcard in Perl regexp; '*' just means "repeat".
   pattern.append(".*\\.tif");
+  return boost::regex(pattern);
+}
 
-  const boost::regex my_filter(pattern);
+bool fileMatchesPattern(const std::string& path, std::string pattern)
+{
+  boost::smatch what;
+  return boost::regex_match(path, what, fileFilter(pattern));
+}
+
+std::vector<std::string> gatherMatchingFiles(std::string target_path, std::string pattern)
+{
+  const boost::regex my_filter = fileFilter(pattern);
 
   std::vector< std::string > all_matching_files;
 
@@ -0,0 +1,190 @@
+#include "chunkStore.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __SIRECON_USE_ZLIB__
+#include <zlib.h>
+#endif
+
+namespace {
+
+bool littleEndian()
+{
+  const unsigned short one = 1;
+  return *(const unsigned char*) &one == 1;
+}
+
+size_t nblocks(size_t n, size_t chunk)
+{
+  return (n + chunk - 1) / chunk;
+}
+
+}
+
+ChunkStore::ChunkStore(const std::string& path, const size_t shape[5],
+    const size_t chunks[3], const std::string& dtype, int level,
+    int nthreads) : m_path(path), m_level(level), m_nthreads(nthreads)
+{
+  for (int i = 0; i < 5; ++i) {
+    m_shape[i] = shape[i];
+  }
+  for (int i = 0; i < 3; ++i) {
+    if (chunks[i] == 0) {
+      throw std::runtime_error("Chunk sizes must be positive");
+    }
+    m_chunks[i] = chunks[i];
+  }
+  m_elementSize = std::atoi(dtype.c_str() + 1);
+#ifndef __SIRECON_USE_ZLIB__
+  if (m_level) {
+    printf("Built without zlib; chunks are stored uncompressed\n");
+    m_level = 0;
+  }
+#endif
+
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(m_path, ec);
+  if (ec) {
+    throw std::runtime_error("Cannot create output directory " + m_path +
+        ": " + ec.message());
+  }
+
+  std::ostringstream zarray;
+  zarray << "{\n"
+    << "  \"zarr_format\": 2,\n"
+    << "  \"shape\": [" << m_shape[0] << ", " << m_shape[1] << ", "
+    << m_shape[2] << ", " << m_shape[3] << ", " << m_shape[4] << "],\n"
+    << "  \"chunks\": [1, 1, " << m_chunks[0] << ", " << m_chunks[1] << ", "
+    << m_chunks[2] << "],\n"
+    << "  \"dtype\": \"" << (littleEndian() ? '<' : '>') << dtype << "\",\n"
+    << "  \"compressor\": ";
+  if (m_level) {
+    zarray << "{\"id\": \"zlib\", \"level\": " << m_level << "},\n";
+  } else {
+    zarray << "null,\n";
+  }
+  zarray << "  \"fill_value\": 0,\n"
+    << "  \"order\": \"C\",\n"
+    << "  \"filters\": null\n"
+    << "}\n";
+  const std::string text = zarray.str();
+  writeFile(".zarray", text.data(), text.size());
+}
+
+void ChunkStore::write(int it, int iw, const void* volume)
+{
+  const size_t nz = m_shape[2], ny = m_shape[3], nx = m_shape[4];
+  const size_t cz = m_chunks[0], cy = m_chunks[1], cx = m_chunks[2];
+  const size_t nbz = nblocks(nz, cz), nby = nblocks(ny, cy),
+    nbx = nblocks(nx, cx);
+  const size_t chunkBytes = cz * cy * cx * m_elementSize;
+  const unsigned char* src = (const unsigned char*) volume;
+  const int nchunks = (int) (nbz * nby * nbx);
+
+  std::string error;
+  int nthreads = m_nthreads;
+#ifdef _OPENMP
+  if (nthreads <= 0) {
+    nthreads = omp_get_max_threads();
+  }
+#endif
+
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+  for (int c = 0; c < nchunks; ++c) {
+    const size_t bz = c / (nby * nbx);
+    const size_t by = (c / nbx) % nby;
+    const size_t bx = c % nbx;
+    const size_t z0 = bz * cz, y0 = by * cy, x0 = bx * cx;
+    const size_t rowBytes = ((x0 + cx <= nx) ? cx : nx - x0) * m_elementSize;
+
+    // gather the chunk; the parts past the edges stay zero
+    std::vector<unsigned char> chunk(chunkBytes, 0);
+    for (size_t z = z0; z < z0 + cz && z < nz; ++z) {
+      for (size_t y = y0; y < y0 + cy && y < ny; ++y) {
+        std::memcpy(&chunk[(((z - z0) * cy) + (y - y0)) * cx * m_elementSize],
+            src + ((z * ny + y) * nx + x0) * m_elementSize, rowBytes);
+      }
+    }
+
+    const void* data = &chunk[0];
+    size_t size = chunkBytes;
+#ifdef __SIRECON_USE_ZLIB__
+    std::vector<unsigned char> packed;
+    if (m_level) {
+      uLongf packedSize = compressBound((uLong) chunkBytes);
+      packed.resize(packedSize);
+      if (compress2(&packed[0], &packedSize, &chunk[0], (uLong) chunkBytes,
+            m_level) != Z_OK) {
+#pragma omp critical(chunkStoreError)
+        error = "zlib compression failed";
+        continue;
+      }
+      data = &packed[0];
+      size = packedSize;
+    }
+#endif
+
+    std::ostringstream name;
+    name << it << '.' << iw << '.' << bz << '.' << by << '.' << bx;
+    try {
+      writeFile(name.str(), data, size);
+    }
+    catch (std::exception &e) {
+#pragma omp critical(chunkStoreError)
+      error = e.what();
+    }
+  }
+
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+}
+
+void ChunkStore::setAttributes(const std::string& json)
+{
+  writeFile(".zattrs", json.data(), json.size());
+}
+
+std::string ChunkStore::jsonQuote(const std::string& s)
+{
+  std::string quoted("\"");
+  for (size_t i = 0; i < s.size(); ++i) {
+    const unsigned char ch = s[i];
+    if (ch == '"' || ch == '\\') {
+      quoted += '\\';
+      quoted += ch;
+    } else if (ch < 0x20) {
+      char escaped[8];
+      sprintf(escaped, "\\u%04x", ch);
+      quoted += escaped;
+    } else {
+      quoted += ch;
+    }
+  }
+  return quoted + '"';
+}
+
+void ChunkStore::writeFile(const std::string& name, const void* data,
+    size_t size)
+{
+  const std::string path = (boost::filesystem::path(m_path) / name).string();
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    throw std::runtime_error("Cannot create " + path);
+  }
+  const bool ok = fwrite(data, 1, size, file) == size;
+  if (fclose(file) != 0 || !ok) {
+    throw std::runtime_error("Cannot write " + path);
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <cstddef>
+#include <string>
+
+//! Chunked, compressed directory store for output volumes (Zarr v2 layout)
+/*!
+  The output is a 5D array (t, c, z, y, x) in a directory: the metadata
+  in '.zarray' (and optional attributes in '.zattrs'), and every chunk in
+  a file of its own named "t.c.z.y.x" after its chunk indices.  Chunks
+  span one time point and one channel and (chunkz, chunky, chunkx)
+  pixels; the ones at the far edges are padded with zeros, as Zarr
+  expects.
+
+  write() cuts a volume into chunks, compresses them with zlib (when
+  built with __SIRECON_USE_ZLIB__; otherwise chunks are stored raw) and
+  writes them to disk on an OpenMP thread team, so a reader can fetch
+  any chunk without touching the rest.
+ */
+class ChunkStore {
+public:
+  /* Creates 'path' (and its parents) and writes '.zarray'.  shape is
+     (nt, nc, nz, ny, nx) and chunks (chunkz, chunky, chunkx).  dtype is
+     the numpy type character and size, e.g. "f4", "f2" or "u2", and
+     level the zlib level (0 to store chunks uncompressed).  nthreads 0
+     means the OpenMP default.  Throws std::runtime_error on failure. */
+  ChunkStore(const std::string& path, const size_t shape[5],
+      const size_t chunks[3], const std::string& dtype, int level,
+      int nthreads);
+
+  //! Stores the (nz, ny, nx) volume of time point it, channel iw
+  /*!
+    Safe to call from any one thread at a time.  Throws
+    std::runtime_error if a chunk cannot be written.
+   */
+  void write(int it, int iw, const void* volume);
+
+  //! Writes 'json' (an object) as the array's '.zattrs'
+  void setAttributes(const std::string& json);
+
+  //! s as a quoted and escaped JSON string
+  static std::string jsonQuote(const std::string& s);
+
+  int level() const { return m_level; }
+
+private:
+  std::string m_path;
+  size_t m_shape[5];
+  size_t m_chunks[3];
+  size_t m_elementSize;
+  int m_level;
+  int m_nthreads;
+
+  void writeFile(const std::string& name, const void* data, size_t size);
+};
+
+#endif
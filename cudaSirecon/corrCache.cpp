@@ -0,0 +1,169 @@
+#include "corrCache.h"
+
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace corrcache {
+
+namespace {
+
+const char MAGIC[8] = { 'S', 'I', 'M', 'C', 'O', 'R', 'R', '\0' };
+const boost::int32_t VERSION = 1;
+const boost::int32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header {
+  char magic[8];
+  boost::int32_t version;
+  boost::int32_t byteOrder;
+  boost::int32_t nx, ny;
+  boost::int64_t srcSize;
+  boost::int64_t srcMtime;
+  boost::int32_t pathLen;
+  boost::int32_t dataOffset;   // of the background map, a multiple of 8
+};
+
+/** Identity of the correction file as seen now */
+struct Source {
+  std::string path;
+  boost::int64_t size;
+  boost::int64_t mtime;
+};
+
+Source describe(const std::string& corrfile)
+{
+  Source src;
+  boost::filesystem::path p = boost::filesystem::absolute(corrfile);
+  src.path = p.string();
+  src.size = (boost::int64_t) boost::filesystem::file_size(p);
+  src.mtime = (boost::int64_t) boost::filesystem::last_write_time(p);
+  return src;
+}
+
+/** FNV-1a; only used to make a short file name from the path */
+boost::uint64_t hashString(const std::string& s)
+{
+  boost::uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < s.size(); ++i) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+boost::filesystem::path entryPath(const std::string& dir, const Source& src)
+{
+  std::ostringstream name;
+  name << "corr_" << std::hex << hashString(src.path) << std::dec << "_"
+       << src.size << "_" << src.mtime << ".bin";
+  return boost::filesystem::path(dir) / name.str();
+}
+
+}
+
+bool load(const std::string& dir, const std::string& corrfile, int nx,
+    int ny, float* background, float* slope)
+{
+  using namespace boost::interprocess;
+  if (dir.empty()) {
+    return false;
+  }
+  try {
+    Source src = describe(corrfile);
+    boost::filesystem::path entry = entryPath(dir, src);
+    if (!boost::filesystem::exists(entry)) {
+      return false;
+    }
+    file_mapping file(entry.string().c_str(), read_only);
+    mapped_region region(file, read_only);
+    const char* data = static_cast<const char*>(region.get_address());
+    const size_t mapBytes = (size_t) nx * ny * sizeof(float);
+
+    Header hdr;
+    if (region.get_size() < sizeof(hdr)) {
+      return false;
+    }
+    std::memcpy(&hdr, data, sizeof(hdr));
+    if (std::memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        hdr.version != VERSION || hdr.byteOrder != BYTE_ORDER_MARK ||
+        hdr.nx != nx || hdr.ny != ny || hdr.srcSize != src.size ||
+        hdr.srcMtime != src.mtime ||
+        hdr.pathLen != (boost::int32_t) src.path.size() ||
+        hdr.dataOffset < (boost::int32_t) (sizeof(hdr) + hdr.pathLen) ||
+        region.get_size() < hdr.dataOffset + 2 * mapBytes ||
+        src.path.compare(0, std::string::npos, data + sizeof(hdr),
+          hdr.pathLen) != 0) {
+      return false;
+    }
+    std::memcpy(background, data + hdr.dataOffset, mapBytes);
+    std::memcpy(slope, data + hdr.dataOffset + mapBytes, mapBytes);
+    return true;
+  }
+  catch (std::exception &) {
+    return false;
+  }
+}
+
+void store(const std::string& dir, const std::string& corrfile, int nx,
+    int ny, const float* background, const float* slope)
+{
+  if (dir.empty()) {
+    return;
+  }
+  boost::filesystem::path tmp;
+  try {
+    Source src = describe(corrfile);
+    boost::filesystem::create_directories(dir);
+    boost::filesystem::path entry = entryPath(dir, src);
+
+    Header hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    std::memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+    hdr.version = VERSION;
+    hdr.byteOrder = BYTE_ORDER_MARK;
+    hdr.nx = nx;
+    hdr.ny = ny;
+    hdr.srcSize = src.size;
+    hdr.srcMtime = src.mtime;
+    hdr.pathLen = (boost::int32_t) src.path.size();
+    hdr.dataOffset = (boost::int32_t) ((sizeof(hdr) + hdr.pathLen + 7) / 8 * 8);
+    std::vector<char> padding(hdr.dataOffset - sizeof(hdr) - hdr.pathLen, 0);
+    const size_t mapBytes = (size_t) nx * ny * sizeof(float);
+
+    tmp = entry.parent_path() /
+      boost::filesystem::unique_path(entry.filename().string() + ".%%%%%%");
+    {
+      std::ofstream out(tmp.string().c_str(), std::ios::binary);
+      out.write((const char*) &hdr, sizeof(hdr));
+      out.write(src.path.data(), hdr.pathLen);
+      if (!padding.empty()) {
+        out.write(&padding[0], padding.size());
+      }
+      out.write((const char*) background, mapBytes);
+      out.write((const char*) slope, mapBytes);
+      if (!out) {
+        throw std::runtime_error("write failed");
+      }
+    }
+    boost::filesystem::rename(tmp, entry);
+  }
+  catch (std::exception &e) {
+    std::cout << "Could not cache correction maps of " << corrfile << ": "
+              << e.what() << std::endl;
+    boost::system::error_code ec;
+    if (!tmp.empty()) {
+      boost::filesystem::remove(tmp, ec);
+    }
+  }
+}
+
+}
@@ -0,0 +1,37 @@
+#ifndef CORR_CACHE_H
+#define CORR_CACHE_H
+
+#include <string>
+
+/*
+  On-disk cache of parsed camera correction maps (--usecorr).
+
+  The background and slope maps read from a correction file are stored
+  in a small binary file in the cache directory, named after the
+  correction file's absolute path, size and modification time.  Editing
+  or replacing the correction file therefore just makes a new entry.
+  Entries are written to a temporary file and renamed into place, and
+  are only ever mapped read-only afterwards, so concurrent
+  reconstructions can share one cache directory.
+
+  File layout (native byte order): a versioned header holding nx, ny,
+  the source size and mtime and the source path, then nx*ny background
+  floats and nx*ny slope floats.
+*/
+namespace corrcache {
+
+/* Copies the maps of correction file 'corrfile' into background and
+   slope (nx*ny floats each) if 'dir' holds a valid entry for it.
+   Returns false on a miss or if dir is empty. */
+bool load(const std::string& dir, const std::string& corrfile, int nx,
+    int ny, float* background, float* slope);
+
+/* Adds the maps of 'corrfile' to the cache in 'dir' (created if
+   missing).  Failures are reported on stdout and otherwise ignored; the
+   cache is only an optimisation. */
+void store(const std::string& dir, const std::string& corrfile, int nx,
+    int ny, const float* background, const float* slope);
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+#include "cpuFeatures.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define SIRECON_X86_MSVC
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIRECON_X86_GNUC
+#endif
+
+namespace cpufeatures {
+
+SimdLevel simdLevel()
+{
+#if defined(SIRECON_X86_GNUC)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SIMD_AVX512;
+  }
+  // older GCCs cannot ask for f16c, but every AVX2 CPU has it
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+#elif defined(SIRECON_X86_MSVC)
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7) {
+    return SIMD_BASELINE;
+  }
+  __cpuid(regs, 1);
+  const bool osxsave = (regs[2] & (1 << 27)) != 0;
+  const bool avx = (regs[2] & (1 << 28)) != 0;
+  const bool f16c = (regs[2] & (1 << 29)) != 0;
+  if (!osxsave || !avx) {
+    return SIMD_BASELINE;
+  }
+  // the OS must save the YMM (and for AVX-512 the ZMM and mask) registers
+  const unsigned long long xcr0 = _xgetbv(0);
+  if ((xcr0 & 0x6) != 0x6) {
+    return SIMD_BASELINE;
+  }
+  __cpuidex(regs, 7, 0);
+  if ((regs[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6) {
+    return SIMD_AVX512;
+  }
+  if ((regs[1] & (1 << 5)) && f16c) {
+    return SIMD_AVX2;
+  }
+#endif
+  return SIMD_BASELINE;
+}
+
+}
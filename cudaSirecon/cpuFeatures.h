@@ -0,0 +1,21 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+/*
+  Run-time detection of the x86 vector extensions the host kernels
+  (flatfield.h, outputFormat.h) have specialised versions for.
+*/
+namespace cpufeatures {
+
+//! Widest vector extension that both the CPU and the OS support
+enum SimdLevel {
+  SIMD_BASELINE,   /**< anything else; scalar code */
+  SIMD_AVX2,       /**< AVX2 and F16C */
+  SIMD_AVX512      /**< AVX-512F */
+};
+
+SimdLevel simdLevel();
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef CPU_FUNCTIONS_H
+#define CPU_FUNCTIONS_H
+
+#include "GPUBuffer.h"
+#include "cudaSireconImpl.h"
+
+#include <vector>
+
+struct vector;
+struct vector3d;
+struct ReconParams;
+
+/*
+  Host implementations of the reconstruction stages declared in
+  gpuFunctions.h, used when the program runs with --backend=cpu.
+  The signatures are identical to their CUDA counterparts; the
+  GPUBuffers passed in must have been allocated in host memory mode
+  (see GPUBuffer::useHostMemory()).  Loops are parallelised with
+  OpenMP and the FFTs are done with single precision FFTW3.
+*/
+namespace cpu {
+
+/* Initialises the CPU backend: FFTW threading (if available) and the
+   number of OpenMP threads.  nthreads <= 0 means use all cores. */
+void init(int nthreads);
+
+void image_arithmetic(GPUBuffer* a, const GPUBuffer& b, int offset,
+    int len, float alpha, float beta);
+void image_arithmetic(GPUBuffer* a, const GPUBuffer& b,
+    int offsetA, int offsetB,
+    int len, float alpha, float beta);
+
+void flatfield_u16(const GPUBuffer& raw, size_t rawOffset, int nx, int ny,
+    const GPUBuffer& background, float backgroundExtra,
+    const GPUBuffer* slope, float inscale, GPUBuffer* image, int offset);
+void apodize(int napodize, int nx,int ny, GPUBuffer* image, int offset);
+void cosapodize(int nx,int ny, GPUBuffer* image, int offset);
+void rescale(int nx, int ny, int nz, int z, int zoffset, int direction,
+    int wave, int t, int phases, std::vector<GPUBuffer>* images, int equalizez,
+    int equalizet, double* sum_dir0_phase0);
+
+float estimate_Wiener(const std::vector<GPUBuffer>& rawImages, int nx,
+	      int ny, int z, int nphases, int rdistcutoff);
+
+int calcRefImage(const std::vector<GPUBuffer>& rawImages,
+    GPUBuffer* refImage, const std::vector<GPUBuffer>& offImages,
+    int nOffImages, int nx, int ny, int nphases, int type_of_refImage);
+
+void determinedrift_2D(const std::vector<GPUBuffer>& rawImages,
+      const std::vector<GPUBuffer>& offImages, int nOffImages,
+      const GPUBuffer& CrefImage,
+      vector3d *drifts, int nphases, int nx, int ny, int dir,
+      float rdistcutoff, float drift_filter_fact);
+
+void fixdrift_2D(std::vector<GPUBuffer>* CrawImages,
+    vector3d *driftlist, int nphases, int nx, int ny, int nz, int dir,
+    int z);
+
+void separate(int nx, int ny, int z, int direction, int nphases, int
+    norders, std::vector<GPUBuffer>*rawImages, float *sepMatrix);
+
+void makemodeldata(int nx, int ny, int nz, std::vector<GPUBuffer>* bands,
+    int norders, vector k0, float dy, float dz,
+    std::vector<GPUBuffer>* OTF, short wave, ReconParams *pParams);
+
+void fixdrift_bt_dirs(std::vector<GPUBuffer>* bands, int norders,
+    vector3d drift, int nx,int ny, int nz);
+
+void findk0(std::vector<GPUBuffer>* bands, GPUBuffer* overlap0,
+    GPUBuffer* overlap1, int nx, int ny, int nz, int norders, vector *k0,
+    float dy, float dz, std::vector<GPUBuffer>* OTF, short wave,
+    ReconParams * pParams);
+
+void fitk0andmodamps(std::vector<GPUBuffer>* bands, GPUBuffer* overlap0,
+    GPUBuffer* overlap1, int nx, int ny, int nz, int norders,
+    vector *k0, float dy, float dz, std::vector<GPUBuffer>* otf, short wave,
+    cuFloatComplex* amps, ReconParams * pParams);
+
+float findrealspacemodamp(std::vector<GPUBuffer>* bands,
+    GPUBuffer* overlap0, GPUBuffer* overlap1, int nx, int ny, int nz,
+    int order1, int order2, vector k0, float dy, float dz,
+    std::vector<GPUBuffer>* OTF, short wave, cuFloatComplex* modamp1,
+    cuFloatComplex* modamp2, cuFloatComplex* modamp3, int redoarrays,
+    ReconParams *pParams);
+
+void filterbands(int dir, std::vector<GPUBuffer>* bands,
+    const std::vector<vector>& k0, int ndirs, int norders,
+    std::vector<GPUBuffer>& otf, float dy, float dz,
+    const std::vector<std::vector<cuFloatComplex> >& amp,
+    const std::vector<float>& noiseVarFactors, int nx, int ny, int nz,
+    short wave, ReconParams* params);
+
+void assemblerealspacebands(int dir, GPUBuffer* outbuffer, GPUBuffer* bigbuffer,
+    std::vector<GPUBuffer>* bands, int ndirs, int norders,
+    const std::vector<vector>& k0, int nx, int ny, int nz, float zoomfact,
+    int z_zoom, float expfact);
+
+void computeAminAmax(const GPUBuffer* data, int nx, int ny, int nz,
+    float* min, float* max);
+
+/* In-place batched 2D real-to-complex FFT of nz padded (nx+2)*ny
+   sections; the CPU equivalent of the cufftPlanMany R2C in
+   transformXYSlice() */
+void fftXYSlices(float* data, int nx, int ny, int nz);
+
+/* In-place forward 1D FFT along z of nz0 stacked half-complex
+   (nx/2+1)*ny sections */
+void fftZ(cuFloatComplex* data, int nx, int ny, int nz0);
+
+}
+
+#endif
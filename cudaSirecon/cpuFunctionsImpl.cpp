@@ -0,0 +1,1395 @@
+#include "cpuFunctions.h"
+#include "flatfield.h"
+
+#include <fftw3.h>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+/*
+  Host versions of the kernels in gpuFunctionsImpl.cu.  Every function
+  below follows its CUDA counterpart statement by statement so that the
+  two backends agree to within float rounding; the CUDA thread index
+  becomes a loop index and __constant__ data become local variables.
+  Reductions accumulate in double and the FFTs come from FFTW rather
+  than cuFFT, so the CPU results are not bit-identical to the GPU ones;
+  README.md ("CPU backend") says how to compare the two.
+*/
+
+namespace cpu {
+
+namespace {
+
+/** Parameters that live in __constant__ memory on the GPU */
+struct KernelParams {
+  int bSuppress_singularities;
+  int suppression_radius;
+  int bDampenOrder0;
+  int bNoKz0;
+  int bFilteroverlaps;
+  int apodizeoutput;
+  float apoGamma;
+  int bRadAvgOTF;
+  int nzotf;
+  float wiener;
+};
+
+KernelParams makeKernelParams(const ReconParams* pParams)
+{
+  KernelParams kp;
+  kp.bSuppress_singularities = pParams->bSuppress_singularities;
+  kp.suppression_radius = pParams->suppression_radius;
+  kp.bDampenOrder0 = pParams->bDampenOrder0;
+  kp.bNoKz0 = pParams->bNoKz0;
+  kp.bFilteroverlaps = pParams->bFilteroverlaps;
+  kp.apodizeoutput = pParams->apodizeoutput;
+  kp.apoGamma = pParams->apoGamma;
+  kp.bRadAvgOTF = pParams->bRadAvgOTF;
+  kp.nzotf = pParams->nzotf;
+  kp.wiener = pParams->wiener * pParams->wiener;
+  return kp;
+}
+
+inline fftwf_complex* asFFTW(cuFloatComplex* p)
+{
+  return reinterpret_cast<fftwf_complex*>(p);
+}
+
+/* Complex-to-complex FFT of a single ny*nx (nz == 1) or nz*ny*nx array,
+   in place */
+void fftC2C(cuFloatComplex* data, int nz, int ny, int nx, int sign)
+{
+  fftwf_plan plan = fftplan::fftwPlanC2C(nz, ny, nx, asFFTW(data),
+      asFFTW(data), sign);
+  fftwf_execute_dft(plan, asFFTW(data), asFFTW(data));
+}
+
+cuFloatComplex otfinterpolate(const cuFloatComplex * otf, float kx,
+    float ky, float krscale, int kz, float kzscale, const KernelParams& kp)
+  /* (kx, ky, kz) is Fourier space coords with origin at kx=ky=kz=0 and going  betwen -nx(or ny,nz)/2 and +nx(or ny,nz)/2 */
+{
+  cuFloatComplex otfval = make_cuFloatComplex(0.f, 0.f);
+  if (kp.bRadAvgOTF) {
+    int irindex, izindex, indices[2][2];
+    float krindex, kzindex;
+    float ar, az;
+
+    krindex = sqrt(kx*kx+ky*ky) * krscale;
+    kzindex = kz * kzscale;
+    if (kzindex<0) kzindex += kp.nzotf;
+
+    irindex = floor(krindex);
+    izindex = floor(kzindex);
+
+    ar = krindex - irindex;
+    az = kzindex - izindex;  // az is always 0 for 2D case, and it'll just become a 1D interp
+
+    if (izindex == kp.nzotf-1) {
+      indices[0][0] = irindex*kp.nzotf+izindex;
+      indices[0][1] = irindex*kp.nzotf;
+      indices[1][0] = (irindex+1)*kp.nzotf+izindex;
+      indices[1][1] = (irindex+1)*kp.nzotf;
+    }
+    else {
+      indices[0][0] = irindex*kp.nzotf+izindex;
+      indices[0][1] = irindex*kp.nzotf+(izindex+1);
+      indices[1][0] = (irindex+1)*kp.nzotf+izindex;
+      indices[1][1] = (irindex+1)*kp.nzotf+(izindex+1);
+    }
+    otfval.x = (1-ar)*(otf[indices[0][0]].x*(1-az) + otf[indices[0][1]].x*az) +
+      ar*(otf[indices[1][0]].x*(1-az) + otf[indices[1][1]].x*az);
+    otfval.y = (1-ar)*(otf[indices[0][0]].y*(1-az) + otf[indices[0][1]].y*az) +
+      ar*(otf[indices[1][0]].y*(1-az) + otf[indices[1][1]].y*az);
+  }
+  return otfval;
+}
+
+inline float order0damping(float radius, float zindex, int rlimit, int zlimit)
+{
+  float rfraction, zfraction;
+
+  rfraction = radius/rlimit;
+  zfraction = fabs(zindex/zlimit);
+
+  return rfraction*rfraction + zfraction*zfraction*zfraction;
+}
+
+inline float mag2(cuFloatComplex x)
+{
+  return x.x*x.x+x.y*x.y;
+}
+
+inline float suppress(float x)
+{
+  float x6,out;
+  x6 = x*x*x;
+  x6 *= x6;
+  out = 1.0/(1+20000/(x6+20));
+  return out;
+}
+
+float fitparabola( float a1, float a2, float a3 )
+{
+  float slope,curve,peak;
+
+  slope = 0.5* (a3-a1);         /* the slope at (x=0).  */
+  curve = (a3+a1) - 2*a2;       /* (a3-a2)-(a2-a1). The change in slope per unit of x. */
+  if( curve == 0 ) {
+    printf("no peak: a1=%f, a2=%f, a3=%f, slope=%f, curvature=%f\n",a1,a2,a3,slope,curve);
+    return( 0.0 );
+  }
+  peak = -slope/curve;          /* the x value where slope = 0  */
+  if( peak>1.5 || peak<-1.5 ) {
+    printf("bad peak position: a1=%f, a2=%f, a3=%f, slope=%f, curvature=%f, peak=%f\n",a1,a2,a3,slope,curve,peak);
+    return( 0.0 );
+  }
+  return( peak );
+}
+
+void findpeak(float array[], int sizex, int sizey, vector *peak)
+{
+  int   xcent=0, ycent=0, i, j;
+  float a1, a2, a3, big;
+
+  big = -1e11;
+  for(i=0;i<sizey;i++)
+    for(j=0;j<sizex;j++)
+      if(array[i*sizex+j] > big) {
+        big=array[i*sizex+j];
+        ycent = i;  xcent = j;
+      }
+
+  if(xcent==0)
+    a1 = array[ ycent*sizex +  xcent-1+sizex];
+  else
+    a1 = array[ ycent*sizex +  xcent-1];
+  a2 = array[ ycent*sizex +  xcent  ];
+  if(xcent==sizex-1)
+    a3 = array[ ycent*sizex +  xcent+1-sizex];
+  else
+    a3 = array[ ycent*sizex +  xcent+1];
+  (*peak).x = fitparabola(a1,a2,a3) + xcent;
+
+  if(ycent==0)
+    a1 = array[ (ycent-1+sizey)*sizex + xcent ];
+  else
+    a1 = array[ (ycent-1)*sizex + xcent ];
+  a2 = array[ (ycent  )*sizex + xcent ];
+  if(ycent==sizey-1)
+    a3 = array[ (ycent+1-sizey)*sizex + xcent ];
+  else
+    a3 = array[ (ycent+1)*sizex + xcent ];
+  (*peak).y = fitparabola(a1,a2,a3) + ycent;
+}
+
+float fitxyparabola( float x1, float y1, float x2, float y2, float x3, float y3 )
+{
+  float slope1,slope2,curve,peak,xbar1,xbar2;
+
+  if( x1==x2 || x2==x3 || x3==x1 ) {
+    printf("Fit fails; two points are equal: x1=%f, x2=%f, x3=%f\n",x1,x2,x3);
+    return( 0.0 );
+  }
+  xbar1 = 0.5 * (x1 + x2);               /* middle of x1 and x2 */
+  xbar2 = 0.5 * (x2 + x3);               /* middle of x2 and x3 */
+  slope1 = (y2-y1)/(x2-x1);    /* the slope at (x=xbar1).  */
+  slope2 = (y3-y2)/(x3-x2);    /* the slope at (x=xbar2).  */
+  curve = (slope2-slope1) / (xbar2-xbar1);       /* The change in slope per unit of x. */
+  if( curve == 0 ) {
+    printf("Fit fails; no curvature: r1=(%f,%f), r2=(%f,%f), r3=(%f,%f) slope1=%f, slope2=%f, curvature=%f\n",
+        x1,y1,x2,y2,x3,y3, slope1,slope2,curve);
+    return( 0.0 );
+  }
+
+  peak = xbar2 - slope2/curve;          /* the x value where slope = 0  */
+
+  return( peak );
+}
+
+void makeoverlaps(std::vector<GPUBuffer>* bands,
+    GPUBuffer* overlap0, GPUBuffer* overlap1, int nx, int ny, int nz,
+    int order1, int order2, float k0x, float k0y, float dy, float dz,
+    std::vector<GPUBuffer>* OTF, short wave, ReconParams* params)
+{
+  float order0_2_factor = 1.0f;
+  if (nz > 1) {
+    order0_2_factor = 5.0f;
+  }
+  float dkr = 1.0f / (ny * dy);
+  float dkz;
+  if (dz > 0.0f) {
+    dkz = 1.0f / (nz * dz);
+  } else {
+    dkz = params->dkzotf;
+  }
+  float krscale = dkr / params->dkrotf;
+  float kzscale = dkz / params->dkzotf;
+  int rdistcutoff = (int)((params->na * 2.0 / (wave / 1.0e3)) / dkr);
+  if (rdistcutoff > nx / 2) {
+    rdistcutoff = nx / 2;
+  }
+  float lambdaem = (wave / params->nimm) / 1.0e3;
+  float alpha = asin(params->na / params->nimm);
+  float zdistcutoff;
+  if (!params->bTwolens) {
+    zdistcutoff = (int)ceil(((1.0 - cos(alpha)) / lambdaem) / dkz);
+  }
+  else {
+    std::cerr << "Sorry, this program doesn't handel 2-objective mode data\n";
+    exit(-1);
+  }
+
+  if (zdistcutoff > nz / 2) {
+    zdistcutoff = ((nz / 2 - 1) > 0) ? (nz / 2 - 1) : 0;
+  }
+  printf("order2=%d, rdistcutoff=%d, zdistcutoff=%f\n", order2, rdistcutoff, zdistcutoff);
+
+  float kx = k0x * (order2 - order1);
+  float ky = k0y * (order2 - order1);
+  float otfcutoff;
+  otfcutoff = 0.007;
+
+  memset(overlap0->getPtr(), 0, nx * ny * nz * sizeof(cuFloatComplex));
+  memset(overlap1->getPtr(), 0, nx * ny * nz * sizeof(cuFloatComplex));
+
+  const KernelParams kp = makeKernelParams(params);
+  const cuFloatComplex* otf1Ptr = (const cuFloatComplex*)OTF->at(order1).getPtr();
+  const cuFloatComplex* otf2Ptr = (const cuFloatComplex*)OTF->at(order2).getPtr();
+
+  // Set the band ptrs
+  const cuFloatComplex* band1re;
+  const cuFloatComplex* band1im;
+  if (order1 == 0) {
+    band1re = (const cuFloatComplex*)bands->at(0).getPtr();
+    band1im = 0;
+  } else {
+    band1re = (const cuFloatComplex*)bands->at(order1 * 2 - 1).getPtr();
+    band1im = (const cuFloatComplex*)bands->at(order1 * 2).getPtr();
+  }
+  // It is assumed that order2 is never 0
+  const cuFloatComplex* band2re = (const cuFloatComplex*)bands->at(order2 * 2 - 1).getPtr();
+  const cuFloatComplex* band2im = (const cuFloatComplex*)bands->at(order2 * 2).getPtr();
+
+  cuFloatComplex* ovlp0 = (cuFloatComplex*)overlap0->getPtr();
+  cuFloatComplex* ovlp1 = (cuFloatComplex*)overlap1->getPtr();
+
+  // Generate the overlap arrays; the loops over i, zi, j correspond to
+  // blockIdx.y, blockIdx.z and the x thread index of makeOverlaps0Kernel
+  // and makeOverlaps1Kernel.
+  int numZ = 2 * (int)zdistcutoff + 1;
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < ny; ++i) {
+    for (int zi = 0; zi < numZ; ++zi) {
+      int z0 = zi - zdistcutoff;
+      for (int j = 0; j < nx; ++j) {
+        int x1 = j;
+        int y1 = i;
+        if (x1 > nx / 2) {
+          x1 -= nx;
+        }
+        if (y1 > ny / 2) {
+          y1 -= ny;
+        }
+
+        float rdist1 = sqrt((float)x1 * (float)x1 + (float)y1 * (float)y1);
+        if (rdist1 > rdistcutoff) {
+          continue;
+        }
+        float x12 = x1 - kx;
+        float y12 = y1 - ky;
+        float rdist12 = sqrt(x12 * x12 + y12 * y12);
+        float x21 = x1 + kx;
+        float y21 = y1 + ky;
+        float rdist21 = sqrt(x21 * x21 + y21 * y21);
+        if (!(rdist12 <= rdistcutoff || rdist21 <= rdistcutoff)) {
+          continue;
+        }
+
+        int iin;
+        int jin;
+        int conj;
+        if (j <= nx / 2) {
+          iin = i;
+          jin = j;
+          conj = 0;
+        } else {
+          jin = nx - j;
+          iin = (ny - i) % ny;
+          conj = 1;
+        }
+        if (z0 == 0 && kp.bNoKz0) {
+          continue;
+        }
+        int z = conj ? -z0 : z0;
+        z = (z + nz) % nz;
+        int indin = z * (nx / 2 + 1) * ny + iin * (nx / 2 + 1) + jin;
+        int indout = ((z0 + nz) % nz) * nx * ny + i * nx + j;
+
+        // makeOverlaps0Kernel
+        if (rdist12 <= rdistcutoff) {
+          cuFloatComplex otf1 = otfinterpolate(otf1Ptr, x1, y1, krscale,
+              z0, kzscale, kp);
+          if (sqrt(otf1.x * otf1.x + otf1.y * otf1.y) > otfcutoff) {
+            cuFloatComplex otf12 = otfinterpolate(otf2Ptr, x12, y12,
+                krscale, z0, kzscale, kp);
+            if (sqrt(otf12.x * otf12.x + otf12.y * otf12.y) * order0_2_factor > otfcutoff) {
+              cuFloatComplex val1re = band1re[indin];
+              cuFloatComplex val1im;
+              val1im.x = 0.0f;
+              val1im.y = 0.0f;
+              if (order1 > 0) {
+                val1im = band1im[indin];
+              }
+              float root = sqrt(otf1.x * otf1.x + otf1.y * otf1.y +
+                                otf12.x * otf12.x + otf12.y * otf12.y);
+              cuFloatComplex fact = otf12;
+              fact.x /= root;
+              fact.y /= root;
+              if (conj) {
+                val1re.y *= -1.0;
+                if (order1 > 0) {
+                  val1im.y *= -1.0;
+                }
+              }
+              float temp = val1re.x * fact.x - val1re.y * fact.y;
+              val1re.y = val1re.x * fact.y + val1re.y * fact.x;
+              val1re.x = temp;
+              if (order1 > 0) {
+                temp = val1im.x * fact.x - val1im.y * fact.y;
+                val1im.y = val1im.x * fact.y + val1im.y * fact.x;
+                val1im.x = temp;
+              }
+              ovlp0[indout].x = val1re.x - val1im.y;
+              ovlp0[indout].y = val1re.y + val1im.x;
+            }
+          }
+        }
+
+        // makeOverlaps1Kernel (note the strict inequality on rdist1)
+        if (rdist1 < rdistcutoff && rdist21 <= rdistcutoff) {
+          cuFloatComplex otf2 = otfinterpolate(otf2Ptr, x1, y1, krscale,
+              z0, kzscale, kp);
+          if (sqrt(otf2.x * otf2.x + otf2.y * otf2.y) * order0_2_factor > otfcutoff) {
+            cuFloatComplex otf21 = otfinterpolate(otf1Ptr, x21, y21,
+                krscale, z0, kzscale, kp);
+            if (sqrt(otf21.x * otf21.x + otf21.y * otf21.y) > otfcutoff) {
+              cuFloatComplex val2re = band2re[indin];
+              cuFloatComplex val2im = band2im[indin];
+              float root = sqrt(otf2.x * otf2.x + otf2.y * otf2.y +
+                                otf21.x * otf21.x + otf21.y * otf21.y);
+              cuFloatComplex fact = otf21;
+              fact.x /= root;
+              fact.y /= root;
+              if (conj) {
+                val2re.y *= -1.0f;
+                val2im.y *= -1.0f;
+              }
+              float temp = val2re.x * fact.x - val2re.y * fact.y;
+              val2re.y = val2re.x * fact.y + val2re.y * fact.x;
+              val2re.x = temp;
+              temp = val2im.x * fact.x - val2im.y * fact.y;
+              val2im.y = val2im.x * fact.y + val2im.y * fact.x;
+              val2im.x = temp;
+              ovlp1[indout].x = val2re.x - val2im.y;
+              ovlp1[indout].y = val2re.y + val2im.x;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  fftC2C(ovlp0, nz, ny, nx, FFTW_BACKWARD);
+  fftC2C(ovlp1, nz, ny, nx, FFTW_BACKWARD);
+}
+
+float getmodamp(float kangle, float klength,
+    std::vector<GPUBuffer>* bands, GPUBuffer* overlap0, GPUBuffer* overlap1,
+    int nx, int ny,int nz, int order1, int order2, float dy, float dz,
+    std::vector<GPUBuffer>* otf, short wave, cuFloatComplex* modamp,
+    int redoarrays, ReconParams *pParams, int bShowDetail)
+{
+  vector k1;
+  float amp2;
+  float corr_coef;
+  cuFloatComplex amp_inv;
+  cuFloatComplex amp_combo;
+
+  k1.x = klength * cos(kangle);
+  k1.y = klength * sin(kangle);
+  corr_coef = cpu::findrealspacemodamp(bands, overlap0, overlap1, nx, ny, nz, order1, order2, k1, dy, dz, otf,
+      wave, modamp, &amp_inv, &amp_combo, redoarrays, pParams);
+  amp2 = modamp->x * modamp->x + modamp->y * modamp->y;
+
+  printf(" In getmodamp: angle=%f, mag=%f, amp=%f, phase=%f\n", kangle, klength, sqrt(amp2), get_phase(*modamp));
+  if (bShowDetail) {
+    printf(" Reverse modamp is: amp=%f, phase=%f\n", 1.0 / cmag(amp_inv), -get_phase(amp_inv));
+    printf(" Combined modamp is: amp=%f, phase=%f\n", cmag(amp_combo), get_phase(amp_combo));
+    printf(" Correlation coefficient is: %f\n", corr_coef);
+  }
+
+  return(amp2);
+}
+
+} // anonymous namespace
+
+void init(int nthreads)
+{
+#ifndef __clang__
+  if (nthreads > 0) {
+    omp_set_num_threads(nthreads);
+  }
+  nthreads = omp_get_max_threads();
+#else
+  if (nthreads <= 0) {
+    nthreads = 1;
+  }
+#endif
+#ifdef __SIRECON_FFTW_THREADS__
+  if (!fftwf_init_threads()) {
+    throw std::runtime_error("fftwf_init_threads() failed.");
+  }
+  fftwf_plan_with_nthreads(nthreads);
+#endif
+  printf("CPU backend: %d threads\n", nthreads);
+}
+
+void image_arithmetic(GPUBuffer* a, const GPUBuffer& b, int offset,
+    int len, float alpha, float beta)
+{
+  cpu::image_arithmetic(a, b, offset, 0, len, alpha, beta);
+}
+
+void image_arithmetic(GPUBuffer* a, const GPUBuffer& b,
+    int offsetA, int offsetB, int len, float alpha, float beta)
+{
+  float* aPtr = (float*)a->getPtr() + offsetA;
+  const float* bPtr = (const float*)b.getPtr() + offsetB;
+#pragma omp parallel for
+  for (int i = 0; i < len; ++i) {
+    aPtr[i] = alpha * aPtr[i] + beta * bPtr[i];
+  }
+}
+
+void flatfield_u16(const GPUBuffer& raw, size_t rawOffset, int nx, int ny,
+    const GPUBuffer& background, float backgroundExtra,
+    const GPUBuffer* slope, float inscale, GPUBuffer* image, int offset)
+{
+  ingest::flatfield(((const unsigned short*)raw.getPtr()) + rawOffset,
+      (float*)image->getPtr() + offset, nx, ny,
+      (const float*)background.getPtr(), backgroundExtra,
+      slope ? (const float*)slope->getPtr() : 0, inscale);
+}
+
+void apodize(int napodize, int nx,int ny, GPUBuffer* image, int offset)
+{
+  float* img = (float*)image->getPtr() + offset;
+
+#pragma omp parallel for
+  for (int k = 0; k < nx; ++k) {
+    float diff = (img[(ny - 1) * (nx + 2) + k] - img[k]) / 2.0;
+    for (int l = 0; l < napodize; ++l) {
+      float fact = 1.0 - sin((((float)l + 0.5) / (float)napodize) *
+          M_PI * 0.5);
+      img[l * (nx + 2) + k] = img[l * (nx + 2) + k] + diff * fact;
+      img[(ny - 1 - l) * (nx + 2) + k] = img[(ny - 1 - l) * (nx + 2) + k] -
+        diff * fact;
+    }
+  }
+
+#pragma omp parallel for
+  for (int l = 0; l < ny; ++l) {
+    float diff = (img[l * (nx + 2) + nx - 1] - img[l * (nx + 2)]) / 2.0;
+    for (int k = 0; k < napodize; ++k) {
+      float fact = 1.0 - sin(((k + 0.5) / (float)napodize) * M_PI *
+          0.5);
+      img[l * (nx + 2) + k] = img[l * (nx + 2) + k] + diff * fact;
+      img[l * (nx + 2) + (nx - 1 - k)] =
+        img[l * (nx + 2) + (nx - 1 - k)] - diff * fact;
+    }
+  }
+}
+
+void cosapodize(int nx,int ny, GPUBuffer* image, int offset)
+{
+  float* img = (float*)image->getPtr() + offset;
+#pragma omp parallel for
+  for (int l = 0; l < ny; ++l) {
+    float yfact = sin(M_PI * ((float)l + 0.5) / ny);
+    for (int k = 0; k < nx; ++k) {
+      float xfact = sin(M_PI * ((float)k + 0.5) / nx);
+      img[l * (nx + 2) + k] *= xfact * yfact;
+    }
+  }
+}
+
+void rescale(int nx, int ny, int nz, int z, int zoffset, int direction,
+    int wave, int t, int nphases, std::vector<GPUBuffer>* images, int equalizez,
+    int equalizet, double* sum_dir0_phase0)
+{
+  std::vector<float> sum(nphases);
+
+  for (int phase = 0; phase < nphases; ++phase) {
+    const float* img = ((const float*)((*images)[phase].getPtr())) +
+      (z + zoffset) * (nx + 2) * ny;
+    double s = 0.0;
+    // Same (unpadded) indexing as sum_reduction_kernel
+#pragma omp parallel for reduction(+:s)
+    for (int l = 0; l < ny; ++l) {
+      for (int k = 0; k < nx; ++k) {
+        s += img[k + l * nx];
+      }
+    }
+    sum[phase] = (float)s;
+  }
+
+  if (direction == 0 && !(equalizet && t != 0)) {
+    sum_dir0_phase0[wave * nz + z] = (double)sum[0];
+  }
+  float ref;
+  if (equalizez) {
+    ref = sum_dir0_phase0[wave * nz + 0];
+  } else  {
+    ref = sum_dir0_phase0[wave * nz + z];
+  }
+
+  for (int phase = 0; phase < nphases; ++phase) {
+    float ratio = ref / sum[phase];
+    float* img = ((float*)((*images)[phase].getPtr())) +
+      (z + zoffset) * (nx + 2) * ny;
+#pragma omp parallel for
+    for (int l = 0; l < ny; ++l) {
+      for (int k = 0; k < nx; ++k) {
+        img[l * (nx + 2) + k] *= ratio;
+      }
+    }
+  }
+}
+
+float estimate_Wiener(const std::vector<GPUBuffer>& rawImages, int nx,
+          int ny, int z, int nphases, int rdistcutoff)
+{
+  printf("In estimate_Wiener.\n");
+  fflush(stdout);
+  return 0.0f;
+}
+
+void fixdrift_2D(std::vector<GPUBuffer>* CrawImages,
+    vector3d *driftlist, int nphases, int nx, int ny, int nz, int dir,
+    int z)
+{
+  printf("In fixdrift_2D.\n");
+  fflush(stdout);
+}
+
+int calcRefImage(const std::vector<GPUBuffer>& rawImages,
+    GPUBuffer* refImage, const std::vector<GPUBuffer>& offImages,
+    int nOffImages, int nx, int ny, int nphases, int type_of_refImage)
+{
+  printf("In calcRefImage.\n");
+  fflush(stdout);
+  return 0;
+}
+
+void determinedrift_2D(const std::vector<GPUBuffer>& rawImages,
+      const std::vector<GPUBuffer>& offImages, int nOffImages,
+      const GPUBuffer& CrefImage,
+      vector3d *drifts, int nphases, int nx, int ny, int dir,
+      float rdistcutoff, float drift_filter_fact)
+{
+  printf("In determinedrift_2D.\n");
+  fflush(stdout);
+}
+
+void separate(int nx, int ny, int nz, int direction, int nphases,
+    int norders, std::vector<GPUBuffer>*rawImages, float *sepMatrix)
+{
+  // Unlike the GPU version this works in place: all phases of a pixel
+  // are read before any of the orders is written back.
+  int nout = std::min(norders * 2 - 1, nphases);
+  int nxy2 = (nx + 2) * ny;
+  std::vector<float*> imgPtrs(nphases);
+  for (int j = 0; j < nphases; ++j) {
+    imgPtrs[j] = (float*)rawImages->at(j).getPtr();
+  }
+
+#pragma omp parallel for
+  for (int offset = 0; offset < nz * nxy2; ++offset) {
+    float in[MAXPHASES];
+    for (int j = 0; j < nphases; ++j) {
+      in[j] = imgPtrs[j][offset];
+    }
+    for (int i = 0; i < nout; ++i) {
+      float result = 0.0f;
+      for (int j = 0; j < nphases; ++j) {
+        result += sepMatrix[i * nphases + j] * in[j];
+      }
+      imgPtrs[i][offset] = result;
+    }
+  }
+}
+
+void makemodeldata(int nx, int ny, int nz, std::vector<GPUBuffer>* bands,
+    int norders, vector k0, float dy, float dz,
+    std::vector<GPUBuffer>* OTF, short wave, ReconParams *pParams) {
+  printf("In makemodeldata.\n");
+  fflush(stdout);
+}
+
+void fixdrift_bt_dirs(std::vector<GPUBuffer>* bands, int norders,
+    vector3d drift, int nx,int ny, int nz) {
+  printf("In fixdrift_bt_dirs.\n");
+  fflush(stdout);
+}
+
+void findk0(std::vector<GPUBuffer>* bands, GPUBuffer* overlap0,
+    GPUBuffer* overlap1, int nx, int ny, int nz, int norders, vector *k0,
+    float dy, float dz, std::vector<GPUBuffer>* OTF, short wave,
+    ReconParams * pParams)
+{
+  int fitorder1 = 0;
+  int fitorder2;
+  if (nz > 1) {
+    fitorder2 = 2;
+  }
+  else {
+    fitorder2 = 1;
+  }
+
+  makeoverlaps(bands, overlap0, overlap1, nx, ny, nz, fitorder1, fitorder2,
+      (*k0).x, (*k0).y, dy, dz, OTF, wave, pParams);
+
+  // aTimesConjB
+  GPUBuffer crosscorr_c(nx * ny * sizeof(cuFloatComplex), 0);
+  const cuFloatComplex* ol0 = (const cuFloatComplex*)overlap0->getPtr();
+  const cuFloatComplex* ol1 = (const cuFloatComplex*)overlap1->getPtr();
+  cuFloatComplex* cc = (cuFloatComplex*)crosscorr_c.getPtr();
+  int nxy = nx * ny;
+#pragma omp parallel for
+  for (int l = 0; l < ny; ++l) {
+    for (int k = 0; k < nx; ++k) {
+      cuFloatComplex result;
+      result.x = 0.0f;
+      result.y = 0.0f;
+      for (int z = 0; z < nz; ++z) {
+        cuFloatComplex Xval = ol0[z * nxy + l * nx + k];
+        cuFloatComplex Yval = ol1[z * nxy + l * nx + k];
+        result.x += Xval.x * Yval.x + Xval.y * Yval.y;
+        result.y += -Xval.x * Yval.y + Xval.y * Yval.x;
+      }
+      cc[l * nx + k] = result;
+    }
+  }
+
+  fftC2C(cc, 1, ny, nx, FFTW_FORWARD);
+
+  // computeIntensities
+  std::vector<float> intensities(nxy);
+#pragma omp parallel for
+  for (int i = 0; i < nxy; ++i) {
+    intensities[i] = cc[i].x * cc[i].x + cc[i].y * cc[i].y;
+  }
+
+  vector old_k0 = *k0;
+  findpeak(&intensities[0], nx, ny, k0);
+
+  if (old_k0.x < (*k0).x - nx / 2) (*k0).x -= nx;
+  if (old_k0.x > (*k0).x + nx / 2) (*k0).x += nx;
+  if (old_k0.y < (*k0).y - ny / 2) (*k0).y -= ny;
+  if (old_k0.y > (*k0).y + ny / 2) (*k0).y += ny;
+
+  k0->x /= fitorder2;
+  k0->y /= fitorder2; /* return k0 of the first order, no matter which fitorder2 is used */
+}
+
+void fitk0andmodamps(std::vector<GPUBuffer>* bands,
+    GPUBuffer* overlap0, GPUBuffer* overlap1, int nx, int ny, int nz,
+    int norders, vector *k0, float dy, float dz, std::vector<GPUBuffer>* otf,
+    short wave, cuFloatComplex amps[], ReconParams * pParams)
+{
+  int fitorder1 = 0;
+  int fitorder2 = 0;
+  if (nz > 1) {
+      fitorder2 = 2;
+  }
+  else {
+    fitorder2 = 1;
+  }
+
+  float k0mag = sqrt(k0->x * k0->x + k0->y * k0->y);
+  float k0angle = atan2(k0->y, k0->x);
+
+  /* recalculate the overlap arrays at least this first time */
+  int redoarrays = (pParams->recalcarrays >= 1);
+  float x2 = k0angle;
+  cuFloatComplex modamp;
+  float amp2 = getmodamp(k0angle, k0mag, bands, overlap0,  overlap1, nx, ny, nz,
+      fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+
+  /* recalculate the overlap arrays every time only if recalcarrays >= 3*/
+  redoarrays = (pParams->recalcarrays >= 3);
+  float deltaangle = 0.001;
+  float deltamag = 0.1;
+  float angle = k0angle + deltaangle;
+  float x3 = angle;
+  float amp3 = getmodamp(angle, k0mag, bands, overlap0,  overlap1, nx, ny, nz,
+      fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+
+  float amp1 = 0.0f;
+  float x1 = 0.0;
+  float a;
+  if (amp3 > amp2) {
+    while(amp3 > amp2) {
+      amp1 = amp2;
+      x1 = x2;
+      amp2 = amp3;
+      x2 = x3;
+      angle += deltaangle;
+      x3 = angle;
+      amp3 = getmodamp(angle, k0mag, bands, overlap0, overlap1, nx, ny, nz,
+          fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+    }
+  } else {
+    angle = k0angle;
+    a = amp3;
+    amp3 = amp2;
+    amp2 = a;
+    a = x3;
+    x3 = x2;
+    x2 = a;
+    while (amp3 > amp2) {
+      amp1 = amp2;
+      x1 = x2;
+      amp2 = amp3;
+      x2 = x3;
+      angle -= deltaangle;
+      x3 = angle;
+      amp3 = getmodamp(angle, k0mag, bands, overlap0, overlap1, nx, ny, nz,
+          fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+    }
+  }  /* the maximum of modamp(x) is now between x1 and x3 */
+  angle = fitxyparabola(x1, amp1, x2, amp2, x3, amp3);   /* this should be a good angle.  */
+
+  /***** now search for optimum magnitude, at this angle  *****/
+
+  x2 = k0mag;
+  amp2 = getmodamp(angle, k0mag, bands, overlap0, overlap1, nx, ny, nz,
+      fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+
+  float mag = k0mag + deltamag;
+  x3 = mag;
+  amp3 = getmodamp(angle, mag, bands, overlap0, overlap1, nx, ny, nz,
+      fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+  if (amp3 > amp2) {
+    while (amp3 > amp2) {
+      amp1 = amp2;
+      x1 = x2;
+      amp2 = amp3;
+      x2 = x3;
+      mag += deltamag;
+      x3 = mag;
+      amp3 = getmodamp(angle, mag, bands, overlap0, overlap1, nx, ny, nz,
+          fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+    }
+  } else {
+    mag = k0mag;
+    a = amp3;
+    amp3 = amp2;
+    amp2 = a;
+    a = x3;
+    x3 = x2;
+    x2 = a;
+    while (amp3 > amp2) {
+      amp1 = amp2;
+      x1 = x2;
+      amp2 = amp3;
+      x2 = x3;
+      mag -= deltamag;
+      x3 = mag;
+      amp3 = getmodamp(angle, mag, bands, overlap0, overlap1, nx, ny, nz,
+          fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 0);
+    }
+  }  /* the maximum of modamp(x) is now between x1 and x3 */
+
+  mag = fitxyparabola(x1, amp1, x2, amp2, x3, amp3);  /* this should be a good magnitude.  */
+
+  printf("Optimum modulation amplitude:\n");
+  redoarrays = (pParams->recalcarrays>=2);    /* recalculate the d_overlap arrays for optimum modamp fit */
+  amp3 = getmodamp(angle, mag, bands, overlap0,  overlap1, nx, ny, nz,
+      fitorder1, fitorder2, dy, dz, otf, wave, &modamp, redoarrays, pParams, 1);
+  /* one last time, to find the modamp at the optimum k0*/
+
+  float dk = (1/(ny*dy));   /* inverse microns per pixel in data */
+  printf("Optimum k0 angle=%f, length=%f, spacing=%f microns\n", angle, mag, 1.0 / (mag * dk));
+
+  k0->x = mag * cos(angle);
+  k0->y = mag * sin(angle);
+  amps[fitorder2] = modamp;
+
+  /* finally find the modamp for the other orders */
+  redoarrays=1;
+  if (nz == 1) {
+    for (int order = 2; order < norders; ++order) {
+      /* assuming that "angle" and "mag" remain the same for every adjacent pair of bands within one direction */
+      getmodamp(angle, mag, bands, overlap0, overlap1, nx, ny, nz,
+          order - 1, order, dy, dz, otf, wave, &modamp, redoarrays, pParams, 1);
+      amps[order] = modamp;
+    }
+  } else {
+    /* 3D */
+    for (int order = 1; order < norders; ++order) {
+      if (order != fitorder2) {
+        getmodamp(angle, mag, bands, overlap0, overlap1, nx, ny, nz,
+            0, order, dy, dz, otf, wave, &modamp, redoarrays, pParams, 1);
+        amps[order] = modamp;
+      }
+    }
+  }
+}
+
+float findrealspacemodamp(
+    std::vector<GPUBuffer>* bands,
+    GPUBuffer* overlap0, GPUBuffer* overlap1,
+    int nx, int ny, int nz, int order1, int order2,
+    vector k0, float dy, float dz,
+    std::vector<GPUBuffer>* OTF,
+    short wave,
+    cuFloatComplex *modamp1, cuFloatComplex *modamp2,
+    cuFloatComplex *modamp3, int redoarrays,
+    ReconParams *pParams)
+{
+  if (redoarrays) {
+    /* make arrays that contain only the overlapping parts of fourier
+       space. Otf-equalize there, set to zero elsewhere  */
+    makeoverlaps(bands, overlap0, overlap1, nx, ny, nz, order1, order2,
+        k0.x, k0.y, dy, dz, OTF, wave, pParams);
+  }
+
+  float kx = k0.x * (order2 - order1);
+  float ky = k0.y * (order2 - order1);
+
+  const cuFloatComplex* ol0 = (const cuFloatComplex*)overlap0->getPtr();
+  const cuFloatComplex* ol1 = (const cuFloatComplex*)overlap1->getPtr();
+  int strideZ = nx * ny;
+
+  // Same per-pixel arithmetic as reductionKernel; the sum over the x-y
+  // plane is done in double.
+  double XStarYx = 0.0;
+  double XStarYy = 0.0;
+  double sumXMagD = 0.0;
+  double sumYMagD = 0.0;
+#pragma omp parallel for reduction(+:XStarYx,XStarYy,sumXMagD,sumYMagD)
+  for (int j = 0; j < ny; ++j) {
+    for (int i = 0; i < nx; ++i) {
+      float angle = 2.0f * M_PI * (
+          ((float)i - 0.5f * (float)nx) * kx / (float)nx +
+          ((float)j - 0.5f * (float)ny) * ky / (float)ny);
+      cuFloatComplex expiphi;
+      expiphi.x = cos(angle);
+      expiphi.y = sin(angle);
+
+      cuFloatComplex xsy;
+      xsy.x = 0.0f;
+      xsy.y = 0.0f;
+      float sxm = 0.0f;
+      float sym = 0.0f;
+      for (int z = 0; z < nz; ++z) {
+        cuFloatComplex Xval = ol0[z * strideZ + j * nx + i];
+        cuFloatComplex Yval = ol1[z * strideZ + j * nx + i];
+        xsy.x += Xval.x * Yval.x + Xval.y * Yval.y;
+        xsy.y += Xval.x * Yval.y - Xval.y * Yval.x;
+        sxm += Xval.x * Xval.x + Xval.y * Xval.y;
+        sym += Yval.x * Yval.x + Yval.y * Yval.y;
+      }
+      XStarYx += xsy.x * expiphi.x - xsy.y * expiphi.y;
+      XStarYy += xsy.x * expiphi.y + xsy.y * expiphi.x;
+      sumXMagD += sxm;
+      sumYMagD += sym;
+    }
+  }
+  cuFloatComplex XStarYFR;
+  XStarYFR.x = (float)XStarYx;
+  XStarYFR.y = (float)XStarYy;
+  float sumXMagFR = (float)sumXMagD;
+  float sumYMagFR = (float)sumYMagD;
+
+  // Compute results
+  modamp1->x = XStarYFR.x / sumXMagFR;
+  modamp1->y = XStarYFR.y / sumXMagFR;
+  modamp2->x = XStarYFR.x / sumYMagFR;
+  modamp2->y = -XStarYFR.y / sumYMagFR;
+  float tan2beta = 2.0f * sqrt(XStarYFR.x * XStarYFR.x +
+      XStarYFR.y * XStarYFR.y) / (sumXMagFR - sumYMagFR);
+  float beta = 0.5f * atan(tan2beta);
+  if (beta < 0.0f) {
+    beta += 0.5f * M_PI;
+  }
+  float modamp_amp = tan(beta);
+  float modamp_arg = atan2(XStarYFR.y, XStarYFR.x);
+  modamp3->x = modamp_amp * cos(modamp_arg);
+  modamp3->y = modamp_amp * sin(modamp_arg);
+
+  float corr_coef = (XStarYFR.x * XStarYFR.x + XStarYFR.y * XStarYFR.y)
+    / (sumXMagFR * sumYMagFR);
+  corr_coef = sqrt(corr_coef);
+
+  return corr_coef;
+}
+
+void filterbands(int dir, std::vector<GPUBuffer>* bands,
+    const std::vector<vector>& k0, int ndirs, int norders,
+    std::vector<GPUBuffer>& otf, float dy, float dz,
+    const std::vector<std::vector<cuFloatComplex> >& amp,
+    const std::vector<float>& noiseVarFactors, int nx, int ny, int nz,
+    short wave, ReconParams* pParams)
+{
+  float rdistcutoff;
+  int order;
+  float apocutoff, zapocutoff;
+  float dkr, dkz, krscale, kzscale, k0mag, k0pix;
+  float lambdaem, lambdaexc, alpha, beta, betamin;
+
+  dkr = (1/(ny*dy));   /* inverse microns per pixel in data */
+  if (dz>0)
+    dkz = (1/(nz*dz));   /* inverse microns per pixel in data */
+  else
+    dkz = pParams->dkzotf;
+  krscale = dkr / pParams->dkrotf;   /* ratio of radial direction pixel scales of data and otf */
+  kzscale = dkz / pParams->dkzotf;   /* ratio of axial direction pixel scales of data and otf */
+  k0pix =  sqrt(k0[0].x*k0[0].x + k0[0].y*k0[0].y);   /* k0 magnitude (for highest order) in pixels */
+  k0mag = k0pix * dkr;   /* k0 magnitude (for highest order) in inverse microns */
+  lambdaem = (wave/pParams->nimm)/1000.0;  /* emission wavelength in the sample, in microns */
+  lambdaexc = 0.88* lambdaem;;  /* 0.88 approximates a typical lambdaexc/lambdaem  */
+  alpha = asin(pParams->na/pParams->nimm);  /* aperture angle of objectives */
+  beta = asin(k0mag/(2/lambdaexc));   /* angle of center of side illumination beams */
+  betamin = asin((k0mag/(2/lambdaexc)) -sin(alpha)*SPOTRATIO);   /* angle of inner edge of side illumination beams */
+  rdistcutoff = (pParams->na*2/(wave/1000.0)) / dkr;    /* OTF support radial limit in data pixels */
+  if (rdistcutoff>nx/2) rdistcutoff=nx/2;
+
+  std::vector<int> zdistcutoff(norders);
+  if (!pParams->bTwolens) {
+    zdistcutoff[0] = (int) ceil(((1-cos(alpha))/lambdaem) / dkz);    /* OTF support axial limit in data pixels */
+    zdistcutoff[norders-1] = 1.3*zdistcutoff[0];    /* approx max axial support limit of the OTF of the high frequency side band */
+    if (norders>=3)
+      for (order=1;order<norders-1;order++)
+        zdistcutoff[order] = (1+lambdaem/lambdaexc)*zdistcutoff[0];       /* axial support limit of the OTF of the medium frequency side band(s?) */
+  }
+  else {  /* two lenses */
+    zdistcutoff[0] = (int) ceil(1.02*(2/lambdaem + 2/lambdaexc) / dkz);  /* 1.02 is just a safety margin */
+    zdistcutoff[norders-1] = (int) ceil(1.02*(2/lambdaem + 2*cos(beta)/lambdaexc) / dkz);    /* approx max axial support limit of the OTF of the high frequency side band */
+    if (norders==3) {
+      zdistcutoff[1] =  (int) ceil(1.02*(2/lambdaem + (1+cos(betamin))/lambdaexc) / dkz); /* axial support limit of the OTF of the medium frequency side band */
+    }
+    else if (norders>3)
+      for (order=1;order<norders-1;order++) {
+        float a;
+        a = ((float)order)/(norders-1);
+        zdistcutoff[order] = 1.1*((1-a)*zdistcutoff[0] + a*zdistcutoff[norders-1]);       /* axial support limit of the OTF of the medium frequency side bands */ /* 1.1 is a blur margin */
+      }
+  }
+
+  for (order=0;order<norders;order++) {
+    if (zdistcutoff[order]>=nz/2) zdistcutoff[order]=((nz/2-1) > 0 ? (nz/2-1) : 0);
+  }
+
+  apocutoff = rdistcutoff+ k0pix*(norders-1);
+
+  if (pParams->bTwolens)
+    zapocutoff = zdistcutoff[0];
+  else
+    zapocutoff = zdistcutoff[1];
+
+  std::vector<float> ampmag2(norders);
+  std::vector<cuFloatComplex> conjamp(norders);
+  for (order=0;order<norders;order++) {
+    ampmag2[order] = amp[dir][order].x * amp[dir][order].x +
+      amp[dir][order].y * amp[dir][order].y;
+    conjamp[order] = amp[dir][order];
+    conjamp[order].y *= -1;
+  }
+
+  std::vector<float> ampmag2_alldirs(ndirs * norders);
+  for (int dir2=0; dir2<ndirs; dir2++) {
+    for (int order2=0;order2<norders;order2++) {
+      ampmag2_alldirs[dir2*norders+order2] =
+        amp[dir2][order2].x * amp[dir2][order2].x +amp[dir2][order2].y * amp[dir2][order2].y;
+    }
+  }
+
+  const KernelParams kp = makeKernelParams(pParams);
+  std::vector<const cuFloatComplex*> otfPtrs;
+  for (std::vector<GPUBuffer>::iterator i = otf.begin();
+      i != otf.end(); ++i) {
+    otfPtrs.push_back((const cuFloatComplex*)i->getPtr());
+  }
+
+  for (order=0;order<norders;order++) {
+    cuFloatComplex * bandptr, * bandptr2 = 0;
+    if (order==0) {
+      bandptr = (cuFloatComplex*)bands->at(0).getPtr();
+    }
+    else {
+      bandptr = (cuFloatComplex*)bands->at(2*order-1).getPtr();     /* bands contains only the data of one direction -- dir*/
+      bandptr2 = (cuFloatComplex*)bands->at(2*order).getPtr();
+    }
+
+    float kx = order * k0[dir].x;
+    float ky = order * k0[dir].y;
+    int zdc = zdistcutoff[order];
+    int nrows = (2 * zdc + 1) * ny;
+
+    // filterbands_kernel1 is launched twice: first for x1 in [1, nx/2],
+    // then (bSecondEntry) for x1 in [1-nx/2, 0].  Each pass touches
+    // every band element at most once, so the rows of a pass can be
+    // processed in parallel, but the passes must run one after the other.
+    for (int pass = 0; pass < 2; ++pass) {
+#pragma omp parallel for schedule(dynamic)
+      for (int row = 0; row < nrows; ++row) {
+        int z0 = row / ny - zdc;
+        int y1 = row % ny - ny/2;
+        for (int x = 1; x <= nx/2; ++x) {
+          int x1 = pass ? x - nx/2 : x;
+
+          float xabs, yabs, rdist1, rdistabs, apofact = 1.0f;
+          int iin, jin, conj, xyind, ind, iz, z;
+          cuFloatComplex scale, bandreval, bandimval, bandplusval, bandminusval;
+          cuFloatComplex otf1, otf2;
+          float weight, sumweight, dampfact;
+
+          /*x1, y1 are coords within each band to be scaled */
+          if (x1 >= 0) {
+            /* integer coords of actual arrays to be filtered */
+            iin = y1;
+            jin = x1;
+            conj = 0;
+          } else {
+            iin = -y1;
+            jin = -x1;
+            conj = 1;
+          }
+
+          if (order==0 && conj) continue;   /* For center band only the actual pixels need to be filtered */
+
+          if (iin<0) {
+            iin += ny;
+          }
+          xyind = iin * (nx / 2 + 1) + jin;
+
+          rdist1 = sqrtf(x1*x1+y1*y1);  /* dist from center of band to be filtered */
+
+          if (rdist1<=rdistcutoff) { /* is x1,y1 within the theoretical lateral OTF support of
+                                        the data that is to be scaled? */
+            xabs=x1+kx;   /* (floating point) coords rel. to absolute fourier space, with */
+            yabs=y1+ky;   /* the absolute origin=(0,0) after the band is shifted by k0 */
+            rdistabs = sqrt(xabs*xabs + yabs*yabs);  // used later for apodization calculation
+            otf1 = otfinterpolate(otfPtrs[order], x1, y1, krscale, z0, kzscale, kp);
+
+            weight = otf1.x * otf1.x + otf1.y * otf1.y;
+            if (order!= 0) weight *= ampmag2[order];
+            dampfact = 1. / noiseVarFactors[dir*norders+order];
+
+            if (kp.bSuppress_singularities && order != 0 && rdist1 <=kp.suppression_radius)
+              dampfact *= suppress(rdist1);
+            else if (!kp.bDampenOrder0 && kp.bSuppress_singularities && order ==0)
+              dampfact *= suppress(rdist1);
+            else if (kp.bDampenOrder0 && order ==0)
+              dampfact *= order0damping(rdist1, z0, rdistcutoff, zdistcutoff[0]);
+
+            // if no kz=0 plane is used:
+            if (order==0 && z0==0 && kp.bNoKz0) dampfact = 0;
+
+            weight *= dampfact;
+            sumweight=weight;
+
+            for (int dir2=0; dir2<ndirs; dir2++) {
+              for (int order2=-(norders-1); order2<norders; order2++) {
+                if (dir2==dir && order2==order) continue;
+                if (!kp.bFilteroverlaps && !(order2==0 && order==0)) continue; /* bFilteroverlaps is always true except when (during debug) generating an unfiltered exploded view */
+                float amp2mag2 = ampmag2_alldirs[dir2*norders+abs(order2)];
+                float kx2 = order2 * k0[dir2].x;
+                float ky2 = order2 * k0[dir2].y;
+                float x2 = xabs-kx2; /* coords rel to shifted center of band 2 */
+                float y2 = yabs-ky2;
+                float rdist2 = sqrt(x2*x2+y2*y2);       /* dist from center of band 2 */
+
+                if (rdist2<rdistcutoff) {
+                  otf2 = otfinterpolate(otfPtrs[abs(order2)], x2, y2, krscale, z0, kzscale, kp);
+                  weight = mag2(otf2) / noiseVarFactors[dir2*norders+abs(order2)];
+                  if (order2 != 0) weight *= amp2mag2;
+
+                  if (kp.bSuppress_singularities && order2 != 0 && rdist2 <= kp.suppression_radius)
+                    weight *= suppress(rdist2);
+                  else if (!kp.bDampenOrder0 && kp.bSuppress_singularities && order2 ==0)
+                    weight *= suppress(rdist2);
+                  else if (kp.bDampenOrder0 && order2==0)
+                    weight *= order0damping(rdist2, z0, rdistcutoff, zdistcutoff[0]);
+
+                  if (kp.bNoKz0 && order2==0 && z0==0) weight = 0.0f;
+
+                  sumweight += weight;
+                }
+              }
+            }
+
+            sumweight += kp.wiener;
+            scale.x = dampfact *   otf1.x/sumweight;
+            scale.y = dampfact * (-otf1.y)/sumweight;
+
+            if (kp.apodizeoutput) {
+              float rho, zdistabs;
+              zdistabs = abs(z0);
+
+              if (zapocutoff > 0) {  /* 3D case */
+                rho = sqrt((rdistabs / apocutoff) * (rdistabs / apocutoff) +
+                           (zdistabs / zapocutoff) * (zdistabs / zapocutoff));
+              }
+              else         /* 2D case */
+                rho = sqrt((rdistabs/apocutoff)*(rdistabs/apocutoff));
+
+              if (rho > 1.f) rho = 1.0f;
+
+              if (kp.apodizeoutput == 1)    /* cosine-apodize */
+                apofact = cos((M_PI*0.5f)* rho);
+              else if (kp.apodizeoutput == 2)
+                apofact = 1.0f - rho;
+              scale.x *= apofact;
+              scale.y *= apofact;
+            }
+
+            if (conj) {
+              z = -z0;
+            } else {
+              z = z0;
+            }
+            iz = (z + nz) % nz;
+            ind = iz*((nx/2+1)*ny) + xyind;
+            if (order == 0) {
+              bandptr[ind] = cuCmulf(bandptr[ind], scale);
+            }
+            else {
+              scale = cuCmulf(scale, conjamp[order]); /* not invamp: the 1/|amp| factor is
+                                                         taken care of by including ampmag2 in the weights */
+              bandreval = bandptr[ind];
+              bandimval = bandptr2[ind];
+              if (conj) {
+                bandreval.y *= -1.0f;
+                bandimval.y *= -1.0f;
+              }
+              /* bandplus = bandre + i bandim */
+              bandplusval.x = bandreval.x - bandimval.y;
+              bandplusval.y = bandreval.y + bandimval.x;
+              /* bandminus = bandre - i bandim */
+              bandminusval.x = bandreval.x + bandimval.y;
+              bandminusval.y = bandreval.y - bandimval.x;
+              bandplusval = cuCmulf(bandplusval, scale);
+
+              bandreval.x = 0.5f*( bandplusval.x + bandminusval.x);
+              bandreval.y = 0.5f*( bandplusval.y + bandminusval.y);
+              bandimval.x = 0.5f*( bandplusval.y - bandminusval.y);
+              bandimval.y = 0.5f*(-bandplusval.x + bandminusval.x);
+              if (conj) {
+                bandreval.y *= -1.f;
+                bandimval.y *= -1.f;
+              }
+              bandptr[ind] = bandreval;
+              bandptr2[ind] = bandimval;
+            }
+          }
+          else {
+            iz = (z0 + nz) % nz;
+            ind = iz * ((nx / 2 + 1) * ny) + xyind;
+            bandptr[ind] = make_cuFloatComplex(0.f, 0.f);
+            if (order != 0)
+              bandptr2[ind] = make_cuFloatComplex(0.f, 0.f);
+          }
+        }
+      }
+    }
+
+    // filterbands_kernel3: clear everything above and below zdistcutoff
+#pragma omp parallel for
+    for (int z0 = zdc + 1; z0 < nz - zdc; ++z0) {
+      cuFloatComplex* p = bandptr + (size_t)z0 * (nx/2+1) * ny;
+      memset(p, 0, (nx/2+1) * ny * sizeof(cuFloatComplex));
+      if (order != 0) {
+        p = bandptr2 + (size_t)z0 * (nx/2+1) * ny;
+        memset(p, 0, (nx/2+1) * ny * sizeof(cuFloatComplex));
+      }
+    }
+  } /* for order */
+}
+
+void assemblerealspacebands(int dir, GPUBuffer* outbuffer,
+    GPUBuffer* bigbuffer, std::vector<GPUBuffer>* bands, int ndirs,
+    int norders, const std::vector<vector>& k0, int nx, int ny, int nz,
+    float zoomfact, int z_zoom, float expfact)
+{
+  int xdim = zoomfact * nx;
+  int ydim = zoomfact * ny;
+  int zdim = z_zoom * nz;
+  int nxyout = xdim * ydim;
+  int nxy = (nx/2+1)*ny;
+  float fact = expfact/0.5;  /* expfact is used for "exploded view".  For normal reconstruction expfact = 1.0  */
+
+  cuFloatComplex* big = (cuFloatComplex*)bigbuffer->getPtr();
+  float* out = (float*)outbuffer->getPtr();
+  std::vector<float> coslookup(nxyout);
+  std::vector<float> sinlookup(nxyout);
+
+  // big is cleared below before every order, so it can be measured on
+  fftplan::measureC2C(zdim, ydim, xdim, asFFTW(big), FFTW_BACKWARD);
+
+  for (int order=0; order < norders; order ++) {
+    const cuFloatComplex* inarray1;
+    const cuFloatComplex* inarray2;
+    if (order == 0) {
+      printf("moving centerband\n");
+      inarray1 = inarray2 = (const cuFloatComplex*)bands->at(0).getPtr();
+    } else {
+      printf("moving order %d\n",order);
+      inarray1 = (const cuFloatComplex*)bands->at(2*order-1).getPtr();
+      inarray2 = (const cuFloatComplex*)bands->at(2*order).getPtr();
+    }
+    memset(big, 0, (size_t)nxyout * zdim * sizeof(cuFloatComplex));
+
+    // move_kernel
+#pragma omp parallel for
+    for (int zi = 0; zi < nz; ++zi) {
+      for (int yi = 0; yi < ny; ++yi) {
+        for (int xi = 0; xi < nx; ++xi) {
+          int x = xi - (nx/2-1);
+          int y = yi - (ny/2-1);
+          int z = (nz>1) ? zi - (nz/2-1) : 0;
+          int indin, indout, xout, yout, zout, conj;
+          cuFloatComplex valre, valim, val;
+
+          xout = x;     /* xout,yot,zout = (non-centered) output coords with zoomed-up dims and origin of fourier space at (0,0,0) */
+          if (xout<0) xout += xdim;
+          yout = y;
+          if (yout<0) yout += ydim;
+          zout = z;
+          if (zout<0) zout += zdim;
+          indout = zout*nxyout + yout*xdim + xout;
+
+          if (x<0) {    /* now xyz get turned into coords of the (half fourier space) input arrays */
+            x = -x;
+            y = -y;
+            z = -z;
+            conj = 1;
+          }
+          else
+            conj = 0;
+
+          if (y<0) y += ny;
+          if (z<0) z += nz;
+          indin = z*nxy + y*(nx/2+1) + x;
+
+          if (order == 0) {
+            val = inarray1[indin];
+            if (conj)
+              val.y *= -1;
+          }
+          else {
+            valre = inarray1[indin];
+            valim = inarray2[indin];
+            if (conj) {
+              valre.y *= -1;
+              valim.y *= -1;
+            }
+            val.x = valre.x - valim.y;
+            val.y = valre.y + valim.x;
+          }
+          big[indout] = val;
+        }
+      }
+    }
+
+    /* transform it into real space */
+    if (order == 0) {
+      printf("re-transforming centerband\n");
+    }
+    fftC2C(big, zdim, ydim, xdim, FFTW_BACKWARD);
+
+    if (order == 0) {
+      printf("inserting centerband\n");
+      // write_outbuffer_kernel1
+#pragma omp parallel for
+      for (int k = 0; k < zdim; ++k) {
+        for (int ind = k * nxyout; ind < (k + 1) * nxyout; ++ind) {
+          out[ind] += big[ind].x;
+        }
+      }
+      printf("centerband assembly completed\n");
+      continue;
+    }
+
+    /***** For 3D, prepare 2D array of sines and cosines first, then loop over z. ******/
+    float k0x = k0[dir].x*((float)order);
+    float k0y = k0[dir].y*((float)order);
+
+    // cos_sin_kernel
+#pragma omp parallel for
+    for (int i = 0; i < ydim; ++i) {
+      for (int j = 0; j < xdim; ++j) {
+        float angle = fact * M_PI * ((j-xdim/2)*k0x/xdim + (i-ydim/2)*k0y/ydim);
+        coslookup[i*xdim + j] = cos(angle);
+        sinlookup[i*xdim + j] = sin(angle);
+      }
+    }
+    // write_outbuffer_kernel2
+#pragma omp parallel for
+    for (int k = 0; k < zdim; ++k) {
+      for (int indxy = 0; indxy < nxyout; ++indxy) {
+        int ind = k * nxyout + indxy;
+        out[ind] += (big[ind].x * 2.0*coslookup[indxy] - big[ind].y * 2.0*sinlookup[indxy]);
+      }
+    }
+
+    printf("order %d sideband assembly completed\n", order);
+  } /* for (order =...) */
+}
+
+void computeAminAmax(const GPUBuffer* data, int nx, int ny, int nz,
+    float* min, float* max)
+{
+  const float* d = (const float*)data->getPtr();
+  int numElems = nx * ny * nz;
+  // Unlike computeAminAmax_kernel this scans every element.  Serial on
+  // purpose: min/max reductions need OpenMP 3.1, which MSVC lacks.
+  float mx = -10000.0f;
+  float mn = 10000.0f;
+  for (int i = 0; i < numElems; ++i) {
+    if (d[i] > mx) {
+      mx = d[i];
+    }
+    if (d[i] < mn) {
+      mn = d[i];
+    }
+  }
+  *max = mx;
+  *min = mn;
+}
+
+void fftXYSlices(float* data, int nx, int ny, int nz)
+{
+  int fftN[2] = {ny, nx};
+  int inembed[2] = {ny, nx + 2};
+  int onembed[2] = {ny, nx / 2 + 1};
+  fftwf_plan plan = fftplan::fftwPlanManyR2C(2, fftN, nz,
+      data, inembed, 1, (nx + 2) * ny,
+      (fftwf_complex*)data, onembed, 1, (nx / 2 + 1) * ny);
+  fftwf_execute_dft_r2c(plan, data, (fftwf_complex*)data);
+}
+
+void fftZ(cuFloatComplex* data, int nx, int ny, int nz0)
+{
+  int fftN[1] = {nz0};
+  int stride = (nx / 2 + 1) * ny;
+  fftwf_plan plan = fftplan::fftwPlanMany(1, fftN, stride,
+      asFFTW(data), fftN, stride, 1,
+      asFFTW(data), fftN, stride, 1,
+      FFTW_FORWARD);
+  fftwf_execute_dft(plan, asFFTW(data), asFFTW(data));
+}
+
+}
@@ -21,6 +21,11 @@ void SetDefaultParams(ReconParams *pParams)
   pParams->zoomfact = 2;
   pParams->z_zoom = 1;
   pParams->nzPadTo = 0;
+  pParams->roi[0] = pParams->roi[1] = pParams->roi[2] = pParams->roi[3] = 0;
+  pParams->zrange[0] = pParams->zrange[1] = -1;
+  pParams->tstart = 0;
+  pParams->tend = -1;
+  pParams->tstep = 1;
   pParams->explodefact=1.0;
   pParams->bFilteroverlaps=1;
   pParams->recalcarrays = 1; /* whether to calculate the overlaping regions between bands just once or always; used in fitk0andmodamps() */
@@ -41,6 +46,29 @@ void SetDefaultParams(ReconParams *pParams)
   pParams->bNoKz0 = 0;
   pParams->bUseEstimatedWiener = 1;
 
+  pParams->backend = BACKEND_CUDA;
+  pParams->nthreads = 0;
+  pParams->bPrefetch = 0;
+  pParams->writeQueue = 2;
+  pParams->outputMode = outfmt::OUTPUT_FLOAT;
+  pParams->bU16GlobalScale = 0;
+  pParams->bChunkedOutput = 0;
+  pParams->chunkSize[0] = 16;
+  pParams->chunkSize[1] = 256;
+  pParams->chunkSize[2] = 256;
+  pParams->chunkLevel = 1;
+  pParams->tiffLevel = 1;
+  pParams->bMip = 0;
+  pParams->thumbSize = 256;
+  pParams->bWatch = 0;
+  pParams->watchIdle = 0;
+  pParams->bStreamInput = 0;
+  pParams->bShmInput = 0;
+  pParams->shmOutput[0] = '\0';
+  pParams->bIoUring = 0;
+  pParams->bResume = 0;
+  pParams->shmSlots = 4;
+
   pParams->bRadAvgOTF = 0;  /* default to use non-radially averaged OTFs */
   pParams->bOneOTFperAngle = 0;  /* default to use one OTF for all SIM angles */
 
@@ -51,6 +79,7 @@ void SetDefaultParams(ReconParams *pParams)
   pParams->bBgInExtHdr = 0;
   pParams->bUsecorr = 0;
   pParams->corrfiles[0] = '\0';  /* name of CCD correction file if usecorr is 1 */
+  pParams->corrCacheDir[0] = '\0';  /* no caching of parsed correction maps */
   pParams->electrons_per_bit = 0.6528;
   pParams->readoutNoiseVar = 32.42;  // electron^2
 
@@ -94,28 +123,206 @@ unsigned findOptimalDimension(unsigned inSize, int step=-1)
   return outSize;
 }
 
+namespace {
+
+/* The reconstruction stages that have both a CUDA (gpuFunctions.h) and
+ * a host (cpuFunctions.h) implementation; the signatures are the same,
+ * so callers take the set for their backend from stagesFor() */
+struct Stages {
+  void (*flatfield_u16)(const GPUBuffer&, size_t, int, int, const GPUBuffer&,
+      float, const GPUBuffer*, float, GPUBuffer*, int);
+  void (*apodize)(int, int, int, GPUBuffer*, int);
+  void (*cosapodize)(int, int, GPUBuffer*, int);
+  void (*rescale)(int, int, int, int, int, int, int, int, int,
+      std::vector<GPUBuffer>*, int, int, double*);
+  void (*separate)(int, int, int, int, int, int, std::vector<GPUBuffer>*,
+      float*);
+  void (*makemodeldata)(int, int, int, std::vector<GPUBuffer>*, int, vector,
+      float, float, std::vector<GPUBuffer>*, short, ReconParams*);
+  void (*fixdrift_bt_dirs)(std::vector<GPUBuffer>*, int, vector3d, int, int,
+      int);
+  void (*findk0)(std::vector<GPUBuffer>*, GPUBuffer*, GPUBuffer*, int, int,
+      int, int, vector*, float, float, std::vector<GPUBuffer>*, short,
+      ReconParams*);
+  void (*fitk0andmodamps)(std::vector<GPUBuffer>*, GPUBuffer*, GPUBuffer*,
+      int, int, int, int, vector*, float, float, std::vector<GPUBuffer>*,
+      short, cuFloatComplex*, ReconParams*);
+  float (*findrealspacemodamp)(std::vector<GPUBuffer>*, GPUBuffer*,
+      GPUBuffer*, int, int, int, int, int, vector, float, float,
+      std::vector<GPUBuffer>*, short, cuFloatComplex*, cuFloatComplex*,
+      cuFloatComplex*, int, ReconParams*);
+  void (*filterbands)(int, std::vector<GPUBuffer>*, const std::vector<vector>&,
+      int, int, std::vector<GPUBuffer>&, float, float,
+      const std::vector<std::vector<cuFloatComplex> >&,
+      const std::vector<float>&, int, int, int, short, ReconParams*);
+  void (*assemblerealspacebands)(int, GPUBuffer*, GPUBuffer*,
+      std::vector<GPUBuffer>*, int, int, const std::vector<vector>&, int, int,
+      int, float, int, float);
+};
+
+const Stages& stagesFor(int backend)
+{
+  static const Stages cudaStages = {
+    flatfield_u16, apodize, cosapodize, rescale, separate, makemodeldata,
+    fixdrift_bt_dirs, findk0, fitk0andmodamps, findrealspacemodamp,
+    filterbands, assemblerealspacebands
+  };
+  static const Stages cpuStages = {
+    cpu::flatfield_u16, cpu::apodize, cpu::cosapodize, cpu::rescale,
+    cpu::separate, cpu::makemodeldata, cpu::fixdrift_bt_dirs, cpu::findk0,
+    cpu::fitk0andmodamps, cpu::findrealspacemodamp, cpu::filterbands,
+    cpu::assemblerealspacebands
+  };
+  return backend == BACKEND_CPU ? cpuStages : cudaStages;
+}
+
+}
+
+namespace {
+
+// z sections added on either side of a --zrange against the axial wrap-around
+const int ZRANGE_MARGIN = 2;
+
+/* One axis of the 'size' pixel grid centred on the 'n' raw pixels from
+ * 'first' on, shifted to stay within the 'rawN' raw pixels */
+void roiAxis(int first, int n, int rawN, int size, int* gridN,
+    int* gridFirst, int* outFirst)
+{
+  if (size > rawN) {
+    size = rawN;
+  }
+  int start = first - (size - n) / 2;
+  if (start > rawN - size) {
+    start = rawN - size;
+  }
+  if (start < 0) {
+    start = 0;
+  }
+  *gridN = size;
+  *gridFirst = start;
+  *outFirst = first - start;
+}
+
+}
+
+void applyTimeRange(const ReconParams& params, ImageParams* imgParams)
+{
+  const int rawNTimes = imgParams->ntimes;
+  const int tend = params.tend < 0 ? rawNTimes - 1 : params.tend;
+  if (params.tstart > tend || tend >= rawNTimes) {
+    std::ostringstream msg;
+    msg << "Time points " << params.tstart << " to " << tend
+        << " are not within the " << rawNTimes << " of the input file";
+    throw std::runtime_error(msg.str());
+  }
+  imgParams->t0 = params.tstart;
+  imgParams->tstep = params.tstep;
+  imgParams->ntimes = (tend - params.tstart) / params.tstep + 1;
+  if (imgParams->ntimes != rawNTimes) {
+    printf("Reconstructing %d of %d time points: %d to %d every %d\n",
+        imgParams->ntimes, rawNTimes, params.tstart, tend, params.tstep);
+  }
+}
+
+void applyRoi(const ReconParams& params, ImageParams* imgParams)
+{
+  imgParams->rawNx = imgParams->nx;
+  imgParams->rawNy = imgParams->ny;
+  imgParams->rawNz = imgParams->nz;
+  imgParams->x0 = imgParams->y0 = imgParams->z0 = 0;
+  imgParams->outX0 = imgParams->outY0 = imgParams->outZ0 = 0;
+  imgParams->outNx = imgParams->nx;
+  imgParams->outNy = imgParams->ny;
+  imgParams->outNz = imgParams->nz;
+
+  if (params.roi[2] > 0) {
+    if (params.roi[0] + params.roi[2] > imgParams->rawNx ||
+        params.roi[1] + params.roi[3] > imgParams->rawNy) {
+      std::ostringstream msg;
+      msg << "--roi " << params.roi[0] << "," << params.roi[1] << ","
+          << params.roi[2] << "," << params.roi[3] << " is not inside the "
+          << imgParams->rawNx << "x" << imgParams->rawNy << " raw sections";
+      throw std::runtime_error(msg.str());
+    }
+    // the apodized edge of the grid stays outside the region written out.
+    // The k-space code assumes square sections (dkx == dky, from ny), so
+    // the grid is square and even, sized for the longer side of the ROI;
+    // if that does not fit in the raw sections, the whole sections are
+    // processed and only the ROI is written
+    int margin = params.napodize > 0 ? params.napodize : 0;
+    int longer = params.roi[2] > params.roi[3] ? params.roi[2] : params.roi[3];
+    int size = findOptimalDimension(longer + 2 * margin, 1);
+    while (size % 2) {
+      size = findOptimalDimension(size + 1, 1);
+    }
+    if (size > imgParams->rawNx || size > imgParams->rawNy) {
+      size = imgParams->rawNx > imgParams->rawNy ? imgParams->rawNx :
+        imgParams->rawNy;
+    }
+    roiAxis(params.roi[0], params.roi[2], imgParams->rawNx, size,
+        &imgParams->nx, &imgParams->x0, &imgParams->outX0);
+    roiAxis(params.roi[1], params.roi[3], imgParams->rawNy, size,
+        &imgParams->ny, &imgParams->y0, &imgParams->outY0);
+    imgParams->outNx = params.roi[2];
+    imgParams->outNy = params.roi[3];
+  }
+  if (params.zrange[0] >= 0) {
+    if (params.zrange[1] >= imgParams->rawNz) {
+      std::ostringstream msg;
+      msg << "--zrange " << params.zrange[0] << "," << params.zrange[1]
+          << " goes beyond the " << imgParams->rawNz << " z sections";
+      throw std::runtime_error(msg.str());
+    }
+    imgParams->outNz = params.zrange[1] - params.zrange[0] + 1;
+    roiAxis(params.zrange[0], imgParams->outNz, imgParams->rawNz,
+        findOptimalDimension(imgParams->outNz + 2 * ZRANGE_MARGIN, 1),
+        &imgParams->nz, &imgParams->z0, &imgParams->outZ0);
+  }
+  if (imgParams->nx != imgParams->rawNx || imgParams->ny != imgParams->rawNy ||
+      imgParams->nz != imgParams->rawNz) {
+    printf("Reconstructing raw x %d-%d, y %d-%d, z %d-%d; writing x %d-%d, y %d-%d, z %d-%d\n",
+        imgParams->x0, imgParams->x0 + imgParams->nx - 1,
+        imgParams->y0, imgParams->y0 + imgParams->ny - 1,
+        imgParams->z0, imgParams->z0 + imgParams->nz - 1,
+        imgParams->x0 + imgParams->outX0,
+        imgParams->x0 + imgParams->outX0 + imgParams->outNx - 1,
+        imgParams->y0 + imgParams->outY0,
+        imgParams->y0 + imgParams->outY0 + imgParams->outNy - 1,
+        imgParams->z0 + imgParams->outZ0,
+        imgParams->z0 + imgParams->outZ0 + imgParams->outNz - 1);
+  }
+}
+
 void setup_part2(ReconParams* params, ImageParams* imgParams, ReconData* reconData)
 {
 #ifdef __SIRECON_USE_TIFF__
   imgParams->nz0 = findOptimalDimension(imgParams->nz);
 #endif
 
-  getOTFs(params, *imgParams, reconData);
-  allocSepMatrixAndNoiseVarFactors(*params, reconData);
-  makematrix(params->nphases, params->norders, 0, 0,
-      &(reconData->sepMatrix[0]), &(reconData->noiseVarFactors[0]));
-
+  setup_wave(params, *imgParams, reconData);
   allocateImageBuffers(*params, *imgParams, reconData);
 
   imgParams->inscale = 1.0 / (imgParams->nx * imgParams->ny * imgParams->nz0 *
       params->zoomfact * params->zoomfact * params->z_zoom * params->ndirs);
+  reconData->sum_dir0_phase0 = std::vector<double>(imgParams->nz *
+      imgParams->nwaves);
+}
+
+void setup_wave(ReconParams* params, const ImageParams& imgParams,
+    ReconData* reconData)
+{
+  getOTFs(params, imgParams, reconData);
+  allocSepMatrixAndNoiseVarFactors(*params, reconData);
+  makematrix(params->nphases, params->norders, 0, 0,
+      &(reconData->sepMatrix[0]), &(reconData->noiseVarFactors[0]));
+
   reconData->k0 = std::vector<vector>(params->ndirs);
   reconData->k0_time0 = std::vector<vector>(params->ndirs);
   reconData->k0guess = std::vector<vector>(params->ndirs);
   float delta_angle = M_PI / params->ndirs;
-  float dkr = 1 / (imgParams->ny * imgParams->dy);  // assuming square images sizes
+  float dkr = 1 / (imgParams.ny * imgParams.dy);  // assuming square images sizes
   float k0magguess = (1.0 / params->linespacing) / dkr;
-  if (imgParams->nz > 1) {
+  if (imgParams.nz > 1) {
     int nordersIn = params->nphases / 2 + 1;
     k0magguess /= nordersIn - 1; 
   }
@@ -130,8 +337,6 @@ void setup_part2(ReconParams* params, ImageParams* imgParams, ReconData* reconDa
     reconData->k0guess[i].y = k0magguess * sin(k0angleguess);
   }
 
-  reconData->sum_dir0_phase0 = std::vector<double>(imgParams->nz *
-      imgParams->nwaves);
   reconData->amp = std::vector<std::vector<cuFloatComplex> >(
       params->ndirs, std::vector<cuFloatComplex>(params->norders));
   for (int i = 0; i < params->ndirs; ++i) {
@@ -140,7 +345,37 @@ void setup_part2(ReconParams* params, ImageParams* imgParams, ReconData* reconDa
   }
 }
 
+void swapWaveData(ReconData* reconData, WaveData* wave)
+{
+  // vectors swap their storage, so no device memory is copied
+  std::swap(reconData->sizeOTF, wave->sizeOTF);
+  reconData->otf.swap(wave->otf);
+  reconData->sepMatrix.swap(wave->sepMatrix);
+  reconData->noiseVarFactors.swap(wave->noiseVarFactors);
+  reconData->k0.swap(wave->k0);
+  reconData->k0_time0.swap(wave->k0_time0);
+  reconData->k0guess.swap(wave->k0guess);
+  reconData->amp.swap(wave->amp);
+}
+
 #ifndef __SIRECON_USE_TIFF__
+namespace {
+
+/* Size a copy of the raw header for a debug file of raw-sized sections
+ * (--savealignedraw etc.): the grid of applyRoi() and the time points of
+ * applyTimeRange() instead of the whole input */
+void gridHeader(const ReconParams& params, const ImageParams& imgParams,
+    IW_MRC_HEADER* header)
+{
+  header->nx = imgParams.nx;
+  header->ny = imgParams.ny;
+  header->nz = imgParams.nz * params.nphases * params.ndirs *
+    imgParams.nwaves * imgParams.ntimes;
+  header->num_times = imgParams.ntimes;
+}
+
+}
+
 void loadHeader(const ReconParams& params, ImageParams* imgParams, IW_MRC_HEADER &header)
 {
   int ixyz[3];
@@ -157,8 +392,10 @@ void loadHeader(const ReconParams& params, ImageParams* imgParams, IW_MRC_HEADER
   /* header.nz is defined as the total number of sections =
    * nz*nwaves*ntimes (* ndirs*nphases in our case) */
   imgParams->nz /= params.nphases  * params.ndirs;
+  applyRoi(params, imgParams);
   imgParams->nwaves = header.num_waves;
   imgParams->ntimes = header.num_times;
+  applyTimeRange(params, imgParams);
   imgParams->wave[0]=header.iwav1;
   imgParams->wave[1]=header.iwav2;
   imgParams->wave[2]=header.iwav3;
@@ -171,6 +408,7 @@ void loadHeader(const ReconParams& params, ImageParams* imgParams, IW_MRC_HEADER
   /* Initialize headers for intermediate output files if requested */
   if (params.bSaveAlignedRaw) {
     memcpy(&aligned_header, &header, sizeof(header));
+    gridHeader(params, *imgParams, &aligned_header);
     IMOpen(aligned_stream_no, params.fileRawAligned, "new");
     aligned_header.mode = IW_FLOAT;
     aligned_header.inbsym = 0;
@@ -178,6 +416,7 @@ void loadHeader(const ReconParams& params, ImageParams* imgParams, IW_MRC_HEADER
   }
   if (params.bSaveSeparated) {
     memcpy(&sep_header, &header, sizeof(header));
+    gridHeader(params, *imgParams, &sep_header);
     IMOpen(separated_stream_no, params.fileSeparated, "new");
     sep_header.nx = (imgParams->nx+2)/2;    // saved will be separated FFTs
     sep_header.mode = IW_COMPLEX;
@@ -186,6 +425,7 @@ void loadHeader(const ReconParams& params, ImageParams* imgParams, IW_MRC_HEADER
   }
   if (params.bSaveOverlaps) {
     memcpy(&overlaps_header, &header, sizeof(header));
+    gridHeader(params, *imgParams, &overlaps_header);
     IMOpen(overlaps_stream_no, params.fileOverlaps, "new");
     overlaps_header.nz = imgParams->nz*2*params.ndirs*imgParams->ntimes*imgParams->nwaves;
     overlaps_header.num_waves = 2;  // save overlap 0 and 1 as wave 0 and 1 respectively
@@ -453,16 +693,30 @@ void allocateImageBuffers(const ReconParams& params,
 void setOutputHeader(const ReconParams& myParams, const ImageParams& imgParams,
                      IW_MRC_HEADER &header)
 {
-  header.mode = IW_FLOAT;
-  header.nz = imgParams.nz * imgParams.nwaves * imgParams.ntimes *
+  switch (myParams.outputMode) {
+  case outfmt::OUTPUT_HALF:
+    header.mode = outfmt::MRC_MODE_HALF;
+    break;
+  case outfmt::OUTPUT_UINT16:
+    header.mode = IW_USHORT;
+    break;
+  default:
+    header.mode = IW_FLOAT;
+  }
+  header.nz = imgParams.outNz * imgParams.nwaves * imgParams.ntimes *
     myParams.z_zoom;
-  header.nx *= myParams.zoomfact;
-  header.ny *= myParams.zoomfact;
+  header.num_times = imgParams.ntimes;
+  header.nx = imgParams.outNx * myParams.zoomfact;
+  header.ny = imgParams.outNy * myParams.zoomfact;
   header.xlen /= myParams.zoomfact;
   header.ylen /= myParams.zoomfact;
   header.zlen /= myParams.z_zoom;
   header.inbsym = 0;
   IMPutHdr(ostream_no, &header);
+  if (myParams.outputMode == outfmt::OUTPUT_UINT16) {
+    // two floats per section for the scale: value = offset + scale * pixel
+    IMAlExHdrSize(ostream_no, 0, 2, header.nz);
+  }
   IMAlCon(ostream_no, 0);
 }
 #endif
@@ -478,9 +732,24 @@ void bgAndSlope(const ReconParams& myParams,
   if (myParams.bUsecorr) {
     // flatfield correction of measured data using calibration data
     printf("loading CCD calibration file\n");
-    getbg_and_slope(myParams.corrfiles,
-        (float*)reconData->background.getPtr(),
-        (float*)reconData->slope.getPtr(), imgParams.nx, imgParams.ny);
+    // the calibration covers the whole raw section; the grid's part of
+    // it is cut out afterwards (see applyRoi())
+    const int rawNx = imgParams.rawNx, rawNy = imgParams.rawNy;
+    std::vector<float> background(rawNx * rawNy), slope(rawNx * rawNy);
+    if (!corrcache::load(myParams.corrCacheDir, myParams.corrfiles,
+          rawNx, rawNy, &background[0], &slope[0])) {
+      getbg_and_slope(myParams.corrfiles, &background[0], &slope[0],
+          rawNx, rawNy);
+      corrcache::store(myParams.corrCacheDir, myParams.corrfiles,
+          rawNx, rawNy, &background[0], &slope[0]);
+    }
+    for (int l = 0; l < imgParams.ny; ++l) {
+      size_t from = (size_t) (imgParams.y0 + l) * rawNx + imgParams.x0;
+      memcpy((float*)reconData->background.getPtr() + l * imgParams.nx,
+          &background[from], imgParams.nx * sizeof(float));
+      memcpy((float*)reconData->slope.getPtr() + l * imgParams.nx,
+          &slope[from], imgParams.nx * sizeof(float));
+    }
   } else {
 #endif
     for (int i = 0; i < imgParams.nx * imgParams.ny; i++) {
@@ -492,6 +761,14 @@ void bgAndSlope(const ReconParams& myParams,
   }
 #endif
   reconData->backgroundExtra = 0;
+
+  // device copies for flat-fielding raw uint16 data where it is used
+  reconData->backgroundGPU.resize(reconData->background.getSize());
+  reconData->background.set(&reconData->backgroundGPU, 0,
+      reconData->background.getSize(), 0);
+  reconData->slopeGPU.resize(reconData->slope.getSize());
+  reconData->slope.set(&reconData->slopeGPU, 0,
+      reconData->slope.getSize(), 0);
 }
 
 #ifndef __SIRECON_USE_TIFF__
@@ -526,9 +803,11 @@ void getbg_and_slope(const char *corrfiles, float *background,
 #endif
 
 void findModulationVectorsAndPhasesForAllDirections(
-    int zoffset, ReconParams* params, const ImageParams& imgParams,
+    int zoffset, int iw, ReconParams* params, const ImageParams& imgParams,
     DriftParams* driftParams, ReconData* data)
 {
+  const Stages& stages = stagesFor(params->backend);
+
   // Apodize (or edge softening) every 2D slice:
   apodizationDriver(zoffset, params, imgParams, driftParams, data);
 
@@ -554,7 +833,7 @@ void findModulationVectorsAndPhasesForAllDirections(
     }
 
     // Unmixing info components in real or reciprocal space:
-    separate(imgParams.nx, imgParams.ny, imgParams.nz,
+    stages.separate(imgParams.nx, imgParams.ny, imgParams.nz,
         direction, params->nphases, params->norders,
         rawImages, &data->sepMatrix[0]);
 
@@ -565,25 +844,26 @@ void findModulationVectorsAndPhasesForAllDirections(
     }
 #endif
 
-    if (imgParams.nz > 1) {
+    if (imgParams.nz > 1 && params->backend == BACKEND_CPU) {
+      for (int i = 0; i < params->nphases; ++i) {
+        cpu::fftZ((cuFloatComplex*)((*bands)[i]).getPtr(),
+            imgParams.nx, imgParams.ny, imgParams.nz0);
+      }
+    }
+    else if (imgParams.nz > 1) {
       // 1D FFT of a stack of 2D FFTs to obtain equivalent of 3D FFT
-      cufftHandle fftplan1D;
       int fftN[1] = {imgParams.nz0};
       int stride = (imgParams.nx / 2 + 1) * imgParams.ny;
       int dist = 1;
-      cufftResult cuFFTErr = cufftPlanMany(&fftplan1D, 1, fftN,
-                                           fftN, stride, dist,
-                                           fftN, stride, dist,
-                                           CUFFT_C2C,
-                                           (imgParams.nx / 2 + 1) * imgParams.ny);
-      if (cuFFTErr != CUFFT_SUCCESS) {
-        throw std::runtime_error("CUFFT plan creation failed");
-      }
+      cufftHandle fftplan1D = fftplan::cuPlanMany(1, fftN,
+                                                  fftN, stride, dist,
+                                                  fftN, stride, dist,
+                                                  CUFFT_C2C,
+                                                  (imgParams.nx / 2 + 1) * imgParams.ny);
       for (int i = 0; i < params->nphases; ++i) {
         cufftExecC2C(fftplan1D, (cuFloatComplex*)((*bands)[i]).getPtr(),
                      (cuFloatComplex*)((*bands)[i]).getPtr(), CUFFT_FORWARD);
       }
-      cufftDestroy(fftplan1D);
     }
 
     if (params->bMakemodel) {
@@ -591,9 +871,9 @@ void findModulationVectorsAndPhasesForAllDirections(
        * with simulated data
        * DM: k0 is not initialized but has memory allocate at this point.
        * k0 initialization code is near lines 430ff in sirecon.c */
-      makemodeldata(imgParams.nx, imgParams.ny, imgParams.nz0, bands,
+      stages.makemodeldata(imgParams.nx, imgParams.ny, imgParams.nz0, bands,
           params->norders, data->k0[direction], imgParams.dy, imgParams.dz,
-          &data->otf[0], imgParams.wave[0], params);
+          &data->otf[0], imgParams.wave[iw], params);
     }
 
 #ifndef __SIRECON_USE_TIFF__
@@ -627,7 +907,8 @@ void findModulationVectorsAndPhasesForAllDirections(
 
     // Now to fix 3D drift between dirs estimated by determinedrift_3D()
     if (direction != 0 && params->bFixdrift) {
-      fixdrift_bt_dirs(bands, params->norders, driftParams->drift_bt_dirs[direction],
+      stages.fixdrift_bt_dirs(bands, params->norders,
+          driftParams->drift_bt_dirs[direction],
           imgParams.nx, imgParams.ny, imgParams.nz0);
     }
 
@@ -647,10 +928,10 @@ void findModulationVectorsAndPhasesForAllDirections(
        * rest of the series.
        * Find initial estimate of modulation wave vector k0 by
        * cross-correlation. */
-      findk0(bands, &data->overlap0, &data->overlap1, imgParams.nx,
+      stages.findk0(bands, &data->overlap0, &data->overlap1, imgParams.nx,
           imgParams.ny, imgParams.nz0, params->norders,
           &(data->k0[direction]), imgParams.dy, imgParams.dz, &(data->otf[dir_]),
-          imgParams.wave[0], params);
+          imgParams.wave[iw], params);
 
       if (params->bSaveOverlaps) {
         // output the overlaps
@@ -686,9 +967,9 @@ void findModulationVectorsAndPhasesForAllDirections(
       /* if k0 is very close to the guess, we can save time by not
        * recalculating the overlap arrays */
 
-      fitk0andmodamps(bands, &data->overlap0, &data->overlap1, imgParams.nx,
+      stages.fitk0andmodamps(bands, &data->overlap0, &data->overlap1, imgParams.nx,
           imgParams.ny, imgParams.nz0, params->norders, &(data->k0[direction]),
-          imgParams.dy, imgParams.dz, &(data->otf[dir_]), imgParams.wave[0],
+          imgParams.dy, imgParams.dz, &(data->otf[dir_]), imgParams.wave[iw],
           &data->amp[direction][0], params);
 
       if (imgParams.curTimeIdx == 0) {
@@ -711,16 +992,16 @@ void findModulationVectorsAndPhasesForAllDirections(
         for (int order = 1; order < params->norders; ++order) {
           float corr_coeff;
           if (imgParams.nz0>1)
-            corr_coeff = findrealspacemodamp(bands, &data->overlap0,
+            corr_coeff = stages.findrealspacemodamp(bands, &data->overlap0,
               &data->overlap1, imgParams.nx, imgParams.ny, imgParams.nz0,
               0, order, data->k0[direction], imgParams.dy, imgParams.dz,
-              &(data->otf[dir_]), imgParams.wave[0], &data->amp[direction][order],
+              &(data->otf[dir_]), imgParams.wave[iw], &data->amp[direction][order],
               &amp_inv, &amp_combo, 1, params);
           else
-            corr_coeff = findrealspacemodamp(bands, &data->overlap0,
+            corr_coeff = stages.findrealspacemodamp(bands, &data->overlap0,
               &data->overlap1, imgParams.nx, imgParams.ny, imgParams.nz0,
               order-1, order, data->k0[direction], imgParams.dy, imgParams.dz,
-              &(data->otf[dir_]), imgParams.wave[0], &data->amp[direction][order],
+              &(data->otf[dir_]), imgParams.wave[iw], &data->amp[direction][order],
               &amp_inv, &amp_combo, 1, params);
           printf("modamp mag=%f, phase=%f\n, correlation coeff=%f\n\n",
                  cmag(data->amp[direction][order]),
@@ -733,10 +1014,10 @@ void findModulationVectorsAndPhasesForAllDirections(
       printf("known k0 for direction %d = (%f, %f) \n", direction, 
           data->k0[direction].x, data->k0[direction].y);
       for (int order = 1; order < params->norders; ++order) {
-        float corr_coeff = findrealspacemodamp(bands, &data->overlap0,
+        float corr_coeff = stages.findrealspacemodamp(bands, &data->overlap0,
             &data->overlap1, imgParams.nx, imgParams.ny, imgParams.nz0, 
             0, order, data->k0[direction], imgParams.dy, imgParams.dz,
-            &(data->otf[dir_]), imgParams.wave[0], &data->amp[direction][order],
+            &(data->otf[dir_]), imgParams.wave[iw], &data->amp[direction][order],
             &amp_inv, &amp_combo, 1, params);
         printf("modamp mag=%f, phase=%f\n",
             cmag(data->amp[direction][order]),
@@ -810,74 +1091,477 @@ void findModulationVectorsAndPhasesForAllDirections(
   } /* end for (dir)  */   /* done finding the modulation vectors and phases for all directions */
 }
 
+int rawSectionIndex(const ReconParams& params, const ImageParams& imgParams,
+    int direction, int z, int phase)
+{
+  // z counts from the first section of the grid (see applyRoi())
+  z += imgParams.z0;
+  if (params.bFastSIM) {
+    /* data organized into (nz, ndirs, nphases) */
+    return z * params.ndirs * params.nphases +
+      direction * params.nphases + phase;
+  }
+  /* data organized into (ndirs, nz, nphases) */
+  return direction * imgParams.rawNz * params.nphases + z * params.nphases + phase;
+}
+
 void SIM_Reconstructor::loadImageData(int it, int iw, int zoffset)
 {
 #ifdef __SIRECON_USE_TIFF__
+  // Only the pages' directories are read here; each section is decoded
+  // when its task below asks for it
+  m_tiffReader.open(m_all_matching_files[it]);
   // set up m_myParams, m_imgParams, and m_reconData based on the first input TIFF
-  CImg<> rawtiff(m_all_matching_files[it].c_str());
   if (it == 0)
-    ::setup(rawtiff, &m_myParams, &m_imgParams, &m_reconData);
-
-  if (m_imgParams.nz0 < rawtiff.depth())
-    rawtiff.crop(0,0,0,0,rawtiff.width()-1,rawtiff.height()-1,
-                 m_imgParams.nz0*m_myParams.ndirs*m_myParams.nphases-1,0);
+    setup(m_tiffReader);
+#else
+  if (m_shmIn) {
+    uploadShmSlot(zoffset);
+    return;
+  }
+  if (rawIsU16()) {
+    // 16-bit data stay 16-bit until they are on the device
+    if (!takePrefetched(it, iw)) {
+      reserveStaging();
+      loadIntoStaging(it, iw);
+    }
+    uploadRawU16(zoffset);
+    return;
+  }
+  bool staged = takePrefetched(it, iw);
+  if (!staged && m_batch.isOpen()) {
+    reserveStaging();
+    loadIntoStaging(it, iw);
+    staged = true;
+  }
+  if (staged) {
+    // Time point 'it' was already read and flat-fielded in the
+    // background, or by the batch; only the upload is left
+    const size_t volBytes = sizeof(float) * m_imgParams.nz *
+      (m_imgParams.nx + 2) * m_imgParams.ny;
+    for (int direction = 0; direction < m_myParams.ndirs; ++direction) {
+      for (int phase = 0; phase < m_myParams.nphases; ++phase) {
+        size_t slot = direction * m_myParams.nphases + phase;
+        m_staging.set(&(m_reconData.savedBands[direction][phase]),
+            slot * volBytes, (slot + 1) * volBytes,
+            zoffset * (m_imgParams.nx + 2) * m_imgParams.ny * sizeof(float));
+      }
+    }
+    releaseStaging();
+    return;
+  }
 #endif
 
-  for (int direction = 0; direction < m_myParams.ndirs; ++direction) {
-    // Temporary Buffers for reading switch-off images
-    PinnedCPUBuffer buffer(sizeof(float) * m_imgParams.nx * m_imgParams.ny);
+  // Every (direction, z, phase) section is an independent task: it has
+  // its own staging buffer and nothing shared is written except its own
+  // slot in savedBands, so the sections can be loaded in any order.
+  const int nz = m_imgParams.nz;
+  const int nphases = m_myParams.nphases;
+  const int ntasks = m_myParams.ndirs * nz * nphases;
+  std::string errorMsg;
+
+#pragma omp parallel
+  {
+    // Temporary Buffer for reading switch-off images
     /*Pinned*/CPUBuffer offBuff(sizeof(float) * (m_imgParams.nx + 2) * m_imgParams.ny);
+#ifdef __SIRECON_USE_TIFF__
+    std::vector<float> rawSection(m_imgParams.nx * m_imgParams.ny);
+#endif
 
-    std::vector<GPUBuffer>* rawImages = &(m_reconData.savedBands[direction]);
-    std::vector<GPUBuffer>* bands = &(m_reconData.savedBands[direction]);
-
-    int z = 0;
-    for (z = 0; z < m_imgParams.nz; ++z) {
-      int zsec;
-      /* First determine which section of the raw data to load */
-      if (m_myParams.bFastSIM) {
-        /* data organized into (nz, ndirs, nphases) */
-        zsec = (z * m_myParams.ndirs * m_myParams.nphases +
-                direction * m_myParams.nphases);
-      } else { /* data organized into (ndirs, nz, nphases) */
-        zsec = direction * m_imgParams.nz * m_myParams.nphases + z * m_myParams.nphases;
-      }
+#pragma omp for schedule(dynamic)
+    for (int task = 0; task < ntasks; ++task) {
+      int direction = task / (nz * nphases);
+      int z = (task / nphases) % nz;
+      int phase = task % nphases;
 
-      for (int phase = 0; phase < m_myParams.nphases; ++phase) {
+      try {
 #ifdef __SIRECON_USE_TIFF__
-        load_and_flatfield(rawtiff, zsec, (float*)offBuff.getPtr(), m_myParams.constbkgd, 
+        int zsec = rawSectionIndex(m_myParams, m_imgParams, direction, z, phase);
+        load_and_flatfield(m_tiffReader, zsec, &rawSection[0],
+                           (float*)offBuff.getPtr(), m_myParams.constbkgd,
                            m_imgParams.inscale);
 #else
-        if (m_myParams.bBgInExtHdr) {
-          /* subtract the background value of each exposure stored in
-           * extended header, indexed by the section number. */
-          int extInts;
-          float extFloats[3];
-          IMRtExHdrZWT(istream_no, zsec, iw, it, &extInts, extFloats);
-          m_reconData.backgroundExtra = extFloats[2];
-        }
-        load_and_flatfield(zsec, iw, it,
-            (float*)offBuff.getPtr(), (float*)buffer.getPtr(),
-            m_imgParams.nx, m_imgParams.ny,
-            (float*)m_reconData.background.getPtr(), m_reconData.backgroundExtra,
-            (float*)m_reconData.slope.getPtr(),
-            m_imgParams.inscale, m_myParams.bUsecorr);
+        loadSection(it, iw, direction, z, phase, (float*)offBuff.getPtr());
 #endif
         assert(offBuff.hasNaNs() == false);
         // Transfer the data from offBuff to device buffer previously allocated (see m_reconData.savedBands)
-        offBuff.set(&(rawImages->at(phase)),
+        offBuff.set(&(m_reconData.savedBands[direction][phase]),
             0, (m_imgParams.nx + 2) * m_imgParams.ny * sizeof(float),
             (z + zoffset) * (m_imgParams.nx + 2) * m_imgParams.ny * sizeof(float));
+      }
+      catch (std::exception &e) {
+        // exceptions must not leave an OpenMP region
+#pragma omp critical
+        errorMsg = e.what();
+      }
+    } // end for (task)
+  }
+
+  if (!errorMsg.empty()) {
+    throw std::runtime_error(errorMsg);
+  }
+}
+
+#ifndef __SIRECON_USE_TIFF__
+bool SIM_Reconstructor::rawIsU16() const
+{
+  if (liveInput()) {
+    return true;
+  }
+  return m_reader.mode() == MRCReader::MODE_USHORT && !m_reader.byteSwapped();
+}
+
+float SIM_Reconstructor::sectionBackgroundExtra(int zsec, int iw, int it) const
+{
+  if (m_myParams.bBgInExtHdr) {
+    /* subtract the background value of each exposure stored in
+     * extended header, indexed by the section number. */
+    return m_reader.extFloat(zsec, iw, rawTime(it), 2);
+  }
+  return m_reconData.backgroundExtra;
+}
+
+void SIM_Reconstructor::loadSection(int it, int iw, int direction, int z,
+    int phase, float* dest)
+{
+  int zsec = rawSectionIndex(m_myParams, m_imgParams, direction, z, phase);
+  load_and_flatfield(m_reader,
+      roiOrigin(m_reader.section(zsec, iw, rawTime(it))), dest, m_imgParams.nx, m_imgParams.ny,
+      (float*)m_reconData.background.getPtr(),
+      sectionBackgroundExtra(zsec, iw, it),
+      (float*)m_reconData.slope.getPtr(),
+      m_imgParams.inscale, m_myParams.bUsecorr);
+}
+
+void SIM_Reconstructor::prefetch(int timeIdx, int waveIdx)
+{
+  // the time point after the last one of a stream is read to find out
+  // whether there is one
+  int ntimes = m_imgParams.ntimes;
+  if (m_myParams.bStreamInput) {
+    ntimes = m_streamEnded ? 0 : ntimes + 1;
+  }
+  if (!m_myParams.bPrefetch || timeIdx >= ntimes) {
+    return;
+  }
+  joinPrefetch();
+  reserveStaging();
+  m_prefetchTime = timeIdx;
+  m_prefetchWave = waveIdx;
+  m_prefetchError.clear();
+  m_prefetchThread = new boost::thread(&SIM_Reconstructor::runPrefetch,
+      this, timeIdx, waveIdx);
+}
+
+void SIM_Reconstructor::reserveStaging()
+{
+  const size_t nsections = m_myParams.ndirs * m_myParams.nphases *
+    m_imgParams.nz;
+  size_t nbytes;
+  if (rawIsU16()) {
+    nbytes = sizeof(unsigned short) * nsections * m_imgParams.nx *
+      m_imgParams.ny;
+    m_stagingBgExtra.resize(nsections);
+  } else {
+    nbytes = sizeof(float) * nsections * (m_imgParams.nx + 2) *
+      m_imgParams.ny;
+  }
+  if (m_staging.getSize() != nbytes) {
+    m_staging.resize(nbytes);
+    if (m_batch.isOpen() && batchReadsInPlace()) {
+      m_batch.registerBuffer(m_staging.getPtr(), nbytes);
+    }
+  }
+}
+
+void SIM_Reconstructor::releaseStaging()
+{
+  // transfers from a pinned buffer are asynchronous, on the default stream
+  if (m_myParams.backend != BACKEND_CPU &&
+      cudaStreamSynchronize(0) != cudaSuccess) {
+    throw std::runtime_error("Upload of the staged raw data failed");
+  }
+}
+
+void SIM_Reconstructor::runPrefetch(int it, int iw)
+{
+  try {
+    loadIntoStaging(it, iw);
+  }
+  catch (std::exception &e) {
+    m_prefetchError = e.what();
+  }
+}
+
+void SIM_Reconstructor::loadIntoStaging(int it, int iw)
+{
+  // Same task split as loadImageData().  Raw uint16 sections are copied
+  // as they are, in task order, with their background offsets in
+  // m_stagingBgExtra; anything else is flat-fielded straight into its
+  // place in m_staging, where slot (direction, phase) holds nz sections
+  const int nz = m_imgParams.nz;
+  const int nphases = m_myParams.nphases;
+  const int ntasks = m_myParams.ndirs * nz * nphases;
+  const bool u16 = rawIsU16();
+  const size_t sectionPixels = m_imgParams.nx * m_imgParams.ny;
+  const size_t sectionFloats = (m_imgParams.nx + 2) * m_imgParams.ny;
+  std::string errorMsg;
+
+  if (m_myParams.bStreamInput) {
+    m_streamEnded = !readStreamedTimePoint();
+    return;
+  }
+  if (m_batch.isOpen()) {
+    batchLoadIntoStaging(it, iw);
+    return;
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int task = 0; task < ntasks; ++task) {
+    int direction = task / (nz * nphases);
+    int z = (task / nphases) % nz;
+    int phase = task % nphases;
+    try {
+      if (u16) {
+        int zsec = rawSectionIndex(m_myParams, m_imgParams, direction, z, phase);
+        copyRawU16(roiOrigin(m_reader.section(zsec, iw, rawTime(it))),
+            (unsigned short*)m_staging.getPtr() + task * sectionPixels);
+        m_stagingBgExtra[task] = sectionBackgroundExtra(zsec, iw, it);
+      } else {
+        size_t slot = direction * nphases + phase;
+        loadSection(it, iw, direction, z, phase,
+            (float*)m_staging.getPtr() + (slot * nz + z) * sectionFloats);
+      }
+    }
+    catch (std::exception &e) {
+#pragma omp critical
+      errorMsg = e.what();
+    }
+  }
+
+  if (!errorMsg.empty()) {
+    throw std::runtime_error(errorMsg);
+  }
+}
+
+void SIM_Reconstructor::batchLoadIntoStaging(int it, int iw)
+{
+  // All sections of the time point are asked for at once, each only
+  // for the rows of the grid.  uint16 sections of full rows are read
+  // straight into their place in m_staging; anything else is read into
+  // the reader's own buffer and cut out or flat-fielded from there as
+  // soon as its read is done
+  const int nz = m_imgParams.nz;
+  const int nphases = m_myParams.nphases;
+  const int ntasks = m_myParams.ndirs * nz * nphases;
+  const size_t rowBytes = m_reader.sectionBytes() / m_imgParams.rawNy;
+  const size_t bandBytes = rowBytes * m_imgParams.ny;
+  char* dest = batchReadsInPlace() ? (char*)m_staging.getPtr() :
+    (char*)m_batch.buffer(ntasks * bandBytes);
+
+  std::vector<BatchReader::Request> requests(ntasks);
+  for (int task = 0; task < ntasks; ++task) {
+    int direction = task / (nz * nphases);
+    int z = (task / nphases) % nz;
+    int phase = task % nphases;
+    int zsec = rawSectionIndex(m_myParams, m_imgParams, direction, z, phase);
+    requests[task].offset = m_reader.sectionOffset(zsec, iw, rawTime(it)) +
+      m_imgParams.y0 * rowBytes;
+    requests[task].nbytes = bandBytes;
+    requests[task].dest = dest + task * bandBytes;
+  }
+  m_batch.read(requests,
+      boost::bind(&SIM_Reconstructor::stageBatchedSection, this, it, iw,
+        (const char*)dest, boost::placeholders::_1));
+}
+
+void SIM_Reconstructor::stageBatchedSection(int it, int iw, const char* raw,
+    int task)
+{
+  const int nz = m_imgParams.nz;
+  const int nphases = m_myParams.nphases;
+  int direction = task / (nz * nphases);
+  int z = (task / nphases) % nz;
+  int phase = task % nphases;
+  int zsec = rawSectionIndex(m_myParams, m_imgParams, direction, z, phase);
+  const size_t rowBytes = m_reader.sectionBytes() / m_imgParams.rawNy;
+  const char* origin = raw + task * rowBytes * m_imgParams.ny +
+    m_imgParams.x0 * (rowBytes / m_imgParams.rawNx);
+  if (rawIsU16()) {
+    if (!batchReadsInPlace()) {
+      copyRawU16(origin, (unsigned short*)m_staging.getPtr() +
+          task * m_imgParams.nx * m_imgParams.ny);
+    }
+    m_stagingBgExtra[task] = sectionBackgroundExtra(zsec, iw, it);
+    return;
+  }
+  size_t slot = direction * nphases + phase;
+  load_and_flatfield(m_reader, origin,
+      (float*)m_staging.getPtr() +
+        (slot * nz + z) * (m_imgParams.nx + 2) * m_imgParams.ny,
+      m_imgParams.nx, m_imgParams.ny,
+      (float*)m_reconData.background.getPtr(),
+      sectionBackgroundExtra(zsec, iw, it),
+      (float*)m_reconData.slope.getPtr(),
+      m_imgParams.inscale, m_myParams.bUsecorr);
+}
+
+int SIM_Reconstructor::rawTime(int it) const
+{
+  return m_imgParams.t0 + it * m_imgParams.tstep;
+}
+
+bool SIM_Reconstructor::batchReadsInPlace() const
+{
+  return rawIsU16() && m_imgParams.nx == m_imgParams.rawNx;
+}
+
+const char* SIM_Reconstructor::roiOrigin(const void* section) const
+{
+  const size_t rowBytes = m_reader.sectionBytes() / m_imgParams.rawNy;
+  return (const char*)section + m_imgParams.y0 * rowBytes +
+    m_imgParams.x0 * (rowBytes / m_imgParams.rawNx);
+}
+
+void SIM_Reconstructor::copyRawU16(const char* origin,
+    unsigned short* dest) const
+{
+  const size_t rowBytes = m_imgParams.nx * sizeof(unsigned short);
+  if (m_imgParams.nx == m_imgParams.rawNx) {
+    memcpy(dest, origin, rowBytes * m_imgParams.ny);
+    return;
+  }
+  for (int l = 0; l < m_imgParams.ny; ++l) {
+    memcpy(dest + l * m_imgParams.nx,
+        origin + l * m_imgParams.rawNx * sizeof(unsigned short), rowBytes);
+  }
+}
+
+bool SIM_Reconstructor::readStreamedTimePoint()
+{
+  // Frames arrive in file order (see rawSectionIndex()); each is read
+  // straight into its task's place in m_staging
+  const int nz = m_imgParams.nz;
+  const int ndirs = m_myParams.ndirs;
+  const int nphases = m_myParams.nphases;
+  const int nframes = ndirs * nz * nphases;
+  const size_t sectionPixels = m_imgParams.nx * m_imgParams.ny;
+
+  for (int frame = 0; frame < nframes; ++frame) {
+    int direction, z;
+    int phase = frame % nphases;
+    if (m_myParams.bFastSIM) {
+      z = frame / (ndirs * nphases);
+      direction = (frame / nphases) % ndirs;
+    } else {
+      direction = frame / (nz * nphases);
+      z = (frame / nphases) % nz;
+    }
+    int task = (direction * nz + z) * nphases + phase;
+    if (!m_stream.readFrame((unsigned short*)m_staging.getPtr() +
+          task * sectionPixels)) {
+      if (frame == 0) {
+        return false;
+      }
+      throw std::runtime_error("Input stream ended in the middle of a time point");
+    }
+    m_stagingBgExtra[task] = m_reconData.backgroundExtra;
+  }
+  return true;
+}
+
+void SIM_Reconstructor::uploadRawU16(int zoffset)
+{
+  // One transfer of half the size of the float data, then the
+  // flat-fielding and padding are done where the data will be used
+  const int nz = m_imgParams.nz;
+  const int nphases = m_myParams.nphases;
+  const int ntasks = m_myParams.ndirs * nz * nphases;
+  const size_t sectionPixels = m_imgParams.nx * m_imgParams.ny;
+  const size_t nbytes = ntasks * sectionPixels * sizeof(unsigned short);
+
+  if (m_reconData.rawU16.getSize() != nbytes) {
+    m_reconData.rawU16.resize(nbytes);
+  }
+  m_staging.set(&m_reconData.rawU16, 0, nbytes, 0);
+  releaseStaging();
+  flatfieldRawU16(zoffset, false);
+}
+
+void SIM_Reconstructor::uploadShmSlot(int zoffset)
+{
+  // The slot goes to the device as the producer wrote it, in file order,
+  // without passing through m_staging
+  if (!m_shmSlot) {
+    throw std::runtime_error("No time point waiting in the input ring");
+  }
+  const size_t nbytes = m_shmIn->slotBytes();
+  if (m_reconData.rawU16.getSize() != nbytes) {
+    m_reconData.rawU16.resize(nbytes);
+  }
+  m_reconData.rawU16.setFrom(m_shmSlot, 0, nbytes, 0);
+  m_shmSlot = 0;
+  m_shmIn->endRead();
+  flatfieldRawU16(zoffset, true);
+}
+
+void SIM_Reconstructor::flatfieldRawU16(int zoffset, bool fileOrder)
+{
+  const int nz = m_imgParams.nz;
+  const int nphases = m_myParams.nphases;
+  const int ntasks = m_myParams.ndirs * nz * nphases;
+  const size_t sectionPixels = m_imgParams.nx * m_imgParams.ny;
+
+  const GPUBuffer* slope = m_myParams.bUsecorr ? &m_reconData.slopeGPU : 0;
+  const Stages& stages = stagesFor(m_myParams.backend);
+  for (int task = 0; task < ntasks; ++task) {
+    int direction = task / (nz * nphases);
+    int z = (task / nphases) % nz;
+    int phase = task % nphases;
+    int offset = (z + zoffset) * (m_imgParams.nx + 2) * m_imgParams.ny;
+    size_t section = task;
+    float bgExtra;
+    if (fileOrder) {
+      section = rawSectionIndex(m_myParams, m_imgParams, direction, z, phase);
+      bgExtra = m_reconData.backgroundExtra;
+    } else {
+      bgExtra = m_stagingBgExtra[task];
+    }
+    stages.flatfield_u16(m_reconData.rawU16, section * sectionPixels,
+        m_imgParams.nx, m_imgParams.ny, m_reconData.backgroundGPU,
+        bgExtra, slope, m_imgParams.inscale,
+        &(m_reconData.savedBands[direction][phase]), offset);
+  }
+}
 
-        ++zsec;
-      } // end for (phase)
-    } // end for (z)
-  } // end for (direction)
+void SIM_Reconstructor::joinPrefetch()
+{
+  if (m_prefetchThread) {
+    m_prefetchThread->join();
+    delete m_prefetchThread;
+    m_prefetchThread = 0;
+  }
+}
+
+bool SIM_Reconstructor::takePrefetched(int it, int iw)
+{
+  if (m_prefetchTime < 0) {
+    return false;
+  }
+  joinPrefetch();
+  bool hit = (m_prefetchTime == it && m_prefetchWave == iw);
+  m_prefetchTime = -1;
+  if (hit && !m_prefetchError.empty()) {
+    throw std::runtime_error(m_prefetchError);
+  }
+  return hit;
 }
+#endif
 
 void apodizationDriver(int zoffset, ReconParams* params,
     const ImageParams& imgParams, DriftParams* driftParams, ReconData* data)
 {
+  const Stages& stages = stagesFor(params->backend);
   for (int direction = 0; direction < params->ndirs; ++direction) {
     /* data assumed taken with z changing fast, direction changing
      * slowly */
@@ -888,11 +1572,11 @@ void apodizationDriver(int zoffset, ReconParams* params,
       for (int phase = 0; phase < params->nphases; ++phase) {
         if (params->napodize >= 0) {
           // Goes through here
-          apodize(params->napodize, imgParams.nx, imgParams.ny,
+          stages.apodize(params->napodize, imgParams.nx, imgParams.ny,
               &(rawImages->at(phase)),
               (z + zoffset) * (imgParams.nx + 2) * imgParams.ny);
         } else if (params->napodize == -1) {
-          cosapodize(imgParams.nx, imgParams.ny, &(*rawImages)[phase],
+          stages.cosapodize(imgParams.nx, imgParams.ny, &(*rawImages)[phase],
               (z + zoffset) * imgParams.nx * imgParams.ny);
         }
       } /* end for (phase), loading, flatfielding, and apodizing raw images */
@@ -903,6 +1587,7 @@ void apodizationDriver(int zoffset, ReconParams* params,
 void rescaleDriver(int it, int iw, int zoffset, ReconParams* params,
     const ImageParams& imgParams, DriftParams* driftParams, ReconData* data)
 {
+  const Stages& stages = stagesFor(params->backend);
   for (int direction = 0; direction < params->ndirs; ++direction) {
     /* data assumed taken with z changing fast, direction changing
      * slowly */
@@ -912,7 +1597,7 @@ void rescaleDriver(int it, int iw, int zoffset, ReconParams* params,
     for (int z = 0; z < imgParams.nz; ++z) {
       if (params->do_rescale) {
         // Goes through here
-        rescale(imgParams.nx, imgParams.ny, imgParams.nz, z, zoffset,
+        stages.rescale(imgParams.nx, imgParams.ny, imgParams.nz, z, zoffset,
             direction, iw, it, params->nphases, rawImages, params->equalizez,
             params->equalizet, &data->sum_dir0_phase0[0]);
       }
@@ -923,7 +1608,16 @@ void rescaleDriver(int it, int iw, int zoffset, ReconParams* params,
 void transformXYSlice(int zoffset, ReconParams* params,
     const ImageParams& imgParams, DriftParams* driftParams, ReconData* data)
 {
-  cufftHandle rfftplanGPU;
+  if (params->backend == BACKEND_CPU) {
+    for (int direction = 0; direction < params->ndirs; ++direction) {
+      for (int phase = 0; phase < params->nphases; ++phase) {
+        cpu::fftXYSlices((float*)data->savedBands[direction][phase].getPtr(),
+            imgParams.nx, imgParams.ny, imgParams.nz);
+      }
+    }
+    return;
+  }
+
   int fftN[2] = {imgParams.ny, imgParams.nx};
   int inembed[2] = {imgParams.nx * imgParams.ny, imgParams.nx + 2};
   int istride = 1;
@@ -931,18 +1625,14 @@ void transformXYSlice(int zoffset, ReconParams* params,
   int onembed[2] = {imgParams.nx * imgParams.ny, imgParams.nx /2 +1};
   int ostride = 1;
   int odist = (imgParams.nx / 2 + 1) * imgParams.ny;
-  cufftResult cuFFTErr = cufftPlanMany(&rfftplanGPU, 2, &fftN[0],
+  cufftHandle rfftplanGPU = fftplan::cuPlanMany(2, &fftN[0],
       inembed, istride, idist,
       onembed, istride, odist,
       CUFFT_R2C, imgParams.nz);
-  if (cuFFTErr != CUFFT_SUCCESS) {
-    std::cout << "Error code: " << cuFFTErr << std::endl;
-    throw std::runtime_error("cufftPlanMany() failed.");
-  }
 
   for (int direction = 0; direction < params->ndirs; ++direction) {
     for (int phase = 0; phase < params->nphases; ++phase) {
-      cuFFTErr = cufftExecR2C(rfftplanGPU,
+      cufftResult cuFFTErr = cufftExecR2C(rfftplanGPU,
           (float*)data->savedBands[direction][phase].getPtr(),
           (cuFloatComplex*)data->savedBands[direction][phase].getPtr());
       if (cuFFTErr != CUFFT_SUCCESS) {
@@ -951,12 +1641,6 @@ void transformXYSlice(int zoffset, ReconParams* params,
       }
     }
   }
-
-  cufftDestroy(rfftplanGPU);
-  if (cuFFTErr != CUFFT_SUCCESS) {
-    std::cout << "Error code: " << cuFFTErr << std::endl;
-    throw std::runtime_error("cufftDestroy() failed.");
-  }
 }
 
 /***************************** makematrix ************************************/
@@ -1110,39 +1794,26 @@ void allocSepMatrixAndNoiseVarFactors(const ReconParams& params, ReconData* reco
 }
 
 #ifdef __SIRECON_USE_TIFF__
-void load_and_flatfield(CImg<> &cimg, int section_no, float *bufDestiny,
+void load_and_flatfield(const TIFFReader& reader, int section_no,
+                        float *rawSection, float *bufDestiny,
                         float background, float inscale)
 {
-  float *buffer = cimg.data(0, 0, section_no);
-  int nx = cimg.width();
-  int ny = cimg.height();
-#pragma omp parallel for
-  for (int l=0; l<ny; l++) {
-    for (int k=0; k<nx; k++) {
-      bufDestiny[l*(nx+2) + k] = (buffer[l*nx + k] - background) * inscale;
-    }
-    for(int k=nx;k<nx+2;k++)
-      bufDestiny[l*(nx+2) + k] = 0.0;
-  }
+  // only this one page is decoded, into rawSection (nx*ny floats)
+  reader.readSection(section_no, rawSection);
+  ingest::flatfield(rawSection, bufDestiny, reader.nx(), reader.ny(), 0,
+                    background, 0, inscale);
 }
 #else
-void load_and_flatfield(int section_no, int wave_no, int time_no,
-    float *bufDestiny, float *buffer, int nx, int ny, float *background,
-    float backgroundExtra, float *slope, float inscale, int bUsecorr)
-  /*
-     Load the next 2D section from the MRC file identified by "istream_no".
-     "bufDestiny" is where the current loaded section ends up being; it's assumed to have 2 extra columns for in-place FFT later
-     "buffer" is a nx*ny sized array to hold temporarily the loaded data before it is flat-fielded and copied to "bufDestiny"
-     */
+template <typename T>
+static void flatfield(const MRCReader& reader, const T* buffer,
+    float *bufDestiny, int nx, int ny, const float *background,
+    float backgroundExtra, const float *slope, float inscale, int bUsecorr)
 {
-  IMPosnZWT(istream_no, section_no, wave_no, time_no);
-  IMRdSec(istream_no, buffer);
-
   if (bUsecorr) {
 #pragma omp parallel for
     for (int l=0; l<ny; l++) {
       for (int k=0; k<nx; k++) {
-        bufDestiny[l*(nx+2) + k] = ((buffer[l*nx + k]-background[l*nx+k]-backgroundExtra) * slope[l*nx+k]) * inscale;
+        bufDestiny[l*(nx+2) + k] = ((reader.pixel(buffer, l*nx + k)-background[l*nx+k]-backgroundExtra) * slope[l*nx+k]) * inscale;
       }
       for(int k=nx;k<nx+2;k++)
         bufDestiny[l*(nx+2) + k] = 0.0;
@@ -1151,13 +1822,76 @@ void load_and_flatfield(int section_no, int wave_no, int time_no,
 #pragma omp parallel for
     for (int l=0; l<ny; l++) {
       for (int k=0; k<nx; k++) {
-        bufDestiny[l*(nx+2) + k] = (buffer[l*nx + k]-background[l*nx+k]-backgroundExtra) * inscale;
+        bufDestiny[l*(nx+2) + k] = (reader.pixel(buffer, l*nx + k)-background[l*nx+k]-backgroundExtra) * inscale;
       }
       for(int k=nx;k<nx+2;k++)
         bufDestiny[l*(nx+2) + k] = 0.0;
     }
   }
 }
+
+void load_and_flatfield(const MRCReader& reader, int section_no,
+    int wave_no, int time_no, float *bufDestiny, int nx, int ny,
+    const float *background, float backgroundExtra, const float *slope,
+    float inscale, int bUsecorr)
+  /*
+     Load a 2D section of the raw data file mapped by "reader" and flat-field it.
+     "bufDestiny" is where the current loaded section ends up being; it's assumed to have 2 extra columns for in-place FFT later
+     The section is read in its stored pixel type straight from the mapped file; no intermediate copy is made
+     */
+{
+  load_and_flatfield(reader, reader.section(section_no, wave_no, time_no),
+      bufDestiny, nx, ny, background, backgroundExtra, slope, inscale,
+      bUsecorr);
+}
+
+void load_and_flatfield(const MRCReader& reader, const void* section,
+    float *bufDestiny, int nx, int ny, const float *background,
+    float backgroundExtra, const float *slope, float inscale, int bUsecorr)
+{
+  if (nx != reader.nx()) {
+    // part of a row (see applyRoi()): the rows are reader.nx() apart
+    const size_t rowBytes = reader.sectionBytes() / reader.ny();
+    for (int l = 0; l < ny; ++l) {
+      load_and_flatfield(reader, (const char*)section + l * rowBytes,
+          bufDestiny + l * (nx + 2), nx, 1, background + l * nx,
+          backgroundExtra, slope + l * nx, inscale, bUsecorr);
+    }
+    return;
+  }
+
+  // The common cases go through the vectorized ingest kernels
+  if (!reader.byteSwapped() &&
+      (reader.mode() == MRCReader::MODE_USHORT ||
+       reader.mode() == MRCReader::MODE_FLOAT)) {
+    const float* slopeOrNull = bUsecorr ? slope : 0;
+    if (reader.mode() == MRCReader::MODE_USHORT)
+      ingest::flatfield((const unsigned short*)section, bufDestiny, nx, ny,
+          background, backgroundExtra, slopeOrNull, inscale);
+    else
+      ingest::flatfield((const float*)section, bufDestiny, nx, ny,
+          background, backgroundExtra, slopeOrNull, inscale);
+    return;
+  }
+
+  switch (reader.mode()) {
+  case MRCReader::MODE_BYTE:
+    flatfield(reader, (const unsigned char*)section, bufDestiny, nx, ny,
+        background, backgroundExtra, slope, inscale, bUsecorr);
+    break;
+  case MRCReader::MODE_SHORT:
+    flatfield(reader, (const short*)section, bufDestiny, nx, ny,
+        background, backgroundExtra, slope, inscale, bUsecorr);
+    break;
+  case MRCReader::MODE_USHORT:
+    flatfield(reader, (const unsigned short*)section, bufDestiny, nx, ny,
+        background, backgroundExtra, slope, inscale, bUsecorr);
+    break;
+  default:
+    flatfield(reader, (const float*)section, bufDestiny, nx, ny,
+        background, backgroundExtra, slope, inscale, bUsecorr);
+  }
+}
 #endif
 
 void matrix_transpose(float* mat, int nRows, int nCols)
@@ -1442,19 +2176,29 @@ SIM_Reconstructor::SIM_Reconstructor(int argc, char **argv)
 #endif
   m_argc = argc;
   m_argv = argv;
+  m_writer = 0;
+#ifdef __SIRECON_USE_TIFF__
+  m_watcher = 0;
+#else
+  m_streamEnded = false;
+  m_shmIn = 0;
+  m_shmSlot = 0;
+  m_shmOut = 0;
+  m_prefetchThread = 0;
+  m_prefetchTime = -1;
+  m_prefetchWave = 0;
+  m_chunkStore = 0;
+#endif
+  m_curWave = 0;
+  m_firstTime = 0;
 
   SetDefaultParams(&m_myParams);
   
   // define all the commandline and config file options
   setupProgramOptions();
-  po::positional_options_description p;
-  p.add("input-file", 1);
-  p.add("output-file", 1);
-  p.add("otf-file", 1);
 
   // parse the commandline
-  store(po::command_line_parser(argc, argv).
-        options(m_progopts).positional(p).run(), m_varsmap);
+  parseCommandLine();
 
   if (m_varsmap.count("help")) {
     std::cout << "cudasirecon v" + version_number + " -- Written by Lin Shao. All rights reserved.\n" << "\n";
@@ -1464,21 +2208,16 @@ SIM_Reconstructor::SIM_Reconstructor(int argc, char **argv)
 
   notify(m_varsmap);
 
-  if (m_config_file != "") {
-    std::ifstream ifs(m_config_file.c_str());
-    if (!ifs) {
-      std::cout << "can not open config file: " << m_config_file << "\n";
-      std::cout << "proceed without it\n";
-    }
-    else {
-      // parse config file
-      store(parse_config_file(ifs, m_progopts), m_varsmap);
-      notify(m_varsmap);
-    }
+#ifndef __SIRECON_USE_TIFF__
+  if (m_config_file.find("{wave}") != std::string::npos) {
+    peekWavelengths();
   }
+#endif
+  readConfigFile(0);
 
    // fill in m_myParams fields that have not been set yet
   setParams();
+  initBackend();
 
   printf("nphases=%d, ndirs=%d\n", m_myParams.nphases, m_myParams.ndirs);
   
@@ -1488,6 +2227,12 @@ SIM_Reconstructor::SIM_Reconstructor(int argc, char **argv)
   /* Suppress "unknown field" warnings */
   TIFFSetWarningHandler(NULL);
 
+  if (m_myParams.bWatch) {
+    // watching starts before the folder is listed, so a file finished in
+    // between is either in the list or reported by the watcher
+    m_watcher = new FileWatcher(m_myParams.ifiles, m_myParams.ofiles);
+  }
+
   // gather all TIFF files with matching names under the same folder:
   m_all_matching_files = gatherMatchingFiles(std::string(m_myParams.ifiles), 
                                              std::string(m_myParams.ofiles));
@@ -1495,6 +2240,20 @@ SIM_Reconstructor::SIM_Reconstructor(int argc, char **argv)
   // and m_myParams.ofiles refers to a pattern in all the raw data file names.
   m_imgParams.ntimes = m_all_matching_files.size();
 
+  if (m_myParams.bWatch) {
+    // Files already in the folder are processed first; the watcher only
+    // reports the others
+    for (size_t i = 0; i < m_all_matching_files.size(); ++i) {
+      m_watcher->markSeen(m_all_matching_files[i]);
+    }
+    // the first file sets everything up, so wait for one
+    if (m_all_matching_files.empty()) {
+      std::cout << "Waiting for files matching " << m_myParams.ofiles
+                << " in " << m_myParams.ifiles << '\n';
+      waitForNextTimePoint();
+    }
+  }
+
 #else
   /* Suppress IVE display of file headers */
   IMAlPrt(0);
@@ -1506,18 +2265,51 @@ SIM_Reconstructor::SIM_Reconstructor(int argc, char **argv)
   m_zoffset = 0;
 #ifndef __SIRECON_USE_TIFF__
   setup();
-  ::setOutputHeader(m_myParams, m_imgParams, m_in_out_header);
+  if (m_myParams.bChunkedOutput) {
+    createChunkStore();
+  }
+  else {
+    ::setOutputHeader(m_myParams, m_imgParams, m_in_out_header);
+  }
 
   if (m_myParams.nzPadTo) {
     m_zoffset = (m_imgParams.nz0 - m_imgParams.nz) / 2;
   }
 
   bgAndSlope(m_myParams, m_imgParams, &m_reconData);
+
+  if (m_myParams.bResume) {
+    openJournal();
+  }
+  if (m_myParams.shmOutput[0]) {
+    createShmOutput();
+  }
+  if (liveInput()) {
+    // the first time point is there once its last frame is
+    waitForNextTimePoint();
+  }
 #endif
 }
 
 SIM_Reconstructor::~SIM_Reconstructor()
 {
+#ifndef __SIRECON_USE_TIFF__
+  joinPrefetch();
+#endif
+  delete m_writer;
+#ifdef __SIRECON_USE_TIFF__
+  delete m_watcher;
+#else
+  delete m_chunkStore;
+  if (m_shmIn && m_myParams.backend != BACKEND_CPU) {
+    cudaHostUnregister(m_shmIn->data());
+    cudaGetLastError();  // it may never have been registered
+  }
+  delete m_shmIn;
+  delete m_shmOut;
+#endif
+  // FFT plans are cached for the life of the reconstructor
+  fftplan::clear();
 }
 
 int SIM_Reconstructor::setupProgramOptions()
@@ -1530,6 +2322,8 @@ int SIM_Reconstructor::setupProgramOptions()
     ("output-file", po::value<std::string>()->required(), "output file (or filename pattern in TIFF mode)")
     ("otf-file", po::value<std::string>()->required(), "OTF file")
     ("usecorr", po::value<std::string>(), "use the flat-field correction file provided")
+    ("corrcache", po::value<std::string>()->default_value("auto"),
+     "directory where parsed correction files are cached for later runs; 'auto' means the FFTW wisdom directory default, 'none' turns caching off")
     ("ndirs", po::value<int>(&m_myParams.ndirs)->default_value(3),
      "number of directions")
     ("nphases", po::value<int>(&m_myParams.nphases)->default_value(5),
@@ -1591,6 +2385,54 @@ int SIM_Reconstructor::setupProgramOptions()
     ("2lenses", po::value<int>(&m_myParams.bTwolens)->implicit_value(true), "I5S data")
     ("writeTitle", po::value<int>(&m_myParams.bWriteTitle)->implicit_value(true),
      "Write command line to image header (may cause issues with bioformats)")
+    ("backend", po::value<std::string>()->default_value("cuda"),
+     "where to run the reconstruction: cuda or cpu")
+    ("nthreads", po::value<int>(&m_myParams.nthreads)->default_value(0),
+     "number of threads used by the cpu backend; 0 means all cores")
+    ("fftwisdom", po::value<std::string>()->default_value("auto"),
+     "directory of the FFTW wisdom store used by the cpu backend to keep tuned FFT plans across runs; 'auto' means ~/.cudasirecon, 'none' turns tuning off")
+    ("prefetch", po::value<int>(&m_myParams.bPrefetch)->implicit_value(true),
+     "read the next time point while the current one is being reconstructed (needs host memory for one more raw time point; not in TIFF mode)")
+    ("writequeue", po::value<int>(&m_myParams.writeQueue)->default_value(2),
+     "number of output volumes that may wait to be written to disk while reconstruction goes on; 0 writes synchronously")
+    ("mip", po::value<int>(&m_myParams.bMip)->implicit_value(true),
+     "also write an XY and an XZ maximum-intensity projection and an 8-bit PGM preview of every output volume, next to the output")
+    ("thumbsize", po::value<int>(&m_myParams.thumbSize)->default_value(256),
+     "longest side of the --mip preview, in pixels")
+#ifndef __SIRECON_USE_TIFF__
+    ("outputmode", po::value<std::string>()->default_value("float"),
+     "pixel type of the output file: float, half (MRC mode 12) or uint16 (scaled; see --u16scale)")
+    ("u16scale", po::value<std::string>()->default_value("time"),
+     "how --outputmode uint16 is scaled: 'time' maps each time point's own range onto 0..65535, 'global' uses time point 0's range for all (values outside it are clipped); the scale and offset of each section go into the extended header")
+    ("outputformat", po::value<std::string>()->default_value("mrc"),
+     "mrc, or zarr for a directory of compressed (t, c, z, y, x) chunks written in parallel; output-file then names the directory")
+    ("chunksize", po::value<std::string>()->default_value("16,256,256"),
+     "z,y,x size of the chunks of --outputformat zarr")
+    ("chunklevel", po::value<int>(&m_myParams.chunkLevel)->default_value(1),
+     "zlib compression level (1-9) of --outputformat zarr; 0 stores chunks uncompressed")
+    ("stream", po::value<int>(&m_myParams.bStreamInput)->implicit_value(true),
+     "input-file is a FIFO, or - for stdin, delivering a header and raw uint16 frames; each time point is reconstructed as soon as its frames have arrived")
+    ("shm", po::value<int>(&m_myParams.bShmInput)->implicit_value(true),
+     "input-file names a POSIX shared-memory ring of raw uint16 time points (see shmRingTool); each is reconstructed straight from its slot")
+    ("shmout", po::value<std::string>(),
+     "also publish every output volume to the shared-memory ring of this name, for a viewer; volumes are skipped while it is full")
+    ("shmslots", po::value<int>(&m_myParams.shmSlots)->default_value(4),
+     "number of volumes the --shmout ring holds")
+    ("roi", po::value<std::string>(),
+     "x0,y0,width,height: reconstruct only this region of the raw sections (in raw pixels), on a grid with an apodization margin around it, and write only the region")
+    ("zrange", po::value<std::string>(),
+     "first,last: reconstruct only these raw z sections (counting from 0), plus a margin of a few sections, and write only them")
+    ("tstart", po::value<int>(&m_myParams.tstart)->default_value(0),
+     "first raw time point to reconstruct, counting from 0")
+    ("tend", po::value<int>(&m_myParams.tend)->default_value(-1),
+     "last raw time point to reconstruct; -1 means the last in the file")
+    ("tstep", po::value<int>(&m_myParams.tstep)->default_value(1),
+     "reconstruct every tstep-th raw time point from --tstart on; the output file holds only these")
+    ("resume", po::value<int>(&m_myParams.bResume)->implicit_value(true),
+     "record every finished time point in output-file.journal; if that journal is there already, continue the run it belongs to from the first time point it does not have")
+    ("iouring", po::value<int>(&m_myParams.bIoUring)->implicit_value(true),
+     "read each time point as one batch of section reads, through io_uring on Linux (pread elsewhere), and flat-field sections as their reads complete; for datasets on fast NVMe drives")
+#endif
     ("help,h", "produce help message")
 #ifdef __SIRECON_USE_TIFF__
     ("xyres", po::value<float>(&m_imgParams.dy)->default_value(0.1),
@@ -1599,12 +2441,61 @@ int SIM_Reconstructor::setupProgramOptions()
      "z pixel size (only used for TIFF files)")
     ("wavelength", po::value<short>(&m_imgParams.wave[0])->default_value(530),
      "emission wavelength (only used for TIFF files)")
+    ("tifflevel", po::value<int>(&m_myParams.tiffLevel)->default_value(1),
+     "deflate level (1-9) of the output TIFF files, which are written tiled and compressed in parallel; 0 writes them uncompressed")
+    ("watch", po::value<int>(&m_myParams.bWatch)->implicit_value(true),
+     "after the files already in the data folder, keep reconstructing new matching files as soon as they are finished")
+    ("watchidle", po::value<int>(&m_myParams.watchIdle)->default_value(0),
+     "with --watch, stop after this many seconds without a new file; 0 waits until interrupted")
 #endif
     ;
 
   return 0;
 }
 
+void SIM_Reconstructor::parseCommandLine()
+{
+  po::positional_options_description p;
+  p.add("input-file", 1);
+  p.add("output-file", 1);
+  p.add("otf-file", 1);
+
+  store(po::command_line_parser(m_argc, m_argv).
+        options(m_progopts).positional(p).run(), m_varsmap);
+}
+
+void SIM_Reconstructor::readConfigFile(int iw)
+{
+  if (m_config_file == "") {
+    return;
+  }
+  std::string configFile = waveFileName(m_config_file, iw);
+  std::ifstream ifs(configFile.c_str());
+  if (!ifs) {
+    std::cout << "can not open config file: " << configFile << "\n";
+    std::cout << "proceed without it\n";
+  }
+  else {
+    // parse config file
+    store(parse_config_file(ifs, m_progopts), m_varsmap);
+    notify(m_varsmap);
+  }
+}
+
+std::string SIM_Reconstructor::waveFileName(const std::string& name,
+    int iw) const
+{
+  const std::string placeholder = "{wave}";
+  std::ostringstream wave;
+  wave << m_imgParams.wave[iw];
+  std::string result = name;
+  size_t pos;
+  while ((pos = result.find(placeholder)) != std::string::npos) {
+    result.replace(pos, placeholder.size(), wave.str());
+  }
+  return result;
+}
+
 int SIM_Reconstructor::setParams()
 {
   // "input-file", "output-file", and "otf-file" are now all required arguments.
@@ -1626,6 +2517,13 @@ int SIM_Reconstructor::setParams()
 
   if (m_varsmap.count("usecorr")) {
     strcpy(m_myParams.corrfiles, m_varsmap["usecorr"].as<std::string>().c_str());
+    std::string corrCacheDir = m_varsmap["corrcache"].as<std::string>();
+    if (corrCacheDir == "auto") {
+      corrCacheDir = fftplan::defaultWisdomDir();
+    }
+    if (corrCacheDir != "none") {
+      strcpy(m_myParams.corrCacheDir, corrCacheDir.c_str());
+    }
     m_myParams.bUsecorr = 1;
   }
 
@@ -1669,32 +2567,294 @@ int SIM_Reconstructor::setParams()
 //    std::cout << m_myParams.k0angles << std::endl;
   }
 
+  if (m_varsmap.count("backend")) {
+    std::string backend = m_varsmap["backend"].as<std::string>();
+    if (backend == "cuda") {
+      m_myParams.backend = BACKEND_CUDA;
+    }
+    else if (backend == "cpu") {
+      m_myParams.backend = BACKEND_CPU;
+    }
+    else {
+      throw std::runtime_error("Unknown backend \"" + backend +
+          "\"; must be cuda or cpu");
+    }
+  }
+
+#ifndef __SIRECON_USE_TIFF__
+  if (m_varsmap.count("outputmode")) {
+    std::string outputMode = m_varsmap["outputmode"].as<std::string>();
+    if (outputMode == "float") {
+      m_myParams.outputMode = outfmt::OUTPUT_FLOAT;
+    }
+    else if (outputMode == "half") {
+      m_myParams.outputMode = outfmt::OUTPUT_HALF;
+    }
+    else if (outputMode == "uint16") {
+      m_myParams.outputMode = outfmt::OUTPUT_UINT16;
+    }
+    else {
+      throw std::runtime_error("Unknown output mode \"" + outputMode +
+          "\"; must be float, half or uint16");
+    }
+  }
+
+  if (m_varsmap.count("u16scale")) {
+    std::string u16Scale = m_varsmap["u16scale"].as<std::string>();
+    if (u16Scale == "time") {
+      m_myParams.bU16GlobalScale = 0;
+    }
+    else if (u16Scale == "global") {
+      m_myParams.bU16GlobalScale = 1;
+    }
+    else {
+      throw std::runtime_error("Unknown uint16 scaling \"" + u16Scale +
+          "\"; must be time or global");
+    }
+  }
+
+  if (m_varsmap.count("outputformat")) {
+    std::string outputFormat = m_varsmap["outputformat"].as<std::string>();
+    if (outputFormat == "mrc") {
+      m_myParams.bChunkedOutput = 0;
+    }
+    else if (outputFormat == "zarr") {
+      m_myParams.bChunkedOutput = 1;
+    }
+    else {
+      throw std::runtime_error("Unknown output format \"" + outputFormat +
+          "\"; must be mrc or zarr");
+    }
+  }
+
+  if (m_varsmap.count("chunksize")) {
+    std::string chunkSize = m_varsmap["chunksize"].as<std::string>();
+    if (sscanf(chunkSize.c_str(), "%d,%d,%d", &m_myParams.chunkSize[0],
+          &m_myParams.chunkSize[1], &m_myParams.chunkSize[2]) != 3 ||
+        m_myParams.chunkSize[0] <= 0 || m_myParams.chunkSize[1] <= 0 ||
+        m_myParams.chunkSize[2] <= 0) {
+      throw std::runtime_error("Invalid chunk size \"" + chunkSize +
+          "\"; must be three positive numbers z,y,x");
+    }
+  }
+
+  if (m_varsmap.count("roi")) {
+    std::string roi = m_varsmap["roi"].as<std::string>();
+    if (sscanf(roi.c_str(), "%d,%d,%d,%d", &m_myParams.roi[0],
+          &m_myParams.roi[1], &m_myParams.roi[2], &m_myParams.roi[3]) != 4 ||
+        m_myParams.roi[0] < 0 || m_myParams.roi[1] < 0 ||
+        m_myParams.roi[2] <= 0 || m_myParams.roi[3] <= 0) {
+      throw std::runtime_error("Invalid region \"" + roi +
+          "\"; must be x0,y0,width,height with a positive width and height");
+    }
+  }
+  if (m_varsmap.count("zrange")) {
+    std::string zrange = m_varsmap["zrange"].as<std::string>();
+    if (sscanf(zrange.c_str(), "%d,%d", &m_myParams.zrange[0],
+          &m_myParams.zrange[1]) != 2 ||
+        m_myParams.zrange[0] < 0 || m_myParams.zrange[1] < m_myParams.zrange[0]) {
+      throw std::runtime_error("Invalid z range \"" + zrange +
+          "\"; must be first,last with 0 <= first <= last");
+    }
+  }
+
+  if (m_varsmap.count("shmout")) {
+    strcpy(m_myParams.shmOutput, m_varsmap["shmout"].as<std::string>().c_str());
+  }
+
+  if (m_myParams.bStreamInput && m_myParams.bShmInput) {
+    throw std::runtime_error("--stream and --shm cannot be used together");
+  }
+  if (m_myParams.bIoUring && liveInput()) {
+    throw std::runtime_error("--iouring only reads MRC files");
+  }
+  if ((m_myParams.roi[2] > 0 || m_myParams.zrange[0] >= 0) && liveInput()) {
+    throw std::runtime_error("--roi and --zrange only work on MRC files");
+  }
+  if (m_myParams.bResume && (liveInput() || m_myParams.bChunkedOutput)) {
+    throw std::runtime_error("--resume needs an MRC input and output file");
+  }
+  if (m_myParams.tstart < 0 || m_myParams.tstep < 1) {
+    throw std::runtime_error("--tstart must be at least 0 and --tstep at least 1");
+  }
+  if ((m_myParams.tstart > 0 || m_myParams.tend >= 0 || m_myParams.tstep > 1) &&
+      liveInput()) {
+    throw std::runtime_error("--tstart, --tend and --tstep only work on MRC files");
+  }
+  if (liveInput()) {
+    // the number of time points is not known until the input ends
+    std::string option = m_myParams.bStreamInput ? "--stream" : "--shm";
+    if (m_myParams.bChunkedOutput) {
+      throw std::runtime_error(option + " cannot be used with --outputformat zarr");
+    }
+    if (m_myParams.outputMode == outfmt::OUTPUT_UINT16) {
+      throw std::runtime_error(option + " cannot be used with --outputmode uint16");
+    }
+  }
+#endif
+
   return 0;
 }
 
+void SIM_Reconstructor::initBackend()
+{
+  if (m_myParams.backend == BACKEND_CPU) {
+    // Has to happen before any GPUBuffer is allocated
+    GPUBuffer::useHostMemory(true);
+    cpu::init(m_myParams.nthreads);
+
+    std::string wisdomDir = m_varsmap["fftwisdom"].as<std::string>();
+    if (wisdomDir == "auto") {
+      wisdomDir = fftplan::defaultWisdomDir();
+    }
+    if (wisdomDir != "none" && wisdomDir != "") {
+      fftplan::useWisdom(wisdomDir);
+    }
+  }
+}
+
+#ifndef __SIRECON_USE_TIFF__
+bool SIM_Reconstructor::waitForNextTimePoint()
+{
+  if (m_shmIn) {
+    // the slot stays the producer's until loadImageData() has uploaded it
+    m_shmSlot = m_shmIn->beginRead();
+    if (!m_shmSlot) {
+      return false;
+    }
+    if (m_imgParams.ntimes == SHRT_MAX) {
+      throw std::runtime_error("Too many time points for one run");
+    }
+    ++m_imgParams.ntimes;
+    return true;
+  }
+  if (!m_myParams.bStreamInput || m_streamEnded) {
+    return false;
+  }
+  const int it = m_imgParams.ntimes;
+  if (m_prefetchTime == it) {
+    // --prefetch is already reading it
+    joinPrefetch();
+    if (!m_prefetchError.empty()) {
+      throw std::runtime_error(m_prefetchError);
+    }
+  } else {
+    joinPrefetch();
+    reserveStaging();
+    m_prefetchError.clear();
+    loadIntoStaging(it, 0);
+    m_prefetchTime = it;
+    m_prefetchWave = 0;
+  }
+  if (m_streamEnded) {
+    m_prefetchTime = -1;
+    return false;
+  }
+  if (m_imgParams.ntimes == SHRT_MAX) {
+    throw std::runtime_error("Too many time points for one run");
+  }
+  ++m_imgParams.ntimes;
+  return true;
+}
+#else
+bool SIM_Reconstructor::waitForNextTimePoint()
+{
+  if (!m_watcher) {
+    return false;
+  }
+  std::string file;
+  if (!m_watcher->next(file, m_myParams.watchIdle)) {
+    std::cout << "No new file in " << m_myParams.watchIdle
+              << " seconds; stopping\n";
+    return false;
+  }
+  if (m_imgParams.ntimes == SHRT_MAX) {
+    throw std::runtime_error("Too many time points for one run: " + file);
+  }
+  std::cout << "New file: " << file << '\n';
+  {
+    boost::mutex::scoped_lock lock(m_filesMutex);
+    m_all_matching_files.push_back(file);
+  }
+  ++m_imgParams.ntimes;
+  return true;
+}
+#endif
+
 void SIM_Reconstructor::openFiles()
 {
 #ifdef __SIRECON_USE_TIFF__
   if (!m_all_matching_files.size()) // TIFF files are not opened till loadAndRescaleImage()
 #else
-  if (IMOpen(istream_no, m_myParams.ifiles, "ro"))
+  if (m_myParams.bStreamInput) {
+    m_stream.open(m_myParams.ifiles);
+    m_imgParams.wave[0] = m_stream.wavelength();  // for the OTF file name
+  }
+  else if (m_myParams.bShmInput) {
+    m_shmIn = new ShmRing;
+    m_shmIn->attach(m_myParams.ifiles);
+    m_imgParams.wave[0] = m_shmIn->info().wavelength;
+    // Pinning the slots lets the uploads DMA straight out of the ring;
+    // without it they still work, through the driver's bounce buffer
+    if (m_myParams.backend != BACKEND_CPU &&
+        cudaHostRegister(m_shmIn->data(),
+          m_shmIn->nslots() * m_shmIn->slotBytes(),
+          cudaHostRegisterDefault) != cudaSuccess) {
+      cudaGetLastError();
+    }
+  }
+  else if (IMOpen(istream_no, m_myParams.ifiles, "ro"))
 #endif
     throw std::runtime_error("Input file not found");
+#ifndef __SIRECON_USE_TIFF__
+  if (!liveInput()) {
+    m_reader.open(m_myParams.ifiles);
+  }
+  if (m_myParams.bIoUring) {
+    m_batch.open(m_myParams.ifiles);
+    std::cout << "Reading sections with " << m_batch.method() << '\n';
+  }
+#endif
 
   /* Create output file */
   // In TIFF mode, output files are not created until writeResult() is called
 #ifndef __SIRECON_USE_TIFF__
-  if (IMOpen(ostream_no, m_myParams.ofiles, "new")) {
+  // a chunked output store is created once the image size is known
+  bool reopen = false;
+  if (m_myParams.bResume) {
+    // a journal without its output file is left from a run that never
+    // wrote anything
+    FILE* journal = fopen(journalName().c_str(), "r");
+    FILE* output = fopen(m_myParams.ofiles, "rb");
+    reopen = journal && output;
+    if (journal) {
+      fclose(journal);
+    }
+    if (output) {
+      fclose(output);
+    }
+    if (journal && !reopen) {
+      remove(journalName().c_str());
+    }
+  }
+  if (reopen) {
+    if (IMOpen(ostream_no, m_myParams.ofiles, "old")) {
+      throw std::runtime_error("Cannot reopen " + std::string(m_myParams.ofiles) +
+          " to resume it");
+    }
+  }
+  else if (!m_myParams.bChunkedOutput &&
+      IMOpen(ostream_no, m_myParams.ofiles, "new")) {
     std::cerr << "File " << m_myParams.ofiles << " can not be created.\n";
     throw std::runtime_error("File not found");
   }
 #endif
 
 #ifdef __SIRECON_USE_TIFF__
-  if (!(otf_tiff = TIFFOpen(m_myParams.otffiles, "r")))
+  if (!(otf_tiff = TIFFOpen(waveFileName(m_myParams.otffiles, 0).c_str(), "r")))
   // m_otf_tiff.assign(m_myParams.otffiles); // will throw CImgIOException if file cannot be opened
 #else
-  if (IMOpen(otfstream_no, m_myParams.otffiles, "ro"))
+  if (IMOpen(otfstream_no, waveFileName(m_myParams.otffiles, 0).c_str(), "ro"))
 #endif
     throw std::runtime_error("OTF file not found");
 }
@@ -1704,9 +2864,10 @@ void SIM_Reconstructor::openFiles()
 void SIM_Reconstructor::processOneVolume()
 {
   // process one SIM volume (i.e., for the time point timeIdx)
+  ReconParams* params = waveParams();
 
   int zoffset = 0;
-  if (m_myParams.nzPadTo) {
+  if (params->nzPadTo) {
     zoffset = (m_imgParams.nz0 - m_imgParams.nz) / 2;
   }
 
@@ -1720,8 +2881,8 @@ void SIM_Reconstructor::processOneVolume()
       sizeof(cuFloatComplex));
   m_reconData.overlap1.setToZero();
 
-  findModulationVectorsAndPhasesForAllDirections(zoffset,
-      &m_myParams, m_imgParams, &m_driftParams, &m_reconData);
+  findModulationVectorsAndPhasesForAllDirections(zoffset, m_curWave,
+      params, m_imgParams, &m_driftParams, &m_reconData);
 
   m_reconData.overlap0.resize(0);
   m_reconData.overlap1.resize(0);
@@ -1729,52 +2890,56 @@ void SIM_Reconstructor::processOneVolume()
   // deviceMemoryUsage();
 
 #ifndef __SIRECON_USE_TIFF__
-  saveIntermediateDataForDebugging(m_myParams);
+  saveIntermediateDataForDebugging(*params);
 #endif
-  m_reconData.bigbuffer.resize((m_myParams.zoomfact * m_imgParams.nx) *
-      (m_myParams.zoomfact * m_imgParams.ny) * (m_myParams.z_zoom * m_imgParams.nz0) *
+  m_reconData.bigbuffer.resize((params->zoomfact * m_imgParams.nx) *
+      (params->zoomfact * m_imgParams.ny) * (params->z_zoom * m_imgParams.nz0) *
       sizeof(cuFloatComplex));
   m_reconData.bigbuffer.setToZero();
-  m_reconData.outbuffer.resize((m_myParams.zoomfact * m_imgParams.nx) *
-      (m_myParams.zoomfact * m_imgParams.ny) * (m_myParams.z_zoom * m_imgParams.nz0) *
+  m_reconData.outbuffer.resize((params->zoomfact * m_imgParams.nx) *
+      (params->zoomfact * m_imgParams.ny) * (params->z_zoom * m_imgParams.nz0) *
       sizeof(float));
   m_reconData.outbuffer.setToZero();
 
   // deviceMemoryUsage();
 
-  for (int direction = 0; direction < m_myParams.ndirs; ++direction) {
+  const Stages& stages = stagesFor(params->backend);
+  for (int direction = 0; direction < params->ndirs; ++direction) {
 
     // dir_ is used in upcoming calls involving otf, to differentiate the cases
     // of common OTF and dir-specific OTF
     int dir_=0;
-    if (m_myParams.bOneOTFperAngle)
+    if (params->bOneOTFperAngle)
       dir_ = direction;
 
-    filterbands(direction, &m_reconData.savedBands[direction],
-        m_reconData.k0, m_myParams.ndirs, m_myParams.norders,
+    stages.filterbands(direction, &m_reconData.savedBands[direction],
+        m_reconData.k0, params->ndirs, params->norders,
         m_reconData.otf[dir_], m_imgParams.dy, m_imgParams.dz,
         m_reconData.amp, m_reconData.noiseVarFactors,
-        m_imgParams.nx, m_imgParams.ny, m_imgParams.nz0, m_imgParams.wave[0],
-        &m_myParams);
-    assemblerealspacebands(direction, &m_reconData.outbuffer,
+        m_imgParams.nx, m_imgParams.ny, m_imgParams.nz0, m_imgParams.wave[m_curWave],
+        params);
+    stages.assemblerealspacebands(direction, &m_reconData.outbuffer,
         &m_reconData.bigbuffer, &m_reconData.savedBands[direction],
-        m_myParams.ndirs, m_myParams.norders, m_reconData.k0,
+        params->ndirs, params->norders, m_reconData.k0,
         m_imgParams.nx, m_imgParams.ny, m_imgParams.nz0,
-        m_myParams.zoomfact, m_myParams.z_zoom, m_myParams.explodefact);
+        params->zoomfact, params->z_zoom, params->explodefact);
   }
 }
 
 #ifdef __SIRECON_USE_TIFF__
-void SIM_Reconstructor::setup(CImg<> &inTIFF)
+void SIM_Reconstructor::setup(const TIFFReader& inTIFF)
 {
-  m_imgParams.nx = inTIFF.width();
-  m_imgParams.ny = inTIFF.height();
-  m_imgParams.nz = inTIFF.depth();
-  m_imgParams.nwaves = inTIFF.spectrum();
-  m_imgParams.nz /= m_imgParams.nwaves * params->nphases * params->ndirs;
+  m_imgParams.nx = inTIFF.nx();
+  m_imgParams.ny = inTIFF.ny();
+  m_imgParams.nz = inTIFF.nsections();
+  m_imgParams.nwaves = inTIFF.nchannels();
+  m_imgParams.nz /= m_imgParams.nwaves * m_myParams.nphases * m_myParams.ndirs;
+  applyRoi(m_myParams, &m_imgParams);
+  m_imgParams.t0 = 0;  // the time points are the input files
+  m_imgParams.tstep = 1;
   //  dy, dz, wavelength[0] from command line input or config file
-  if (params->nzPadTo) {
-    m_imgParams.nz0 = params->nzPadTo;
+  if (m_myParams.nzPadTo) {
+    m_imgParams.nz0 = m_myParams.nzPadTo;
   } else {
     m_imgParams.nz0 = m_imgParams.nz;
   }
@@ -1789,43 +2954,399 @@ void SIM_Reconstructor::setup(CImg<> &inTIFF)
 #else
 void SIM_Reconstructor::setup()
 {
-  ::loadHeader(m_myParams, &m_imgParams, m_in_out_header);
+  if (m_myParams.bStreamInput) {
+    liveHeader(m_stream.nx(), m_stream.ny(), m_stream.nz(), m_stream.dxy(),
+        m_stream.dz(), m_stream.wavelength());
+  }
+  else if (m_shmIn) {
+    const ShmRingInfo& info = m_shmIn->info();
+    liveHeader(info.nx, info.ny, info.nz, info.dxy, info.dz, info.wavelength);
+    if (m_shmIn->slotBytes() != sizeof(unsigned short) * m_myParams.ndirs *
+        m_myParams.nphases * m_imgParams.nz * m_imgParams.nx * m_imgParams.ny) {
+      throw std::runtime_error("The slots of input ring " +
+          std::string(m_myParams.ifiles) +
+          " do not hold ndirs*nphases*nz uint16 frames");
+    }
+  }
+  else {
+    ::loadHeader(m_myParams, &m_imgParams, m_in_out_header);
+  }
   ::setup_part2(&m_myParams, &m_imgParams, &m_reconData);
+  if (m_imgParams.nwaves > 1) {
+    setupWaves();
+  }
+}
+
+bool SIM_Reconstructor::liveInput() const
+{
+  return m_myParams.bStreamInput || m_myParams.bShmInput;
+}
+
+void SIM_Reconstructor::liveHeader(int nx, int ny, int nz, float dxy,
+    float dz, int wavelength)
+{
+  if (nx <= 0 || ny <= 0 || nz <= 0 || !(dxy > 0.f)) {
+    throw std::runtime_error("Invalid image size in the input header");
+  }
+  m_imgParams.nx = nx;
+  m_imgParams.ny = ny;
+  m_imgParams.nz = nz;
+  m_imgParams.nwaves = 1;
+  m_imgParams.ntimes = 0;  // counted as they arrive
+  m_imgParams.t0 = 0;
+  m_imgParams.tstep = 1;
+  m_imgParams.wave[0] = wavelength;
+  m_imgParams.dy = dxy;
+  m_imgParams.dz = dz;
+  applyRoi(m_myParams, &m_imgParams);
+  if (m_myParams.nzPadTo) {
+    m_imgParams.nz0 = m_myParams.nzPadTo;
+  } else {
+    m_imgParams.nz0 = m_imgParams.nz;
+  }
+
+  // what loadHeader() would have found in an MRC file of the same data
+  memset(&m_in_out_header, 0, sizeof(m_in_out_header));
+  m_in_out_header.nx = m_imgParams.nx;
+  m_in_out_header.ny = m_imgParams.ny;
+  m_in_out_header.nz = m_imgParams.nz * m_myParams.ndirs * m_myParams.nphases;
+  m_in_out_header.mode = IW_USHORT;
+  m_in_out_header.mx = m_imgParams.nx;
+  m_in_out_header.my = m_imgParams.ny;
+  m_in_out_header.mz = m_in_out_header.nz;
+  m_in_out_header.xlen = m_imgParams.dy;
+  m_in_out_header.ylen = m_imgParams.dy;
+  m_in_out_header.zlen = m_imgParams.dz;
+  m_in_out_header.alpha = m_in_out_header.beta = m_in_out_header.gamma = 90.f;
+  m_in_out_header.mapc = 1;
+  m_in_out_header.mapr = 2;
+  m_in_out_header.maps = 3;
+  m_in_out_header.num_times = 0;
+  m_in_out_header.num_waves = 1;
+  m_in_out_header.iwav1 = m_imgParams.wave[0];
+
+  printf("nx=%d, ny=%d, nz=%d, nz0 = %d, nwaves=%d, live input\n",
+      m_imgParams.nx, m_imgParams.ny, m_imgParams.nz, m_imgParams.nz0,
+      m_imgParams.nwaves);
 }
 #endif
 
 void SIM_Reconstructor::loadAndRescaleImage(int timeIdx, int waveIdx)
 {
+#ifndef __SIRECON_USE_TIFF__
+  selectWave(waveIdx);
+#endif
   loadImageData(timeIdx, waveIdx, m_zoffset);
 
-  ::rescaleDriver(timeIdx, waveIdx, m_zoffset, &m_myParams, m_imgParams, 
+  ::rescaleDriver(timeIdx, waveIdx, m_zoffset, waveParams(), m_imgParams, 
                     &m_driftParams, &m_reconData);
 }
 
+int SIM_Reconstructor::getNWaves() const
+{
+#ifdef __SIRECON_USE_TIFF__
+  return 1;
+#else
+  return m_imgParams.nwaves;
+#endif
+}
+
+ReconParams* SIM_Reconstructor::waveParams()
+{
+#ifndef __SIRECON_USE_TIFF__
+  if (!m_waves.empty()) {
+    return &m_waves[m_curWave].params;
+  }
+#endif
+  return &m_myParams;
+}
+
+#ifndef __SIRECON_USE_TIFF__
+void SIM_Reconstructor::peekWavelengths()
+{
+  // The config file is read before the input file is opened, so the
+  // wavelengths for its name come straight from the header
+  if (liveInput()) {
+    throw std::runtime_error("{wave} in the config file name needs an MRC input file");
+  }
+  if (!m_varsmap.count("input-file")) {
+    return;
+  }
+  MRCReader reader(m_varsmap["input-file"].as<std::string>());
+  for (int iw = 0; iw < reader.nwaves() && iw < 5; ++iw) {
+    m_imgParams.wave[iw] = reader.wavelength(iw);
+  }
+}
+
+void SIM_Reconstructor::setupWaves()
+{
+  // Channel 0 was set up as for a single-channel file.  Every other
+  // channel gets the config and OTF named for its wavelength, parsed
+  // afresh under the same command line, and is then parked in m_waves
+  const int nwaves = m_imgParams.nwaves;
+  if (nwaves > 5) {
+    throw std::runtime_error("MRC files have at most 5 wavelengths");
+  }
+  if (strstr(m_myParams.otffiles, "{wave}") == 0) {
+    printf("Every channel uses OTF %s; put {wave} in its name to give each its own\n",
+        m_myParams.otffiles);
+  }
+  const ReconParams first = m_myParams;
+  m_waves.resize(nwaves);
+  m_waves[0].params = first;
+  swapWaveData(&m_reconData, &m_waves[0]);
+
+  for (int iw = 1; iw < nwaves; ++iw) {
+    SetDefaultParams(&m_myParams);
+    m_varsmap = po::variables_map();
+    parseCommandLine();
+    notify(m_varsmap);
+    readConfigFile(iw);
+    setParams();
+    // the raw data layout and the buffers are shared by all channels
+    if (m_myParams.ndirs != first.ndirs || m_myParams.nphases != first.nphases ||
+        m_myParams.bFastSIM != first.bFastSIM ||
+        m_myParams.zoomfact != first.zoomfact ||
+        m_myParams.z_zoom != first.z_zoom ||
+        m_myParams.backend != first.backend) {
+      std::ostringstream msg;
+      msg << "The config of wavelength " << m_imgParams.wave[iw]
+          << " differs from the first one in ndirs, nphases, fastSI, zoomfact,"
+          << " zzoom or backend";
+      throw std::runtime_error(msg.str());
+    }
+    // the loaders, the --roi grid and the writer use the first channel's
+    // (nzPadTo, bBgInExtHdr and napodize have no option yet, but the same
+    // goes for them)
+    if (m_myParams.constbkgd != first.constbkgd ||
+        m_myParams.bUsecorr != first.bUsecorr ||
+        strcmp(m_myParams.corrfiles, first.corrfiles) != 0 ||
+        m_myParams.nzPadTo != first.nzPadTo ||
+        m_myParams.bBgInExtHdr != first.bBgInExtHdr ||
+        m_myParams.napodize != first.napodize) {
+      std::ostringstream msg;
+      msg << "The config of wavelength " << m_imgParams.wave[iw]
+          << " differs from the first one in background or usecorr, which"
+          << " all channels share";
+      throw std::runtime_error(msg.str());
+    }
+
+    std::string otfFile = waveFileName(m_myParams.otffiles, iw);
+    if (IMOpen(otfstream_no, otfFile.c_str(), "ro")) {
+      throw std::runtime_error("OTF file not found: " + otfFile);
+    }
+    printf("wavelength %d: OTF %s\n", m_imgParams.wave[iw], otfFile.c_str());
+    ::setup_wave(&m_myParams, m_imgParams, &m_reconData);
+    m_waves[iw].params = m_myParams;
+    swapWaveData(&m_reconData, &m_waves[iw]);
+  }
+
+  m_myParams = first;
+  swapWaveData(&m_reconData, &m_waves[0]);
+  m_curWave = 0;
+}
+
+void SIM_Reconstructor::selectWave(int iw)
+{
+  if (m_waves.empty() || iw == m_curWave) {
+    return;
+  }
+  swapWaveData(&m_reconData, &m_waves[m_curWave]);
+  swapWaveData(&m_reconData, &m_waves[iw]);
+  m_curWave = iw;
+}
+
+std::string SIM_Reconstructor::journalName() const
+{
+  return std::string(m_myParams.ofiles) + ".journal";
+}
+
+void SIM_Reconstructor::openJournal()
+{
+  // what has to be the same for the output file to be continued
+  std::ostringstream signature;
+  signature << "cudasirecon " << m_myParams.ifiles << ' ' << m_myParams.ofiles
+    << ' ' << m_imgParams.outNx << ' ' << m_imgParams.outNy << ' '
+    << m_imgParams.outNz << ' ' << m_imgParams.nwaves << ' '
+    << m_imgParams.t0 << ' ' << m_imgParams.tstep << ' '
+    << m_imgParams.ntimes << ' ' << m_myParams.outputMode;
+  m_firstTime = m_journal.open(journalName(), signature.str());
+  if (m_firstTime == 0) {
+    return;
+  }
+
+  // the state that time point 0, or the last one done, left behind
+  std::istringstream sums(m_journal.value("sums"));
+  for (size_t i = 0; i < m_reconData.sum_dir0_phase0.size(); ++i) {
+    sums >> m_reconData.sum_dir0_phase0[i];
+  }
+  if (!sums) {
+    throw std::runtime_error("Journal " + journalName() + " has no time point 0 intensities");
+  }
+  for (int iw = 0; iw < m_imgParams.nwaves; ++iw) {
+    std::ostringstream key;
+    key << "wave" << iw << ".t" << m_firstTime - 1;
+    std::istringstream fit(m_journal.value(key.str()));
+    selectWave(iw);
+    for (int direction = 0; direction < waveParams()->ndirs; ++direction) {
+      fit >> m_reconData.k0[direction].x >> m_reconData.k0[direction].y
+        >> m_reconData.k0_time0[direction].x >> m_reconData.k0_time0[direction].y;
+      for (int order = 0; order < waveParams()->norders; ++order) {
+        fit >> m_reconData.amp[direction][order].x
+          >> m_reconData.amp[direction][order].y;
+      }
+    }
+    if (!fit) {
+      throw std::runtime_error("Journal " + journalName() + " has no k0 fit for " +
+          key.str());
+    }
+  }
+  selectWave(0);
+
+  std::istringstream range(m_journal.value("range"));
+  range >> m_in_out_header.amin >> m_in_out_header.amax
+    >> m_in_out_header.min2 >> m_in_out_header.max2
+    >> m_in_out_header.min3 >> m_in_out_header.max3
+    >> m_in_out_header.min4 >> m_in_out_header.max4
+    >> m_in_out_header.min5 >> m_in_out_header.max5;
+  if (m_myParams.bU16GlobalScale) {
+    std::istringstream u16(m_journal.value("u16"));
+    m_u16Offset.resize(m_imgParams.nwaves);
+    m_u16Scale.resize(m_imgParams.nwaves);
+    for (int iw = 0; iw < m_imgParams.nwaves; ++iw) {
+      u16 >> m_u16Offset[iw] >> m_u16Scale[iw];
+    }
+  }
+  printf("Resuming at time point %d of %d (journal %s)\n", m_firstTime,
+      m_imgParams.ntimes, journalName().c_str());
+}
+
+void SIM_Reconstructor::journalFit(int it, int iw)
+{
+  std::ostringstream fit;
+  fit.precision(9);
+  for (int direction = 0; direction < waveParams()->ndirs; ++direction) {
+    fit << m_reconData.k0[direction].x << ' ' << m_reconData.k0[direction].y << ' '
+      << m_reconData.k0_time0[direction].x << ' ' << m_reconData.k0_time0[direction].y;
+    for (int order = 0; order < waveParams()->norders; ++order) {
+      fit << ' ' << m_reconData.amp[direction][order].x
+        << ' ' << m_reconData.amp[direction][order].y;
+    }
+    fit << ' ';
+  }
+  std::ostringstream key;
+  key << "wave" << iw << ".t" << it;
+  m_journal.append(key.str(), fit.str());
+
+  // every channel has added its intensities once its time point 0 is loaded
+  if (it == 0 && iw == m_imgParams.nwaves - 1) {
+    std::ostringstream sums;
+    sums.precision(17);
+    for (size_t i = 0; i < m_reconData.sum_dir0_phase0.size(); ++i) {
+      sums << m_reconData.sum_dir0_phase0[i] << ' ';
+    }
+    m_journal.append("sums", sums.str());
+  }
+}
+
+void SIM_Reconstructor::journalDone(int it)
+{
+  if (it == 0) {
+    std::ostringstream range;
+    range.precision(9);
+    range << m_in_out_header.amin << ' ' << m_in_out_header.amax << ' '
+      << m_in_out_header.min2 << ' ' << m_in_out_header.max2 << ' '
+      << m_in_out_header.min3 << ' ' << m_in_out_header.max3 << ' '
+      << m_in_out_header.min4 << ' ' << m_in_out_header.max4 << ' '
+      << m_in_out_header.min5 << ' ' << m_in_out_header.max5;
+    m_journal.append("range", range.str());
+    if (m_myParams.bU16GlobalScale) {
+      std::ostringstream u16;
+      u16.precision(9);
+      for (size_t iw = 0; iw < m_u16Scale.size(); ++iw) {
+        u16 << m_u16Offset[iw] << ' ' << m_u16Scale[iw] << ' ';
+      }
+      m_journal.append("u16", u16.str());
+    }
+  }
+  // the time point may only be recorded once its sections and the header
+  // are on disk; IMWrSec() writes straight to the file, so syncing the
+  // file through a handle of our own covers them
+  IMPutHdr(ostream_no, &m_in_out_header);
+  IMWrHdr(ostream_no, m_in_out_header.label, 0, m_in_out_header.amin,
+      m_in_out_header.amax, m_in_out_header.amean);
+  if (!syncFile(m_myParams.ofiles)) {
+    throw std::runtime_error("Cannot flush " + std::string(m_myParams.ofiles) +
+        " to disk");
+  }
+  m_journal.done(it);
+}
+#endif
+
 void SIM_Reconstructor::writeResult(int it, int iw)
 {
-  CPUBuffer outbufferHost(
-      (m_myParams.zoomfact * m_imgParams.nx) *
-      (m_myParams.zoomfact * m_imgParams.ny) *
-      (m_myParams.z_zoom * m_imgParams.nz0) *
-      sizeof(float));
+  if (!m_writer) {
+    // created here because in TIFF mode nz0 is only known after the first load
+    m_writer = new AsyncWriter(
+        (m_myParams.zoomfact * m_imgParams.nx) *
+        (m_myParams.zoomfact * m_imgParams.ny) *
+        (m_myParams.z_zoom * m_imgParams.nz0) *
+        sizeof(float),
+        m_myParams.writeQueue,
+        boost::bind(&SIM_Reconstructor::writeVolume, this,
+          boost::placeholders::_1, boost::placeholders::_2,
+          boost::placeholders::_3));
+  }
+
+  CPUBuffer* outbufferHost = m_writer->acquire();
   // if (it==0)
   //   computeAminAmax(&reconData.outbuffer, m_myParams.zoomfact * m_imgParams.nx,
   //                   m_myParams.zoomfact * m_imgParams.ny, m_myParams.z_zoom * m_imgParams.nz,
   //                   &minval, &maxval);
-  m_reconData.outbuffer.set(&outbufferHost, 0, outbufferHost.getSize(), 0);
+  m_reconData.outbuffer.set(outbufferHost, 0, outbufferHost->getSize(), 0);
+  // the pool's buffers are pinned, so the download is asynchronous; it
+  // must be complete before the writer thread sees the buffer
+  if (m_myParams.backend != BACKEND_CPU &&
+      cudaStreamSynchronize(0) != cudaSuccess) {
+    throw std::runtime_error("Download of the reconstruction failed");
+  }
+#ifndef __SIRECON_USE_TIFF__
+  if (m_journal.isOpen()) {
+    journalFit(it, iw);
+  }
+#endif
+  m_writer->submit(outbufferHost, it, iw);
+}
 
+void SIM_Reconstructor::writeVolume(const CPUBuffer& outbufferHost, int it,
+    int iw)
+{
 #ifndef __clang__
   double t1 = omp_get_wtime();
 #endif
 
 #ifdef __SIRECON_USE_TIFF__
-  CImg<> outCimg((float*) outbufferHost.getPtr(),
-    m_myParams.zoomfact * m_imgParams.nx,
-    m_myParams.zoomfact * m_imgParams.ny,
-    m_myParams.z_zoom * m_imgParams.nz0, true);  // "true" means outCimg does not allocate host memory
-
-  outCimg.save(makeOutputFilePath(m_all_matching_files[it], std::string("_proc")).c_str());
+  std::string inputFile;
+  {
+    boost::mutex::scoped_lock lock(m_filesMutex);
+    inputFile = m_all_matching_files[it];
+  }
+  std::string outputFile = makeOutputFilePath(inputFile, std::string("_proc"));
+  if (!save_tiff_stack(outputFile.c_str(),
+        m_myParams.zoomfact * m_imgParams.nx,
+        m_myParams.zoomfact * m_imgParams.ny,
+        m_myParams.z_zoom * m_imgParams.nz0,
+        (const float*) outbufferHost.getPtr(), m_myParams.tiffLevel)) {
+    throw std::runtime_error("Cannot write " + outputFile);
+  }
+  if (m_myParams.bMip) {
+    std::string prefix = makeOutputFilePath(inputFile, "");
+    writeProjections((const float*) outbufferHost.getPtr(),
+        m_myParams.zoomfact * m_imgParams.nx,
+        m_myParams.zoomfact * m_imgParams.ny,
+        m_myParams.z_zoom * m_imgParams.nz0, iw,
+        prefix.substr(0, prefix.find_last_of('.')), "");
+  }
 
 #else
 
@@ -1833,29 +3354,191 @@ void SIM_Reconstructor::writeResult(int it, int iw)
   if (m_myParams.nzPadTo) {
     zoffset = (m_imgParams.nz0 - m_imgParams.nz) / 2;
   }
+  // the reconstructed grid, and the part of it that is written (see applyRoi())
+  const size_t gridNx = (size_t) (m_myParams.zoomfact * m_imgParams.nx);
+  const size_t gridNy = (size_t) (m_myParams.zoomfact * m_imgParams.ny);
+  const size_t outNx = (size_t) (m_myParams.zoomfact * m_imgParams.outNx);
+  const size_t outNy = (size_t) (m_myParams.zoomfact * m_imgParams.outNy);
+  const size_t nxy = outNx * outNy;
+  const int nsecs = m_imgParams.outNz * m_myParams.z_zoom;
   float* ptr = ((float*)outbufferHost.getPtr()) +
-    (int)(zoffset * m_myParams.z_zoom * m_imgParams.nx * m_imgParams.ny *
-        m_myParams.zoomfact * m_myParams.zoomfact);
-  for (int i = 0; i < m_imgParams.nz * m_myParams.z_zoom; ++i) {
-    IMWrSec(ostream_no, ptr);
+    (zoffset + m_imgParams.outZ0) * m_myParams.z_zoom * gridNx * gridNy;
+  if (outNx != gridNx || outNy != gridNy) {
+    const size_t x0 = (size_t) (m_myParams.zoomfact * m_imgParams.outX0);
+    const size_t y0 = (size_t) (m_myParams.zoomfact * m_imgParams.outY0);
+    m_roiVolume.resize(nxy * nsecs);
+    for (int i = 0; i < nsecs; ++i) {
+      for (size_t l = 0; l < outNy; ++l) {
+        memcpy(&m_roiVolume[(i * outNy + l) * outNx],
+            ptr + (i * gridNy + y0 + l) * gridNx + x0, outNx * sizeof(float));
+      }
+    }
+    ptr = &m_roiVolume[0];
+  }
+
+  if (m_shmOut) {
+    // a viewer that falls behind misses volumes rather than holding up
+    // the reconstruction
+    void* slot = m_shmOut->beginWrite(false);
+    if (slot) {
+      memcpy(slot, ptr, nxy * nsecs * sizeof(float));
+      m_shmOut->endWrite(it);
+    }
+  }
+
+  if (m_myParams.bMip) {
+    std::string prefix = m_myParams.ofiles;
+    std::string::size_type dot = prefix.find_last_of('.');
+    if (dot != std::string::npos && dot > prefix.find_last_of("/\\") + 1) {
+      prefix.erase(dot);
+    }
+    char suffix[32];
+    if (m_imgParams.nwaves > 1) {
+      sprintf(suffix, "_t%04d_w%d", it, iw);
+    }
+    else {
+      sprintf(suffix, "_t%04d", it);
+    }
+    writeProjections(ptr, (int) outNx, (int) outNy, nsecs, iw, prefix, suffix);
+  }
+
+  float volMin, volMax;
+  outfmt::minMax(ptr, nxy * nsecs, &volMin, &volMax);
+  if (it == 0) {
+    if (volMin < minval) {
+      minval = volMin;
+    }
+    if (volMax > maxval) {
+      maxval = volMax;
+    }
+  }
+
+  // uint16 output: value = offset + scale * pixel
+  float offset = 0.f, scale = 1.f;
+  if (m_myParams.outputMode == outfmt::OUTPUT_UINT16) {
+    offset = volMin;
+    scale = (volMax - volMin) / outfmt::UINT16_RANGE;
+    if (!(scale > 0.f)) {
+      scale = 1.f;  // constant volume
+    }
+    if (m_myParams.bU16GlobalScale) {
+      if (m_u16Scale.size() <= (size_t) iw) {
+        m_u16Offset.resize(iw + 1);
+        m_u16Scale.resize(iw + 1);
+      }
+      // volumes are written in order, so time point 0 of a channel comes first
+      if (it == 0) {
+        m_u16Offset[iw] = offset;
+        m_u16Scale[iw] = scale;
+      }
+      offset = m_u16Offset[iw];
+      scale = m_u16Scale[iw];
+      // the earlier volumes are written already, so a brighter one can
+      // only be clipped
+      const float top = offset + scale * outfmt::UINT16_RANGE;
+      if (volMin < offset || volMax > top) {
+        printf("WARNING: time point %d, wave %d ranges from %g to %g; values outside "
+            "time point 0's %g to %g are clipped (--u16scale global)\n",
+            it, iw, volMin, volMax, offset, top);
+      }
+    }
+  }
+
+  if (m_chunkStore) {
+    // the whole volume is converted, then cut into chunks
+    const void* volume = ptr;
+    if (m_myParams.outputMode != outfmt::OUTPUT_FLOAT) {
+      m_outSection.resize(nxy * nsecs);
+      if (m_myParams.outputMode == outfmt::OUTPUT_HALF) {
+        outfmt::toHalf(ptr, &m_outSection[0], nxy * nsecs);
+      }
+      else {
+        outfmt::toScaledU16(ptr, &m_outSection[0], nxy * nsecs, offset, scale);
+        m_volumeOffset[it * m_imgParams.nwaves + iw] = offset;
+        m_volumeScale[it * m_imgParams.nwaves + iw] = scale;
+      }
+      volume = &m_outSection[0];
+    }
+    m_chunkStore->write(it, iw, volume);
+  }
+  else {
+    if (m_myParams.outputMode != outfmt::OUTPUT_FLOAT &&
+        m_outSection.size() < nxy) {
+      m_outSection.resize(nxy);
+    }
+    if (liveInput()) {
+      // a live series grows by a time point with every volume
+      m_in_out_header.num_times = it + 1;
+      m_in_out_header.nz = nsecs * m_imgParams.nwaves * (it + 1);
+      IMPutHdr(ostream_no, &m_in_out_header);
+    }
+
+    for (int i = 0; i < nsecs; ++i) {
+      // channels are written one after another, so their sections go
+      // where the header's interleave puts them
+      IMPosnZWT(ostream_no, i, iw, it);
+      switch (m_myParams.outputMode) {
+      case outfmt::OUTPUT_HALF:
+        outfmt::toHalf(ptr, &m_outSection[0], nxy);
+        IMWrSec(ostream_no, &m_outSection[0]);
+        break;
+      case outfmt::OUTPUT_UINT16: {
+        outfmt::toScaledU16(ptr, &m_outSection[0], nxy, offset, scale);
+        IMWrSec(ostream_no, &m_outSection[0]);
+        int noInts = 0;
+        float scaleAndOffset[2] = {scale, offset};
+        IMAlExHdrZWT(ostream_no, i, iw, it, &noInts, scaleAndOffset);
+        break;
+      }
+      default:
+        IMWrSec(ostream_no, ptr);
+      }
+      ptr += nxy;
+    }
     if (it == 0) {
-      for (int j = 0;
-          j < (int)(m_imgParams.nx * m_imgParams.ny *
-            m_myParams.zoomfact * m_myParams.zoomfact);
-          ++j) {
-        if (ptr[j] > maxval) {
-          maxval = ptr[j];
-        } else if (ptr[j] < minval) {
-          minval = ptr[j];
-        }
+      float lo, hi;
+      if (m_myParams.outputMode == outfmt::OUTPUT_UINT16) {
+        // the header range is in stored units
+        lo = 0.f;
+        hi = volMax > volMin ? outfmt::UINT16_RANGE : 0.f;
+      }
+      else if (iw == 0) {
+        lo = minval;
+        hi = maxval;
+      }
+      else {
+        lo = volMin;
+        hi = volMax;
+      }
+      // each of the header's five wavelengths has its own range
+      switch (iw) {
+      case 0:
+        m_in_out_header.amin = lo;
+        m_in_out_header.amax = hi;
+        break;
+      case 1:
+        m_in_out_header.min2 = lo;
+        m_in_out_header.max2 = hi;
+        break;
+      case 2:
+        m_in_out_header.min3 = lo;
+        m_in_out_header.max3 = hi;
+        break;
+      case 3:
+        m_in_out_header.min4 = lo;
+        m_in_out_header.max4 = hi;
+        break;
+      default:
+        m_in_out_header.min5 = lo;
+        m_in_out_header.max5 = hi;
       }
     }
-    ptr += (int)(m_myParams.zoomfact * m_imgParams.nx *
-        m_myParams.zoomfact * m_imgParams.ny);
   }
-  if (it == 0 && iw == 0) {
-    m_in_out_header.amin = minval;
-    m_in_out_header.amax = maxval;
+#endif
+
+#ifndef __SIRECON_USE_TIFF__
+  if (m_journal.isOpen() && iw == m_imgParams.nwaves - 1) {
+    journalDone(it);
   }
 #endif
 
@@ -1867,6 +3550,73 @@ void SIM_Reconstructor::writeResult(int it, int iw)
   printf("Time point %d, wave %d done\n", it, iw);
 }
 
+void SIM_Reconstructor::writeProjections(const float* volume, int nx, int ny,
+    int nz, int iw, const std::string& prefix, const std::string& suffix)
+{
+  std::vector<float> xy((size_t) nx * ny), xz((size_t) nx * nz);
+  proj::maxXY(volume, nx, ny, nz, &xy[0]);
+  proj::maxXZ(volume, nx, ny, nz, &xz[0]);
+#ifdef __SIRECON_USE_TIFF__
+  const char* ext = ".tif";
+#else
+  const char* ext = ".mrc";
+#endif
+  writeImage(prefix + "_mipxy" + suffix + ext, nx, ny, &xy[0], iw, false);
+  writeImage(prefix + "_mipxz" + suffix + ext, nx, nz, &xz[0], iw, true);
+
+  const int factor = proj::shrinkFactor(nx, ny, m_myParams.thumbSize);
+  const int thumbNx = nx / factor, thumbNy = ny / factor;
+  if (thumbNx > 0 && thumbNy > 0) {
+    std::vector<float> thumb((size_t) thumbNx * thumbNy);
+    proj::downsample(&xy[0], nx, ny, factor, &thumb[0]);
+    std::vector<unsigned char> pixels(thumb.size());
+    proj::toU8(&thumb[0], thumb.size(), &pixels[0]);
+    std::string fname = prefix + "_thumb" + suffix + ".pgm";
+    if (!proj::writePgm(fname, thumbNx, thumbNy, &pixels[0])) {
+      throw std::runtime_error("Cannot write " + fname);
+    }
+  }
+}
+
+void SIM_Reconstructor::writeImage(const std::string& fname, int nx, int ny,
+    const float* image, int iw, bool xz)
+{
+#ifdef __SIRECON_USE_TIFF__
+  if (!save_tiff_stack(fname.c_str(), nx, ny, 1, image, m_myParams.tiffLevel)) {
+    throw std::runtime_error("Cannot write " + fname);
+  }
+#else
+  // the output's calibration, for a single section of channel 'iw'
+  IW_MRC_HEADER header;
+  memcpy(&header, &m_in_out_header, sizeof(header));
+  header.mode = IW_FLOAT;
+  header.nx = nx;
+  header.ny = ny;
+  header.nz = 1;
+  header.num_waves = 1;
+  header.num_times = 1;
+  header.iwav1 = m_imgParams.wave[iw];
+  header.inbsym = 0;
+  if (xz) {
+    header.ylen = header.zlen;
+  }
+  double sum = 0;
+  const int n = nx * ny;
+#pragma omp parallel for reduction(+:sum)
+  for (int i = 0; i < n; ++i) {
+    sum += image[i];
+  }
+  outfmt::minMax(image, n, &header.amin, &header.amax);
+  header.amean = (float) (sum / n);
+  if (IMOpen(mip_stream_no, fname.c_str(), "new")) {
+    throw std::runtime_error("Cannot create " + fname);
+  }
+  IMPutHdr(mip_stream_no, &header);
+  IMWrSec(mip_stream_no, const_cast<float*>(image));
+  IMClose(mip_stream_no);
+#endif
+}
+
 #ifndef __SIRECON_USE_TIFF__
 void saveCommandLineToHeader(int argc, char **argv, IW_MRC_HEADER &header, const ReconParams& myParams)
 {
@@ -1886,9 +3636,123 @@ void saveCommandLineToHeader(int argc, char **argv, IW_MRC_HEADER &header, const
 
 void SIM_Reconstructor::closeFiles()
 {
+  // the header can only be finalised once every volume is on disk
+  if (m_writer) {
+    m_writer->finish();
+  }
 #ifndef __SIRECON_USE_TIFF__
-  ::IMClose(istream_no);
-  ::saveCommandLineToHeader(m_argc, m_argv, m_in_out_header, m_myParams);
-  ::IMClose(ostream_no);
+  joinPrefetch();
+  if (m_shmOut) {
+    m_shmOut->finish();
+  }
+  if (m_myParams.bStreamInput) {
+    m_stream.close();
+  }
+  else if (!m_shmIn) {
+    ::IMClose(istream_no);
+  }
+  if (m_chunkStore) {
+    writeChunkAttributes();
+  }
+  else {
+    ::saveCommandLineToHeader(m_argc, m_argv, m_in_out_header, m_myParams);
+    ::IMClose(ostream_no);
+  }
 #endif
 }
+
+#ifndef __SIRECON_USE_TIFF__
+void SIM_Reconstructor::createShmOutput()
+{
+  // one slot holds one output volume, as written to the output file
+  ShmRingInfo info;
+  memset(&info, 0, sizeof(info));
+  info.nx = (int) (m_myParams.zoomfact * m_imgParams.outNx);
+  info.ny = (int) (m_myParams.zoomfact * m_imgParams.outNy);
+  info.nz = m_imgParams.outNz * m_myParams.z_zoom;
+  info.dxy = m_imgParams.dy / m_myParams.zoomfact;
+  info.dz = m_imgParams.dz / m_myParams.z_zoom;
+  info.wavelength = m_imgParams.wave[0];
+  m_shmOut = new ShmRing;
+  m_shmOut->create(m_myParams.shmOutput,
+      sizeof(float) * info.nx * info.ny * info.nz, m_myParams.shmSlots, info);
+}
+
+void SIM_Reconstructor::createChunkStore()
+{
+  size_t shape[5];
+  shape[0] = m_imgParams.ntimes;
+  shape[1] = m_imgParams.nwaves;
+  shape[2] = m_imgParams.outNz * m_myParams.z_zoom;
+  shape[3] = (size_t) (m_myParams.zoomfact * m_imgParams.outNy);
+  shape[4] = (size_t) (m_myParams.zoomfact * m_imgParams.outNx);
+  size_t chunks[3];
+  for (int i = 0; i < 3; ++i) {
+    // no point in chunks bigger than the volume
+    chunks[i] = (size_t) m_myParams.chunkSize[i] < shape[i + 2] ?
+      m_myParams.chunkSize[i] : shape[i + 2];
+  }
+
+  std::string dtype;
+  switch (m_myParams.outputMode) {
+  case outfmt::OUTPUT_HALF:
+    dtype = "f2";
+    break;
+  case outfmt::OUTPUT_UINT16:
+    dtype = "u2";
+    m_volumeOffset.assign(shape[0] * shape[1], 0.f);
+    m_volumeScale.assign(shape[0] * shape[1], 1.f);
+    break;
+  default:
+    dtype = "f4";
+  }
+
+  m_chunkStore = new ChunkStore(m_myParams.ofiles, shape, chunks, dtype,
+      m_myParams.chunkLevel, 0);
+}
+
+void SIM_Reconstructor::writeChunkAttributes()
+{
+  std::ostringstream attrs;
+  attrs << "{\n"
+    << "  \"_ARRAY_DIMENSIONS\": [\"t\", \"c\", \"z\", \"y\", \"x\"],\n"
+    << "  \"pixel_size_um\": {\"z\": " << m_imgParams.dz / m_myParams.z_zoom
+    << ", \"y\": " << m_imgParams.dy / m_myParams.zoomfact
+    << ", \"x\": " << m_imgParams.dy / m_myParams.zoomfact << "},\n"
+    << "  \"wavelengths_nm\": [";
+  for (int iw = 0; iw < m_imgParams.nwaves; ++iw) {
+    attrs << (iw ? ", " : "") << m_imgParams.wave[iw];
+  }
+  attrs << "],\n";
+  // which raw time points t counts (--tstart, --tstep)
+  attrs << "  \"raw_time_points\": {\"start\": " << m_imgParams.t0
+    << ", \"step\": " << m_imgParams.tstep << "},\n";
+
+  if (m_myParams.outputMode == outfmt::OUTPUT_UINT16) {
+    // value = offset + scale * pixel, indexed [t][c]
+    const char* names[2] = {"uint16_scale", "uint16_offset"};
+    const std::vector<float>* values[2] = {&m_volumeScale, &m_volumeOffset};
+    attrs.precision(9);
+    for (int k = 0; k < 2; ++k) {
+      attrs << "  \"" << names[k] << "\": [";
+      for (int it = 0; it < m_imgParams.ntimes; ++it) {
+        attrs << (it ? ", [" : "[");
+        for (int iw = 0; iw < m_imgParams.nwaves; ++iw) {
+          attrs << (iw ? ", " : "")
+            << (*values[k])[it * m_imgParams.nwaves + iw];
+        }
+        attrs << "]";
+      }
+      attrs << "],\n";
+    }
+  }
+
+  std::string commandLine;
+  for (int i = 0; i < m_argc; ++i) {
+    commandLine += (i ? " " : "") + std::string(m_argv[i]);
+  }
+  attrs << "  \"command_line\": " << ChunkStore::jsonQuote(commandLine)
+    << "\n}\n";
+  m_chunkStore->setAttributes(attrs.str());
+}
+#endif
@@ -16,18 +16,27 @@ int main(int argc, char **argv)
   try {
     SIM_Reconstructor myreconstructor(argc, argv);
 
-    for (int it = 0; it < myreconstructor.getNTimes(); ++it) {
-      for (int iw = 0; iw < 1; ++iw) {
+    const int nwaves = myreconstructor.getNWaves();
+    for (int it = myreconstructor.getFirstTime(); it < myreconstructor.getNTimes(); ++it) {
+      for (int iw = 0; iw < nwaves; ++iw) {
         myreconstructor.loadAndRescaleImage(it, iw);
+#ifndef __SIRECON_USE_TIFF__
+        // overlap reading of the next volume with this one's reconstruction
+        if (iw + 1 < nwaves)
+          myreconstructor.prefetch(it, iw + 1);
+        else
+          myreconstructor.prefetch(it + 1, 0);
+#endif
         myreconstructor.setCurTimeIdx(it);
         myreconstructor.processOneVolume();
         myreconstructor.writeResult(it, iw);
       }
+      // with --watch or --stream, the series goes on as the acquisition does
+      if (it + 1 == myreconstructor.getNTimes())
+        myreconstructor.waitForNextTimePoint();
     }
 
-#ifndef __SIRECON_USE_TIFF__
     myreconstructor.closeFiles();
-#endif
   }
   catch (std::exception &e) {
     std::cerr << "\n!!Error occurred: " << e.what() << std::endl;
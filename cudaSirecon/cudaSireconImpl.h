@@ -10,6 +10,7 @@
 #include <driver_types.h>
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <cstring>
 #include <string>
 #include <sstream>
@@ -23,6 +24,7 @@
 
 #include <memory>
 #include <cfloat>
+#include <climits>
 #include <cassert>
 
 #include <complex>
@@ -40,14 +42,28 @@ static nvmlMemory_t memoryStruct;
 #include "CPUBuffer.h"
 #include "PinnedCPUBuffer.h"
 #include "gpuFunctions.h"
+#include "cpuFunctions.h"
+#include "fftPlans.h"
+#include "flatfield.h"
+#include "corrCache.h"
+#include "outputFormat.h"
+#include "chunkStore.h"
+#include "projections.h"
 
 #ifdef __SIRECON_USE_TIFF__
 #include <tiffio.h>
 #define cimg_use_tiff
 #include <CImg.h>
 using namespace cimg_library;
+#include "tiffReader.h"  // page-at-a-time raw data input
+#include "fileWatcher.h"  // --watch
 #else
 #include <IMInclude.h>  // MRC file I/O routines
+#include "mrcReader.h"  // memory-mapped raw data input
+#include "frameStream.h"  // --stream raw data input
+#include "shmRing.h"  // --shm and --shmout
+#include "batchReader.h"  // --iouring
+#include "journal.h"  // --resume
 #endif
 
 // Block sizes for reduction kernels
@@ -82,6 +98,7 @@ static const int otfstream_no = 3;
 static const int aligned_stream_no = 10;
 static const int separated_stream_no = 11;
 static const int overlaps_stream_no = 12;
+static const int mip_stream_no = 13;
 
 // static IW_MRC_HEADER header;
 static IW_MRC_HEADER aligned_header;
@@ -111,6 +128,12 @@ struct vector3d {
   float z;
 };
 
+/** Where the reconstruction stages are executed (--backend) */
+enum ReconBackend {
+  BACKEND_CUDA = 0,
+  BACKEND_CPU = 1
+};
+
 /** Overall image reconstruction parameters. */
 struct ReconParams {
   float k0startangle, linespacing;
@@ -126,6 +149,9 @@ struct ReconParams {
   float zoomfact;
   int   z_zoom;
   int   nzPadTo;  /** pad zero sections to this number of z sections */
+  int   roi[4];  /** x0, y0, width and height of the raw-pixel region to reconstruct; width 0 means the whole field */
+  int   zrange[2];  /** first and last raw z section to reconstruct; -1 means all */
+  int   tstart, tend, tstep;  /** raw time points tstart, tstart+tstep, ... up to tend are reconstructed; tend -1 means the last */
   float explodefact;
   int   bFilteroverlaps;
   int   recalcarrays; /** whether to calculate the overlaping regions between bands just once or always; used in fitk0andmodamps() */
@@ -148,6 +174,28 @@ struct ReconParams {
   float wiener, wienerInr;
   int   bUseEstimatedWiener;
 
+  /* execution related parameters */
+  int   backend;  /** BACKEND_CUDA or BACKEND_CPU */
+  int   nthreads;  /** number of CPU threads used by the CPU backend; 0 means all cores */
+  int   bPrefetch;  /** read and flat-field time point it+1 in the background while it is reconstructed */
+  int   writeQueue;  /** how many output volumes may be queued for the writer thread; 0 means write synchronously */
+  int   outputMode;  /** pixel type of the MRC output, an outfmt::Mode */
+  int   bU16GlobalScale;  /** OUTPUT_UINT16: scale every time point like time point 0 (else each is scaled to its own range) */
+  int   bChunkedOutput;  /** write a chunked directory store (see chunkStore.h) instead of an MRC file */
+  int   chunkSize[3];  /** z, y and x size of the chunks of the chunked output */
+  int   chunkLevel;  /** zlib level of the chunked output; 0 means uncompressed */
+  int   tiffLevel;  /** deflate level of TIFF-mode output files; 0 means uncompressed */
+  int   bMip;  /** also write XY and XZ maximum-intensity projections and a preview of every output volume (see projections.h) */
+  int   thumbSize;  /** longest side of the bMip preview, in pixels */
+  int   bStreamInput;  /** input-file is a stream of raw frames (see frameStream.h) */
+  int   bShmInput;  /** input-file names a shared-memory ring of raw time points (see shmRing.h) */
+  char  shmOutput[400];  /** name of a shared-memory ring to publish output volumes to; empty for none */
+  int   shmSlots;  /** number of slots of the shmOutput ring */
+  int   bResume;  /** keep a journal next to the output and continue from it if there is one (see journal.h) */
+  int   bIoUring;  /** read MRC time points as one batch of section reads (see batchReader.h) instead of through the mapping */
+  int   bWatch;  /** TIFF mode: keep reconstructing new matching files as they appear */
+  int   watchIdle;  /** seconds without a new file after which --watch stops; 0 means never */
+
   /* OTF specific parameters */
   int   nxotf, nyotf, nzotf;
   float dkzotf, dkrotf;  /** OTF's pixel size in inverse mirons */
@@ -163,6 +211,7 @@ struct ReconParams {
   int bBgInExtHdr; /** In Andor EMCCD, background varies with each exposure, esp. in EM mode. Hidden-behind-aluminum-foil pixels can be used to estimate background of each exposure and stored in the extended header. When this option is true, the 3rd float of the extended header stores such estimated background values. */
   int   bUsecorr;    /** whether to use a camera flat-fielding (or correction) file */
   char  corrfiles[400];  /** name of the camera correction file if bUsecorr is 1 */
+  char  corrCacheDir[400];  /** where parsed correction files are cached (see corrCache.h); empty means no caching */
   float readoutNoiseVar;
   float electrons_per_bit;
 
@@ -195,6 +244,16 @@ struct ImageParams {
   float dy;
   float dz;
   float inscale;
+  /* --roi and --zrange: nx, ny and nz above are the grid that is
+   * reconstructed, which is this part of the raw data ... */
+  int rawNx, rawNy, rawNz;  /** size of the raw sections, and raw sections per direction and phase */
+  int x0, y0, z0;  /** first raw column, row and z section of the grid */
+  /* ... and this part of the grid is written out */
+  int outX0, outY0, outZ0;
+  int outNx, outNy, outNz;
+  /* --tstart, --tend and --tstep: ntimes above counts the time points
+   * reconstructed; time point 'it' is raw time point t0 + it*tstep */
+  int t0, tstep;
 };
 struct DriftParams {
   vector3d* driftlist;
@@ -226,6 +285,9 @@ struct ReconData {
   CPUBuffer background;
   CPUBuffer slope;
   float backgroundExtra;
+  GPUBuffer backgroundGPU;  /** device copies of background and slope */
+  GPUBuffer slopeGPU;
+  GPUBuffer rawU16;  /** raw uint16 sections of one time point, before flat-fielding */
   std::vector<std::vector<GPUBuffer> > savedBands;
   std::vector<float> sepMatrix;
   std::vector<float> noiseVarFactors;
@@ -239,6 +301,21 @@ struct ReconData {
   GPUBuffer bigbuffer;
   GPUBuffer outbuffer;
 };
+/** What each channel of a multi-wavelength file has of its own: its
+ * config and the parts of ReconData that setup_wave() fills in or the
+ * k0 and modamp fits carry over from one time point to the next */
+struct WaveData {
+  ReconParams params;
+  int sizeOTF;
+  std::vector<std::vector<GPUBuffer> > otf;
+  std::vector<float> sepMatrix;
+  std::vector<float> noiseVarFactors;
+  std::vector<vector> k0;
+  std::vector<vector> k0_time0;
+  std::vector<vector> k0guess;
+  std::vector<std::vector<cuFloatComplex> > amp;
+  WaveData() : sizeOTF(0) {};
+};
 
 
 void SetDefaultParams(ReconParams *pParams);
@@ -253,10 +330,22 @@ void SetDefaultParams(ReconParams *pParams);
 // void setup(ReconParams* params, ImageParams*
 //     imgParams, DriftParams* driftParams, ReconData* data);
 void setup_part2(ReconParams* params, ImageParams* imgParams, ReconData* reconData);
+/** The part of setup_part2() that depends on the channel: OTF, separation
+ * matrix, k0 guesses and modamps */
+void setup_wave(ReconParams* params, const ImageParams& imgParams,
+    ReconData* reconData);
+/** Exchange the channel-specific buffers of reconData with those of wave (not the params) */
+void swapWaveData(ReconData* reconData, WaveData* wave);
 // #ifdef __SIRECON_USE_TIFF__
 // void setup(CImg<> &inTIFF, ReconParams* params, ImageParams* imgParams, ReconData* reconData);
 // #endif
 void loadHeader(const ReconParams& params, ImageParams* imgParams, IW_MRC_HEADER &header);
+/** Turn the raw section size in imgParams (nx, ny, nz) into the grid
+ * around params.roi and params.zrange that is reconstructed; see the
+ * rawNx ... outNz fields of ImageParams */
+void applyRoi(const ReconParams& params, ImageParams* imgParams);
+/** Same for the raw time points and params.tstart, tend and tstep */
+void applyTimeRange(const ReconParams& params, ImageParams* imgParams);
 // void readDriftData(const ReconParams& params, DriftParams* driftParams);
 void getOTFs(ReconParams* params, const ImageParams& imgParams,
     ReconData* data);
@@ -281,15 +370,26 @@ void makematrix(int nphases, int norders, int dir, float *arrPhases,
 void allocSepMatrixAndNoiseVarFactors(const ReconParams& params,
     ReconData* reconData);
 
+/** Section number, within one (wave, time), of raw image (direction, z, phase) */
+int rawSectionIndex(const ReconParams& params, const ImageParams& imgParams,
+    int direction, int z, int phase);
+
 #ifdef __SIRECON_USE_TIFF__
-void load_and_flatfield(CImg<> &cimg, int section_no, float *bufDestiny, 
-    float background, float inscale);
+void load_and_flatfield(const TIFFReader& reader, int section_no,
+    float *rawSection, float *bufDestiny, float background, float inscale);
 #endif
 
-void load_and_flatfield(int section_no, int wave_no,
-    int time_no, float *bufDestiny, float *buffer, int nx, int ny,
-    float *background, float backgroundExtra, float *slope, float inscale,
-    int bUsecorr);
+#ifndef __SIRECON_USE_TIFF__
+void load_and_flatfield(const MRCReader& reader, int section_no, int wave_no,
+    int time_no, float *bufDestiny, int nx, int ny,
+    const float *background, float backgroundExtra, const float *slope,
+    float inscale, int bUsecorr);
+//! Same for a section of the reader's file that was read into memory some other way (e.g. BatchReader)
+/*! If nx is less than reader.nx(), 'section' points at the first of ny partial rows (see applyRoi()) */
+void load_and_flatfield(const MRCReader& reader, const void* section,
+    float *bufDestiny, int nx, int ny, const float *background,
+    float backgroundExtra, const float *slope, float inscale, int bUsecorr);
+#endif
 
 void saveIntermediateDataForDebugging(const ReconParams& params);
 
@@ -299,7 +399,7 @@ void matrix_transpose(float* mat, int nRows, int nCols);
   
 */
 void findModulationVectorsAndPhasesForAllDirections(
-    int zoffset, ReconParams* params, const ImageParams& imgParams,
+    int zoffset, int iw, ReconParams* params, const ImageParams& imgParams,
     DriftParams* driftParams, ReconData* data);
 
 void apodizationDriver(int zoffset, ReconParams* params,
@@ -344,9 +444,12 @@ extern "C" void sgels_(const char*, int*, int*, int*, float*, int*, float*,
 
 #ifdef __SIRECON_USE_TIFF__
 extern "C" int load_tiff(TIFF *const tif, const unsigned int directory, const unsigned colind, float *const buffer);
+extern "C" int load_tiff_current(TIFF *const tif, const unsigned colind, float *const buffer);
 extern "C" int save_tiff(TIFF *tif, const unsigned int directory, int colind, const int nwaves, int width, int height, float * buffer , int bIsComplex);
+extern "C" int save_tiff_stack(const char *filename, int width, int height, int depth, const float *buffer, int level);
 
 std::vector<std::string> gatherMatchingFiles(std::string target_path, std::string pattern);
+bool fileMatchesPattern(const std::string& path, std::string pattern);
 std::string makeOutputFilePath(std::string inputFileName, std::string insert);
 #endif
 
@@ -0,0 +1,90 @@
+#ifndef FFT_PLANS_H
+#define FFT_PLANS_H
+
+#include <cufft.h>
+#include <fftw3.h>
+#include <string>
+
+/*
+  Process-wide cache of FFT plans, shared by the CUDA (cuFFT) and CPU
+  (FFTW) code paths.  Creating a plan is expensive compared to executing
+  it, and the reconstruction asks for the same handful of geometries
+  over and over (every k0 search iteration, every direction, every time
+  point), so plans are created on first use, keyed by
+  (rank, dims, strides, batch, direction, backend), and kept until
+  clear() is called.
+
+  The returned plans are owned by the cache: never destroy them.  The
+  cache itself is not thread safe; all FFT planning in this program is
+  requested from the main thread.
+
+  For FFTW there is also a persistent wisdom store (see useWisdom()):
+  geometries without wisdom get a quick FFTW_ESTIMATE plan right away
+  and are measured (FFTW_MEASURE) on a background thread; once that
+  finishes the measured plan replaces the estimated one in the cache,
+  and the wisdom is saved so that later runs start with it.  Geometries
+  needing more than 256 MB of measuring arrays are not tuned in the
+  background; callers that own a large array whose contents do not
+  matter yet measure its plan in place with measureC2C().
+*/
+namespace fftplan {
+
+/* Returns a cuFFT plan; the arguments are those of cufftPlanMany().
+   inembed/onembed may be NULL for contiguous data.  A cuFFT plan
+   serves both directions (the direction is given to cufftExecC2C()),
+   so direction is not part of its key. */
+cufftHandle cuPlanMany(int rank, const int* n,
+    const int* inembed, int istride, int idist,
+    const int* onembed, int ostride, int odist,
+    cufftType type, int batch);
+
+/* Shorthands for single, contiguous C2C transforms; nz == 1 gives a
+   2D plan */
+cufftHandle cuPlanC2C(int nz, int ny, int nx);
+
+/* Returns an FFTW plan; the arguments are those of
+   fftwf_plan_many_dft(). in/out are only looked at while planning (with
+   FFTW_ESTIMATE nothing is written to them) and to tell in-place from
+   out-of-place and their SIMD alignment, which are part of the key.
+   Run the plan on any arrays of the same geometry with
+   fftwf_execute_dft(). */
+fftwf_plan fftwPlanMany(int rank, const int* n, int howmany,
+    fftwf_complex* in, const int* inembed, int istride, int idist,
+    fftwf_complex* out, const int* onembed, int ostride, int odist,
+    int sign);
+
+/* Same as above for real-to-complex transforms; run with
+   fftwf_execute_dft_r2c() */
+fftwf_plan fftwPlanManyR2C(int rank, const int* n, int howmany,
+    float* in, const int* inembed, int istride, int idist,
+    fftwf_complex* out, const int* onembed, int ostride, int odist);
+
+/* Shorthand for a single, contiguous C2C transform; nz == 1 gives a 2D
+   plan */
+fftwf_plan fftwPlanC2C(int nz, int ny, int nx, fftwf_complex* in,
+    fftwf_complex* out, int sign);
+
+/* Measures (FFTW_MEASURE) the plan fftwPlanC2C() returns for data, on
+   data itself, unless wisdom or an earlier measurement already gave
+   one.  Overwrites data; call it before filling the array.  Does
+   nothing without the wisdom store. */
+void measureC2C(int nz, int ny, int nx, fftwf_complex* data, int sign);
+
+/* Loads the FFTW wisdom for this CPU model from directory dir (created
+   if missing) and turns on background tuning of new FFTW geometries.
+   Wisdom files are named after the CPU model, so a directory shared by
+   different machines is fine.  Call before the first FFTW plan. */
+void useWisdom(const std::string& dir);
+
+/* Default wisdom directory: ~/.cudasirecon, or %LOCALAPPDATA%\cudasirecon
+   on Windows; empty if neither can be determined */
+std::string defaultWisdomDir();
+
+/* Destroys every cached plan, releasing cuFFT work areas.  If the wisdom
+   store is in use, drops the measurements not started yet, waits for
+   the one in progress and saves the wisdom first. */
+void clear();
+
+}
+
+#endif
@@ -0,0 +1,563 @@
+#include "fftPlans.h"
+
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <cctype>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace fftplan {
+
+namespace {
+
+enum { KEY_CUFFT = 0, KEY_FFTW = 1 };
+
+typedef std::vector<int> PlanKey;
+
+/** A cached FFTW plan; estimated plans are replaced once measured */
+struct FFTWEntry {
+  fftwf_plan plan;
+  bool estimated;
+};
+
+/** Everything needed to re-plan an FFTW geometry on scratch arrays */
+struct FFTWGeometry {
+  bool r2c;
+  int rank;
+  std::vector<int> n;
+  std::vector<int> inembed;   // empty means contiguous
+  std::vector<int> onembed;
+  int istride, idist, ostride, odist;
+  int howmany;
+  int sign;
+  bool inPlace;
+};
+
+std::map<PlanKey, cufftHandle> cuPlans;
+std::map<PlanKey, FFTWEntry> fftwPlans;
+
+/* The FFTW planner (and its wisdom) is not thread safe; every planner
+   call made here holds plannerMutex */
+boost::mutex plannerMutex;
+
+/* Background tuning state, guarded by tuneMutex; tuneBusy is set while
+   the tuner measures a job it has taken off the queue */
+boost::mutex tuneMutex;
+boost::condition_variable tuneCond;
+std::deque<std::pair<PlanKey, FFTWGeometry> > tuneQueue;
+std::set<PlanKey> tunedKeys;
+bool tuneStop = false;
+bool tuneBusy = false;
+boost::thread* tuneThread = NULL;
+
+bool wisdomOn = false;
+std::string wisdomFile;
+
+/* Geometries whose measuring arrays would exceed this are not queued
+   for the background tuner, which would need a second copy of the
+   (zoomed) volume next to the caller's; they keep their estimated plans
+   unless the caller measures them on its own array with measureC2C() */
+const size_t maxTuneBytes = (size_t) 256 << 20;
+
+/* Flattens the plan geometry into a key; missing embeds count as 0 */
+PlanKey makeKey(int backend, int type, int rank, const int* n,
+    const int* inembed, int istride, int idist,
+    const int* onembed, int ostride, int odist, int batch, int direction)
+{
+  PlanKey key;
+  key.push_back(backend);
+  key.push_back(type);
+  key.push_back(rank);
+  for (int i = 0; i < rank; ++i) {
+    key.push_back(n[i]);
+  }
+  for (int i = 0; i < rank; ++i) {
+    key.push_back(inembed ? inembed[i] : 0);
+  }
+  for (int i = 0; i < rank; ++i) {
+    key.push_back(onembed ? onembed[i] : 0);
+  }
+  key.push_back(istride);
+  key.push_back(idist);
+  key.push_back(ostride);
+  key.push_back(odist);
+  key.push_back(batch);
+  key.push_back(direction);
+  return key;
+}
+
+/* FFTW plans are only valid for arrays with the same in-/out-of-place
+   layout and the same SIMD alignment as the ones they were made with */
+void addFFTWLayout(PlanKey* key, float* in, float* out)
+{
+  key->push_back(in == out);
+  key->push_back(fftwf_alignment_of(in));
+  key->push_back(fftwf_alignment_of(out));
+}
+
+FFTWGeometry makeGeometry(bool r2c, int rank, const int* n, int howmany,
+    const int* inembed, int istride, int idist,
+    const int* onembed, int ostride, int odist, int sign, bool inPlace)
+{
+  FFTWGeometry g;
+  g.r2c = r2c;
+  g.rank = rank;
+  g.n.assign(n, n + rank);
+  if (inembed) {
+    g.inembed.assign(inembed, inembed + rank);
+  }
+  if (onembed) {
+    g.onembed.assign(onembed, onembed + rank);
+  }
+  g.istride = istride;
+  g.idist = idist;
+  g.ostride = ostride;
+  g.odist = odist;
+  g.howmany = howmany;
+  g.sign = sign;
+  g.inPlace = inPlace;
+  return g;
+}
+
+/* Number of elements spanned by a strided, batched array */
+size_t extent(const std::vector<int>& n, const std::vector<int>& embed,
+    int stride, int dist, int howmany)
+{
+  const std::vector<int>& dims = embed.empty() ? n : embed;
+  size_t last = 0;
+  size_t step = stride;
+  for (int i = (int)n.size() - 1; i >= 0; --i) {
+    last += (size_t)(n[i] - 1) * step;
+    step *= dims[i];
+  }
+  return (size_t)(howmany - 1) * dist + last + 1;
+}
+
+/* Sizes in floats of the input and output arrays of g */
+void arraySizes(const FFTWGeometry& g, size_t* inSize, size_t* outSize)
+{
+  std::vector<int> nOut(g.n);
+  if (g.r2c) {
+    nOut.back() = nOut.back() / 2 + 1;
+  }
+  *inSize = extent(g.n, g.inembed, g.istride, g.idist, g.howmany)
+    * (g.r2c ? 1 : 2);
+  *outSize = extent(nOut, g.onembed, g.ostride, g.odist, g.howmany) * 2;
+}
+
+/* Bytes of scratch tuneLoop() needs to measure g */
+size_t scratchBytes(const FFTWGeometry& g)
+{
+  size_t inSize, outSize;
+  arraySizes(g, &inSize, &outSize);
+  return (g.inPlace ? std::max(inSize, outSize) : inSize + outSize)
+    * sizeof(float);
+}
+
+/* Plans g on arrays in/out with the given flags; NULL if FFTW declines
+   (e.g. FFTW_WISDOM_ONLY without wisdom).  Caller holds plannerMutex. */
+fftwf_plan planGeometry(const FFTWGeometry& g, float* in, float* out,
+    unsigned flags)
+{
+  const int* inembed = g.inembed.empty() ? NULL : &g.inembed[0];
+  const int* onembed = g.onembed.empty() ? NULL : &g.onembed[0];
+  if (g.r2c) {
+    return fftwf_plan_many_dft_r2c(g.rank, &g.n[0], g.howmany,
+        in, inembed, g.istride, g.idist,
+        (fftwf_complex*)out, onembed, g.ostride, g.odist, flags);
+  }
+  return fftwf_plan_many_dft(g.rank, &g.n[0], g.howmany,
+      (fftwf_complex*)in, inembed, g.istride, g.idist,
+      (fftwf_complex*)out, onembed, g.ostride, g.odist, g.sign, flags);
+}
+
+/* Runs FFTW_MEASURE for queued geometries on scratch arrays; the result
+   only matters for the wisdom it leaves behind */
+void tuneLoop()
+{
+  for (;;) {
+    std::pair<PlanKey, FFTWGeometry> job;
+    {
+      boost::mutex::scoped_lock lock(tuneMutex);
+      while (tuneQueue.empty() && !tuneStop) {
+        tuneCond.wait(lock);
+      }
+      if (tuneQueue.empty()) {
+        return;
+      }
+      job = tuneQueue.front();
+      tuneQueue.pop_front();
+      tuneBusy = true;
+    }
+
+    const FFTWGeometry& g = job.second;
+    size_t inSize, outSize;
+    arraySizes(g, &inSize, &outSize);
+    float* in = (float*)fftwf_malloc(
+        (g.inPlace ? std::max(inSize, outSize) : inSize) * sizeof(float));
+    float* out = g.inPlace ? in :
+      (float*)fftwf_malloc(outSize * sizeof(float));
+    if (in && out) {
+      boost::mutex::scoped_lock lock(plannerMutex);
+      fftwf_plan plan = planGeometry(g, in, out, FFTW_MEASURE);
+      if (plan) {
+        fftwf_destroy_plan(plan);
+      }
+    }
+    if (out != in) {
+      fftwf_free(out);
+    }
+    fftwf_free(in);
+
+    boost::mutex::scoped_lock lock(tuneMutex);
+    tuneBusy = false;
+    tunedKeys.insert(job.first);
+  }
+}
+
+void enqueueTuning(const PlanKey& key, const FFTWGeometry& g)
+{
+  boost::mutex::scoped_lock lock(tuneMutex);
+  tuneQueue.push_back(std::make_pair(key, g));
+  if (!tuneThread) {
+    tuneThread = new boost::thread(tuneLoop);
+  }
+  tuneCond.notify_one();
+}
+
+bool isTuned(const PlanKey& key)
+{
+  boost::mutex::scoped_lock lock(tuneMutex);
+  return tunedKeys.count(key) > 0;
+}
+
+/* Common lookup for all FFTW plans.  in/out are the arrays the caller
+   is about to transform; they are only written to by FFTW_MEASURE,
+   which never runs on them here.  Swapping in a measured plan is
+   skipped while the tuner holds the planner, rather than waiting for
+   it; the estimated plan is used until a later lookup finds it free. */
+fftwf_plan lookupFFTW(const PlanKey& key, const FFTWGeometry& g,
+    float* in, float* out)
+{
+  std::map<PlanKey, FFTWEntry>::iterator it = fftwPlans.find(key);
+  if (it != fftwPlans.end()) {
+    if (it->second.estimated && isTuned(key)) {
+      boost::mutex::scoped_try_lock lock(plannerMutex);
+      if (lock.owns_lock()) {
+        fftwf_plan plan = planGeometry(g, in, out,
+            FFTW_MEASURE | FFTW_WISDOM_ONLY);
+        if (plan) {
+          fftwf_destroy_plan(it->second.plan);
+          it->second.plan = plan;
+        }
+        it->second.estimated = false;
+      }
+    }
+    return it->second.plan;
+  }
+
+  FFTWEntry entry;
+  entry.plan = NULL;
+  entry.estimated = false;
+  {
+    boost::mutex::scoped_lock lock(plannerMutex);
+    if (wisdomOn) {
+      entry.plan = planGeometry(g, in, out, FFTW_MEASURE | FFTW_WISDOM_ONLY);
+    }
+    if (!entry.plan) {
+      entry.plan = planGeometry(g, in, out, FFTW_ESTIMATE);
+      entry.estimated = wisdomOn && scratchBytes(g) <= maxTuneBytes;
+    }
+  }
+  if (!entry.plan) {
+    throw std::runtime_error(g.r2c ? "fftwf_plan_many_dft_r2c() failed." :
+        "fftwf_plan_many_dft() failed.");
+  }
+  if (entry.estimated) {
+    enqueueTuning(key, g);
+  }
+  fftwPlans[key] = entry;
+  return entry.plan;
+}
+
+/* Wisdom is per CPU model; turn its name into something file-name safe */
+std::string cpuModel()
+{
+  std::string model;
+#ifdef _WIN32
+  const char* id = getenv("PROCESSOR_IDENTIFIER");
+  if (id) {
+    model = id;
+  }
+#else
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      model = line.substr(line.find(':') + 1);
+      break;
+    }
+  }
+#endif
+  std::string safe;
+  for (size_t i = 0; i < model.size(); ++i) {
+    char c = model[i];
+    if (isalnum((unsigned char)c) || c == '-' || c == '.') {
+      safe += c;
+    } else if (!safe.empty() && safe[safe.size() - 1] != '_') {
+      safe += '_';
+    }
+  }
+  while (!safe.empty() && safe[safe.size() - 1] == '_') {
+    safe.erase(safe.size() - 1);
+  }
+  return safe.empty() ? "unknown_cpu" : safe;
+}
+
+/* Merges what is on disk (other processes may have added to it) with
+   the wisdom gathered here and replaces the file atomically */
+void saveWisdom()
+{
+  boost::mutex::scoped_lock lock(plannerMutex);
+  fftwf_import_wisdom_from_filename(wisdomFile.c_str());
+  boost::filesystem::path target(wisdomFile);
+  boost::filesystem::path tmp = target.parent_path() /
+    boost::filesystem::unique_path(target.filename().string() + ".%%%%%%");
+  if (!fftwf_export_wisdom_to_filename(tmp.string().c_str())) {
+    std::cout << "Could not write FFTW wisdom to " << tmp.string() << std::endl;
+    return;
+  }
+  boost::system::error_code ec;
+  boost::filesystem::rename(tmp, target, ec);
+  if (ec) {
+    std::cout << "Could not write FFTW wisdom to " << wisdomFile << ": "
+              << ec.message() << std::endl;
+    boost::filesystem::remove(tmp, ec);
+  }
+}
+
+/* Stops the tuner: measurements not yet started are dropped (their
+   geometries get tuned by a later run), only the one in progress, which
+   FFTW cannot abandon, is waited for */
+/* Key and geometry of an FFTW C2C plan */
+PlanKey c2cKey(int rank, const int* n, int howmany,
+    fftwf_complex* in, const int* inembed, int istride, int idist,
+    fftwf_complex* out, const int* onembed, int ostride, int odist,
+    int sign, FFTWGeometry* g)
+{
+  PlanKey key = makeKey(KEY_FFTW, CUFFT_C2C, rank, n, inembed, istride,
+      idist, onembed, ostride, odist, howmany, sign);
+  addFFTWLayout(&key, (float*)in, (float*)out);
+  *g = makeGeometry(false, rank, n, howmany, inembed, istride,
+      idist, onembed, ostride, odist, sign, in == out);
+  return key;
+}
+
+void finishTuning()
+{
+  if (!tuneThread) {
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(tuneMutex);
+    tuneQueue.clear();
+    if (tuneBusy) {
+      std::cout << "Waiting for an FFT plan measurement to finish"
+                << std::endl;
+    }
+    tuneStop = true;
+    tuneCond.notify_one();
+  }
+  tuneThread->join();
+  delete tuneThread;
+  tuneThread = NULL;
+  tuneStop = false;
+}
+
+}
+
+cufftHandle cuPlanMany(int rank, const int* n,
+    const int* inembed, int istride, int idist,
+    const int* onembed, int ostride, int odist,
+    cufftType type, int batch)
+{
+  PlanKey key = makeKey(KEY_CUFFT, type, rank, n, inembed, istride, idist,
+      onembed, ostride, odist, batch, 0);
+  std::map<PlanKey, cufftHandle>::iterator it = cuPlans.find(key);
+  if (it != cuPlans.end()) {
+    return it->second;
+  }
+
+  // cufftPlanMany() takes non-const arrays
+  std::vector<int> nn(n, n + rank);
+  std::vector<int> in_embed, out_embed;
+  if (inembed) {
+    in_embed.assign(inembed, inembed + rank);
+  }
+  if (onembed) {
+    out_embed.assign(onembed, onembed + rank);
+  }
+  cufftHandle plan;
+  cufftResult err = cufftPlanMany(&plan, rank, &nn[0],
+      inembed ? &in_embed[0] : NULL, istride, idist,
+      onembed ? &out_embed[0] : NULL, ostride, odist,
+      type, batch);
+  if (err != CUFFT_SUCCESS) {
+    std::cout << "Error code: " << err << std::endl;
+    if (err == CUFFT_ALLOC_FAILED) {
+      std::cout << "CUFFT failed to allocate GPU or CPU memory" << std::endl;
+    }
+    throw std::runtime_error("cufftPlanMany() failed.");
+  }
+  cuPlans[key] = plan;
+  return plan;
+}
+
+cufftHandle cuPlanC2C(int nz, int ny, int nx)
+{
+  if (nz > 1) {
+    int n[3] = {nz, ny, nx};
+    return cuPlanMany(3, n, NULL, 1, 0, NULL, 1, 0, CUFFT_C2C, 1);
+  }
+  int n[2] = {ny, nx};
+  return cuPlanMany(2, n, NULL, 1, 0, NULL, 1, 0, CUFFT_C2C, 1);
+}
+
+fftwf_plan fftwPlanMany(int rank, const int* n, int howmany,
+    fftwf_complex* in, const int* inembed, int istride, int idist,
+    fftwf_complex* out, const int* onembed, int ostride, int odist,
+    int sign)
+{
+  FFTWGeometry g;
+  PlanKey key = c2cKey(rank, n, howmany, in, inembed, istride, idist,
+      out, onembed, ostride, odist, sign, &g);
+  return lookupFFTW(key, g, (float*)in, (float*)out);
+}
+
+fftwf_plan fftwPlanManyR2C(int rank, const int* n, int howmany,
+    float* in, const int* inembed, int istride, int idist,
+    fftwf_complex* out, const int* onembed, int ostride, int odist)
+{
+  PlanKey key = makeKey(KEY_FFTW, CUFFT_R2C, rank, n, inembed, istride,
+      idist, onembed, ostride, odist, howmany, FFTW_FORWARD);
+  addFFTWLayout(&key, in, (float*)out);
+  FFTWGeometry g = makeGeometry(true, rank, n, howmany, inembed, istride,
+      idist, onembed, ostride, odist, FFTW_FORWARD, in == (float*)out);
+  return lookupFFTW(key, g, in, (float*)out);
+}
+
+fftwf_plan fftwPlanC2C(int nz, int ny, int nx, fftwf_complex* in,
+    fftwf_complex* out, int sign)
+{
+  if (nz > 1) {
+    int n[3] = {nz, ny, nx};
+    return fftwPlanMany(3, n, 1, in, NULL, 1, 0, out, NULL, 1, 0, sign);
+  }
+  int n[2] = {ny, nx};
+  return fftwPlanMany(2, n, 1, in, NULL, 1, 0, out, NULL, 1, 0, sign);
+}
+
+void measureC2C(int nz, int ny, int nx, fftwf_complex* data, int sign)
+{
+  if (!wisdomOn) {
+    return;
+  }
+  int n[3] = {nz, ny, nx};
+  int rank = nz > 1 ? 3 : 2;
+  FFTWGeometry g;
+  PlanKey key = c2cKey(rank, nz > 1 ? n : n + 1, 1, data, NULL, 1, 0,
+      data, NULL, 1, 0, sign, &g);
+  std::map<PlanKey, FFTWEntry>::iterator it = fftwPlans.find(key);
+  if (it != fftwPlans.end() && !it->second.estimated) {
+    return;
+  }
+
+  fftwf_plan plan;
+  {
+    boost::mutex::scoped_lock lock(plannerMutex);
+    plan = planGeometry(g, (float*)data, (float*)data,
+        FFTW_MEASURE | FFTW_WISDOM_ONLY);
+    if (!plan) {
+      std::cout << "Measuring the FFT plan for " << nz << "x" << ny << "x"
+                << nx << std::endl;
+      plan = planGeometry(g, (float*)data, (float*)data, FFTW_MEASURE);
+    }
+  }
+  if (!plan) {
+    return;  // fftwPlanC2C() falls back to an estimated plan
+  }
+  if (it != fftwPlans.end()) {
+    fftwf_destroy_plan(it->second.plan);
+  }
+  FFTWEntry entry;
+  entry.plan = plan;
+  entry.estimated = false;
+  fftwPlans[key] = entry;
+}
+
+void useWisdom(const std::string& dir)
+{
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(dir, ec);
+  if (ec) {
+    std::cout << "Cannot create FFTW wisdom directory " << dir << ": "
+              << ec.message() << "; FFT plans will not be tuned" << std::endl;
+    return;
+  }
+  wisdomFile = (boost::filesystem::path(dir) /
+      ("fftwf_wisdom_" + cpuModel() + ".txt")).string();
+  wisdomOn = true;
+
+  boost::mutex::scoped_lock lock(plannerMutex);
+  if (fftwf_import_wisdom_from_filename(wisdomFile.c_str())) {
+    std::cout << "Loaded FFTW wisdom from " << wisdomFile << std::endl;
+  }
+}
+
+std::string defaultWisdomDir()
+{
+#ifdef _WIN32
+  const char* base = getenv("LOCALAPPDATA");
+  if (base) {
+    return (boost::filesystem::path(base) / "cudasirecon").string();
+  }
+#else
+  const char* base = getenv("HOME");
+  if (base) {
+    return (boost::filesystem::path(base) / ".cudasirecon").string();
+  }
+#endif
+  return "";
+}
+
+void clear()
+{
+  finishTuning();
+  if (wisdomOn) {
+    saveWisdom();
+  }
+
+  for (std::map<PlanKey, cufftHandle>::iterator it = cuPlans.begin();
+       it != cuPlans.end(); ++it) {
+    cufftDestroy(it->second);
+  }
+  cuPlans.clear();
+  for (std::map<PlanKey, FFTWEntry>::iterator it = fftwPlans.begin();
+       it != fftwPlans.end(); ++it) {
+    fftwf_destroy_plan(it->second.plan);
+  }
+  fftwPlans.clear();
+  tunedKeys.clear();
+}
+
+}
@@ -0,0 +1,153 @@
+#include "fileWatcher.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+bool fileMatchesPattern(const std::string& path, std::string pattern);
+
+FileWatcher::FileWatcher(const std::string& dir, const std::string& pattern) :
+  m_dir(dir), m_pattern(pattern)
+{
+  if (!boost::filesystem::is_directory(dir)) {
+    throw std::runtime_error("Cannot watch " + dir + ": not a folder");
+  }
+#ifdef __linux__
+  m_fd = inotify_init();
+  if (m_fd < 0) {
+    throw std::runtime_error(std::string("inotify_init: ") + strerror(errno));
+  }
+  if (inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    std::string error = strerror(errno);
+    ::close(m_fd);
+    throw std::runtime_error("Cannot watch " + dir + ": " + error);
+  }
+#endif
+}
+
+FileWatcher::~FileWatcher()
+{
+#ifdef __linux__
+  ::close(m_fd);
+#endif
+}
+
+void FileWatcher::markSeen(const std::string& path)
+{
+  m_seen.insert(path);
+}
+
+bool FileWatcher::next(std::string& path, int timeout)
+{
+  const time_t start = time(0);
+  while (m_ready.empty()) {
+    if (timeout > 0) {
+      int left = timeout - (int) difftime(time(0), start);
+      if (left <= 0) {
+        return false;
+      }
+    }
+    collect(1000);
+  }
+  path = m_ready.front();
+  m_ready.pop_front();
+  return true;
+}
+
+void FileWatcher::candidate(const std::string& path)
+{
+  if (m_seen.count(path) || !fileMatchesPattern(path, m_pattern)) {
+    return;
+  }
+  m_seen.insert(path);
+  m_ready.push_back(path);
+}
+
+void FileWatcher::rescan()
+{
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator i(m_dir); i != end; ++i) {
+    if (boost::filesystem::is_regular_file(i->status())) {
+      candidate(i->path().string());
+    }
+  }
+}
+
+#ifdef __linux__
+
+void FileWatcher::collect(int ms)
+{
+  struct pollfd pfd;
+  pfd.fd = m_fd;
+  pfd.events = POLLIN;
+  int n = poll(&pfd, 1, ms);
+  if (n < 0 && errno != EINTR) {
+    throw std::runtime_error(std::string("poll: ") + strerror(errno));
+  }
+  if (n <= 0) {
+    return;
+  }
+
+  char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read(m_fd, buf, sizeof(buf));
+  if (len < 0) {
+    if (errno == EINTR || errno == EAGAIN) {
+      return;
+    }
+    throw std::runtime_error(std::string("read inotify: ") + strerror(errno));
+  }
+  for (char* p = buf; p < buf + len; ) {
+    const struct inotify_event* event = (const struct inotify_event*) p;
+    if (event->mask & IN_Q_OVERFLOW) {
+      // events were dropped; whatever finished meanwhile is in the folder
+      rescan();
+    }
+    else if (event->len > 0) {
+      boost::filesystem::path path(m_dir);
+      path /= event->name;
+      candidate(path.string());
+    }
+    p += sizeof(struct inotify_event) + event->len;
+  }
+}
+
+#else
+
+void FileWatcher::collect(int ms)
+{
+  boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+
+  // without close notifications, a file counts as finished once its size
+  // is the same in two listings in a row
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator i(m_dir); i != end; ++i) {
+    if (!boost::filesystem::is_regular_file(i->status())) {
+      continue;
+    }
+    std::string path = i->path().string();
+    if (m_seen.count(path) || !fileMatchesPattern(path, m_pattern)) {
+      continue;
+    }
+    boost::uintmax_t size = boost::filesystem::file_size(i->path());
+    std::map<std::string, boost::uintmax_t>::iterator last = m_sizes.find(path);
+    if (last != m_sizes.end() && last->second == size && size > 0) {
+      m_sizes.erase(last);
+      candidate(path);
+    }
+    else {
+      m_sizes[path] = size;
+    }
+  }
+}
+
+#endif
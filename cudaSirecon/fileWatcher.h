@@ -0,0 +1,58 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+//! Reports new TIFF files in a folder as they are finished (TIFF mode --watch)
+/*!
+  Files are matched exactly like gatherMatchingFiles() matches them.  On
+  Linux the folder is watched with inotify and a file is reported when
+  the writer closes it (or renames it into the folder), so it is never
+  picked up half-written.  Elsewhere the folder is listed once a second
+  and a file is reported once its size has stayed the same between two
+  listings.
+
+  Every file is reported once; files the caller already knows about are
+  passed to markSeen() so that they are not reported again.
+ */
+class FileWatcher {
+public:
+  //! Starts watching folder 'dir'; throws std::runtime_error on failure
+  FileWatcher(const std::string& dir, const std::string& pattern);
+  ~FileWatcher();
+
+  void markSeen(const std::string& path);
+
+  //! Waits for the next finished matching file and puts its path in 'path'
+  /*! Returns false if none came within 'timeout' seconds; a timeout of 0
+      or less waits for ever. */
+  bool next(std::string& path, int timeout);
+
+private:
+  std::string m_dir, m_pattern;
+  std::set<std::string> m_seen;
+  std::deque<std::string> m_ready;  //! finished files not handed out yet
+#ifdef __linux__
+  int m_fd;  //! inotify instance
+#else
+  std::map<std::string, boost::uintmax_t> m_sizes;  //! size at the last listing of files still growing
+#endif
+
+  //! Waits up to 'ms' milliseconds for files to finish and queues them in m_ready
+  void collect(int ms);
+  //! Queues 'path' if it matches and has not been seen
+  void candidate(const std::string& path);
+  //! Queues every matching file now in the folder
+  void rescan();
+
+  // not copyable
+  FileWatcher(const FileWatcher&);
+  FileWatcher& operator=(const FileWatcher&);
+};
+
+#endif
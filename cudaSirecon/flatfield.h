@@ -0,0 +1,37 @@
+#ifndef FLATFIELD_H
+#define FLATFIELD_H
+
+/*
+  Raw data ingest: turns one raw 2D section into the flat-fielded and
+  scaled float rows the reconstruction works on, padded to nx+2 columns
+  for the in-place real-to-complex FFT that follows:
+
+    dest[l*(nx+2) + k] = ((raw[l*nx + k] - background[l*nx + k]
+                          - backgroundExtra) * slope[l*nx + k]) * inscale
+
+  background and slope are per-pixel maps of nx*ny floats; either may be
+  NULL, in which case that term is left out.  The two padding columns of
+  every row are set to 0.
+
+  Each row is converted, corrected and padded in a single pass, with
+  AVX-512 or AVX2 if the CPU supports it (decided once, at start-up) and
+  with plain C++ otherwise.  All variants give bit-identical results.
+*/
+namespace ingest {
+
+//! Unsigned 16-bit raw data in native byte order (MRC mode 6)
+void flatfield(const unsigned short* raw, float* dest, int nx, int ny,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale);
+
+//! 32-bit float raw data in native byte order (MRC mode 2, TIFF)
+void flatfield(const float* raw, float* dest, int nx, int ny,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale);
+
+//! Instruction set used by flatfield(): "avx512", "avx2" or "scalar"
+const char* isa();
+
+}
+
+#endif
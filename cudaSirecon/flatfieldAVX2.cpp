@@ -0,0 +1,68 @@
+/* AVX2 flat-field kernels; build with -mavx2 (or /arch:AVX2).  Without
+   those flags this file compiles to a stub and the scalar kernels are
+   used. */
+#include "flatfieldKernels.h"
+
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+namespace {
+
+inline __m256 load8(const unsigned short* p)
+{
+  return _mm256_cvtepi32_ps(
+      _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) p)));
+}
+
+inline __m256 load8(const float* p)
+{
+  return _mm256_loadu_ps(p);
+}
+
+template <bool BG, bool SLOPE, typename T>
+void avx2Row(const T* raw, float* dest, int nx, const float* background,
+    float backgroundExtra, const float* slope, float inscale)
+{
+  const __m256 extra = _mm256_set1_ps(backgroundExtra);
+  const __m256 scale = _mm256_set1_ps(inscale);
+  int k = 0;
+  for (; k + 8 <= nx; k += 8) {
+    __m256 v = load8(raw + k);
+    if (BG) {
+      v = _mm256_sub_ps(v, _mm256_loadu_ps(background + k));
+    }
+    v = _mm256_sub_ps(v, extra);
+    if (SLOPE) {
+      v = _mm256_mul_ps(v, _mm256_loadu_ps(slope + k));
+    }
+    _mm256_storeu_ps(dest + k, _mm256_mul_ps(v, scale));
+  }
+  flatfieldTail<BG, SLOPE>(raw, dest, k, nx, background, backgroundExtra,
+      slope, inscale);
+}
+
+}
+
+bool ingest::detail::avx2Kernels(Kernels* kernels)
+{
+  kernels->u16[variant(false, false)] = &avx2Row<false, false, unsigned short>;
+  kernels->u16[variant(false, true)] = &avx2Row<false, true, unsigned short>;
+  kernels->u16[variant(true, false)] = &avx2Row<true, false, unsigned short>;
+  kernels->u16[variant(true, true)] = &avx2Row<true, true, unsigned short>;
+  kernels->f32[variant(false, false)] = &avx2Row<false, false, float>;
+  kernels->f32[variant(false, true)] = &avx2Row<false, true, float>;
+  kernels->f32[variant(true, false)] = &avx2Row<true, false, float>;
+  kernels->f32[variant(true, true)] = &avx2Row<true, true, float>;
+  kernels->name = "avx2";
+  return true;
+}
+
+#else
+
+bool ingest::detail::avx2Kernels(Kernels*)
+{
+  return false;
+}
+
+#endif
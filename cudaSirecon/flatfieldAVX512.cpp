@@ -0,0 +1,68 @@
+/* AVX-512 flat-field kernels; build with -mavx512f (or /arch:AVX512).
+   Without those flags this file compiles to a stub and the AVX2 or
+   scalar kernels are used. */
+#include "flatfieldKernels.h"
+
+#ifdef __AVX512F__
+
+#include <immintrin.h>
+
+namespace {
+
+inline __m512 load16(const unsigned short* p)
+{
+  return _mm512_cvtepi32_ps(
+      _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*) p)));
+}
+
+inline __m512 load16(const float* p)
+{
+  return _mm512_loadu_ps(p);
+}
+
+template <bool BG, bool SLOPE, typename T>
+void avx512Row(const T* raw, float* dest, int nx, const float* background,
+    float backgroundExtra, const float* slope, float inscale)
+{
+  const __m512 extra = _mm512_set1_ps(backgroundExtra);
+  const __m512 scale = _mm512_set1_ps(inscale);
+  int k = 0;
+  for (; k + 16 <= nx; k += 16) {
+    __m512 v = load16(raw + k);
+    if (BG) {
+      v = _mm512_sub_ps(v, _mm512_loadu_ps(background + k));
+    }
+    v = _mm512_sub_ps(v, extra);
+    if (SLOPE) {
+      v = _mm512_mul_ps(v, _mm512_loadu_ps(slope + k));
+    }
+    _mm512_storeu_ps(dest + k, _mm512_mul_ps(v, scale));
+  }
+  flatfieldTail<BG, SLOPE>(raw, dest, k, nx, background, backgroundExtra,
+      slope, inscale);
+}
+
+}
+
+bool ingest::detail::avx512Kernels(Kernels* kernels)
+{
+  kernels->u16[variant(false, false)] = &avx512Row<false, false, unsigned short>;
+  kernels->u16[variant(false, true)] = &avx512Row<false, true, unsigned short>;
+  kernels->u16[variant(true, false)] = &avx512Row<true, false, unsigned short>;
+  kernels->u16[variant(true, true)] = &avx512Row<true, true, unsigned short>;
+  kernels->f32[variant(false, false)] = &avx512Row<false, false, float>;
+  kernels->f32[variant(false, true)] = &avx512Row<false, true, float>;
+  kernels->f32[variant(true, false)] = &avx512Row<true, false, float>;
+  kernels->f32[variant(true, true)] = &avx512Row<true, true, float>;
+  kernels->name = "avx512";
+  return true;
+}
+
+#else
+
+bool ingest::detail::avx512Kernels(Kernels*)
+{
+  return false;
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include "flatfield.h"
+#include "flatfieldKernels.h"
+#include "cpuFeatures.h"
+
+#include <cstddef>
+
+namespace {
+
+template <bool BG, bool SLOPE, typename T>
+void scalarRow(const T* raw, float* dest, int nx, const float* background,
+    float backgroundExtra, const float* slope, float inscale)
+{
+  flatfieldTail<BG, SLOPE>(raw, dest, 0, nx, background, backgroundExtra,
+      slope, inscale);
+}
+
+ingest::detail::Kernels selectKernels()
+{
+  ingest::detail::Kernels kernels;
+  ingest::detail::scalarKernels(&kernels);
+  cpufeatures::SimdLevel level = cpufeatures::simdLevel();
+  if (level >= cpufeatures::SIMD_AVX512 &&
+      ingest::detail::avx512Kernels(&kernels)) {
+    return kernels;
+  }
+  if (level >= cpufeatures::SIMD_AVX2) {
+    ingest::detail::avx2Kernels(&kernels);
+  }
+  return kernels;
+}
+
+// Chosen during static initialisation, before any loader thread exists
+const ingest::detail::Kernels theKernels = selectKernels();
+
+}
+
+namespace ingest {
+
+namespace detail {
+
+void scalarKernels(Kernels* kernels)
+{
+  kernels->u16[variant(false, false)] = &scalarRow<false, false, unsigned short>;
+  kernels->u16[variant(false, true)] = &scalarRow<false, true, unsigned short>;
+  kernels->u16[variant(true, false)] = &scalarRow<true, false, unsigned short>;
+  kernels->u16[variant(true, true)] = &scalarRow<true, true, unsigned short>;
+  kernels->f32[variant(false, false)] = &scalarRow<false, false, float>;
+  kernels->f32[variant(false, true)] = &scalarRow<false, true, float>;
+  kernels->f32[variant(true, false)] = &scalarRow<true, false, float>;
+  kernels->f32[variant(true, true)] = &scalarRow<true, true, float>;
+  kernels->name = "scalar";
+}
+
+}
+
+void flatfield(const unsigned short* raw, float* dest, int nx, int ny,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale)
+{
+  detail::RowU16 row = theKernels.u16[detail::variant(background != 0, slope != 0)];
+#pragma omp parallel for
+  for (int l = 0; l < ny; ++l) {
+    row(raw + (size_t) l * nx, dest + (size_t) l * (nx + 2), nx,
+        background ? background + (size_t) l * nx : 0, backgroundExtra,
+        slope ? slope + (size_t) l * nx : 0, inscale);
+  }
+}
+
+void flatfield(const float* raw, float* dest, int nx, int ny,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale)
+{
+  detail::RowF32 row = theKernels.f32[detail::variant(background != 0, slope != 0)];
+#pragma omp parallel for
+  for (int l = 0; l < ny; ++l) {
+    row(raw + (size_t) l * nx, dest + (size_t) l * (nx + 2), nx,
+        background ? background + (size_t) l * nx : 0, backgroundExtra,
+        slope ? slope + (size_t) l * nx : 0, inscale);
+  }
+}
+
+const char* isa()
+{
+  return theKernels.name;
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef FLATFIELD_KERNELS_H
+#define FLATFIELD_KERNELS_H
+
+/*
+  Internal to the flatfield*.cpp files: the per-row kernels and the
+  table flatfieldImpl.cpp dispatches through.  Each instruction set
+  lives in its own translation unit, compiled with the matching compiler
+  flags, so that nothing outside of it can end up with AVX code.
+*/
+namespace ingest {
+namespace detail {
+
+typedef void (*RowU16)(const unsigned short* raw, float* dest, int nx,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale);
+typedef void (*RowF32)(const float* raw, float* dest, int nx,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale);
+
+//! Row kernels, indexed by variant(background != 0, slope != 0)
+struct Kernels {
+  RowU16 u16[4];
+  RowF32 f32[4];
+  const char* name;
+};
+
+inline int variant(bool background, bool slope)
+{
+  return (background ? 2 : 0) + (slope ? 1 : 0);
+}
+
+void scalarKernels(Kernels* kernels);
+//! Fill in the AVX2 kernels; false if this build has none
+bool avx2Kernels(Kernels* kernels);
+//! Fill in the AVX-512 kernels; false if this build has none
+bool avx512Kernels(Kernels* kernels);
+
+}
+}
+
+namespace {
+
+/* Scalar loop over columns [k0, nx) of one row, used by every variant
+   for whatever is left after the vector loop.  It has internal linkage
+   on purpose: each kernel file gets its own copy compiled for its own
+   instruction set. */
+template <bool BG, bool SLOPE, typename T>
+inline void flatfieldTail(const T* raw, float* dest, int k0, int nx,
+    const float* background, float backgroundExtra, const float* slope,
+    float inscale)
+{
+  for (int k = k0; k < nx; ++k) {
+    float v = (float) raw[k];
+    if (BG) {
+      v -= background[k];
+    }
+    v -= backgroundExtra;
+    if (SLOPE) {
+      v *= slope[k];
+    }
+    dest[k] = v * inscale;
+  }
+  dest[nx] = 0.f;
+  dest[nx + 1] = 0.f;
+}
+
+}
+
+#endif
@@ -0,0 +1,99 @@
+#include "frameStream.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/cstdint.hpp>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+
+const size_t HEADER_BYTES = 32;
+
+template <typename T>
+T field(const unsigned char* header, size_t offset)
+{
+  T v;
+  memcpy(&v, header + offset, sizeof(T));
+  return v;
+}
+
+}
+
+FrameStream::FrameStream() : m_file(0), m_nx(0), m_ny(0), m_nz(0),
+  m_dxy(0.f), m_dz(0.f), m_wavelength(0)
+{
+}
+
+FrameStream::~FrameStream()
+{
+  close();
+}
+
+void FrameStream::open(const std::string& name)
+{
+  close();
+  m_name = name;
+  if (name == "-") {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    m_file = stdin;
+    m_name = "stdin";
+  }
+  else {
+    m_file = fopen(name.c_str(), "rb");
+    if (!m_file) {
+      throw std::runtime_error("Cannot open input stream " + name);
+    }
+  }
+
+  unsigned char header[HEADER_BYTES];
+  if (fread(header, 1, HEADER_BYTES, m_file) != HEADER_BYTES) {
+    close();
+    throw std::runtime_error("No frame stream header in " + name);
+  }
+  if (memcmp(header, "SIMF", 4)) {
+    close();
+    throw std::runtime_error(name + " is not a frame stream");
+  }
+  m_nx = field<boost::int32_t>(header, 4);
+  m_ny = field<boost::int32_t>(header, 8);
+  m_nz = field<boost::int32_t>(header, 12);
+  m_dxy = field<float>(header, 16);
+  m_dz = field<float>(header, 20);
+  m_wavelength = field<boost::int32_t>(header, 24);
+  if (m_nx <= 0 || m_ny <= 0 || m_nz <= 0 || !(m_dxy > 0.f)) {
+    close();
+    throw std::runtime_error("Invalid frame stream header in " + name);
+  }
+}
+
+void FrameStream::close()
+{
+  if (m_file && m_file != stdin) {
+    fclose(m_file);
+  }
+  m_file = 0;
+}
+
+bool FrameStream::readFrame(unsigned short* dest)
+{
+  const size_t nbytes = frameBytes();
+  size_t got = fread(dest, 1, nbytes, m_file);
+  if (got == nbytes) {
+    return true;
+  }
+  if (ferror(m_file)) {
+    throw std::runtime_error("Cannot read from " + m_name);
+  }
+  if (got == 0) {
+    return false;
+  }
+  throw std::runtime_error("Input stream " + m_name +
+      " ended in the middle of a frame");
+}
@@ -0,0 +1,65 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <cstdio>
+#include <cstddef>
+#include <string>
+
+//! Raw 16-bit frames read from a pipe, FIFO or stdin as they are acquired
+/*!
+  The stream starts with a 32-byte header in the writer's native byte
+  order:
+
+    offset  type      field
+       0    char[4]   "SIMF"
+       4    int32     nx
+       8    int32     ny
+      12    int32     nz (sections per direction and phase)
+      16    float32   x-y pixel size, microns
+      20    float32   z step, microns
+      24    int32     emission wavelength, nm
+      28    int32     reserved, 0
+
+  followed by any number of nx*ny uint16 frames, row by row.  Each
+  time point is ndirs*nphases*nz frames in the same order as the
+  sections of an MRC file; the stream simply ends after the last one.
+
+  Reads block until the writer delivers the data, so open() on a FIFO
+  waits for the writer to connect and readFrame() for the next frame.
+ */
+class FrameStream {
+public:
+  FrameStream();
+  ~FrameStream();
+
+  //! Opens 'name' ("-" for stdin) and reads the header; throws std::runtime_error on failure
+  void open(const std::string& name);
+  void close();
+  bool isOpen() const { return m_file != 0; };
+
+  int nx() const { return m_nx; };
+  int ny() const { return m_ny; };
+  int nz() const { return m_nz; };
+  float dxy() const { return m_dxy; };
+  float dz() const { return m_dz; };
+  int wavelength() const { return m_wavelength; };
+  size_t frameBytes() const { return (size_t) m_nx * m_ny * sizeof(unsigned short); };
+
+  //! Reads the next frame into dest (nx*ny values)
+  /*! Returns false if the stream ended cleanly before it; throws
+      std::runtime_error on a read error or a truncated frame. */
+  bool readFrame(unsigned short* dest);
+
+private:
+  std::string m_name;
+  FILE* m_file;
+  int m_nx, m_ny, m_nz;
+  float m_dxy, m_dz;
+  int m_wavelength;
+
+  // not copyable
+  FrameStream(const FrameStream&);
+  FrameStream& operator=(const FrameStream&);
+};
+
+#endif
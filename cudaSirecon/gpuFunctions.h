@@ -22,6 +22,17 @@ void image_arithmetic(GPUBuffer* a, const GPUBuffer& b,
     int offsetA, int offsetB,
     int len, float alpha, float beta);
 
+/*
+  Flat-fields the raw uint16 section starting at element rawOffset of raw
+  into the float section at offset of image, which has nx+2 columns
+  (padding set to 0):
+    ((raw - background - backgroundExtra) * slope) * inscale
+  background and slope are nx*ny maps; slope may be NULL (no correction)
+*/
+void flatfield_u16(const GPUBuffer& raw, size_t rawOffset, int nx, int ny,
+    const GPUBuffer& background, float backgroundExtra,
+    const GPUBuffer* slope, float inscale, GPUBuffer* image, int offset);
+
 void apodize(int napodize, int nx,int ny, GPUBuffer* image, int offset);
 void cosapodize(int nx,int ny, GPUBuffer* image, int offset);
 void rescale(int nx, int ny, int nz, int z, int zoffset, int direction,
@@ -36,6 +36,45 @@ __global__ void image_arithmetic_kernel(float* a, const float* b,
   }
 }
 
+__host__ void flatfield_u16(const GPUBuffer& raw, size_t rawOffset, int nx,
+    int ny, const GPUBuffer& background, float backgroundExtra,
+    const GPUBuffer* slope, float inscale, GPUBuffer* image, int offset)
+{
+  dim3 blockSize;
+  blockSize.x = 32;
+  blockSize.y = 8;
+  blockSize.z = 1;
+  dim3 numBlocks;
+  numBlocks.x = (int)(ceil((float)(nx + 2) / blockSize.x));
+  numBlocks.y = (int)(ceil((float)ny / blockSize.y));
+  numBlocks.z = 1;
+  flatfield_u16_kernel<<<numBlocks, blockSize>>>(
+      ((const unsigned short*)raw.getPtr()) + rawOffset, nx, ny,
+      (const float*)background.getPtr(), backgroundExtra,
+      slope ? (const float*)slope->getPtr() : 0, inscale,
+      ((float*)image->getPtr()) + offset);
+}
+
+__global__ void flatfield_u16_kernel(const unsigned short* raw, int nx,
+    int ny, const float* background, float backgroundExtra,
+    const float* slope, float inscale, float* image)
+{
+  int k = blockDim.x * blockIdx.x + threadIdx.x;
+  int l = blockDim.y * blockIdx.y + threadIdx.y;
+  if (k < nx + 2 && l < ny) {
+    float v = 0.f;
+    if (k < nx) {
+      // same operation order as the host kernels in flatfield.h
+      v = (float)raw[l * nx + k] - background[l * nx + k] - backgroundExtra;
+      if (slope) {
+        v *= slope[l * nx + k];
+      }
+      v *= inscale;
+    }
+    image[l * (nx + 2) + k] = v;
+  }
+}
+
 __host__ void apodize(int napodize, int nx,int ny, GPUBuffer* image,
     int offset)
 {
@@ -342,15 +381,8 @@ __host__ void findk0(std::vector<GPUBuffer>* bands, GPUBuffer* overlap0,
   GPUBuffer crosscorr_c(nx * ny * sizeof(cuFloatComplex), 0);
   aTimesConjB(overlap0, overlap1, nx, ny, nz, &crosscorr_c);
 
-  cufftHandle cufftplan;
-  int err = cufftPlan2d(&cufftplan, ny, nx, CUFFT_C2C);
-  if (CUFFT_SUCCESS != err) {
-    printf("cufftPlanxd failed\n");
-    printf("Error code: %d\n", err);
-    fflush(stdout);
-    exit(-1);
-  }
-  err = cufftExecC2C(cufftplan, (cuFloatComplex*)crosscorr_c.getPtr(),
+  cufftHandle cufftplan = fftplan::cuPlanC2C(1, ny, nx);
+  int err = cufftExecC2C(cufftplan, (cuFloatComplex*)crosscorr_c.getPtr(),
       (cuFloatComplex*)crosscorr_c.getPtr(), CUFFT_FORWARD);
   if (CUFFT_SUCCESS != err) {
     printf("cufftExecC2C failed at %s(%d)\n", __FILE__, __LINE__);
@@ -358,7 +390,6 @@ __host__ void findk0(std::vector<GPUBuffer>* bands, GPUBuffer* overlap0,
     fflush(stdout);
     exit(-1);
   }
-  cufftDestroy(cufftplan);
 
   GPUBuffer crosscorr(nx * ny * sizeof(float), 0);
   computeIntensities(&crosscorr_c, nx, ny, &crosscorr);
@@ -642,20 +673,8 @@ __host__ void makeoverlaps(std::vector<GPUBuffer>* bands,
   //  std::cout << "overlap 1:\n";
   //  overlap1->dump(std::cout, 2 * nx, 0, 2 * nx * sizeof(float));
   // Do ffts
-  cufftResult err;
-  cufftHandle cufftplan;
-  if (nz > 1) {
-    err = cufftPlan3d(&cufftplan, nz, ny, nx, CUFFT_C2C);
-  } else {
-    err = cufftPlan2d(&cufftplan, ny, nx, CUFFT_C2C);
-  }
-  if (CUFFT_SUCCESS != err) {
-    printf("cufftPlanxd failed\n");
-    printf("Error code: %d\n", err);
-    fflush(stdout);
-    exit(-1);
-  }
-  err = cufftExecC2C(cufftplan, (cuFloatComplex*)overlap0->getPtr(),
+  cufftHandle cufftplan = fftplan::cuPlanC2C(nz, ny, nx);
+  cufftResult err = cufftExecC2C(cufftplan, (cuFloatComplex*)overlap0->getPtr(),
       (cuFloatComplex*)overlap0->getPtr(), CUFFT_INVERSE);
   if (CUFFT_SUCCESS != err) {
     printf("cufftExecC2C failed at %s(%d)\n", __FILE__, __LINE__);
@@ -672,8 +691,6 @@ __host__ void makeoverlaps(std::vector<GPUBuffer>* bands,
     exit(-1);
   }
 
-  cufftDestroy(cufftplan);
-
 #ifndef NDEBUG
   assert(overlap0->hasNaNs() == false);
   assert(overlap1->hasNaNs() == false);
@@ -1788,19 +1805,12 @@ __host__ void assemblerealspacebands(int dir, GPUBuffer* outbuffer,
       (cuFloatComplex*)bands->at(0).getPtr(),
       0, (cuFloatComplex*)bigbuffer->getPtr(), nx, ny, nz, zoomfact, z_zoom);
 
-  cufftHandle myGPUPlan;
-  cufftResult cuFFTErr = cufftPlan3d(&myGPUPlan, (int) (z_zoom*nz), (int) (zoomfact*ny),
-                                     (int) (zoomfact*nx), CUFFT_C2C);
-  if (cuFFTErr!=CUFFT_SUCCESS) {
-    if (cuFFTErr == CUFFT_ALLOC_FAILED)
-      printf("\n*** In assemblerealspacebands(), CUFFT failed to allocate GPU or CPU memory\n");
-    throw std::runtime_error("CUFFT plan creation failed");
-  }
+  cufftHandle myGPUPlan = fftplan::cuPlanC2C((int) (z_zoom*nz), (int) (zoomfact*ny),
+                                             (int) (zoomfact*nx));
 
   /* transform it */
   printf("re-transforming centerband\n");
-  cuFFTErr = CUFFT_SUCCESS;
-  cuFFTErr = cufftExecC2C(myGPUPlan,
+  cufftResult cuFFTErr = cufftExecC2C(myGPUPlan,
       (cuFloatComplex*)bigbuffer->getPtr(),
       (cuFloatComplex*)bigbuffer->getPtr(),
       CUFFT_INVERSE);
@@ -1849,7 +1859,6 @@ __host__ void assemblerealspacebands(int dir, GPUBuffer* outbuffer,
   /* Free memory */
   cutilSafeCall(cudaFree((void *) dev_coslookup));
   cutilSafeCall(cudaFree((void *) dev_sinlookup));
-  cufftDestroy(myGPUPlan);
   return;
 }
 
@@ -45,6 +45,9 @@ __constant__ float const_sepMatrix[(MAX_ORDERS * 2 - 1) * MAX_PHASES];
 
 __global__ void image_arithmetic_kernel(float* a, const float* b,
     int len, float alpha, float beta);
+__global__ void flatfield_u16_kernel(const unsigned short* raw, int nx,
+    int ny, const float* background, float backgroundExtra,
+    const float* slope, float inscale, float* image);
 __global__ void apodize_x_kernel(int napodize, int nx, int ny,
     float* image);
 __global__ void apodize_y_kernel(int napodize, int nx, int ny,
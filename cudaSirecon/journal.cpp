@@ -0,0 +1,154 @@
+#include "journal.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+void syncToDisk(FILE* file)
+{
+  fflush(file);
+#ifdef _WIN32
+  _commit(_fileno(file));
+#else
+  fsync(fileno(file));
+#endif
+}
+
+//! Cuts 'file' off after its first 'size' bytes
+bool truncateTo(FILE* file, long size)
+{
+  fflush(file);
+#ifdef _WIN32
+  return _chsize(_fileno(file), size) == 0;
+#else
+  return ftruncate(fileno(file), size) == 0;
+#endif
+}
+
+}
+
+Journal::Journal() : m_file(0)
+{
+}
+
+Journal::~Journal()
+{
+  close();
+}
+
+int Journal::open(const std::string& fname, const std::string& signature)
+{
+  close();
+  m_fname = fname;
+  m_values.clear();
+
+  int ndone = 0;
+  bool empty = true;
+  long complete = 0;  // bytes up to the end of the last complete record
+  if (FILE* in = fopen(fname.c_str(), "rb")) {
+    char line[65536];
+    while (fgets(line, sizeof(line), in)) {
+      std::string record(line);
+      if (record.empty() || record[record.size() - 1] != '\n') {
+        break;  // cut off by a crash
+      }
+      complete += (long) record.size();
+      record.erase(record.size() - 1);
+      if (!record.empty() && record[record.size() - 1] == '\r') {
+        record.erase(record.size() - 1);  // written in text mode on Windows
+      }
+      if (empty) {
+        if (record != signature) {
+          fclose(in);
+          throw std::runtime_error("Journal " + fname + " belongs to another run (" +
+              record + "); remove it to start over");
+        }
+        empty = false;
+        continue;
+      }
+      std::string::size_type space = record.find(' ');
+      std::string key = record.substr(0, space);
+      if (key == "done") {
+        ++ndone;  // time points are written in order
+      }
+      else {
+        m_values[key] = space == std::string::npos ? "" : record.substr(space + 1);
+      }
+    }
+    fclose(in);
+  }
+
+  m_file = fopen(fname.c_str(), empty ? "w" : "a");
+  if (!m_file) {
+    throw std::runtime_error("Cannot write journal " + fname);
+  }
+  // drop a record cut off by a crash, or the next one would be appended
+  // to it
+  if (!empty && !truncateTo(m_file, complete)) {
+    close();
+    throw std::runtime_error("Cannot write journal " + fname);
+  }
+  if (empty) {
+    fprintf(m_file, "%s\n", signature.c_str());
+    syncToDisk(m_file);
+  }
+  return ndone;
+}
+
+void Journal::close()
+{
+  if (m_file) {
+    fclose(m_file);
+  }
+  m_file = 0;
+}
+
+void Journal::append(const std::string& key, const std::string& value)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  if (fprintf(m_file, "%s %s\n", key.c_str(), value.c_str()) < 0) {
+    throw std::runtime_error("Cannot write journal " + m_fname);
+  }
+  syncToDisk(m_file);
+}
+
+void Journal::done(int it)
+{
+  std::ostringstream value;
+  value << it;
+  append("done", value.str());
+}
+
+std::string Journal::value(const std::string& key) const
+{
+  std::map<std::string, std::string>::const_iterator i = m_values.find(key);
+  return i == m_values.end() ? std::string() : i->second;
+}
+
+bool syncFile(const std::string& fname)
+{
+#ifdef _WIN32
+  int fd = _open(fname.c_str(), _O_RDWR);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = _commit(fd) == 0;
+  _close(fd);
+#else
+  int fd = ::open(fname.c_str(), O_RDWR);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  ::close(fd);
+#endif
+  return ok;
+}
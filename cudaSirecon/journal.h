@@ -0,0 +1,58 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+//! Append-only log of a run's progress, for --resume
+/*!
+  A text file of one record per line, "key value...".  The first line
+  is a signature of the run (input, output, sizes, ...) so a journal is
+  never applied to a different run.  Every append() goes to disk before
+  it returns, so after a crash the journal holds everything up to the
+  last complete record.
+
+  Reading it back keeps the last record of every key; "done" records
+  (one per finished time point) are counted instead.  Records can be
+  appended from several threads.
+ */
+class Journal {
+public:
+  Journal();
+  ~Journal();
+
+  //! Opens journal 'fname' for appending, reading what is in it already
+  /*! A missing or empty file is started with 'signature'; returns the
+      number of time points recorded as done.  Throws std::runtime_error
+      if the file belongs to a run with another signature. */
+  int open(const std::string& fname, const std::string& signature);
+  bool isOpen() const { return m_file != 0; };
+  void close();
+
+  //! Appends record "key value" and flushes it to disk
+  void append(const std::string& key, const std::string& value);
+  //! Records time point 'it' as done
+  void done(int it);
+  //! Value of the last record with 'key' read by open(); empty if there was none
+  std::string value(const std::string& key) const;
+
+private:
+  std::string m_fname;
+  FILE* m_file;
+  std::map<std::string, std::string> m_values;
+  boost::mutex m_mutex;
+
+  // not copyable
+  Journal(const Journal&);
+  Journal& operator=(const Journal&);
+};
+
+//! Flushes what has been written to file 'fname', through any handle, to disk
+/*! For files written by a library that does not expose its handle; false
+    if the file cannot be opened or synced */
+bool syncFile(const std::string& fname);
+
+#endif
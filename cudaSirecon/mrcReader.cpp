@@ -0,0 +1,255 @@
+#include "mrcReader.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Byte offsets into the 1024-byte Priism header
+const size_t HDR_SIZE = 1024;
+const size_t OFS_NX = 0;
+const size_t OFS_NY = 4;
+const size_t OFS_NZ = 8;
+const size_t OFS_MODE = 12;
+const size_t OFS_NEXT = 92;       // extended header size in bytes
+const size_t OFS_DVID = 96;
+const size_t OFS_NINT = 128;
+const size_t OFS_NREAL = 130;
+const size_t OFS_NTIMES = 180;
+const size_t OFS_INTERLEAVE = 182;
+const size_t OFS_NWAVES = 196;
+const size_t OFS_WAVELENGTHS = 198;  // five shorts, one per channel
+
+const short DV_ID = -16224;
+
+// Image sequence codes, as in IWApiConstants.h
+const int ZTW_SEQ = 0;
+const int WZT_SEQ = 1;
+const int ZWT_SEQ = 2;
+
+size_t bytesPerPixel(int mode)
+{
+  switch (mode) {
+  case MRCReader::MODE_BYTE:
+    return 1;
+  case MRCReader::MODE_SHORT:
+  case MRCReader::MODE_USHORT:
+    return 2;
+  case MRCReader::MODE_FLOAT:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+}
+
+MRCReader::MRCReader() : m_data(0), m_nx(0), m_ny(0), m_nz(0),
+  m_nsections(0), m_nwaves(0), m_ntimes(0), m_mode(0), m_interleave(0),
+  m_nint(0), m_nreal(0), m_swapped(false), m_extBytes(0), m_sectionBytes(0),
+  m_nextRecords(0)
+{
+}
+
+MRCReader::MRCReader(const std::string& fname) : m_data(0), m_nx(0),
+  m_ny(0), m_nz(0), m_nsections(0), m_nwaves(0), m_ntimes(0), m_mode(0),
+  m_interleave(0), m_nint(0), m_nreal(0), m_swapped(false), m_extBytes(0),
+  m_sectionBytes(0), m_nextRecords(0)
+{
+  open(fname);
+}
+
+void MRCReader::open(const std::string& fname)
+{
+  using namespace boost::interprocess;
+  close();
+  m_fname = fname;
+  try {
+    file_mapping file(fname.c_str(), read_only);
+    mapped_region region(file, read_only);
+    m_file.swap(file);
+    m_region.swap(region);
+  }
+  catch (interprocess_exception &e) {
+    throw std::runtime_error("Cannot map " + fname + ": " + e.what());
+  }
+  if (m_region.get_size() < HDR_SIZE) {
+    close();
+    throw std::runtime_error(fname + " is too short to be an MRC file");
+  }
+  m_data = static_cast<const char*>(m_region.get_address());
+
+  // The DV id tells the byte order; plain MRC files are recognised by
+  // whether the mode only makes sense one way round
+  short dvid = 0;
+  std::memcpy(&dvid, m_data + OFS_DVID, sizeof(dvid));
+  if (dvid == DV_ID) {
+    m_swapped = false;
+  } else if (swapBytes(dvid) == DV_ID) {
+    m_swapped = true;
+  } else {
+    int mode = 0;
+    std::memcpy(&mode, m_data + OFS_MODE, sizeof(mode));
+    m_swapped = (mode < 0 || mode > 16);
+  }
+
+  m_nx = headerInt(OFS_NX);
+  m_ny = headerInt(OFS_NY);
+  m_nsections = headerInt(OFS_NZ);
+  m_mode = headerInt(OFS_MODE);
+  m_extBytes = headerInt(OFS_NEXT);
+  m_nint = headerShort(OFS_NINT);
+  m_nreal = headerShort(OFS_NREAL);
+  m_ntimes = headerShort(OFS_NTIMES);
+  m_interleave = headerShort(OFS_INTERLEAVE);
+  m_nwaves = headerShort(OFS_NWAVES);
+  if (m_ntimes < 1) {
+    m_ntimes = 1;
+  }
+  if (m_nwaves < 1) {
+    m_nwaves = 1;
+  }
+  m_nz = m_nsections / (m_nwaves * m_ntimes);
+
+  size_t bpp = bytesPerPixel(m_mode);
+  if (bpp == 0) {
+    std::ostringstream msg;
+    msg << fname << ": unsupported MRC mode " << m_mode;
+    close();
+    throw std::runtime_error(msg.str());
+  }
+  m_sectionBytes = (size_t) m_nx * m_ny * bpp;
+  if (HDR_SIZE + m_extBytes + m_sectionBytes * m_nsections >
+      m_region.get_size()) {
+    close();
+    throw std::runtime_error(fname + " is shorter than its header says");
+  }
+
+  readExtHeader();
+}
+
+void MRCReader::readExtHeader()
+{
+  m_extInts.clear();
+  m_extFloats.clear();
+  m_nextRecords = 0;
+  size_t recordBytes = (size_t)(m_nint + m_nreal) * 4;
+  if (m_nint < 0 || m_nreal < 0 || recordBytes == 0) {
+    return;
+  }
+  m_nextRecords = (int) (m_extBytes / recordBytes);
+  if (m_nextRecords > m_nsections) {
+    m_nextRecords = m_nsections;
+  }
+  m_extInts.resize((size_t) m_nextRecords * m_nint);
+  m_extFloats.resize((size_t) m_nextRecords * m_nreal);
+
+  const char* rec = m_data + HDR_SIZE;
+  for (int sec = 0; sec < m_nextRecords; ++sec, rec += recordBytes) {
+    if (m_nint) {
+      std::memcpy(&m_extInts[(size_t) sec * m_nint], rec, m_nint * 4);
+    }
+    if (m_nreal) {
+      std::memcpy(&m_extFloats[(size_t) sec * m_nreal], rec + m_nint * 4,
+          m_nreal * 4);
+    }
+  }
+  if (m_swapped) {
+    for (size_t i = 0; i < m_extInts.size(); ++i) {
+      m_extInts[i] = swapBytes(m_extInts[i]);
+    }
+    for (size_t i = 0; i < m_extFloats.size(); ++i) {
+      m_extFloats[i] = swapBytes(m_extFloats[i]);
+    }
+  }
+}
+
+void MRCReader::close()
+{
+  boost::interprocess::mapped_region().swap(m_region);
+  boost::interprocess::file_mapping().swap(m_file);
+  m_data = 0;
+  m_nextRecords = 0;
+  m_extInts.clear();
+  m_extFloats.clear();
+}
+
+int MRCReader::sectionIndex(int z, int wave, int time) const
+{
+  switch (m_interleave) {
+  case WZT_SEQ:
+    return wave + m_nwaves * (z + m_nz * time);
+  case ZWT_SEQ:
+    return z + m_nz * (wave + m_nwaves * time);
+  case ZTW_SEQ:
+  default:
+    return z + m_nz * (time + m_ntimes * wave);
+  }
+}
+
+size_t MRCReader::sectionOffset(int z, int wave, int time) const
+{
+  int sec = sectionIndex(z, wave, time);
+  if (!m_data || z < 0 || z >= m_nz || sec < 0 || sec >= m_nsections) {
+    std::ostringstream msg;
+    msg << m_fname << ": no section (z=" << z << ", w=" << wave << ", t="
+        << time << ")";
+    throw std::runtime_error(msg.str());
+  }
+  return HDR_SIZE + m_extBytes + m_sectionBytes * sec;
+}
+
+const void* MRCReader::section(int z, int wave, int time) const
+{
+  return m_data + sectionOffset(z, wave, time);
+}
+
+const int* MRCReader::extInts(int z, int wave, int time) const
+{
+  int sec = sectionIndex(z, wave, time);
+  if (m_nint == 0 || sec < 0 || sec >= m_nextRecords) {
+    return 0;
+  }
+  return &m_extInts[(size_t) sec * m_nint];
+}
+
+const float* MRCReader::extFloats(int z, int wave, int time) const
+{
+  int sec = sectionIndex(z, wave, time);
+  if (m_nreal == 0 || sec < 0 || sec >= m_nextRecords) {
+    return 0;
+  }
+  return &m_extFloats[(size_t) sec * m_nreal];
+}
+
+float MRCReader::extFloat(int z, int wave, int time, int i) const
+{
+  const float* ext = extFloats(z, wave, time);
+  if (!ext || i < 0 || i >= m_nreal) {
+    return 0.f;
+  }
+  return ext[i];
+}
+
+int MRCReader::headerInt(size_t offset) const
+{
+  int v;
+  std::memcpy(&v, m_data + offset, sizeof(v));
+  return m_swapped ? swapBytes(v) : v;
+}
+
+int MRCReader::wavelength(int wave) const
+{
+  if (!m_data || wave < 0 || wave >= 5) {
+    return 0;
+  }
+  return headerShort(OFS_WAVELENGTHS + wave * sizeof(short));
+}
+
+short MRCReader::headerShort(size_t offset) const
+{
+  short v;
+  std::memcpy(&v, m_data + offset, sizeof(v));
+  return m_swapped ? swapBytes(v) : v;
+}
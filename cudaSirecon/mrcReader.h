@@ -0,0 +1,121 @@
+#ifndef MRC_READER_H
+#define MRC_READER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+//! Read-only, memory-mapped access to Priism MRC/DV image files
+/*!
+  The whole file is mapped into memory and the 1024-byte header is
+  parsed directly, so every 2D section can be handed out as a pointer
+  into the page cache instead of being copied through IMLIB's stream
+  buffers.  Nothing is mutable after open(), so a const MRCReader can be
+  used from any number of threads at once.
+
+  Pixels are returned in the file's own type (see mode()) and byte
+  order (see byteSwapped()); use pixel() to read one as float.
+
+  The extended header (per-section timestamps, exposure backgrounds,
+  phases, ...) is small, so open() reads all of it once into two tables
+  in native byte order, one row per section.  Looking a value up is then
+  an index calculation, with no I/O or byte swapping.
+ */
+class MRCReader {
+public:
+  //! MRC data modes understood by the reader
+  enum Mode {
+    MODE_BYTE = 0,    /**< unsigned 8-bit */
+    MODE_SHORT = 1,   /**< signed 16-bit */
+    MODE_FLOAT = 2,   /**< 32-bit float */
+    MODE_USHORT = 6   /**< unsigned 16-bit */
+  };
+
+  MRCReader();
+  //! Same as default construction followed by open()
+  explicit MRCReader(const std::string& fname);
+
+  //! Maps file 'fname' and parses its header; throws std::runtime_error on failure
+  void open(const std::string& fname);
+  void close();
+  bool isOpen() const { return m_data != 0; };
+
+  int nx() const { return m_nx; };
+  int ny() const { return m_ny; };
+  //! Number of z sections per (wave, time), as IMPosnZWT() counts them
+  int nz() const { return m_nz; };
+  int nwaves() const { return m_nwaves; };
+  int ntimes() const { return m_ntimes; };
+  //! Emission wavelength in nm of channel 'wave' (the header has room for five)
+  int wavelength(int wave) const;
+  int mode() const { return m_mode; };
+  //! True if the file was written on a machine of the other endianness
+  bool byteSwapped() const { return m_swapped; };
+
+  //! Index of section (z, wave, time) in file order, honouring the header's interleave
+  int sectionIndex(int z, int wave, int time) const;
+  //! Zero-copy pointer to section (z, wave, time); throws if out of range
+  const void* section(int z, int wave, int time) const;
+  //! Byte offset of section (z, wave, time) in the file, for reading it other than through the mapping; throws if out of range
+  size_t sectionOffset(int z, int wave, int time) const;
+  size_t sectionBytes() const { return m_sectionBytes; };
+
+  int nExtInts() const { return m_nint; };
+  int nExtFloats() const { return m_nreal; };
+  //! The nExtInts() ints of the extended header of section (z, wave, time); 0 if it has none
+  const int* extInts(int z, int wave, int time) const;
+  //! The nExtFloats() floats of the extended header of section (z, wave, time); 0 if it has none
+  const float* extFloats(int z, int wave, int time) const;
+  //! i-th float of the extended header of section (z, wave, time); 0 if there is none
+  float extFloat(int z, int wave, int time, int i) const;
+
+  //! Value of the i-th pixel of a section returned by section(), as float
+  template <typename T>
+  float pixel(const T* sec, size_t i) const {
+    return m_swapped ? (float) swapBytes(sec[i]) : (float) sec[i];
+  }
+
+  template <typename T>
+  static T swapBytes(T v) {
+    T r;
+    const char* s = reinterpret_cast<const char*>(&v);
+    char* d = reinterpret_cast<char*>(&r);
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      d[i] = s[sizeof(T) - 1 - i];
+    }
+    return r;
+  }
+
+private:
+  boost::interprocess::file_mapping m_file;
+  boost::interprocess::mapped_region m_region;
+  const char* m_data;
+  std::string m_fname;
+
+  int m_nx, m_ny, m_nz;
+  int m_nsections;
+  int m_nwaves, m_ntimes;
+  int m_mode;
+  int m_interleave;
+  int m_nint, m_nreal;
+  bool m_swapped;
+  size_t m_extBytes;
+  size_t m_sectionBytes;
+  int m_nextRecords;  // sections that have an extended header record
+  std::vector<int> m_extInts;  // m_nextRecords rows of m_nint
+  std::vector<float> m_extFloats;  // m_nextRecords rows of m_nreal
+
+  void readExtHeader();
+
+  int headerInt(size_t offset) const;
+  short headerShort(size_t offset) const;
+
+  // not copyable
+  MRCReader(const MRCReader&);
+  MRCReader& operator=(const MRCReader&);
+};
+
+#endif
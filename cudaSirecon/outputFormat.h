@@ -0,0 +1,40 @@
+#ifndef OUTPUT_FORMAT_H
+#define OUTPUT_FORMAT_H
+
+#include <cstddef>
+
+/*
+  Conversions of reconstructed float data to the compact output types
+  (--outputmode), run by the output writer thread.  Like the ingest
+  kernels in flatfield.h they use AVX2/F16C when the CPU has it and give
+  the same results as the scalar code otherwise.
+*/
+namespace outfmt {
+
+//! Output pixel types
+enum Mode {
+  OUTPUT_FLOAT = 0,   /**< 32-bit float, MRC mode 2 */
+  OUTPUT_HALF = 1,    /**< IEEE 754 half precision, MRC mode 12 */
+  OUTPUT_UINT16 = 2   /**< unsigned 16-bit, MRC mode 6, with a linear scale */
+};
+
+//! MRC2014 data mode of IEEE half precision floats (IMLIB has no name for it)
+const int MRC_MODE_HALF = 12;
+
+//! Largest value of a scaled uint16 pixel
+const float UINT16_RANGE = 65535.f;
+
+//! Float to half, rounding to nearest even; overflows become infinity
+void toHalf(const float* src, unsigned short* dest, size_t n);
+
+/* Quantizes to uint16 so that src ~= offset + scale * dest: dest is
+   (src - offset) / scale rounded to nearest and clamped to [0, 65535]. */
+void toScaledU16(const float* src, unsigned short* dest, size_t n,
+    float offset, float scale);
+
+//! Minimum and maximum of n > 0 values
+void minMax(const float* src, size_t n, float* minval, float* maxval);
+
+}
+
+#endif
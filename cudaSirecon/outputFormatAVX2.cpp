@@ -0,0 +1,94 @@
+/* AVX2/F16C output conversion kernels; build with -mavx2 -mf16c (or
+   /arch:AVX2).  Without those flags this file compiles to a stub and
+   the scalar kernels are used. */
+#include "outputFormatKernels.h"
+
+#if defined(__AVX2__) && (defined(__F16C__) || defined(_MSC_VER))
+
+#include <immintrin.h>
+
+namespace {
+
+void avx2ToHalf(const float* src, unsigned short* dest, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+        _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*) (dest + i), h);
+  }
+  toHalfTail(src, dest, i, n);
+}
+
+void avx2ToScaledU16(const float* src, unsigned short* dest, size_t n,
+    float offset, float inv)
+{
+  const __m256 vOffset = _mm256_set1_ps(offset);
+  const __m256 vInv = _mm256_set1_ps(inv);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 top = _mm256_set1_ps(65535.f);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256 a = _mm256_loadu_ps(src + i);
+    __m256 b = _mm256_loadu_ps(src + i + 8);
+    a = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(a, vOffset), vInv), half);
+    b = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(b, vOffset), vInv), half);
+    // max() returns its second operand for NaN, so NaN goes to 0
+    a = _mm256_min_ps(_mm256_max_ps(a, zero), top);
+    b = _mm256_min_ps(_mm256_max_ps(b, zero), top);
+    __m256i packed = _mm256_packus_epi32(_mm256_cvttps_epi32(a),
+        _mm256_cvttps_epi32(b));
+    // packus works within 128-bit lanes; put the quadwords back in order
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    _mm256_storeu_si256((__m256i*) (dest + i), packed);
+  }
+  toScaledU16Tail(src, dest, i, n, offset, inv);
+}
+
+void avx2MinMax(const float* src, size_t n, float* minval, float* maxval)
+{
+  size_t i = 0;
+  float lo = src[0];
+  float hi = src[0];
+  if (n >= 8) {
+    __m256 vlo = _mm256_loadu_ps(src);
+    __m256 vhi = vlo;
+    for (i = 8; i + 8 <= n; i += 8) {
+      __m256 v = _mm256_loadu_ps(src + i);
+      vlo = _mm256_min_ps(v, vlo);
+      vhi = _mm256_max_ps(v, vhi);
+    }
+    float los[8], his[8];
+    _mm256_storeu_ps(los, vlo);
+    _mm256_storeu_ps(his, vhi);
+    lo = los[0];
+    hi = his[0];
+    minMaxTail(los, 1, 8, &lo, &hi);
+    minMaxTail(his, 1, 8, &lo, &hi);
+  } else {
+    i = 1;
+  }
+  minMaxTail(src, i, n, &lo, &hi);
+  *minval = lo;
+  *maxval = hi;
+}
+
+}
+
+bool outfmt::detail::avx2Kernels(Kernels* kernels)
+{
+  kernels->toHalf = &avx2ToHalf;
+  kernels->toScaledU16 = &avx2ToScaledU16;
+  kernels->minMax = &avx2MinMax;
+  return true;
+}
+
+#else
+
+bool outfmt::detail::avx2Kernels(Kernels*)
+{
+  return false;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include "outputFormat.h"
+#include "outputFormatKernels.h"
+#include "cpuFeatures.h"
+
+namespace {
+
+void scalarToHalf(const float* src, unsigned short* dest, size_t n)
+{
+  toHalfTail(src, dest, 0, n);
+}
+
+void scalarToScaledU16(const float* src, unsigned short* dest, size_t n,
+    float offset, float inv)
+{
+  toScaledU16Tail(src, dest, 0, n, offset, inv);
+}
+
+void scalarMinMax(const float* src, size_t n, float* minval, float* maxval)
+{
+  *minval = src[0];
+  *maxval = src[0];
+  minMaxTail(src, 1, n, minval, maxval);
+}
+
+outfmt::detail::Kernels selectKernels()
+{
+  outfmt::detail::Kernels kernels;
+  outfmt::detail::scalarKernels(&kernels);
+  if (cpufeatures::simdLevel() >= cpufeatures::SIMD_AVX2) {
+    outfmt::detail::avx2Kernels(&kernels);
+  }
+  return kernels;
+}
+
+// Chosen during static initialisation, before the writer thread exists
+const outfmt::detail::Kernels theKernels = selectKernels();
+
+}
+
+namespace outfmt {
+
+namespace detail {
+
+void scalarKernels(Kernels* kernels)
+{
+  kernels->toHalf = &scalarToHalf;
+  kernels->toScaledU16 = &scalarToScaledU16;
+  kernels->minMax = &scalarMinMax;
+}
+
+}
+
+void toHalf(const float* src, unsigned short* dest, size_t n)
+{
+  theKernels.toHalf(src, dest, n);
+}
+
+void toScaledU16(const float* src, unsigned short* dest, size_t n,
+    float offset, float scale)
+{
+  theKernels.toScaledU16(src, dest, n, offset, 1.f / scale);
+}
+
+void minMax(const float* src, size_t n, float* minval, float* maxval)
+{
+  theKernels.minMax(src, n, minval, maxval);
+}
+
+}
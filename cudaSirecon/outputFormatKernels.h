@@ -0,0 +1,100 @@
+#ifndef OUTPUT_FORMAT_KERNELS_H
+#define OUTPUT_FORMAT_KERNELS_H
+
+#include <cstddef>
+#include <cstring>
+
+/*
+  Internal to the outputFormat*.cpp files, on the same pattern as
+  flatfieldKernels.h: one translation unit per instruction set, and a
+  table outputFormatImpl.cpp dispatches through.
+*/
+namespace outfmt {
+namespace detail {
+
+struct Kernels {
+  void (*toHalf)(const float* src, unsigned short* dest, size_t n);
+  void (*toScaledU16)(const float* src, unsigned short* dest, size_t n,
+      float offset, float inv);
+  void (*minMax)(const float* src, size_t n, float* minval, float* maxval);
+};
+
+void scalarKernels(Kernels* kernels);
+//! Fill in the AVX2/F16C kernels; false if this build has none
+bool avx2Kernels(Kernels* kernels);
+
+}
+}
+
+namespace {
+
+/* Scalar versions, also used for the tails of the vector loops; internal
+   linkage so that each kernel file has its own copy (see
+   flatfieldKernels.h) */
+
+inline unsigned short halfFromFloat(float f)
+{
+  // Round to nearest even, the same as F16C's _MM_FROUND_TO_NEAREST_INT
+  unsigned int x;
+  std::memcpy(&x, &f, sizeof(x));
+  const unsigned short sign = (unsigned short) ((x >> 16) & 0x8000);
+  x &= 0x7fffffff;
+  if (x >= 0x7f800000) {
+    // infinity stays infinity, NaN becomes a quiet NaN
+    return sign | 0x7c00 |
+      (x > 0x7f800000 ? 0x200 | ((x >> 13) & 0x3ff) : 0);
+  }
+  if (x >= 0x47800000) {
+    return sign | 0x7c00;   // too big for a half
+  }
+  if (x < 0x38800000) {
+    // half subnormal (or zero): let a float addition do the rounding
+    const unsigned int magicBits = 126u << 23;   // 0.5f
+    float magic, sum;
+    std::memcpy(&magic, &magicBits, sizeof(magic));
+    std::memcpy(&sum, &x, sizeof(sum));
+    sum += magic;
+    unsigned int s;
+    std::memcpy(&s, &sum, sizeof(s));
+    return sign | (unsigned short) (s - magicBits);
+  }
+  const unsigned int mantOdd = (x >> 13) & 1;
+  x += ((unsigned int) (15 - 127) << 23) + 0xfff + mantOdd;
+  return sign | (unsigned short) (x >> 13);
+}
+
+inline void toHalfTail(const float* src, unsigned short* dest, size_t i,
+    size_t n)
+{
+  for (; i < n; ++i) {
+    dest[i] = halfFromFloat(src[i]);
+  }
+}
+
+inline void toScaledU16Tail(const float* src, unsigned short* dest,
+    size_t i, size_t n, float offset, float inv)
+{
+  for (; i < n; ++i) {
+    float q = (src[i] - offset) * inv + 0.5f;
+    q = q > 0.f ? q : 0.f;   // NaN goes to 0 too
+    q = q < 65535.f ? q : 65535.f;
+    dest[i] = (unsigned short) q;
+  }
+}
+
+inline void minMaxTail(const float* src, size_t i, size_t n,
+    float* minval, float* maxval)
+{
+  for (; i < n; ++i) {
+    if (src[i] < *minval) {
+      *minval = src[i];
+    }
+    if (src[i] > *maxval) {
+      *maxval = src[i];
+    }
+  }
+}
+
+}
+
+#endif
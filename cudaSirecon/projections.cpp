@@ -0,0 +1,134 @@
+#include "projections.h"
+
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+//! False for NaN and infinities (x - x is NaN for both)
+inline bool finite(float x)
+{
+  return x - x == 0.f;
+}
+
+}
+
+namespace proj {
+
+void maxXY(const float* volume, int nx, int ny, int nz, float* dest)
+{
+  // every thread reduces its own rows over all sections, reading them
+  // in memory order
+#pragma omp parallel for
+  for (int y = 0; y < ny; ++y) {
+    float* out = dest + (size_t) y * nx;
+    memcpy(out, volume + (size_t) y * nx, nx * sizeof(float));
+    for (int z = 1; z < nz; ++z) {
+      const float* row = volume + ((size_t) z * ny + y) * nx;
+      for (int x = 0; x < nx; ++x) {
+        if (row[x] > out[x]) {
+          out[x] = row[x];
+        }
+      }
+    }
+  }
+}
+
+void maxXZ(const float* volume, int nx, int ny, int nz, float* dest)
+{
+#pragma omp parallel for
+  for (int z = 0; z < nz; ++z) {
+    float* out = dest + (size_t) z * nx;
+    const float* section = volume + (size_t) z * ny * nx;
+    memcpy(out, section, nx * sizeof(float));
+    for (int y = 1; y < ny; ++y) {
+      const float* row = section + (size_t) y * nx;
+      for (int x = 0; x < nx; ++x) {
+        if (row[x] > out[x]) {
+          out[x] = row[x];
+        }
+      }
+    }
+  }
+}
+
+int shrinkFactor(int nx, int ny, int size)
+{
+  int longest = nx > ny ? nx : ny;
+  int factor = size > 0 ? (longest + size - 1) / size : 1;
+  return factor > 1 ? factor : 1;
+}
+
+void downsample(const float* image, int nx, int ny, int factor, float* dest)
+{
+  const int outNx = nx / factor, outNy = ny / factor;
+  const float norm = 1.f / (factor * factor);
+#pragma omp parallel for
+  for (int y = 0; y < outNy; ++y) {
+    float* out = dest + (size_t) y * outNx;
+    for (int x = 0; x < outNx; ++x) {
+      out[x] = 0.f;
+    }
+    for (int l = 0; l < factor; ++l) {
+      const float* row = image + ((size_t) y * factor + l) * nx;
+      for (int x = 0; x < outNx; ++x) {
+        for (int k = 0; k < factor; ++k) {
+          out[x] += row[x * factor + k];
+        }
+      }
+    }
+    for (int x = 0; x < outNx; ++x) {
+      out[x] *= norm;
+    }
+  }
+}
+
+void toU8(const float* src, size_t n, unsigned char* dest)
+{
+  // the range of the finite values; the others become 0
+  float lo = FLT_MAX, hi = -FLT_MAX;
+  const int count = (int) n;
+#pragma omp parallel
+  {
+    float threadLo = FLT_MAX, threadHi = -FLT_MAX;
+#pragma omp for
+    for (int i = 0; i < count; ++i) {
+      if (finite(src[i])) {
+        if (src[i] < threadLo) {
+          threadLo = src[i];
+        }
+        if (src[i] > threadHi) {
+          threadHi = src[i];
+        }
+      }
+    }
+#pragma omp critical(projectionsToU8)
+    {
+      if (threadLo < lo) {
+        lo = threadLo;
+      }
+      if (threadHi > hi) {
+        hi = threadHi;
+      }
+    }
+  }
+  const float scale = hi > lo ? 255.f / (hi - lo) : 0.f;
+#pragma omp parallel for
+  for (int i = 0; i < count; ++i) {
+    dest[i] = finite(src[i]) ? (unsigned char) ((src[i] - lo) * scale + 0.5f) : 0;
+  }
+}
+
+bool writePgm(const std::string& fname, int nx, int ny, const unsigned char* pixels)
+{
+  FILE* file = fopen(fname.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = fprintf(file, "P5\n%d %d\n255\n", nx, ny) > 0 &&
+    fwrite(pixels, 1, (size_t) nx * ny, file) == (size_t) nx * ny;
+  return fclose(file) == 0 && ok;
+}
+
+}
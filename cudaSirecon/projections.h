@@ -0,0 +1,35 @@
+#ifndef PROJECTIONS_H
+#define PROJECTIONS_H
+
+#include <cstddef>
+#include <string>
+
+/*
+  Small previews of a reconstructed volume (--mip), made by the output
+  writer thread from the volume it is about to write, so nobody has to
+  read the output back for them.  Volumes are nz sections of ny rows of
+  nx floats.  The reductions run on an OpenMP thread team.
+*/
+namespace proj {
+
+//! Maximum over z of every (x, y) pixel: ny rows of nx values
+void maxXY(const float* volume, int nx, int ny, int nz, float* dest);
+
+//! Maximum over y of every (x, z) pixel: nz rows of nx values
+void maxXZ(const float* volume, int nx, int ny, int nz, float* dest);
+
+//! Factor by which an nx by ny image is shrunk so neither side exceeds 'size' (at least 1)
+int shrinkFactor(int nx, int ny, int size);
+
+//! Mean of every 'factor' by 'factor' block: (ny/factor) rows of (nx/factor) values
+void downsample(const float* image, int nx, int ny, int factor, float* dest);
+
+//! n values scaled from [min, max] of the finite values of 'src' to 0..255; NaNs and infinities become 0
+void toU8(const float* src, size_t n, unsigned char* dest);
+
+//! Write an nx by ny 8-bit image as a binary PGM file; false on failure
+bool writePgm(const std::string& fname, int nx, int ny, const unsigned char* pixels);
+
+}
+
+#endif
@@ -0,0 +1,323 @@
+#include "shmRing.h"
+
+#include <stdexcept>
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+const int MAX_SLOTS = 64;
+const size_t DATA_OFFSET = 4096;  // the slots start on the page after the header
+const char MAGIC[8] = "SIMRING";
+const int LIVENESS_SECONDS = 1;  // how often a waiting side checks on the other
+
+std::string shmName(const std::string& name)
+{
+  return name.empty() || name[0] == '/' ? name : "/" + name;
+}
+
+std::string errorText(const std::string& what)
+{
+  return what + ": " + strerror(errno);
+}
+
+}
+
+struct ShmRingHeader {
+  char magic[8];  // written last by create(), so attach() sees a complete header
+  boost::uint64_t slotBytes;
+  boost::int32_t nslots;
+  ShmRingInfo info;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  boost::uint64_t head;  // slots written so far
+  boost::uint64_t tail;  // slots read so far
+  boost::int32_t finished;
+  boost::int32_t producerPid;
+  boost::int32_t consumerPid;  // 0 until a consumer has attached
+  boost::int64_t tags[MAX_SLOTS];
+};
+
+namespace {
+
+class Lock {
+public:
+  explicit Lock(ShmRingHeader* header) : m_header(header) {
+    check(pthread_mutex_lock(&m_header->mutex));
+  }
+  ~Lock() {
+    pthread_mutex_unlock(&m_header->mutex);
+  }
+  //! Waits for a change; marks the ring finished if process 'peer' is gone
+  /*! A side that dies without holding the mutex cannot be noticed by
+      the mutex, so the waiting side wakes up every LIVENESS_SECONDS to
+      look for it */
+  void wait(boost::int32_t peer) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + LIVENESS_SECONDS;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    int err = pthread_cond_timedwait(&m_header->changed, &m_header->mutex,
+        &deadline);
+    if (err == ETIMEDOUT) {
+      if (peer && kill(peer, 0) < 0 && errno == ESRCH) {
+        m_header->finished = 1;
+        pthread_cond_broadcast(&m_header->changed);
+      }
+      return;
+    }
+    check(err);
+  }
+private:
+  ShmRingHeader* m_header;
+
+  // 'err' of locking the mutex; throws unless it is held
+  void check(int err) {
+#ifdef __linux__
+    if (err == EOWNERDEAD) {
+      // the other side died holding the (robust) mutex.  The counters are
+      // only ever changed one at a time, so the header is still usable;
+      // nothing more will come from it
+      pthread_mutex_consistent(&m_header->mutex);
+      m_header->finished = 1;
+      pthread_cond_broadcast(&m_header->changed);
+      return;
+    }
+#endif
+    if (err) {
+      errno = err;
+      throw std::runtime_error(errorText("Shared-memory ring lock"));
+    }
+  }
+};
+
+}
+
+ShmRing::ShmRing() : m_header(0), m_data(0), m_mapBytes(0), m_owner(false)
+{
+}
+
+ShmRing::~ShmRing()
+{
+  if (m_header && m_owner) {
+    finish();
+  }
+  unmap();
+  if (m_owner) {
+    shm_unlink(m_name.c_str());
+  }
+}
+
+void ShmRing::create(const std::string& name, size_t slotBytes, int nslots,
+    const ShmRingInfo& info)
+{
+  if (nslots < 1 || nslots > MAX_SLOTS || slotBytes == 0) {
+    throw std::runtime_error("Invalid shared-memory ring size for " + name);
+  }
+  if (sizeof(ShmRingHeader) > DATA_OFFSET) {
+    throw std::runtime_error("ShmRingHeader does not fit its page");
+  }
+  m_name = shmName(name);
+  shm_unlink(m_name.c_str());  // a ring left over from an earlier run
+  // only the user who runs both sides can open it
+  int fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    throw std::runtime_error(errorText("Cannot create shared memory " + m_name));
+  }
+  const size_t nbytes = DATA_OFFSET + slotBytes * nslots;
+  if (ftruncate(fd, nbytes) < 0) {
+    std::string error = errorText("Cannot size shared memory " + m_name);
+    close(fd);
+    shm_unlink(m_name.c_str());
+    throw std::runtime_error(error);
+  }
+  map(fd, nbytes);
+  m_owner = true;
+
+  memset(m_header, 0, sizeof(ShmRingHeader));
+  m_header->slotBytes = slotBytes;
+  m_header->nslots = nslots;
+  m_header->info = info;
+  m_header->producerPid = getpid();
+
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+  // if one side dies holding it, the other gets EOWNERDEAD instead of hanging
+  pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+#endif
+  pthread_mutex_init(&m_header->mutex, &mutexAttr);
+  pthread_mutexattr_destroy(&mutexAttr);
+  pthread_condattr_t condAttr;
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&m_header->changed, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+
+  __sync_synchronize();
+  memcpy(m_header->magic, MAGIC, sizeof(MAGIC));
+}
+
+void ShmRing::attach(const std::string& name)
+{
+  m_name = shmName(name);
+  for (;;) {
+    int fd = shm_open(m_name.c_str(), O_RDWR, 0);
+    if (fd < 0 && errno != ENOENT) {
+      throw std::runtime_error(errorText("Cannot open shared memory " + m_name));
+    }
+    if (fd >= 0) {
+      struct stat st;
+      if (fstat(fd, &st) == 0 && (size_t) st.st_size > DATA_OFFSET) {
+        map(fd, st.st_size);
+        __sync_synchronize();
+        if (!memcmp(m_header->magic, MAGIC, sizeof(MAGIC)) &&
+            DATA_OFFSET + m_header->slotBytes * m_header->nslots <= m_mapBytes) {
+          Lock lock(m_header);
+          m_header->consumerPid = getpid();
+          return;
+        }
+        unmap();
+      }
+      else {
+        close(fd);
+      }
+    }
+    // the producer has not created it (completely) yet
+    usleep(100000);
+  }
+}
+
+void ShmRing::map(int fd, size_t nbytes)
+{
+  void* p = mmap(0, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  std::string error = errorText("Cannot map shared memory " + m_name);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw std::runtime_error(error);
+  }
+  m_header = (ShmRingHeader*) p;
+  m_data = (char*) p + DATA_OFFSET;
+  m_mapBytes = nbytes;
+}
+
+void ShmRing::unmap()
+{
+  if (m_header) {
+    munmap(m_header, m_mapBytes);
+  }
+  m_header = 0;
+  m_data = 0;
+  m_mapBytes = 0;
+}
+
+const ShmRingInfo& ShmRing::info() const
+{
+  return m_header->info;
+}
+
+size_t ShmRing::slotBytes() const
+{
+  return m_header->slotBytes;
+}
+
+int ShmRing::nslots() const
+{
+  return m_header->nslots;
+}
+
+void* ShmRing::beginWrite(bool wait)
+{
+  Lock lock(m_header);
+  while (m_header->head - m_header->tail >= (boost::uint64_t) m_header->nslots) {
+    if (!wait) {
+      return 0;
+    }
+    if (m_header->finished) {
+      // only the consumer going away finishes the ring before finish()
+      throw std::runtime_error("The reader of shared-memory ring " + m_name +
+          " has gone away");
+    }
+    lock.wait(m_header->consumerPid);
+  }
+  return m_data + (m_header->head % m_header->nslots) * m_header->slotBytes;
+}
+
+void ShmRing::endWrite(boost::int64_t tag)
+{
+  Lock lock(m_header);
+  m_header->tags[m_header->head % m_header->nslots] = tag;
+  ++m_header->head;
+  pthread_cond_broadcast(&m_header->changed);
+}
+
+void ShmRing::finish()
+{
+  Lock lock(m_header);
+  m_header->finished = 1;
+  pthread_cond_broadcast(&m_header->changed);
+}
+
+const void* ShmRing::beginRead(boost::int64_t* tag)
+{
+  Lock lock(m_header);
+  while (m_header->head == m_header->tail && !m_header->finished) {
+    lock.wait(m_header->producerPid);
+  }
+  if (m_header->head == m_header->tail) {
+    return 0;
+  }
+  int slot = m_header->tail % m_header->nslots;
+  if (tag) {
+    *tag = m_header->tags[slot];
+  }
+  return m_data + slot * m_header->slotBytes;
+}
+
+void ShmRing::endRead()
+{
+  Lock lock(m_header);
+  ++m_header->tail;
+  pthread_cond_broadcast(&m_header->changed);
+}
+
+#else
+
+namespace {
+
+void unsupported()
+{
+  throw std::runtime_error("Shared-memory rings are not supported on Windows");
+}
+
+}
+
+ShmRing::ShmRing() : m_header(0), m_data(0), m_mapBytes(0), m_owner(false) {}
+ShmRing::~ShmRing() {}
+void ShmRing::create(const std::string&, size_t, int, const ShmRingInfo&) { unsupported(); }
+void ShmRing::attach(const std::string&) { unsupported(); }
+const ShmRingInfo& ShmRing::info() const { static ShmRingInfo none; unsupported(); return none; }
+size_t ShmRing::slotBytes() const { return 0; }
+int ShmRing::nslots() const { return 0; }
+void* ShmRing::beginWrite(bool) { unsupported(); return 0; }
+void ShmRing::endWrite(boost::int64_t) { unsupported(); }
+void ShmRing::finish() { unsupported(); }
+const void* ShmRing::beginRead(boost::int64_t*) { unsupported(); return 0; }
+void ShmRing::endRead() { unsupported(); }
+void ShmRing::map(int, size_t) {}
+void ShmRing::unmap() {}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <cstddef>
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+struct ShmRingHeader;
+
+//! What the slots of a ShmRing hold; filled in by whoever creates the ring
+struct ShmRingInfo {
+  boost::int32_t nx, ny, nz;  //! section size and sections per direction and phase (raw) or per volume (output)
+  float dxy, dz;  //! microns
+  boost::int32_t wavelength;  //! nm
+  boost::int32_t reserved[2];
+};
+
+//! Single-producer, single-consumer ring of fixed-size slots in POSIX shared memory
+/*!
+  One process create()s the ring under a name and writes into it; the
+  other attach()es to it by the same name and reads.  Slots go round in
+  order: the producer fills the slot returned by beginWrite() and hands
+  it over with endWrite(); the consumer gets the oldest filled slot from
+  beginRead() and gives it back with endRead().  Slots are used in place
+  on both sides, so nothing is copied by the ring itself.
+
+  The head and tail counters live in the shared header next to a
+  process-shared mutex and condition variable, so both sides sleep while
+  they wait.  When the producer calls finish(), the consumer gets the
+  remaining slots and then beginRead() returns 0.  The ring also counts
+  as finished when the other side dies: a waiting side checks every
+  second whether the other process still exists, and on Linux the mutex
+  is robust, so dying while holding it is noticed as well.  A producer
+  waiting for a slot then gets a std::runtime_error.  The shared memory
+  is only accessible to the user who created it.
+
+  cudasirecon reads raw time points from a ring with --shm and publishes
+  its output volumes to one with --shmout; shmRingTool is a producer and
+  viewer to try them out with.  Not available on Windows.
+ */
+class ShmRing {
+public:
+  ShmRing();
+  //! Unmaps the ring; the creator also removes the name
+  ~ShmRing();
+
+  //! Creates (or replaces) ring 'name' with 'nslots' slots of 'slotBytes'; throws std::runtime_error on failure
+  void create(const std::string& name, size_t slotBytes, int nslots,
+      const ShmRingInfo& info);
+  //! Attaches to ring 'name', waiting for its creator if it does not exist yet
+  void attach(const std::string& name);
+
+  const ShmRingInfo& info() const;
+  size_t slotBytes() const;
+  int nslots() const;
+  //! First byte of the slot memory, nslots()*slotBytes() long
+  void* data() const { return m_data; };
+
+  //! Producer: the next free slot; waits for one if 'wait', else returns 0 if the ring is full
+  void* beginWrite(bool wait = true);
+  //! Producer: publishes the slot from beginWrite() with a caller-defined tag (e.g. the time point)
+  void endWrite(boost::int64_t tag = 0);
+  //! Producer: no more slots will come
+  void finish();
+
+  //! Consumer: the oldest filled slot, waiting for one; 0 once the producer has finished and all are read
+  const void* beginRead(boost::int64_t* tag = 0);
+  //! Consumer: gives the slot from beginRead() back to the producer
+  void endRead();
+
+private:
+  std::string m_name;
+  ShmRingHeader* m_header;
+  char* m_data;
+  size_t m_mapBytes;
+  bool m_owner;
+
+  void map(int fd, size_t nbytes);
+  void unmap();
+
+  // not copyable
+  ShmRing(const ShmRing&);
+  ShmRing& operator=(const ShmRing&);
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+  Producer and viewer for cudasirecon's shared-memory rings (see
+  shmRing.h), to try the live path on one machine without a microscope:
+
+    shmRingTool produce raw [nx ny nz ndirs nphases ntimes nslots]
+    cudasirecon raw out.dv otf.otf -c config --shm --shmout recon
+    shmRingTool view recon
+
+  'produce' creates ring "raw" and fills it with synthetic SIM time
+  points: a sinusoidal pattern for every direction and phase, on a
+  background, with some noise.  'view' attaches to ring "recon" and
+  prints the range of every reconstructed volume and how long after
+  the previous one it came.
+*/
+#include "shmRing.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <exception>
+#include <string>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace {
+
+int argument(int argc, char** argv, int i, int defaultValue)
+{
+  return i < argc ? atoi(argv[i]) : defaultValue;
+}
+
+void produce(const std::string& name, int nx, int ny, int nz, int ndirs,
+    int nphases, int ntimes, int nslots)
+{
+  ShmRingInfo info;
+  info.nx = nx;
+  info.ny = ny;
+  info.nz = nz;
+  info.dxy = 0.08f;
+  info.dz = 0.125f;
+  info.wavelength = 528;
+  info.reserved[0] = info.reserved[1] = 0;
+  const size_t framePixels = (size_t) nx * ny;
+  const int nframes = ndirs * nz * nphases;
+
+  ShmRing ring;
+  ring.create(name, framePixels * nframes * sizeof(unsigned short), nslots, info);
+  printf("Created ring %s: %d slots of %d %dx%d frames\n", name.c_str(),
+      nslots, nframes, nx, ny);
+
+  // pattern with a 0.2 micron line spacing, like the default k0 guess
+  const double kmag = 2 * M_PI * info.dxy / 0.2;
+  for (int it = 0; it < ntimes; ++it) {
+    unsigned short* slot = (unsigned short*) ring.beginWrite();
+    // frames in MRC order: direction, z, phase
+    for (int frame = 0; frame < nframes; ++frame) {
+      int direction = frame / (nz * nphases);
+      int phase = frame % nphases;
+      double angle = M_PI * direction / ndirs;
+      double kx = kmag * cos(angle), ky = kmag * sin(angle);
+      double phi = 2 * M_PI * phase / nphases;
+      unsigned short* pixel = slot + frame * framePixels;
+      for (int y = 0; y < ny; ++y) {
+        for (int x = 0; x < nx; ++x) {
+          double v = 300 + 200 * (1 + cos(kx * x + ky * y + phi)) +
+            20 * (rand() / (double) RAND_MAX - 0.5);
+          *pixel++ = (unsigned short) v;
+        }
+      }
+    }
+    ring.endWrite(it);
+    printf("Time point %d written\n", it);
+  }
+  ring.finish();
+}
+
+void view(const std::string& name)
+{
+  ShmRing ring;
+  ring.attach(name);
+  const ShmRingInfo& info = ring.info();
+  const size_t n = (size_t) info.nx * info.ny * info.nz;
+  printf("Attached to ring %s: %dx%dx%d volumes\n", name.c_str(),
+      info.nx, info.ny, info.nz);
+
+  boost::posix_time::ptime last = boost::posix_time::microsec_clock::local_time();
+  boost::int64_t tag;
+  const float* volume;
+  while ((volume = (const float*) ring.beginRead(&tag)) != 0) {
+    float vmin = volume[0], vmax = volume[0];
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (volume[i] < vmin) {
+        vmin = volume[i];
+      }
+      if (volume[i] > vmax) {
+        vmax = volume[i];
+      }
+      sum += volume[i];
+    }
+    ring.endRead();
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::local_time();
+    printf("Time point %d: min %g, max %g, mean %g (%.3f s after the last)\n",
+        (int) tag, vmin, vmax, sum / n,
+        (now - last).total_microseconds() / 1e6);
+    last = now;
+  }
+  printf("Ring %s finished\n", name.c_str());
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || (std::string(argv[1]) != "produce" &&
+        std::string(argv[1]) != "view")) {
+    fprintf(stderr,
+        "usage: %s produce NAME [nx ny nz ndirs nphases ntimes nslots]\n"
+        "       %s view NAME\n", argv[0], argv[0]);
+    return 1;
+  }
+  try {
+    if (std::string(argv[1]) == "produce") {
+      produce(argv[2], argument(argc, argv, 3, 512), argument(argc, argv, 4, 512),
+          argument(argc, argv, 5, 1), argument(argc, argv, 6, 3),
+          argument(argc, argv, 7, 5), argument(argc, argv, 8, 10),
+          argument(argc, argv, 9, 4));
+    }
+    else {
+      view(argv[2]);
+    }
+  }
+  catch (std::exception &e) {
+    fprintf(stderr, "\n!!Error occurred: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include "tiffReader.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <tiffio.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+extern "C" int load_tiff_current_mt(TIFF *const *tifs, const int ntifs, const unsigned colind, float *const buffer);
+
+TIFFReader::TIFFReader() : m_nx(0), m_ny(0), m_nchannels(0)
+{
+}
+
+TIFFReader::~TIFFReader()
+{
+  close();
+}
+
+void TIFFReader::open(const std::string& fname)
+{
+  close();
+
+  TIFF* tif = TIFFOpen(fname.c_str(), "r");
+  if (!tif) {
+    throw std::runtime_error("Cannot open TIFF file " + fname);
+  }
+  uint32 nx = 0, ny = 0;
+  uint16 spp = 1;
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &nx);
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ny);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  // only the directory headers are read here, not the image data
+  do {
+    m_offsets.push_back(TIFFCurrentDirOffset(tif));
+  } while (TIFFReadDirectory(tif));
+
+  m_fname = fname;
+  m_nx = nx;
+  m_ny = ny;
+  m_nchannels = spp;
+  m_handles.push_back(tif);
+}
+
+void TIFFReader::close()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  for (size_t i = 0; i < m_handles.size(); ++i) {
+    TIFFClose(m_handles[i]);
+  }
+  m_handles.clear();
+  m_offsets.clear();
+  m_nx = m_ny = m_nchannels = 0;
+}
+
+void TIFFReader::readSection(int section, float* buffer, int channel) const
+{
+  if (section < 0 || section >= nsections()) {
+    std::ostringstream msg;
+    msg << "Section " << section << " is out of range in " << m_fname;
+    throw std::runtime_error(msg.str());
+  }
+  // Called from a parallel loop over sections, each call decodes on its
+  // own thread; otherwise the page's strips are spread over one handle
+  // per thread
+  int nthreads = 1;
+#ifdef _OPENMP
+  if (!omp_in_parallel()) {
+    nthreads = omp_get_max_threads();
+  }
+#endif
+  std::vector<TIFF*> tifs;
+  bool ok = true;
+  try {
+    for (int i = 0; i < nthreads && ok; ++i) {
+      tifs.push_back(takeHandle());
+      ok = TIFFSetSubDirectory(tifs.back(), m_offsets[section]) != 0;
+    }
+  }
+  catch (...) {
+    for (size_t i = 0; i < tifs.size(); ++i) {
+      returnHandle(tifs[i]);
+    }
+    throw;
+  }
+  ok = ok && load_tiff_current_mt(&tifs[0], (int) tifs.size(), channel, buffer);
+  for (size_t i = 0; i < tifs.size(); ++i) {
+    returnHandle(tifs[i]);
+  }
+  if (!ok) {
+    std::ostringstream msg;
+    msg << "Cannot read section " << section << " of " << m_fname;
+    throw std::runtime_error(msg.str());
+  }
+}
+
+tiff* TIFFReader::takeHandle() const
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (!m_handles.empty()) {
+      TIFF* tif = m_handles.back();
+      m_handles.pop_back();
+      return tif;
+    }
+  }
+  TIFF* tif = TIFFOpen(m_fname.c_str(), "r");
+  if (!tif) {
+    throw std::runtime_error("Cannot open TIFF file " + m_fname);
+  }
+  return tif;
+}
+
+void TIFFReader::returnHandle(tiff* handle) const
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_handles.push_back(handle);
+}
@@ -0,0 +1,62 @@
+#ifndef TIFF_READER_H
+#define TIFF_READER_H
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+struct tiff;
+
+//! Section-at-a-time reader of multi-page TIFF stacks (TIFF mode input)
+/*!
+  open() only walks the chain of image directories, remembering where
+  each one is, so no pixel data is read until readSection() asks for a
+  page; that page alone is decoded, straight into the caller's buffer.
+
+  libtiff handles are not thread-safe, so the reader keeps a small pool
+  of them on the same file: readSection() borrows one (opening another
+  if all are busy) and gives it back, and can therefore be called from
+  several threads at once.  A call made outside of any OpenMP parallel
+  region borrows one handle per thread instead and decodes the strips or
+  tiles of the page in parallel.
+ */
+class TIFFReader {
+public:
+  TIFFReader();
+  ~TIFFReader();
+
+  //! Opens file 'fname' and indexes its pages; throws std::runtime_error on failure
+  void open(const std::string& fname);
+  void close();
+  bool isOpen() const { return !m_offsets.empty(); };
+
+  int nx() const { return m_nx; };
+  int ny() const { return m_ny; };
+  //! Number of pages (TIFF directories)
+  int nsections() const { return (int) m_offsets.size(); };
+  //! Samples per pixel of the first page
+  int nchannels() const { return m_nchannels; };
+
+  //! Decodes sample 'channel' of page 'section' into buffer (nx*ny floats)
+  /*! Throws std::runtime_error on failure. */
+  void readSection(int section, float* buffer, int channel = 0) const;
+
+private:
+  std::string m_fname;
+  int m_nx, m_ny, m_nchannels;
+  std::vector<boost::uint64_t> m_offsets;  //! file offset of every directory
+
+  mutable boost::mutex m_mutex;
+  mutable std::vector<tiff*> m_handles;  //! idle handles
+
+  tiff* takeHandle() const;
+  void returnHandle(tiff* handle) const;
+
+  // not copyable
+  TIFFReader(const TIFFReader&);
+  TIFFReader& operator=(const TIFFReader&);
+};
+
+#endif
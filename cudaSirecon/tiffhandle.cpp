@@ -1,5 +1,16 @@
 #include <tiffio.h>
 
+#include <cstring>
+#include <vector>
+
+#ifdef __SIRECON_USE_ZLIB__
+#include <zlib.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #define cimg_for1(bound,i) for (int i = 0; i<(int)(bound); ++i)
 #define cimg_forX(width,x) cimg_for1(width,x)
 #define cimg_forY(height,y) cimg_for1(height,y)
@@ -7,119 +18,157 @@
 #define cimg_forXY(width,height,x,y) cimg_forY(height,y) cimg_forX(width,x)
 
 
-// "t" is the datatype of the TIFF file, while "T" is datatype of memory storage
+/*
+  The _load_tiff_* helpers decode the strips or tiles of one page in
+  parallel.  libtiff handles are not thread-safe, so they are given
+  'ntifs' handles on the same file, all positioned at the same directory,
+  and OpenMP thread i only ever uses tifs[i] and its own decode buffer.
+  With a single handle (or when called from inside another parallel
+  region) everything runs on the calling thread.
+*/
+static int _thread_index()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Converts n pixels of sample 'colind' out of rows of 'samplesperpixel'
+// interleaved samples.  Kept branch-free, with the one-sample case on its
+// own, so that the compiler can vectorise both loops.
 template<typename t, typename T>
-void _load_tiff_tiled_contig(TIFF *const tif, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const uint32 tw, const uint32 th, const int colind, T *const buffer) {
-  t *const buf = (t*)_TIFFmalloc(TIFFTileSize(tif));
-  if (buf) {
-    for (unsigned int row = 0; row<ny; row+=th)
-      for (unsigned int col = 0; col<nx; col+=tw) {
-        if (TIFFReadTile(tif,buf,col,row,0,0)<0) {
-          _TIFFfree(buf); TIFFClose(tif);
-          // throw CImgException(_cimg_instance
-          //                     "load_tiff() : Invalid tile in file '%s'.",
-          //                     cimg_instance,
-          //                     TIFFFileName(tif));
-        }
-        const t *ptr = buf;
-        for (unsigned int rr = row; rr<(row+th) && rr<ny; ++rr)
-          for (unsigned int cc = col; cc<(col+tw) && cc<nx; ++cc)
-            //            for (unsigned int vv = 0; vv<samplesperpixel; ++vv)
-            buffer[rr*nx+cc] = (T) ptr[(rr-row)*tw*samplesperpixel + (cc-col)*samplesperpixel + colind];
-      }
-    _TIFFfree(buf);
+inline void _extract_sample(const t *src, const int samplesperpixel, const int colind, const unsigned int n, T *dest) {
+  if (samplesperpixel==1)
+    for (unsigned int cc = 0; cc<n; ++cc)
+      dest[cc] = (T) src[cc];
+  else {
+    src += colind;
+    for (unsigned int cc = 0; cc<n; ++cc)
+      dest[cc] = (T) src[(size_t)cc*samplesperpixel];
   }
 }
 
+// "t" is the datatype of the TIFF file, while "T" is datatype of memory storage
 template<typename t, typename T>
-void _load_tiff_tiled_separate(TIFF *const tif, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const uint32 tw, const uint32 th, const int colind, T *const buffer) {
-  t *const buf = (t*)_TIFFmalloc(TIFFTileSize(tif));
-  if (buf) {
-    //    for (unsigned int vv = 0; vv<samplesperpixel; ++vv)
-      for (unsigned int row = 0; row<ny; row+=th)
-        for (unsigned int col = 0; col<nx; col+=tw) {
-          if (TIFFReadTile(tif,buf,col,row,0,colind)<0) {
-            _TIFFfree(buf); TIFFClose(tif);
-            // throw CImgException(_cimg_instance
-            //                     "load_tiff() : Invalid tile in file '%s'.",
-            //                     cimg_instance,
-            //                     TIFFFileName(tif));
-          }
-          const t *ptr = buf;
-          for (unsigned int rr = row; rr<(row+th) && rr<ny; ++rr)
-            for (unsigned int cc = col; cc<(col+tw) && cc<nx; ++cc)
-              buffer[rr*nx+cc] = (T) *(ptr++);
-        }
-    _TIFFfree(buf);
+int _load_tiff_tiled_contig(TIFF *const *tifs, const int ntifs, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const uint32 tw, const uint32 th, const int colind, T *const buffer) {
+  const int ntx = (int)((nx+tw-1)/tw), ntiles = ntx*(int)((ny+th-1)/th);
+  int failed = 0;
+#pragma omp parallel num_threads(ntifs) if(ntifs>1)
+  {
+    TIFF *const tif = tifs[_thread_index()];
+    t *const buf = (t*)_TIFFmalloc(TIFFTileSize(tif));
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i<ntiles; ++i) {
+      const uint32 row = (uint32)(i/ntx)*th, col = (uint32)(i%ntx)*tw;
+      if (!buf || TIFFReadTile(tif,buf,col,row,0,0)<0) {
+#pragma omp atomic
+        ++failed;
+        continue;
+      }
+      const unsigned int ncol = (col+tw>nx?nx-col:tw);
+      for (unsigned int rr = row; rr<(row+th) && rr<ny; ++rr)
+        _extract_sample(buf + (size_t)(rr-row)*tw*samplesperpixel, samplesperpixel, colind, ncol, buffer + (size_t)rr*nx + col);
+    }
+    if (buf) _TIFFfree(buf);
   }
+  return !failed;
 }
 
 template<typename t, typename T>
-void _load_tiff_contig(TIFF *const tif, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const int colind, T *const buffer) {
-  t *const buf = (t*)_TIFFmalloc(TIFFStripSize(tif));
-  if (buf) {
-    uint32 row, rowsperstrip = (uint32)-1;
-    TIFFGetField(tif,TIFFTAG_ROWSPERSTRIP,&rowsperstrip);
-    for (row = 0; row<ny; row+= rowsperstrip) {
-      uint32 nrow = (row+rowsperstrip>ny?ny-row:rowsperstrip);
-      tstrip_t strip = TIFFComputeStrip(tif, row, 0);
-      if ((TIFFReadEncodedStrip(tif,strip,buf,-1))<0) {
-        _TIFFfree(buf); TIFFClose(tif);
-        // throw CImgException(_cimg_instance
-        //                     "load_tiff() : Invalid strip in file '%s'.",
-        //                     cimg_instance,
-        //                     TIFFFileName(tif));
+int _load_tiff_tiled_separate(TIFF *const *tifs, const int ntifs, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const uint32 tw, const uint32 th, const int colind, T *const buffer) {
+  const int ntx = (int)((nx+tw-1)/tw), ntiles = ntx*(int)((ny+th-1)/th);
+  int failed = 0;
+#pragma omp parallel num_threads(ntifs) if(ntifs>1)
+  {
+    TIFF *const tif = tifs[_thread_index()];
+    t *const buf = (t*)_TIFFmalloc(TIFFTileSize(tif));
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i<ntiles; ++i) {
+      const uint32 row = (uint32)(i/ntx)*th, col = (uint32)(i%ntx)*tw;
+      if (!buf || TIFFReadTile(tif,buf,col,row,0,colind)<0) {
+#pragma omp atomic
+        ++failed;
+        continue;
       }
-      const t *ptr = buf;
-      for (unsigned int rr = 0; rr<nrow; ++rr)
-        for (unsigned int cc = 0; cc<nx; ++cc)
-          for (int vv = 0; vv<samplesperpixel; ++vv)
-            if (vv==colind) 
-              buffer[(row+rr)*nx+cc] = (T) *(ptr++);
-            else
-              ptr++;
+      const unsigned int ncol = (col+tw>nx?nx-col:tw);
+      for (unsigned int rr = row; rr<(row+th) && rr<ny; ++rr)
+        _extract_sample(buf + (size_t)(rr-row)*tw, 1, 0, ncol, buffer + (size_t)rr*nx + col);
     }
-    _TIFFfree(buf);
+    if (buf) _TIFFfree(buf);
   }
+  return !failed;
 }
 
+// Strips of one page are decoded in parallel; 'sample' is the plane to
+// read for planar-separate data and 0 for contiguous data
 template<typename t, typename T>
-void _load_tiff_separate(TIFF *const tif, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const int colind, T *const buffer) {
-  t *buf = (t*)_TIFFmalloc(TIFFStripSize(tif));
-  if (buf) {
-    uint32 row, rowsperstrip = (uint32)-1;
-    TIFFGetField(tif,TIFFTAG_ROWSPERSTRIP,&rowsperstrip);
-    // for (unsigned int vv = 0; vv<samplesperpixel; ++vv)
-      for (row = 0; row<ny; row+= rowsperstrip) {
-        uint32 nrow = (row+rowsperstrip>ny?ny-row:rowsperstrip);
-        tstrip_t strip = TIFFComputeStrip(tif, row, colind);
-        if ((TIFFReadEncodedStrip(tif,strip,buf,-1))<0) {
-          _TIFFfree(buf); TIFFClose(tif);
-          // throw CImgException(_cimg_instance
-          //                     "load_tiff() : Invalid strip in file '%s'.",
-          //                     cimg_instance,
-          //                     TIFFFileName(tif));
-        }
-        const t *ptr = buf;
-        for (unsigned int rr = 0;rr<nrow; ++rr)
-          for (unsigned int cc = 0; cc<nx; ++cc)
-            buffer[(row+rr)*nx+cc] = (T) *(ptr++);
+int _load_tiff_strips(TIFF *const *tifs, const int ntifs, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const tsample_t sample, const int colind, T *const buffer) {
+  uint32 rowsperstrip = (uint32)-1;
+  TIFFGetField(tifs[0],TIFFTAG_ROWSPERSTRIP,&rowsperstrip);
+  if (rowsperstrip==0 || rowsperstrip>ny) rowsperstrip = ny;
+  const int nstrips = (int)((ny+rowsperstrip-1)/rowsperstrip);
+  int failed = 0;
+#pragma omp parallel num_threads(ntifs) if(ntifs>1)
+  {
+    TIFF *const tif = tifs[_thread_index()];
+    t *const buf = (t*)_TIFFmalloc(TIFFStripSize(tif));
+#pragma omp for schedule(dynamic)
+    for (int s = 0; s<nstrips; ++s) {
+      const uint32 row = (uint32)s*rowsperstrip;
+      const uint32 nrow = (row+rowsperstrip>ny?ny-row:rowsperstrip);
+      tstrip_t strip = TIFFComputeStrip(tif, row, sample);
+      if (!buf || TIFFReadEncodedStrip(tif,strip,buf,-1)<0) {
+#pragma omp atomic
+        ++failed;
+        continue;
       }
-    _TIFFfree(buf);
+      _extract_sample(buf, samplesperpixel, colind, nrow*nx, buffer + (size_t)row*nx);
+    }
+    if (buf) _TIFFfree(buf);
   }
+  return !failed;
+}
+
+template<typename t, typename T>
+int _load_tiff_contig(TIFF *const *tifs, const int ntifs, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const int colind, T *const buffer) {
+  return _load_tiff_strips<t, T>(tifs, ntifs, samplesperpixel, nx, ny, 0, colind, buffer);
+}
+
+template<typename t, typename T>
+int _load_tiff_separate(TIFF *const *tifs, const int ntifs, const uint16 samplesperpixel, const uint32 nx, const uint32 ny, const int colind, T *const buffer) {
+  return _load_tiff_strips<t, T>(tifs, ntifs, 1, nx, ny, (tsample_t)colind, 0, buffer);
 }
 
 #ifdef __SIRECON_USE_TIFF__
 extern "C" int load_tiff(TIFF *const tif, const unsigned int directory, const unsigned colind, float *const buffer);
+extern "C" int load_tiff_current(TIFF *const tif, const unsigned colind, float *const buffer);
+extern "C" int load_tiff_current_mt(TIFF *const *tifs, const int ntifs, const unsigned colind, float *const buffer);
 extern "C" int save_tiff(TIFF *tif, const unsigned int directory, int colind, const int nwaves, int width, int height, float * buffer , int bIsComplex);
+extern "C" int save_tiff_stack(const char *filename, int width, int height, int depth, const float *buffer, int level);
 
 #endif
 
 
 //template<typename T>
 int load_tiff(TIFF *const tif, const unsigned int directory, const unsigned colind, float *const buffer) {
-  //Read the current directory of channel colind into buffer 
+  //Read directory 'directory' of channel colind into buffer 
   if (!TIFFSetDirectory(tif,directory)) return 0;
+  return load_tiff_current(tif, colind, buffer);
+}
+
+int load_tiff_current(TIFF *const tif, const unsigned colind, float *const buffer) {
+  //Read the current directory of channel colind into buffer 
+  return load_tiff_current_mt(&tif, 1, colind, buffer);
+}
+
+int load_tiff_current_mt(TIFF *const *tifs, const int ntifs, const unsigned colind, float *const buffer) {
+  //Read the current directory of channel colind into buffer, decoding
+  //strips or tiles on up to ntifs threads; every handle must be at the
+  //same directory of the same file
+  TIFF *const tif = tifs[0];
+  int ok = 1;
   uint16 samplesperpixel, bitspersample;
   uint16 sampleformat = SAMPLEFORMAT_UINT;
   uint32 nx,ny;
@@ -140,74 +189,77 @@ int load_tiff(TIFF *const tif, const unsigned int directory, const unsigned coli
       TIFFGetField(tif,TIFFTAG_TILELENGTH,&th);
       if (config==PLANARCONFIG_CONTIG) switch (bitspersample) {
         case 8 : {
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_tiled_contig<unsigned char, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else _load_tiff_tiled_contig<signed char, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_tiled_contig<unsigned char, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else ok = _load_tiff_tiled_contig<signed char, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
         } break;
         case 16 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_tiled_contig<unsigned short, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else _load_tiff_tiled_contig<short, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_tiled_contig<unsigned short, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else ok = _load_tiff_tiled_contig<short, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
           break;
         case 32 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_tiled_contig<unsigned int, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else if (sampleformat==SAMPLEFORMAT_INT) _load_tiff_tiled_contig<int, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else _load_tiff_tiled_contig<float, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_tiled_contig<unsigned int, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else if (sampleformat==SAMPLEFORMAT_INT) ok = _load_tiff_tiled_contig<int, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else ok = _load_tiff_tiled_contig<float, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
           break;
         } else switch (bitspersample) {
         case 8 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_tiled_separate<unsigned char, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else _load_tiff_tiled_separate<signed char, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_tiled_separate<unsigned char, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else ok = _load_tiff_tiled_separate<signed char, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
           break;
         case 16 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_tiled_separate<unsigned short, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else _load_tiff_tiled_separate<short, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_tiled_separate<unsigned short, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else ok = _load_tiff_tiled_separate<short, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
           break;
         case 32 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_tiled_separate<unsigned int, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else if (sampleformat==SAMPLEFORMAT_INT) _load_tiff_tiled_separate<int, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
-          else _load_tiff_tiled_separate<float, float>(tif,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_tiled_separate<unsigned int, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else if (sampleformat==SAMPLEFORMAT_INT) ok = _load_tiff_tiled_separate<int, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
+          else ok = _load_tiff_tiled_separate<float, float>(tifs,ntifs,samplesperpixel,nx,ny,tw,th, colind, buffer);
           break;
         }
     } else {
       if (config==PLANARCONFIG_CONTIG) switch (bitspersample) {
         case 8 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_contig<unsigned char, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else _load_tiff_contig<signed char, float>(tif,samplesperpixel,nx,ny, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_contig<unsigned char, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else ok = _load_tiff_contig<signed char, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
           break;
         case 16 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_contig<unsigned short, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else _load_tiff_contig<short, float>(tif,samplesperpixel,nx,ny, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_contig<unsigned short, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else ok = _load_tiff_contig<short, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
           break;
         case 32 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_contig<unsigned int, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else if (sampleformat==SAMPLEFORMAT_INT) _load_tiff_contig<int, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else _load_tiff_contig<float, float>(tif,samplesperpixel,nx,ny, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_contig<unsigned int, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else if (sampleformat==SAMPLEFORMAT_INT) ok = _load_tiff_contig<int, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else ok = _load_tiff_contig<float, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
           break;
         } else switch (bitspersample){
         case 8 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_separate<unsigned char, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else _load_tiff_separate<signed char, float>(tif,samplesperpixel,nx,ny, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_separate<unsigned char, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else ok = _load_tiff_separate<signed char, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
           break;
         case 16 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_separate<unsigned short, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else _load_tiff_separate<short, float>(tif,samplesperpixel,nx,ny, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_separate<unsigned short, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else ok = _load_tiff_separate<short, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
           break;
         case 32 :
-          if (sampleformat==SAMPLEFORMAT_UINT) _load_tiff_separate<unsigned int, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else if (sampleformat==SAMPLEFORMAT_INT) _load_tiff_separate<int, float>(tif,samplesperpixel,nx,ny, colind, buffer);
-          else _load_tiff_separate<float, float>(tif,samplesperpixel,nx,ny, colind, buffer);
+          if (sampleformat==SAMPLEFORMAT_UINT) ok = _load_tiff_separate<unsigned int, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else if (sampleformat==SAMPLEFORMAT_INT) ok = _load_tiff_separate<int, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
+          else ok = _load_tiff_separate<float, float>(tifs,ntifs,samplesperpixel,nx,ny, colind, buffer);
           break;
         }
     }
   } else {
     uint32 *const raster = (uint32*)_TIFFmalloc(nx*ny*sizeof(uint32));
     if (!raster) {
-      _TIFFfree(raster); TIFFClose(tif);
+      return 0;
       // throw CImgException(_cimg_instance
       //                     "load_tiff() : Failed to allocate memory (%s) for file '%s'.",
       //                     cimg_instance,
       //                     cimg::strbuffersize(nx*ny*sizeof(uint32)),filename);
     }
-    TIFFReadRGBAImage(tif,nx,ny,raster,0);
+    if (!TIFFReadRGBAImage(tif,nx,ny,raster,0)) {
+      _TIFFfree(raster);
+      return 0;
+    }
     switch (samplesperpixel) {
     case 1 : {
       cimg_forXY(nx,ny,x,y) buffer[nx*y+x] = (float)((raster[nx*(ny-1-y)+x] + 128)/257);
@@ -232,21 +284,15 @@ int load_tiff(TIFF *const tif, const unsigned int directory, const unsigned coli
     }
     _TIFFfree(raster);
   }
-  return 1;
+  return ok;
 }
 
 
-int save_tiff(TIFF *tif, const unsigned int directory, int colind, const int nwaves,
-              int width, int height, float * buffer, int bIsComplex=0) {
-  // In case of saving complex-number file (bIsComplex==1), colind indicates saving real or imag part
-
-  if (!tif) return 0;
-  // const char *const filename = TIFFFileName(tif);
-  uint32 rowsperstrip = (uint32)-1;
+// Tags of a float32 page with nwaves samples per pixel
+static void _set_float_page_tags(TIFF *tif, const int nwaves, int width, int height) {
   uint16 spp = nwaves, bpp = 32, photometric;
   // if (spp==3 || spp==4) photometric = PHOTOMETRIC_RGB;
   /*else */photometric = PHOTOMETRIC_MINISBLACK;
-  TIFFSetDirectory(tif,directory);
   TIFFSetField(tif,TIFFTAG_IMAGEWIDTH,width);
   TIFFSetField(tif,TIFFTAG_IMAGELENGTH,height);
   TIFFSetField(tif,TIFFTAG_ORIENTATION,ORIENTATION_TOPLEFT);
@@ -258,10 +304,21 @@ int save_tiff(TIFF *tif, const unsigned int directory, int colind, const int nwa
   TIFFSetField(tif,TIFFTAG_BITSPERSAMPLE,bpp);
   TIFFSetField(tif,TIFFTAG_PLANARCONFIG,PLANARCONFIG_SEPARATE);
   TIFFSetField(tif,TIFFTAG_PHOTOMETRIC,photometric);
+  TIFFSetField(tif,TIFFTAG_FILLORDER,FILLORDER_MSB2LSB);
+}
+
+int save_tiff(TIFF *tif, const unsigned int directory, int colind, const int nwaves,
+              int width, int height, float * buffer, int bIsComplex=0) {
+  // In case of saving complex-number file (bIsComplex==1), colind indicates saving real or imag part
+
+  if (!tif) return 0;
+  // const char *const filename = TIFFFileName(tif);
+  uint32 rowsperstrip = (uint32)-1;
+  TIFFSetDirectory(tif,directory);
+  _set_float_page_tags(tif, nwaves, width, height);
   // TIFFSetField(tif,TIFFTAG_COMPRESSION,compression?(compression-1):COMPRESSION_NONE);
   rowsperstrip = TIFFDefaultStripSize(tif,rowsperstrip);
   TIFFSetField(tif,TIFFTAG_ROWSPERSTRIP,rowsperstrip);
-  TIFFSetField(tif,TIFFTAG_FILLORDER,FILLORDER_MSB2LSB);
   // t *const buf = (t*)_TIFFmalloc(TIFFStripSize(tif));
   float *const buf = (float*)_TIFFmalloc(TIFFStripSize(tif));
   if (buf) {
@@ -289,3 +346,93 @@ int save_tiff(TIFF *tif, const unsigned int directory, int colind, const int nwa
   TIFFWriteDirectory(tif);
   return 1;
 }
+
+
+int save_tiff_stack(const char *filename, int width, int height, int depth,
+                    const float *buffer, int level) {
+  // Saves the depth x height x width floats in buffer as a multi-page TIFF of
+  // 256x256 tiles, deflate-compressed at zlib level 'level' (0 = uncompressed).
+  // Pages go in batches of about 64 MB: the tiles of a batch are compressed in
+  // parallel, then handed to libtiff in order, so only one batch of tiles is
+  // held besides the volume.  Switches to BigTIFF when the file could pass
+  // 4 GB uncompressed.
+#ifndef __SIRECON_USE_ZLIB__
+  level = 0;
+#endif
+  const int tw = 256, th = 256;  // TIFF wants multiples of 16
+  const int ntx = (width + tw - 1) / tw, nty = (height + th - 1) / th;
+  const int pageTiles = ntx * nty;
+  const size_t tileBytes = tw * th * sizeof(float);
+  const size_t batchBytes = 64 << 20;
+  int batchPages = (int) (batchBytes / (pageTiles * tileBytes));
+  if (batchPages < 1) batchPages = 1;
+  if (batchPages > depth) batchPages = depth;
+  std::vector< std::vector<unsigned char> > tiles(batchPages * pageTiles);
+
+  // the tiles are not compressed yet, so the format is chosen for the worst
+  // case, plus plenty of room for the directories
+  unsigned long long tileBound = tileBytes;
+#ifdef __SIRECON_USE_ZLIB__
+  if (level) tileBound = compressBound((uLong) tileBytes);
+#endif
+  unsigned long long total = tileBound * pageTiles * depth +
+    (unsigned long long) depth * (4096 + 16 * pageTiles);
+  TIFF *tif = TIFFOpen(filename, total >= 0xffffffffULL ? "w8" : "w");
+  if (!tif) return 0;
+
+  for (int z0 = 0; z0 < depth; z0 += batchPages) {
+    const int npages = depth - z0 < batchPages ? depth - z0 : batchPages;
+    const int ntiles = npages * pageTiles;
+    int failed = 0;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < ntiles; ++i) {
+      const int z = z0 + i / pageTiles, ty = (i / ntx) % nty, tx = i % ntx;
+      const int ncols = (tx + 1) * tw <= width ? tw : width - tx * tw;
+      // edge tiles are padded with zeros to the full tile size
+      std::vector<float> tile(tw * th, 0.f);
+      for (int r = 0; r < th && ty * th + r < height; ++r)
+        std::memcpy(&tile[r * tw],
+                    buffer + ((size_t) z * height + ty * th + r) * width + tx * tw,
+                    ncols * sizeof(float));
+      const unsigned char *raw = (const unsigned char *) &tile[0];
+#ifdef __SIRECON_USE_ZLIB__
+      if (level) {
+        uLongf size = (uLongf) tileBound;
+        tiles[i].resize(size);
+        if (compress2(&tiles[i][0], &size, raw, (uLong) tileBytes, level) != Z_OK) {
+#pragma omp atomic
+          failed++;
+        }
+        tiles[i].resize(size);
+        continue;
+      }
+#endif
+      tiles[i].assign(raw, raw + tileBytes);
+    }
+    if (failed) {
+      TIFFClose(tif);
+      return 0;
+    }
+
+    for (int p = 0; p < npages; ++p) {
+      _set_float_page_tags(tif, 1, width, height);
+      TIFFSetField(tif,TIFFTAG_TILEWIDTH,tw);
+      TIFFSetField(tif,TIFFTAG_TILELENGTH,th);
+      TIFFSetField(tif,TIFFTAG_COMPRESSION,level?COMPRESSION_ADOBE_DEFLATE:COMPRESSION_NONE);
+      for (int t = 0; t < pageTiles; ++t) {
+        std::vector<unsigned char> &tile = tiles[p * pageTiles + t];
+        if (TIFFWriteRawTile(tif, t, &tile[0], tile.size()) < 0) {
+          TIFFClose(tif);
+          return 0;
+        }
+      }
+      if (!TIFFWriteDirectory(tif)) {
+        TIFFClose(tif);
+        return 0;
+      }
+    }
+  }
+  TIFFClose(tif);
+  return 1;
+}
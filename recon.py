@@ -1,9 +1,7 @@
 import os
-from contextlib import contextmanager
 from subprocess import run
 
 import mrc
-import numpy as np
 
 # NOTE: this assumes that you have config files and otf files with the emission wavelength
 # names in them... such as `config528.txt` and `otf528.otf`.  You may place those files
@@ -30,76 +28,16 @@ def get_otf_and_config(wave, otf_dir=OTF_DIR, config_dir=CONFIG_DIR):
     return otf, config
 
 
-def merge_files(file_list, outfile, delete=False):
-    data = [mrc.imread(fname) for fname in file_list]
-    waves = [0, 0, 0, 0, 0]
-    for i, item in enumerate(data):
-        waves[i] = item.Mrc.hdr.wave[0]
-    hdr = data[0].Mrc.hdr
-    m = mrc.Mrc2(outfile, mode="w")
-    array = np.stack(data, -3)
-    m.initHdrForArr(array)
-    mrc.copyHdrInfo(m.hdr, hdr)
-    m.hdr.NumWaves = len(file_list)
-    m.hdr.wave = waves
-    m.writeHeader()
-    m.writeStack(array)
-    m.close()
-    if delete:
-        try:
-            [os.remove(f) for f in file_list]
-        except Exception:
-            pass
-    return outfile
-
-
-def write_single_channel(array, outpath, hdr, wave):
-    """writes a new single-channel file from array data, copying information from hdr"""
-    print(f"Extracting channel {wave}...")
-    m = mrc.Mrc2(outpath, mode="w")
-    m.initHdrForArr(array)
-    mrc.copyHdrInfo(m.hdr, hdr)
-    m.hdr.NumWaves = 1
-    m.hdr.wave = [wave, 0, 0, 0, 0]
-    m.writeHeader()
-    m.writeStack(array)
-    m.close()
-
-
-@contextmanager
-def file_splitter(fname):
-    """Context manager that takes care of splitting the file and making sure that
-    duplicated data gets cleaned up when done.
-    """
-    im = mrc.imread(fname)
-    header = im.Mrc.header
-    namesplit = os.path.splitext(fname)
-    try:
-        splitfiles = []
-        if header.NumWaves == 1:
-            # if it's a single channel file, we don't need to split
-            wave = header.wave[0]
-            otf_config = get_otf_and_config(wave)
-            if otf_config is not None:
-                splitfiles = [(fname, wave, *otf_config)]
-        else:
-            # otherwise break out individual wavelenghts
-            for c in range(header.NumWaves):
-                wave = header.wave[c]
-                out = f"{namesplit[0]}-{wave}{namesplit[1]}"
-                # assumes channel is the 3rd to last dimension
-                data = np.take(im, c, -3)
-                otf_config = get_otf_and_config(wave)
-                if otf_config is not None:
-                    write_single_channel(data, out, header, wave)
-                    splitfiles.append((out, wave, *otf_config))
-        yield splitfiles
-    finally:
-        # clean up the split files
-        if header.NumWaves > 1:
-            print("\nCleaning up extracted channels...")
-            for file, b, c, d in splitfiles:
-                os.remove(file)
+def check_channels(fname):
+    """make sure every channel of fname has its otf and config file"""
+    header = mrc.imread(fname).Mrc.header
+    missing = [
+        header.wave[c]
+        for c in range(header.NumWaves)
+        if get_otf_and_config(header.wave[c]) is None
+    ]
+    if missing:
+        raise FileNotFoundError(f"No otf or config for wavelength(s) {missing}")
 
 
 def reconstruct_single(file, otf, config=None, outfile=None, **kwargs):
@@ -119,28 +57,14 @@ def reconstruct_single(file, otf, config=None, outfile=None, **kwargs):
 
 
 def reconstruct(inFile, outfile=None, **kwargs):
-    """Splits multi-channel file into individual channels
-    then reconstructs each channel and merges the results
+    """Reconstructs all channels of inFile in one run; cudasirecon picks the
+    otf and config of each channel by replacing {wave} in their names with
+    the channel's emission wavelength
     """
-    if outfile is None:
-        namesplit = os.path.splitext(inFile)
-        outfile = f"{namesplit[0]}_PROC{namesplit[1]}"
-
-    with file_splitter(inFile) as splitfiles:
-        processed = []
-        for file, wave, otf, config in splitfiles:
-            try:
-                processed.append(reconstruct_single(file, otf, config, **kwargs))
-            except Exception as e:
-                print(f"Cannot reconstruct file {file} due to error {e}")
-        if len(processed) > 1:
-            print("\nMerging multi-channel reconstructions...")
-            final_file = merge_files(processed, outfile, delete=True)
-        else:
-            final_file = processed[0]
-            if final_file != outfile:
-                os.rename(final_file, outfile)
-    return final_file
+    check_channels(inFile)
+    otf = os.path.join(OTF_DIR, "otf{wave}.otf")
+    config = os.path.join(CONFIG_DIR, "config{wave}.txt")
+    return reconstruct_single(inFile, otf, config, outfile, **kwargs)
 
 
 if __name__ == "__main__":